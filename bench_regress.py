@@ -0,0 +1,352 @@
+#!/usr/bin/env python3
+"""
+RDMA benchmark regression harness
+Runs a fixed suite of bandwidth, latency and message-rate scenarios and
+compares them against a stored baseline, failing on significant regressions
+
+Every scenario runs WARMUP times unmeasured and then REPEAT times, server
+and client pinned to CPUs of their own. Per metric, the baseline keeps all
+samples; a comparison takes the difference of the means with a 95%
+confidence interval (Welch's t), and flags a regression when the metric got
+worse by more than the threshold and the interval excludes no change.
+"""
+
+import argparse
+import json
+import math
+import os
+import platform
+import re
+import subprocess
+import sys
+import time
+from datetime import datetime
+
+BASELINE_FORMAT = 1
+SERVER_START_DELAY = 1.0    # seconds for a server to listen before its client connects
+RUN_TIMEOUT = 60
+# Out of the top directory, whose *.json make clean removes
+DEFAULT_BASELINE = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'demo_results',
+                                'bench_baseline.json')
+
+# Two-sided 95% critical values of Student's t by degrees of freedom
+T95 = [12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+       2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+       2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042]
+T95_TAIL = [(40, 2.021), (60, 2.000), (120, 1.980)]
+
+# incast_bench's unpaced row: Gbit/s, Mwrites/s, p50 us, p99 us
+INCAST_ROW = r'^off\s+\d+\s+([\d.]+)\s+([\d.]+)\s+([\d.]+)\s+([\d.]+)'
+
+# The suite. 'net' scenarios need an RDMA device (SoftRoCE will do) and run
+# incast_bench against its own server on --server-ip; 'local' ones run
+# anywhere. Each metric is a regex group of the client's output, times scale
+SCENARIOS = [
+    {
+        'name': 'write_bw_1m',
+        'suite': 'net',
+        'server': ['incast_bench', '-s', '-n', '1'],
+        'client': ['incast_bench', '-n', '1', '-w', '16', '-b', '1048576', '-t', '2', '-m', 'off'],
+        'metrics': [
+            {'key': 'gbps', 'regex': INCAST_ROW, 'group': 1, 'unit': 'Gbit/s', 'higher': True},
+        ],
+    },
+    {
+        'name': 'write_lat_4k',
+        'suite': 'net',
+        'server': ['incast_bench', '-s', '-n', '1'],
+        'client': ['incast_bench', '-n', '1', '-w', '1', '-b', '4096', '-t', '2', '-m', 'off'],
+        'metrics': [
+            {'key': 'p50_us', 'regex': INCAST_ROW, 'group': 3, 'unit': 'us', 'higher': False},
+            {'key': 'p99_us', 'regex': INCAST_ROW, 'group': 4, 'unit': 'us', 'higher': False},
+        ],
+    },
+    {
+        # 4 connections of 64 B writes, read as writes rather than bits: at
+        # this size Gbit/s to two places rounds off more than the threshold
+        'name': 'write_rate_64b',
+        'suite': 'net',
+        'server': ['incast_bench', '-s', '-n', '4'],
+        'client': ['incast_bench', '-n', '4', '-w', '32', '-b', '64', '-t', '2', '-m', 'off'],
+        'metrics': [
+            {'key': 'mwrites', 'regex': INCAST_ROW, 'group': 2, 'unit': 'Mwrites/s',
+             'higher': True},
+        ],
+    },
+    {
+        # Software cost of the posting path, on verbs_bench's null provider
+        'name': 'post_path',
+        'suite': 'local',
+        'client': ['verbs_bench', '500000'],
+        'metrics': [
+            {'key': 'signaled_ns', 'regex': r'C loop \(rdma_client\.c\)\s+([\d.]+) ns/WR',
+             'group': 1, 'unit': 'ns/WR', 'higher': False},
+            {'key': 'small_inline_ns', 'regex': r'C loop, run-time opcode/signaling/inline\s+([\d.]+) ns/WR',
+             'group': 1, 'unit': 'ns/WR', 'higher': False},
+        ],
+    },
+]
+
+
+def t95(df):
+    """Two-sided 95% t critical value, rounding df down (conservative)"""
+    df = int(df)
+    if df < 1:
+        return float('inf')
+    if df <= len(T95):
+        return T95[df - 1]
+    for limit, t in T95_TAIL:
+        if df <= limit:
+            return t
+    return 1.960
+
+
+def summarize(samples):
+    """Mean, standard deviation and 95% CI half-width of samples"""
+    n = len(samples)
+    mean = sum(samples) / n
+    sd = math.sqrt(sum((x - mean) ** 2 for x in samples) / (n - 1)) if n > 1 else 0.0
+    return mean, sd, t95(n - 1) * sd / math.sqrt(n) if n > 1 else float('inf')
+
+
+def compare(base, cur):
+    """Difference of the means (cur - base) and its 95% CI, by Welch's t"""
+    mb, sb, _ = summarize(base)
+    mc, sc, _ = summarize(cur)
+    vb, vc = sb ** 2 / len(base), sc ** 2 / len(cur)
+    se = math.sqrt(vb + vc)
+    diff = mc - mb
+    if se == 0:
+        return diff, diff, diff
+    # Welch-Satterthwaite degrees of freedom
+    df_den = (vb ** 2 / (len(base) - 1) if len(base) > 1 else 0) + \
+             (vc ** 2 / (len(cur) - 1) if len(cur) > 1 else 0)
+    df = (vb + vc) ** 2 / df_den if df_den > 0 else 1
+    half = t95(df) * se
+    return diff, diff - half, diff + half
+
+
+def find_tool(name):
+    """A binary built next to this script"""
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), name)
+    if not os.access(path, os.X_OK):
+        raise RuntimeError(f"{name} not found; build it first (make {name})")
+    return path
+
+
+def pin(cpus):
+    return lambda: os.sched_setaffinity(0, cpus) if cpus else None
+
+
+def git_revision():
+    """HEAD's short hash, marked -dirty with local changes"""
+    here = os.path.dirname(os.path.abspath(__file__))
+    try:
+        rev = subprocess.run(['git', 'rev-parse', '--short', 'HEAD'], cwd=here,
+                             capture_output=True, text=True, check=True).stdout.strip()
+        dirty = subprocess.run(['git', 'diff', '--quiet', 'HEAD'], cwd=here).returncode != 0
+        return rev + ('-dirty' if dirty else '')
+    except (OSError, subprocess.CalledProcessError):
+        return 'unknown'
+
+
+def run_once(scenario, args):
+    """One run of scenario; its metrics by key"""
+    server = None
+    if 'server' in scenario:
+        cmd = [find_tool(scenario['server'][0])] + scenario['server'][1:]
+        server = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, preexec_fn=pin(args.server_cpus))
+        time.sleep(SERVER_START_DELAY)
+    cmd = [find_tool(scenario['client'][0])] + scenario['client'][1:]
+    if server:
+        cmd.append(args.server_ip)
+    result = None
+    try:
+        result = subprocess.run(cmd, capture_output=True, text=True, timeout=RUN_TIMEOUT,
+                                preexec_fn=pin(args.client_cpus))
+    finally:
+        # The server exits once its connections are done; not after a failed client
+        if server:
+            try:
+                server.wait(timeout=RUN_TIMEOUT if result and result.returncode == 0 else 0.1)
+            except subprocess.TimeoutExpired:
+                server.kill()
+                server.wait()
+    if result.returncode != 0:
+        raise RuntimeError(f"{scenario['name']}: {' '.join(cmd)} exited with status "
+                           f"{result.returncode}\n{result.stderr}")
+
+    values = {}
+    for m in scenario['metrics']:
+        match = re.search(m['regex'], result.stdout, re.MULTILINE)
+        if not match:
+            raise RuntimeError(f"{scenario['name']}: no {m['key']} in the output of {' '.join(cmd)}")
+        values[m['key']] = float(match.group(m['group'])) * m.get('scale', 1)
+    return values
+
+
+def run_scenario(scenario, args):
+    """Warmup runs, then the measured ones; samples per metric"""
+    samples = {m['key']: [] for m in scenario['metrics']}
+    for i in range(args.warmup + args.repeat):
+        values = run_once(scenario, args)
+        if i >= args.warmup:
+            for key, value in values.items():
+                samples[key].append(value)
+    return samples
+
+
+def print_header():
+    print(f"{'metric':<32} {'unit':<10} {'baseline':>18} {'current':>18} {'change':>8} "
+          f"{'95% CI of change':>20}")
+
+
+def fmt(samples):
+    mean, _, half = summarize(samples)
+    return f"{mean:.3f} ± {half:.3f}" if math.isfinite(half) else f"{mean:.3f}"
+
+
+def report_metric(name, metric, base, cur, threshold):
+    """Print one comparison; whether it is a regression"""
+    unit = metric['unit']
+    if not base:
+        print(f"{name:<32} {unit:<10} {'-':>18} {fmt(cur):>18}")
+        return False
+    mb = summarize(base)[0]
+    diff, lo, hi = compare(base, cur)
+    if mb == 0:
+        print(f"{name:<32} {unit:<10} {fmt(base):>18} {fmt(cur):>18}")
+        return False
+    change, lo_pct, hi_pct = (100 * x / mb for x in (diff, lo, hi))
+    # Worse is down for rates, up for times
+    worse = -change if metric['higher'] else change
+    significant = hi < 0 if metric['higher'] else lo > 0
+    regression = worse > threshold and significant
+    verdict = 'REGRESSION' if regression else ('improved' if (lo > 0 if metric['higher'] else hi < 0) else '')
+    print(f"{name:<32} {unit:<10} {fmt(base):>18} {fmt(cur):>18} {change:>+7.1f}% "
+          f"{f'[{lo_pct:+.1f}%, {hi_pct:+.1f}%]':>20}  {verdict}")
+    return regression
+
+
+def load_baseline(path):
+    if not os.path.exists(path):
+        return None
+    with open(path, 'r') as f:
+        baseline = json.load(f)
+    if baseline.get('format') != BASELINE_FORMAT:
+        raise RuntimeError(f"{path} is baseline format {baseline.get('format')}, "
+                           f"this harness reads {BASELINE_FORMAT}; re-record it with --update")
+    return baseline
+
+
+def save_baseline(path, metrics, args):
+    baseline = {
+        'format': BASELINE_FORMAT,
+        'revision': git_revision(),
+        'recorded': datetime.now().isoformat(timespec='seconds'),
+        'host': platform.node(),
+        'kernel': platform.release(),
+        'warmup': args.warmup,
+        'repeat': args.repeat,
+        'server_cpus': sorted(args.server_cpus),
+        'client_cpus': sorted(args.client_cpus),
+        'metrics': metrics,
+    }
+    with open(path, 'w') as f:
+        json.dump(baseline, f, indent=2)
+        f.write('\n')
+
+
+def parse_cpus(spec):
+    """'0-3,6' -> {0, 1, 2, 3, 6}"""
+    cpus = set()
+    for part in spec.split(','):
+        lo, _, hi = part.partition('-')
+        cpus.update(range(int(lo), int(hi or lo) + 1))
+    return cpus
+
+
+def default_cpus():
+    """Server on the first allowed CPU, client on the rest (the same one on a single CPU)"""
+    cpus = sorted(os.sched_getaffinity(0))
+    return {cpus[0]}, set(cpus[1:]) or {cpus[0]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description='RDMA benchmark regression harness')
+    parser.add_argument('-b', '--baseline', default=DEFAULT_BASELINE, help='Baseline file')
+    parser.add_argument('-u', '--update', action='store_true',
+                        help='Record the results as the new baseline (after comparing, if there is one)')
+    parser.add_argument('-s', '--suite', choices=['all', 'net', 'local'], default='all',
+                        help='Scenarios to run: net needs an RDMA device, local runs anywhere')
+    parser.add_argument('-n', '--repeat', type=int, default=5, help='Measured runs per scenario')
+    parser.add_argument('-w', '--warmup', type=int, default=1, help='Unmeasured runs first')
+    parser.add_argument('-t', '--threshold', type=float, default=3.0,
+                        help='Regression threshold, percent worse than the baseline')
+    parser.add_argument('--server-ip', default='127.0.0.1', help='Address the net servers listen on')
+    parser.add_argument('--server-cpus', help='CPUs for servers, e.g. 0 or 0-1 (default: the first)')
+    parser.add_argument('--client-cpus', help='CPUs for clients (default: the rest)')
+    parser.add_argument('--keep-going', action='store_true',
+                        help='Run the whole suite instead of stopping at the first regression')
+    args = parser.parse_args()
+    if args.repeat < 2 or args.warmup < 0:
+        parser.error('--repeat needs at least 2 runs for a confidence interval')
+
+    server_cpus, client_cpus = default_cpus()
+    args.server_cpus = parse_cpus(args.server_cpus) if args.server_cpus else server_cpus
+    args.client_cpus = parse_cpus(args.client_cpus) if args.client_cpus else client_cpus
+
+    try:
+        baseline = load_baseline(args.baseline)
+    except (OSError, ValueError, RuntimeError) as e:
+        print(f"Error: {e}", file=sys.stderr)
+        return 2
+    if baseline:
+        print(f"Baseline {args.baseline}: revision {baseline['revision']}, "
+              f"recorded {baseline['recorded']} on {baseline['host']}")
+        if baseline['host'] != platform.node():
+            print("Warning: the baseline comes from another host", file=sys.stderr)
+    elif not args.update:
+        print(f"No baseline at {args.baseline}; recording one")
+        args.update = True
+    print(f"Revision {git_revision()}, {args.warmup} warmup + {args.repeat} runs per scenario, "
+          f"server on CPUs {sorted(args.server_cpus)}, client on {sorted(args.client_cpus)}\n")
+    print_header()
+
+    old = baseline['metrics'] if baseline else {}
+    new = dict(old) if args.update else {}
+    regressions = []
+    for scenario in SCENARIOS:
+        if args.suite != 'all' and scenario['suite'] != args.suite:
+            continue
+        try:
+            samples = run_scenario(scenario, args)
+        except (OSError, RuntimeError, subprocess.TimeoutExpired) as e:
+            print(f"Error: {e}", file=sys.stderr)
+            return 2
+        for m in scenario['metrics']:
+            name = f"{scenario['name']}.{m['key']}"
+            base = old.get(name, {}).get('samples')
+            if report_metric(name, m, base, samples[m['key']], args.threshold):
+                regressions.append(name)
+            new[name] = {'unit': m['unit'], 'higher_is_better': m['higher'],
+                         'samples': samples[m['key']]}
+        if regressions and not args.keep_going:
+            break
+
+    print()
+    if regressions:
+        print(f"FAIL: {len(regressions)} significant regression(s) over {args.threshold:g}%: "
+              f"{', '.join(regressions)}")
+        if not args.keep_going:
+            print("Stopped at the first regressing scenario (--keep-going runs the rest)")
+    else:
+        print(f"PASS: no significant regression over {args.threshold:g}%")
+    if args.update:
+        save_baseline(args.baseline, new, args)
+        print(f"Baseline written to {args.baseline}")
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,461 @@
+/*
+ * Collectives benchmark: ring allreduce, reduce-scatter, allgather and
+ * broadcast over RDMA (rdma_coll.h), reported the way NCCL's tests do
+ *
+ * For each rank count of -n (local processes, forked here and connected
+ * over 127.0.0.1, e.g. rxe loopback) or across hosts (-r rank on each of
+ * them, the same host list everywhere), and for each collective and
+ * buffer size from -b to -e bytes growing -f times, it runs -w warmup and
+ * -i timed iterations in place and reports
+ *
+ *   time    per collective, on rank 0
+ *   algbw   size / time
+ *   busbw   algbw scaled to what every link carried, so it compares with
+ *           the link rate whatever the rank count: 2 (n - 1) / n for
+ *           allreduce, (n - 1) / n for reduce-scatter and allgather, 1 for
+ *           broadcast
+ *   #wrong  elements off from the expected result over all ranks, in one
+ *           more run on known data
+ *
+ * Size is the whole buffer: for reduce-scatter and allgather each rank's
+ * share is size / n. Before the tables rank 0 times the reduction kernels
+ * on its own, per SIMD level.
+ *
+ * Usage: coll_bench [-n ranks,...] [-c coll,...] [-b bytes] [-e bytes] [-f factor]
+ *                   [-d dtype] [-k chunk] [-v simd] [-i iters] [-w warmup]
+ *        coll_bench -r rank [options] host0,host1,...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "rdma_coll.h"
+
+#define PORT 18523                      // rank i listens on PORT + i
+#define MAX_RANKS 64
+#define KERNEL_BYTES (1024 * 1024)
+#define KERNEL_NS 200000000ULL
+#define DEFAULT_RANKS "2,4"
+#define DEFAULT_MIN_BYTES 1024
+#define DEFAULT_MAX_BYTES (16 * 1024 * 1024)
+#define DEFAULT_FACTOR 4
+#define DEFAULT_ITERS 20
+#define DEFAULT_WARMUP 5
+
+enum coll_kind {
+    COLL_ALLREDUCE,
+    COLL_REDUCE_SCATTER,
+    COLL_ALLGATHER,
+    COLL_BROADCAST,
+    COLL_KIND_COUNT,
+};
+
+static const char *const coll_names[COLL_KIND_COUNT] = {"allreduce", "reduce_scatter",
+                                                        "allgather", "broadcast"};
+
+struct cb_opts {
+    unsigned colls;
+    size_t min_bytes;
+    size_t max_bytes;
+    int factor;
+    enum coll_dtype dtype;
+    uint32_t chunk;
+    enum coll_simd simd;
+    int iters;
+    int warmup;
+};
+
+static void set_elem(enum coll_dtype dtype, char *buf, size_t i, int64_t v) {
+    switch (dtype) {
+    case COLL_FLOAT:
+        ((float *)buf)[i] = v;
+        break;
+    case COLL_DOUBLE:
+        ((double *)buf)[i] = v;
+        break;
+    case COLL_INT32:
+        ((int32_t *)buf)[i] = v;
+        break;
+    default:
+        ((int64_t *)buf)[i] = v;
+        break;
+    }
+}
+
+static int64_t get_elem(enum coll_dtype dtype, const char *buf, size_t i) {
+    switch (dtype) {
+    case COLL_FLOAT:
+        return ((const float *)buf)[i];
+    case COLL_DOUBLE:
+        return ((const double *)buf)[i];
+    case COLL_INT32:
+        return ((const int32_t *)buf)[i];
+    default:
+        return ((const int64_t *)buf)[i];
+    }
+}
+
+// Rank r's input at element i: small integers, exact in every dtype
+static int64_t input(int rank, size_t i) {
+    return rank + 1 + i % 7;
+}
+
+static int64_t input_sum(int size, size_t i) {
+    return (int64_t)size * (size + 1) / 2 + (int64_t)size * (i % 7);
+}
+
+// Elements each rank passes as count, and the buffer's element count
+static size_t coll_count(enum coll_kind kind, size_t elems, int size) {
+    return kind == COLL_REDUCE_SCATTER || kind == COLL_ALLGATHER ? elems / size : elems;
+}
+
+static int run_coll(struct coll_comm *c, enum coll_kind kind, size_t count, enum coll_dtype dtype) {
+    switch (kind) {
+    case COLL_ALLREDUCE:
+        return coll_allreduce(c, count, dtype);
+    case COLL_REDUCE_SCATTER:
+        return coll_reduce_scatter(c, count, dtype);
+    case COLL_ALLGATHER:
+        return coll_allgather(c, count, dtype);
+    default:
+        return coll_broadcast(c, count * coll_dtype_size[dtype], 0);
+    }
+}
+
+static double bus_factor(enum coll_kind kind, int size) {
+    switch (kind) {
+    case COLL_ALLREDUCE:
+        return 2.0 * (size - 1) / size;
+    case COLL_REDUCE_SCATTER:
+    case COLL_ALLGATHER:
+        return (double)(size - 1) / size;
+    default:
+        return 1.0;
+    }
+}
+
+// Run kind once on known data; elements wrong on this rank, -1 on failure
+static int64_t check_coll(struct coll_comm *c, enum coll_kind kind, size_t count,
+                          enum coll_dtype dtype) {
+    size_t elems = kind == COLL_REDUCE_SCATTER || kind == COLL_ALLGATHER ? count * c->size : count;
+    size_t lo = 0, hi = elems;
+    int64_t wrong = 0;
+
+    for (size_t i = 0; i < elems; i++) {
+        int64_t v = input(c->rank, i);
+
+        if (kind == COLL_ALLGATHER && i / count != (size_t)c->rank) {
+            v = 0;
+        } else if (kind == COLL_BROADCAST && c->rank != 0) {
+            v = 0;
+        }
+        set_elem(dtype, c->buf, i, v);
+    }
+    if (run_coll(c, kind, count, dtype)) {
+        return -1;
+    }
+    if (kind == COLL_REDUCE_SCATTER) {
+        lo = count * c->rank;
+        hi = lo + count;
+    }
+    for (size_t i = lo; i < hi; i++) {
+        int64_t want;
+
+        switch (kind) {
+        case COLL_ALLREDUCE:
+        case COLL_REDUCE_SCATTER:
+            want = input_sum(c->size, i);
+            break;
+        case COLL_ALLGATHER:
+            want = input(i / count, i);
+            break;
+        default:
+            want = input(0, i);
+            break;
+        }
+        wrong += get_elem(dtype, c->buf, i) != want;
+    }
+    return wrong;
+}
+
+static int run_size(struct coll_comm *c, enum coll_kind kind, size_t bytes, const struct cb_opts *o) {
+    size_t es = coll_dtype_size[o->dtype];
+    size_t count = coll_count(kind, bytes / es, c->size);
+    int64_t wrong;
+    uint64_t start, ns;
+    double algbw;
+
+    if (!count) {
+        return 0;
+    }
+    // Repeated sums of zeros stay in range
+    memset(c->buf, 0, bytes);
+    for (int i = 0; i < o->warmup; i++) {
+        if (run_coll(c, kind, count, o->dtype)) {
+            return -1;
+        }
+    }
+    start = rdma_now_ns();
+    for (int i = 0; i < o->iters; i++) {
+        if (run_coll(c, kind, count, o->dtype)) {
+            return -1;
+        }
+    }
+    ns = (rdma_now_ns() - start) / o->iters;
+
+    // Every rank's count of wrong elements, summed
+    wrong = check_coll(c, kind, count, o->dtype);
+    if (wrong < 0) {
+        return -1;
+    }
+    ((int64_t *)c->buf)[0] = wrong;
+    if (coll_allreduce(c, 1, COLL_INT64)) {
+        return -1;
+    }
+    wrong = ((int64_t *)c->buf)[0];
+
+    bytes = coll_count(kind, bytes / es, c->size) * es;
+    if (kind == COLL_REDUCE_SCATTER || kind == COLL_ALLGATHER) {
+        bytes *= c->size;
+    }
+    algbw = bytes / (double)ns;
+    printf("%12zu %12zu %8s %10.1f %8.2f %8.2f %8ld\n", bytes, bytes / es,
+           coll_dtype_names[o->dtype], ns / 1e3, algbw, algbw * bus_factor(kind, c->size),
+           wrong);
+    fflush(stdout);
+    return 0;
+}
+
+// GB/s of dst += src over KERNEL_BYTES, per SIMD level this CPU has
+static void report_kernels(enum coll_dtype dtype) {
+    size_t n = KERNEL_BYTES / coll_dtype_size[dtype];
+    char *dst = aligned_alloc(64, KERNEL_BYTES), *src = aligned_alloc(64, KERNEL_BYTES);
+
+    if (!dst || !src) {
+        free(dst);
+        free(src);
+        return;
+    }
+    memset(dst, 0, KERNEL_BYTES);
+    memset(src, 0, KERNEL_BYTES);
+    printf("# %s sum kernels, %d KB:", coll_dtype_names[dtype], KERNEL_BYTES / 1024);
+    for (int s = 0; s < COLL_SIMD_COUNT; s++) {
+        uint64_t start, reps = 0;
+
+        if (!coll_simd_available(s)) {
+            continue;
+        }
+        start = rdma_now_ns();
+        do {
+            coll_reduce_sum(s, dtype, dst, src, n);
+            reps++;
+        } while (rdma_now_ns() - start < KERNEL_NS);
+        printf("  %s %.1f GB/s", coll_simd_names[s],
+               reps * (double)KERNEL_BYTES / (rdma_now_ns() - start));
+    }
+    printf("\n");
+    free(dst);
+    free(src);
+}
+
+static int run_rank(int rank, int size, const char *const *hosts, const struct cb_opts *o) {
+    struct coll_attr attr = {
+        .rank = rank,
+        .size = size,
+        .hosts = hosts,
+        .port = PORT,
+        .max_bytes = o->max_bytes,
+        .chunk = o->chunk,
+        .simd = o->simd,
+    };
+    struct coll_comm c;
+    int ret = 0;
+
+    if (coll_init(&c, &attr)) {
+        return -1;
+    }
+    printf("#\n# %d ranks, %s, %u-byte chunks, %s sums\n", size, coll_dtype_names[o->dtype],
+           c.chunk, coll_simd_names[c.simd]);
+    for (int k = 0; k < COLL_KIND_COUNT && !ret; k++) {
+        if (!(o->colls & (1U << k))) {
+            continue;
+        }
+        printf("#\n# %s\n", coll_names[k]);
+        printf("# %10s %12s %8s %10s %8s %8s %8s\n", "size", "count", "type", "time", "algbw",
+               "busbw", "#wrong");
+        printf("# %10s %12s %8s %10s %8s %8s %8s\n", "(B)", "(elements)", "", "(us)", "(GB/s)",
+               "(GB/s)", "");
+        for (size_t bytes = o->min_bytes; bytes <= o->max_bytes && !ret; bytes *= o->factor) {
+            ret = run_size(&c, k, bytes, o);
+        }
+    }
+    coll_destroy(&c);
+    return ret;
+}
+
+// size ranks as processes on this host
+static int run_local(int size, const struct cb_opts *o) {
+    const char *hosts[MAX_RANKS];
+    pid_t pids[MAX_RANKS];
+    int ret = 0;
+
+    for (int i = 0; i < size; i++) {
+        hosts[i] = "127.0.0.1";
+    }
+    fflush(stdout);
+    for (int i = 1; i < size; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            size = i;
+            ret = -1;
+            break;
+        }
+        if (pids[i] == 0) {
+            // Rank 0 reports for all of them
+            if (!freopen("/dev/null", "w", stdout)) {
+                _exit(1);
+            }
+            _exit(run_rank(i, size, hosts, o) ? 1 : 0);
+        }
+    }
+    if (!ret && run_rank(0, size, hosts, o)) {
+        ret = -1;
+    }
+    for (int i = 1; i < size; i++) {
+        int status;
+
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "Rank %d of %d failed\n", i, size);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n ranks,...] [-c coll,...] [-b bytes] [-e bytes] [-f factor]\n"
+                    "       [-d dtype] [-k chunk] [-v simd] [-i iters] [-w warmup]\n", prog);
+    fprintf(stderr, "       %s -r rank [options] host0,host1,...\n", prog);
+    fprintf(stderr, "  -n  Rank counts to run as local processes, 2..%d (default %s)\n", MAX_RANKS,
+            DEFAULT_RANKS);
+    fprintf(stderr, "  -r  Run this rank only, of one per host listed, on port %d + rank\n", PORT);
+    fprintf(stderr, "  -c  Collectives: allreduce, reduce_scatter, allgather, broadcast\n"
+                    "      (default all)\n");
+    fprintf(stderr, "  -b  Smallest buffer, bytes (default %d)\n", DEFAULT_MIN_BYTES);
+    fprintf(stderr, "  -e  Largest buffer, bytes (default %d)\n", DEFAULT_MAX_BYTES);
+    fprintf(stderr, "  -f  Buffer growth factor (default %d)\n", DEFAULT_FACTOR);
+    fprintf(stderr, "  -d  Type: float, double, int32, int64 (default float)\n");
+    fprintf(stderr, "  -k  Chunk size, bytes, a multiple of 8 (default %d)\n", COLL_DEFAULT_CHUNK);
+    fprintf(stderr, "  -v  Sum kernels: scalar, avx2, avx512 (default the widest available)\n");
+    fprintf(stderr, "  -i  Timed iterations (default %d)\n", DEFAULT_ITERS);
+    fprintf(stderr, "  -w  Warmup iterations (default %d)\n", DEFAULT_WARMUP);
+}
+
+int main(int argc, char *argv[]) {
+    struct cb_opts o = {
+        .colls = (1U << COLL_KIND_COUNT) - 1,
+        .min_bytes = DEFAULT_MIN_BYTES,
+        .max_bytes = DEFAULT_MAX_BYTES,
+        .factor = DEFAULT_FACTOR,
+        .dtype = COLL_FLOAT,
+        .chunk = COLL_DEFAULT_CHUNK,
+        .simd = coll_simd_best(),
+        .iters = DEFAULT_ITERS,
+        .warmup = DEFAULT_WARMUP,
+    };
+    char default_ranks[] = DEFAULT_RANKS;
+    char *ranks = default_ranks;
+    const char *hosts[MAX_RANKS];
+    unsigned mask;
+    int rank = -1;
+    int ret = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:c:b:e:f:d:k:v:i:w:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            ranks = optarg;
+            break;
+        case 'r':
+            rank = atoi(optarg);
+            break;
+        case 'c':
+            if (rdma_parse_names(optarg, coll_names, COLL_KIND_COUNT, &o.colls)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            o.min_bytes = atol(optarg);
+            break;
+        case 'e':
+            o.max_bytes = atol(optarg);
+            break;
+        case 'f':
+            o.factor = atoi(optarg);
+            break;
+        case 'd':
+            if (rdma_parse_names(optarg, coll_dtype_names, COLL_DTYPE_COUNT, &mask) ||
+                (mask & (mask - 1))) {
+                usage(argv[0]);
+                return 1;
+            }
+            o.dtype = __builtin_ctz(mask);
+            break;
+        case 'k':
+            o.chunk = atoi(optarg);
+            break;
+        case 'v':
+            if (rdma_parse_names(optarg, coll_simd_names, COLL_SIMD_COUNT, &mask) ||
+                (mask & (mask - 1))) {
+                usage(argv[0]);
+                return 1;
+            }
+            o.simd = __builtin_ctz(mask);
+            break;
+        case 'i':
+            o.iters = atoi(optarg);
+            break;
+        case 'w':
+            o.warmup = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!o.min_bytes || o.min_bytes > o.max_bytes || o.factor < 2 || o.iters < 1 ||
+        o.warmup < 0 || (rank >= 0 && optind >= argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    report_kernels(o.dtype);
+    if (rank >= 0) {
+        int size = 0;
+
+        for (char *tok = strtok(argv[optind], ","); tok && size < MAX_RANKS;
+             tok = strtok(NULL, ",")) {
+            hosts[size++] = tok;
+        }
+        return run_rank(rank, size, hosts, &o) ? 1 : 0;
+    }
+    for (char *tok = strtok(ranks, ","); tok; tok = strtok(NULL, ",")) {
+        int size = atoi(tok);
+
+        if (size < 2 || size > MAX_RANKS) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (run_local(size, &o)) {
+            ret = 1;
+        }
+    }
+    return ret;
+}
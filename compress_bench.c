@@ -0,0 +1,625 @@
+/*
+ * Compression pipeline benchmark: goodput of the file transfer (rdma_file.h)
+ * with and without its compression stage (rdma_compress.h), over several
+ * data corpora
+ *
+ * The client generates -S MB of a corpus into a file under -d and sends it
+ * to the server (compress_bench -s) with file_send(), once per mode, each
+ * over a connection of its own:
+ *
+ *   raw     every chunk WRITEn straight from the mmap'ed file
+ *   lz4     every chunk compressed on the way out and decompressed by the
+ *   zstd    receiver before it goes to disk
+ *   auto    the adaptive controller picks per chunk: compressed (with -z)
+ *           or raw, when the corpus is not compressing or the workers are
+ *           behind an idle wire
+ *
+ * A hello SEND ahead of each transfer names its corpus, and the server
+ * receives it with file_receive() into a file under its own -d, which it
+ * then checks against the corpus.
+ *
+ * Corpora:
+ *
+ *   zeros   all zero
+ *   text    words of English, about 2x for lz4
+ *   log     timestamped server log lines, highly repetitive
+ *   float   a random walk as doubles, barely compressible
+ *   random  incompressible
+ *   mixed   1 MB blocks of text, log and random, chosen at random
+ *
+ * and per corpus and mode it reports the ratio (corpus / bytes on the wire),
+ * goodput (corpus bytes per second) and its speedup over raw, the share of
+ * chunks sent compressed and the sender's and receiver's CPU seconds.
+ * Compression only pays where the link is the bottleneck: on a fast link,
+ * see it with a slower one, and watch auto back off.
+ *
+ * Usage: compress_bench -s [-n clients] [-d dir]
+ *        compress_bench [-S mb] [-z codec] [-m mode,...] [-a corpus,...] [-d dir]
+ *                       <server_ip>
+ * The server exits after clients clients: 1 by default. Keep -d on tmpfs
+ * to leave the disk out of it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_common.h"
+#include "rdma_connection.h"
+#include "rdma_compress.h"
+#include "rdma_file.h"
+
+#define PORT 18522
+#define QP_DEPTH (FILE_XFER_SLOTS + 2)      // the file pipeline, and the hello
+#define CQ_DEPTH (2 * QP_DEPTH)
+#define MIXED_BLOCK (1024 * 1024)
+#define DEFAULT_MB 256
+#define DEFAULT_DIR "/dev/shm"
+
+enum corpus {
+    CORPUS_ZEROS,
+    CORPUS_TEXT,
+    CORPUS_LOG,
+    CORPUS_FLOAT,
+    CORPUS_RANDOM,
+    CORPUS_MIXED,
+    CORPUS_COUNT,
+};
+
+static const char *const corpus_names[CORPUS_COUNT] = {"zeros", "text", "log", "float", "random",
+                                                       "mixed"};
+
+enum xfer_mode {
+    MODE_RAW,
+    MODE_LZ4,
+    MODE_ZSTD,
+    MODE_AUTO,
+    MODE_COUNT,
+};
+
+static const char *const mode_names[MODE_COUNT] = {"raw", "lz4", "zstd", "auto"};
+
+// Client -> server ahead of each transfer
+struct cz_hello {
+    uint32_t corpus;
+    uint32_t mode;
+    uint64_t size;
+    uint32_t last;          // the client's final transfer
+    uint32_t pad;
+};
+
+struct cz_opts {
+    size_t size;
+    enum compress_codec codec;      // for auto
+    const char *dir;
+};
+
+// Outcome of one corpus and mode
+enum cz_status {
+    CZ_SKIPPED,
+    CZ_DONE,
+    CZ_FAILED,
+    CZ_NOT_BUILT,
+};
+
+// file_send() and file_receive() stop when this drops; nothing drops it
+static volatile int running = 1;
+
+static uint64_t xorshift(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static const char *const words[] = {
+    "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be",
+    "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have",
+    "an", "had", "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there",
+    "been", "if", "more", "when", "will", "would", "who", "so", "no", "queue", "memory", "remote",
+    "network", "transfer", "buffer", "register", "completion", "latency", "bandwidth", "device",
+    "kernel", "request", "between", "through",
+};
+
+static const char *const levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+
+static void fill_text(char *buf, size_t len, uint64_t seed) {
+    size_t n = sizeof(words) / sizeof(words[0]), i = 0, line = 0;
+
+    while (i < len) {
+        uint64_t r = xorshift(&seed);
+        const char *w = words[r % n];
+
+        while (*w && i < len) {
+            buf[i++] = *w++;
+        }
+        if (i < len) {
+            line++;
+            buf[i++] = r >> 32 & 15 ? ' ' : line % 4 ? '.' : '\n';
+        }
+    }
+}
+
+static void fill_log(char *buf, size_t len, uint64_t seed) {
+    uint64_t usec = 1760000000ULL * 1000000 + seed % 1000000;
+    size_t i = 0;
+
+    while (i < len) {
+        uint64_t r = xorshift(&seed);
+        time_t sec = usec / 1000000;
+        struct tm tm;
+        char line[192];
+        int n;
+
+        usec += r % 5000;
+        gmtime_r(&sec, &tm);
+        n = snprintf(line, sizeof(line),
+                     "%04d-%02d-%02dT%02d:%02d:%02d.%06luZ node-%02lu rdma_server[%lu]: %s qp 0x%lx: "
+                     "posted %lu bytes to 0x7f%08lx rkey 0x%lx\n",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                     (unsigned long)(usec % 1000000), (unsigned long)(r >> 8 & 15),
+                     (unsigned long)(4000 + (r >> 12 & 3)), levels[(r >> 14) % 6],
+                     (unsigned long)(0x100 + (r >> 20 & 63)), 64UL << (r >> 26 & 7),
+                     (unsigned long)(r >> 29 & 0xffffff) << 6, (unsigned long)(0x1000 + (r >> 53 & 255)));
+        for (int k = 0; k < n && i < len; k++) {
+            buf[i++] = line[k];
+        }
+    }
+}
+
+static void fill_float(char *buf, size_t len, uint64_t seed) {
+    double x = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        uint64_t r = xorshift(&seed);
+        size_t n = len - i < sizeof(x) ? len - i : sizeof(x);
+
+        x += ((double)(r >> 11) / (1ULL << 53) - 0.5) * 1e-3;
+        memcpy(buf + i, &x, n);
+        i += n;
+    }
+}
+
+static void fill_random(char *buf, size_t len, uint64_t seed) {
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t r = xorshift(&seed);
+        memcpy(buf + i, &r, len - i < 8 ? len - i : 8);
+    }
+}
+
+// The same bytes for the same corpus and size on both ends
+static void fill_corpus(enum corpus corpus, char *buf, size_t len) {
+    uint64_t seed = 0x9e3779b97f4a7c15ULL ^ corpus;
+
+    switch (corpus) {
+    case CORPUS_ZEROS:
+        memset(buf, 0, len);
+        break;
+    case CORPUS_TEXT:
+        fill_text(buf, len, seed);
+        break;
+    case CORPUS_LOG:
+        fill_log(buf, len, seed);
+        break;
+    case CORPUS_FLOAT:
+        fill_float(buf, len, seed);
+        break;
+    case CORPUS_RANDOM:
+        fill_random(buf, len, seed);
+        break;
+    default:
+        for (size_t off = 0; off < len; off += MIXED_BLOCK) {
+            size_t n = len - off < MIXED_BLOCK ? len - off : MIXED_BLOCK;
+            uint64_t r = xorshift(&seed);
+
+            switch (r % 3) {
+            case 0:
+                fill_text(buf + off, n, r);
+                break;
+            case 1:
+                fill_log(buf + off, n, r);
+                break;
+            default:
+                fill_random(buf + off, n, r);
+                break;
+            }
+        }
+        break;
+    }
+}
+
+
+// Whether the file at path holds exactly the size bytes of corpus
+static int check_corpus(const char *path, enum corpus corpus, size_t size) {
+    char *expect = malloc(size), *got = malloc(size);
+    FILE *f = fopen(path, "rb");
+    int ok = 0;
+
+    if (!expect || !got || !f) {
+        fprintf(stderr, "Failed to check %s\n", path);
+    } else {
+        fill_corpus(corpus, expect, size);
+        ok = fread(got, 1, size, f) == size && fgetc(f) == EOF && !memcmp(got, expect, size);
+    }
+    if (f) {
+        fclose(f);
+    }
+    free(got);
+    free(expect);
+    return ok;
+}
+
+// One transfer: its hello, the file, then the check. 1 when it was the
+// client's last, 0 when more follow, -1 on failure
+static int serve_transfer(struct rdma_context *ctx, const char *path) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)ctx->buffer,
+        .length = sizeof(struct cz_hello),
+        .lkey = ctx->mr->lkey,
+    };
+    struct ibv_recv_wr wr = {
+        .sg_list = &sge,
+        .num_sge = 1,
+    };
+    struct ibv_recv_wr *bad_wr;
+    struct file_xfer_stats stats;
+    struct cz_hello hello;
+    struct ibv_wc wc;
+    int n;
+
+    if (ibv_post_recv(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post receive\n");
+        return -1;
+    }
+    while ((n = ibv_poll_cq(ctx->cq, 1, &wc)) == 0) {
+    }
+    if (n < 0 || wc.status != IBV_WC_SUCCESS || wc.opcode != IBV_WC_RECV) {
+        fprintf(stderr, "Failed to receive the transfer request\n");
+        return -1;
+    }
+    memcpy(&hello, ctx->buffer, sizeof(hello));
+    if (hello.corpus >= CORPUS_COUNT || hello.mode >= MODE_COUNT || !hello.size) {
+        fprintf(stderr, "Bad transfer request\n");
+        return -1;
+    }
+
+    if (file_receive(ctx->pd, ctx->qp, ctx->cq, path, &running, &stats)) {
+        return -1;
+    }
+    if (!check_corpus(path, hello.corpus, hello.size)) {
+        fprintf(stderr, "%s/%s: data arrived corrupted\n", corpus_names[hello.corpus],
+                mode_names[hello.mode]);
+        return -1;
+    }
+    printf("%s/%s: %lu bytes arrived intact\n", corpus_names[hello.corpus],
+           mode_names[hello.mode], stats.bytes);
+    return hello.last ? 1 : 0;
+}
+
+static int run_server(int total, const char *dir) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = sizeof(struct cz_hello),
+        .cq_depth = CQ_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .quiet = 1,
+    };
+    struct rdma_context listener;
+    struct rdma_cm_event *event;
+    char path[4096];
+    int served = 0, failed = 0;
+
+    snprintf(path, sizeof(path), "%s/compress_bench.%d.recv", dir, (int)getpid());
+    memset(&listener, 0, sizeof(listener));
+    if (listen_rdma_connections(&listener, NULL, PORT)) {
+        close_rdma_connection(&listener);
+        return -1;
+    }
+    printf("Waiting for %d clients on port %d (lz4 %s, zstd %s)\n", total, PORT,
+           compress_codec_available(COMPRESS_LZ4) ? "yes" : "no",
+           compress_codec_available(COMPRESS_ZSTD) ? "yes" : "no");
+
+    // One transfer at a time; a client is done after its last, or the
+    // first that fails
+    while (served < total) {
+        struct rdma_context ctx;
+        int ret;
+
+        if (rdma_get_cm_event(listener.cm_channel, &event)) {
+            fprintf(stderr, "Failed to get CM event\n");
+            break;
+        }
+        if (event->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
+            rdma_ack_cm_event(event);
+            continue;
+        }
+        memset(&ctx, 0, sizeof(ctx));
+        if (accept_connect_request(&ctx, event, &attr, NULL)) {
+            rdma_ack_cm_event(event);
+            close_rdma_connection(&ctx);
+            served++;
+            failed++;
+            continue;
+        }
+        rdma_ack_cm_event(event);
+
+        ret = serve_transfer(&ctx, path);
+        served += ret != 0;
+        failed += ret < 0;
+
+        while (!rdma_get_cm_event(listener.cm_channel, &event)) {
+            enum rdma_cm_event_type type = event->event;
+
+            rdma_ack_cm_event(event);
+            if (type == RDMA_CM_EVENT_DISCONNECTED || type == RDMA_CM_EVENT_CONNECT_ERROR ||
+                type == RDMA_CM_EVENT_UNREACHABLE || type == RDMA_CM_EVENT_REJECTED) {
+                break;
+            }
+        }
+        close_rdma_connection(&ctx);
+    }
+
+    unlink(path);
+    printf("Served %d clients\n", served);
+    close_rdma_connection(&listener);
+    return served == total && !failed ? 0 : -1;
+}
+
+// Send the file at path in mode over a connection of its own
+static int run_case(const char *server_ip, const char *path, enum corpus corpus,
+                    enum xfer_mode mode, const struct cz_opts *o, int last,
+                    struct file_xfer_stats *stats) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = sizeof(struct cz_hello),
+        .cq_depth = CQ_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .quiet = 1,
+    };
+    struct cz_hello hello = {
+        .corpus = corpus,
+        .mode = mode,
+        .size = o->size,
+        .last = last,
+    };
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+    struct rdma_context ctx;
+    enum compress_codec codec;
+    struct ibv_wc wc;
+    int n, ret = -1;
+
+    codec = mode == MODE_LZ4 ? COMPRESS_LZ4 : mode == MODE_ZSTD ? COMPRESS_ZSTD :
+            mode == MODE_AUTO ? o->codec : COMPRESS_NONE;
+
+    memset(&ctx, 0, sizeof(ctx));
+    if (connect_to_server(&ctx, server_ip, PORT, &attr)) {
+        goto out;
+    }
+    memcpy(ctx.buffer, &hello, sizeof(hello));
+    sge.addr = (uintptr_t)ctx.buffer;
+    sge.length = sizeof(hello);
+    sge.lkey = ctx.mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    if (ibv_post_send(ctx.qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post send\n");
+        goto out;
+    }
+    while ((n = ibv_poll_cq(ctx.cq, 1, &wc)) == 0) {
+    }
+    if (n < 0 || wc.status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "Failed to send the transfer request\n");
+        goto out;
+    }
+
+    ret = file_send(ctx.pd, ctx.qp, ctx.cq, path, FILE_SOURCE_MMAP, codec, mode == MODE_AUTO,
+                    &running, stats);
+
+out:
+    close_rdma_connection(&ctx);
+    return ret;
+}
+
+static int write_corpus(const char *path, enum corpus corpus, char *buf, size_t size) {
+    FILE *f = fopen(path, "wb");
+    int ok;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fill_corpus(corpus, buf, size);
+    ok = fwrite(buf, 1, size, f) == size;
+    if (fclose(f) || !ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int run_client(const char *server_ip, const struct cz_opts *o, unsigned modes,
+                      unsigned corpora) {
+    static struct file_xfer_stats stats[CORPUS_COUNT][MODE_COUNT];
+    enum cz_status status[CORPUS_COUNT][MODE_COUNT];
+    uint64_t nchunks = (o->size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+    char path[4096];
+    char *buf;
+    int last_c = -1, last_md = -1, ret = 0;
+
+    // Which cases run, and so which one the server hears is the last
+    for (int c = 0; c < CORPUS_COUNT; c++) {
+        for (int md = 0; md < MODE_COUNT; md++) {
+            status[c][md] = CZ_SKIPPED;
+            if (!(corpora & (1U << c)) || !(modes & (1U << md))) {
+                continue;
+            }
+            if ((md == MODE_LZ4 && !compress_codec_available(COMPRESS_LZ4)) ||
+                (md == MODE_ZSTD && !compress_codec_available(COMPRESS_ZSTD))) {
+                status[c][md] = CZ_NOT_BUILT;
+                continue;
+            }
+            last_c = c;
+            last_md = md;
+        }
+    }
+    if (last_c < 0) {
+        fprintf(stderr, "Nothing to run\n");
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/compress_bench.%d.src", o->dir, (int)getpid());
+    buf = malloc(o->size);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate %lu bytes\n", o->size);
+        return -1;
+    }
+    for (int c = 0; c <= last_c && !ret; c++) {
+        int written = 0;
+
+        for (int md = 0; md < MODE_COUNT && !ret; md++) {
+            if (status[c][md] != CZ_SKIPPED || !(corpora & (1U << c)) || !(modes & (1U << md))) {
+                continue;
+            }
+            if (!written && write_corpus(path, c, buf, o->size)) {
+                ret = -1;
+                break;
+            }
+            written = 1;
+            if (run_case(server_ip, path, c, md, o, c == last_c && md == last_md, &stats[c][md])) {
+                status[c][md] = CZ_FAILED;
+                ret = -1;
+                break;
+            }
+            status[c][md] = CZ_DONE;
+        }
+    }
+    unlink(path);
+    free(buf);
+
+    printf("\n%lu MB per corpus in %u byte chunks, %d in flight, %d workers per side\n",
+           o->size >> 20, FILE_CHUNK_SIZE, FILE_XFER_SLOTS, FILE_COMPRESS_WORKERS);
+    printf("%-7s %-5s %7s %9s %8s %7s %8s %8s\n", "corpus", "mode", "ratio", "GB/s", "x raw",
+           "comp%", "tx cpu", "rx cpu");
+    for (int c = 0; c < CORPUS_COUNT; c++) {
+        double raw_gbps = 0;
+
+        for (int md = 0; md < MODE_COUNT; md++) {
+            const struct file_xfer_stats *s = &stats[c][md];
+            double gbps;
+
+            if (status[c][md] == CZ_NOT_BUILT) {
+                printf("%-7s %-5s not built in\n", corpus_names[c], mode_names[md]);
+                continue;
+            }
+            if (status[c][md] == CZ_FAILED) {
+                printf("%-7s %-5s failed\n", corpus_names[c], mode_names[md]);
+                continue;
+            }
+            if (status[c][md] != CZ_DONE) {
+                continue;
+            }
+            gbps = s->elapsed > 0 ? s->bytes / s->elapsed / 1e9 : 0;
+            if (md == MODE_RAW) {
+                raw_gbps = gbps;
+            }
+            printf("%-7s %-5s %7.2f %9.3f", corpus_names[c], mode_names[md],
+                   s->wire_bytes ? (double)s->bytes / s->wire_bytes : 0, gbps);
+            if (raw_gbps > 0) {
+                printf(" %8.2f", gbps / raw_gbps);
+            } else {
+                printf(" %8s", "-");
+            }
+            printf(" %7.1f %8.2f %8.2f\n", 100.0 * s->compressed / nchunks, s->cpu, s->peer_cpu);
+        }
+    }
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -s [-n clients] [-d dir]\n", prog);
+    fprintf(stderr, "       %s [-S mb] [-z codec] [-m mode,...] [-a corpus,...] [-d dir]\n"
+                    "       <server_ip>\n", prog);
+    fprintf(stderr, "  -s  Run the server; it exits after clients clients (default 1)\n");
+    fprintf(stderr, "  -S  Corpus size, MB (default %d)\n", DEFAULT_MB);
+    fprintf(stderr, "  -z  Codec for auto: lz4, zstd (default lz4 when built in)\n");
+    fprintf(stderr, "  -m  Modes: raw, lz4, zstd, auto (default all)\n");
+    fprintf(stderr, "  -a  Corpora: zeros, text, log, float, random, mixed (default all)\n");
+    fprintf(stderr, "  -d  Directory for the corpus file, or the received one (default %s)\n",
+            DEFAULT_DIR);
+}
+
+int main(int argc, char *argv[]) {
+    struct cz_opts o = {
+        .size = (size_t)DEFAULT_MB << 20,
+        .codec = compress_codec_available(COMPRESS_LZ4) ? COMPRESS_LZ4 : COMPRESS_ZSTD,
+        .dir = DEFAULT_DIR,
+    };
+    unsigned modes = (1U << MODE_COUNT) - 1;
+    unsigned corpora = (1U << CORPUS_COUNT) - 1;
+    unsigned codec;
+    int server = 0;
+    int server_clients = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sn:S:z:m:a:d:h")) != -1) {
+        switch (opt) {
+        case 's':
+            server = 1;
+            break;
+        case 'n':
+            server_clients = atoi(optarg);
+            break;
+        case 'S':
+            o.size = (size_t)atol(optarg) << 20;
+            break;
+        case 'z':
+            if (rdma_parse_names(optarg, compress_codec_names, COMPRESS_CODEC_COUNT, &codec) ||
+                (codec & (codec - 1)) || codec == 1U << COMPRESS_NONE) {
+                usage(argv[0]);
+                return 1;
+            }
+            o.codec = __builtin_ctz(codec);
+            break;
+        case 'm':
+            if (rdma_parse_names(optarg, mode_names, MODE_COUNT, &modes)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'a':
+            if (rdma_parse_names(optarg, corpus_names, CORPUS_COUNT, &corpora)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'd':
+            o.dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (server_clients < 1 || !o.size || (!server && optind >= argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if ((modes & (1U << MODE_AUTO)) && !compress_codec_available(o.codec)) {
+        fprintf(stderr, "Built without %s; auto sends everything raw\n",
+                compress_codec_names[o.codec]);
+        o.codec = COMPRESS_NONE;
+    }
+
+    if (server) {
+        return run_server(server_clients, o.dir) ? 1 : 0;
+    }
+    return run_client(argv[optind], &o, modes, corpora) ? 1 : 0;
+}
@@ -0,0 +1,288 @@
+/*
+ * Connection setup benchmark: how fast can rdma_cm connections be made?
+ *
+ * The client opens and closes connections to conn_bench -s, first one at a
+ * time and then J at once (every address and route resolution in flight
+ * together, see connect_to_servers()), and reports connections per second,
+ * connect latency, teardown time and where the time went, per setup phase
+ * (rdma_setup_phase). With -p, on both sides, connections come out of a
+ * pool of ready QPs, CQs and registered buffers instead of building them,
+ * and go back into it on close.
+ *
+ * Each connection uses the same resources as rdma_client (1 MB buffer, 16
+ * WR queues). The first connection is a warm-up: librdmacm opens its
+ * devices then, and the pools are created on the device it lands on.
+ *
+ * Usage: conn_bench -s [-p] [-n conns]
+ *        conn_bench [-p] [-n conns] [-j parallel] <server_ip>
+ * The server exits after the client's 2 * conns + 1 connections, so give
+ * both the same -n.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_common.h"
+#include "rdma_connection.h"
+
+#define PORT 18516
+#define BUFFER_SIZE (1024 * 1024)
+#define QP_DEPTH 16
+#define CQ_DEPTH (2 * QP_DEPTH)
+#define DEFAULT_CONNS 1000
+#define DEFAULT_PARALLEL 8
+#define MAX_PARALLEL LISTEN_BACKLOG     // more would be refused, not connected in parallel
+#define POOL_SIZE 64
+
+static const struct rdma_resource_attr bench_attr = {
+    .buffer_size = BUFFER_SIZE,
+    .cq_depth = CQ_DEPTH,
+    .qp_depth = QP_DEPTH,
+    .quiet = 1,
+};
+
+// Accept connections until total have come and gone. Every connection's
+// events arrive on the listener's channel, told apart by id->context
+static int run_server(int use_pool, int total) {
+    struct rdma_context listener;
+    struct rdma_conn_pool *pool = NULL;
+    struct rdma_cm_event *event;
+    int done = 0;
+    int ret = 0;
+
+    memset(&listener, 0, sizeof(listener));
+    if (listen_rdma_connections(&listener, NULL, PORT)) {
+        close_rdma_connection(&listener);
+        return -1;
+    }
+
+    while (done < total) {
+        struct rdma_context *ctx;
+        enum rdma_cm_event_type type;
+
+        if (rdma_get_cm_event(listener.cm_channel, &event)) {
+            fprintf(stderr, "Failed to get CM event\n");
+            ret = -1;
+            break;
+        }
+        type = event->event;
+
+        if (type == RDMA_CM_EVENT_CONNECT_REQUEST) {
+            if (use_pool && !pool) {
+                pool = rdma_conn_pool_create(event->id->verbs, &bench_attr, POOL_SIZE);
+                if (!pool) {
+                    rdma_ack_cm_event(event);
+                    ret = -1;
+                    break;
+                }
+            }
+            ctx = calloc(1, sizeof(*ctx));
+            if (!ctx) {
+                fprintf(stderr, "Failed to allocate connection\n");
+                rdma_reject(event->id, NULL, 0);
+                rdma_ack_cm_event(event);
+                continue;
+            }
+            ret = accept_connect_request(ctx, event, &bench_attr, pool);
+            // The id can only be destroyed once its event is acked
+            rdma_ack_cm_event(event);
+            if (ret) {
+                close_rdma_connection(ctx);
+                free(ctx);
+                done++;
+                ret = 0;
+            }
+            continue;
+        }
+
+        ctx = event->id->context;
+        rdma_ack_cm_event(event);
+        if (!ctx) {
+            continue;
+        }
+        if (type == RDMA_CM_EVENT_ESTABLISHED) {
+            ctx->connected = 1;
+        } else if (type == RDMA_CM_EVENT_DISCONNECTED || type == RDMA_CM_EVENT_REJECTED ||
+                   type == RDMA_CM_EVENT_CONNECT_ERROR || type == RDMA_CM_EVENT_UNREACHABLE) {
+            ctx->connected = 0;
+            close_rdma_connection(ctx);
+            free(ctx);
+            done++;
+        }
+    }
+
+    printf("Served %d connections\n", done);
+    close_rdma_connection(&listener);
+    rdma_conn_pool_destroy(pool);
+    return ret;
+}
+
+struct pass_result {
+    uint64_t *lat;          // connect latency of each connection
+    uint64_t teardown_ns;
+    uint64_t elapsed_ns;    // connects and closes
+    struct rdma_setup_timing phases;
+};
+
+static void add_timing(struct rdma_setup_timing *sum, const struct rdma_setup_timing *t) {
+    for (int p = 0; p < RDMA_PHASE_COUNT; p++) {
+        sum->ns[p] += t->ns[p];
+    }
+}
+
+// conns connections, parallel at a time; each round connects them all,
+// then closes them all
+static int run_pass(const char *server_ip, struct rdma_conn_pool *pool, int conns, int parallel,
+                    struct pass_result *r) {
+    struct rdma_context ctxs[MAX_PARALLEL];
+    struct rdma_setup_timing timing[MAX_PARALLEL];
+    uint64_t start = rdma_now_ns();
+
+    for (int made = 0; made < conns;) {
+        int k = conns - made < parallel ? conns - made : parallel;
+        uint64_t t;
+
+        memset(ctxs, 0, sizeof(ctxs[0]) * k);
+        memset(timing, 0, sizeof(timing[0]) * k);
+        for (int i = 0; i < k; i++) {
+            ctxs[i].timing = &timing[i];
+        }
+
+        t = rdma_now_ns();
+        if (connect_to_servers(ctxs, k, server_ip, PORT, &bench_attr, pool)) {
+            return -1;
+        }
+        t = rdma_now_ns() - t;
+        for (int i = 0; i < k; i++) {
+            r->lat[made + i] = t;
+            add_timing(&r->phases, &timing[i]);
+        }
+
+        t = rdma_now_ns();
+        for (int i = 0; i < k; i++) {
+            close_rdma_connection(&ctxs[i]);
+        }
+        r->teardown_ns += rdma_now_ns() - t;
+        made += k;
+    }
+
+    r->elapsed_ns = rdma_now_ns() - start;
+    return 0;
+}
+
+static void print_pass(const char *name, struct pass_result *r, int conns) {
+    qsort(r->lat, conns, sizeof(*r->lat), rdma_cmp_u64);
+    printf("%-10s %9.0f %9.1f %9.1f %9.1f |", name, conns / (r->elapsed_ns / 1e9),
+           r->lat[conns / 2] / 1e3, r->lat[(size_t)conns * 99 / 100] / 1e3,
+           r->teardown_ns / 1e3 / conns);
+    for (int p = 0; p < RDMA_PHASE_COUNT; p++) {
+        printf(" %8.1f", r->phases.ns[p] / 1e3 / conns);
+    }
+    printf("\n");
+}
+
+static int run_client(const char *server_ip, int use_pool, int conns, int parallel) {
+    struct rdma_context warmup;
+    struct rdma_conn_pool *pool = NULL;
+    struct pass_result serial, batched;
+    char name[16];
+    int ret = -1;
+
+    memset(&serial, 0, sizeof(serial));
+    memset(&batched, 0, sizeof(batched));
+    serial.lat = calloc(conns, sizeof(*serial.lat));
+    batched.lat = calloc(conns, sizeof(*batched.lat));
+    if (!serial.lat || !batched.lat) {
+        fprintf(stderr, "Failed to allocate latency samples\n");
+        goto out;
+    }
+
+    memset(&warmup, 0, sizeof(warmup));
+    if (connect_to_servers(&warmup, 1, server_ip, PORT, &bench_attr, NULL)) {
+        goto out;
+    }
+    if (use_pool) {
+        pool = rdma_conn_pool_create(warmup.cm_id->verbs, &bench_attr, POOL_SIZE);
+    }
+    close_rdma_connection(&warmup);
+    if (use_pool && !pool) {
+        goto out;
+    }
+
+    printf("Connection setup to %s: %d connections per pass, pool %s\n", server_ip, conns,
+           use_pool ? "on" : "off");
+    printf("%-10s %9s %9s %9s %9s |", "pass", "conns/s", "p50 us", "p99 us", "close us");
+    for (int p = 0; p < RDMA_PHASE_COUNT; p++) {
+        printf(" %8s", rdma_phase_names[p]);
+    }
+    printf("\n");
+
+    if (run_pass(server_ip, pool, conns, 1, &serial)) {
+        goto out;
+    }
+    print_pass("serial", &serial, conns);
+
+    if (run_pass(server_ip, pool, conns, parallel, &batched)) {
+        goto out;
+    }
+    snprintf(name, sizeof(name), "parallel%d", parallel);
+    print_pass(name, &batched, conns);
+    printf("Phase columns are mean microseconds per connection; parallel connects share one "
+           "event loop, so their phases overlap\n");
+    ret = 0;
+
+out:
+    rdma_conn_pool_destroy(pool);
+    free(serial.lat);
+    free(batched.lat);
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -s [-p] [-n conns]\n", prog);
+    fprintf(stderr, "       %s [-p] [-n conns] [-j parallel] <server_ip>\n", prog);
+    fprintf(stderr, "  -s  Run the server\n");
+    fprintf(stderr, "  -p  Take QPs, CQs and registered buffers from a pool\n");
+    fprintf(stderr, "  -n  Connections per pass (default %d)\n", DEFAULT_CONNS);
+    fprintf(stderr, "  -j  Connections brought up at once in the parallel pass (default %d, max %d)\n",
+            DEFAULT_PARALLEL, MAX_PARALLEL);
+}
+
+int main(int argc, char *argv[]) {
+    int server = 0, use_pool = 0;
+    int conns = DEFAULT_CONNS, parallel = DEFAULT_PARALLEL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "spn:j:h")) != -1) {
+        switch (opt) {
+        case 's':
+            server = 1;
+            break;
+        case 'p':
+            use_pool = 1;
+            break;
+        case 'n':
+            conns = atoi(optarg);
+            break;
+        case 'j':
+            parallel = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (conns < 1 || parallel < 1 || parallel > MAX_PARALLEL || (!server && optind >= argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (server) {
+        return run_server(use_pool, 2 * conns + 1) ? 1 : 0;
+    }
+    return run_client(argv[optind], use_pool, conns, parallel) ? 1 : 0;
+}
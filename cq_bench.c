@@ -0,0 +1,397 @@
+/*
+ * CQ layout benchmark: completion handling cost as the QP count grows
+ *
+ * The client opens n connections to cq_bench -s and keeps QP_INFLIGHT
+ * small RDMA WRITEs in flight on each, reposting as they complete, under
+ * each CQ layout:
+ *
+ *   per-qp   every QP has its own CQ, and the poll loop visits them all
+ *   shared   all QPs complete on one CQ
+ *   split    one shared CQ for sends and another for receives; the loop
+ *            polls both, as a server with traffic both ways would (this
+ *            workload only completes sends)
+ *
+ * and in each completion mode:
+ *
+ *   poll     busy polling (CPU is 100% by construction, so look at the
+ *            CPU time per completion and at the polls it took)
+ *   event    block on the completion channel, one event per completion
+ *   moder    events with CQ moderation (ibv_modify_cq), MODERATION_COUNT
+ *            completions or MODERATION_USEC per event
+ *
+ * reporting completions/s, CPU time per completion (getrusage), CPU use
+ * and polls (or events) per completion. n doubles from 1 to -m. The server
+ * only accepts connections; WRITEs don't involve its CPU.
+ *
+ * Usage: cq_bench -s [-m max_qps]
+ *        cq_bench [-m max_qps] [-d seconds] <server_ip>
+ * Give both sides the same -m: the server exits after the client's last
+ * connection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_common.h"
+#include "rdma_connection.h"
+
+#define PORT 18517
+#define BUFFER_SIZE 4096
+#define QP_INFLIGHT 4
+#define QP_DEPTH (QP_INFLIGHT + 1)
+#define WRITE_SIZE 64
+#define POLL_BATCH 16
+#define DEFAULT_MAX_QPS 256
+#define MODERATION_COUNT 16
+#define MODERATION_USEC 16
+
+enum cq_layout { LAYOUT_PER_QP, LAYOUT_SHARED, LAYOUT_SPLIT, LAYOUT_COUNT };
+enum cq_mode { MODE_POLL, MODE_EVENT, MODE_MODERATED, MODE_COUNT };
+
+static const char *const layout_names[LAYOUT_COUNT] = {"per-qp", "shared", "split"};
+static const char *const mode_names[MODE_COUNT] = {"poll", "event", "moder"};
+
+struct run_result {
+    uint64_t completions;
+    uint64_t polls;         // ibv_poll_cq calls (poll) or CQ events (event modes)
+    double seconds;
+    double cpu_seconds;
+};
+
+static double cpu_seconds(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec +
+           ru.ru_stime.tv_usec / 1e6;
+}
+
+// Connections the client makes for every layout and mode at each QP count,
+// plus the warm-up
+static int total_connections(int max_qps) {
+    int total = 1;
+
+    for (int n = 1; n <= max_qps; n *= 2) {
+        total += n * LAYOUT_COUNT * MODE_COUNT;
+    }
+    return total;
+}
+
+static int run_server(int max_qps) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = BUFFER_SIZE,
+        .cq_depth = 2 * QP_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .quiet = 1,
+    };
+    int64_t total = total_connections(max_qps);
+    int64_t served;
+
+    served = serve_connections(NULL, PORT, &attr, total, NULL);
+    if (served < 0) {
+        return -1;
+    }
+    printf("Served %ld connections\n", served);
+    return served == total ? 0 : -1;
+}
+
+static int post_write(struct rdma_context *ctx, uint64_t index) {
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+
+    sge.addr = (uintptr_t)ctx->buffer;
+    sge.length = WRITE_SIZE;
+    sge.lkey = ctx->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = index;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = ctx->remote_addr;
+    wr.wr.rdma.rkey = ctx->remote_rkey;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post write\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Take up to POLL_BATCH completions off cq and repost each on its QP
+// (wr_id is the connection index). Returns the number taken, -1 on error
+static int drain_once(struct rdma_context *ctxs, struct ibv_cq *cq, struct run_result *r) {
+    struct ibv_wc wc[POLL_BATCH];
+    int n = ibv_poll_cq(cq, POLL_BATCH, wc);
+
+    if (n < 0) {
+        fprintf(stderr, "Failed to poll CQ\n");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+            return -1;
+        }
+        if (post_write(&ctxs[wc[i].wr_id], wc[i].wr_id)) {
+            return -1;
+        }
+    }
+    r->completions += n;
+    return n;
+}
+
+// The CQs the poll loop visits under a layout
+static int layout_cqs(enum cq_layout layout, struct rdma_context *ctxs, int n,
+                      struct ibv_cq *shared[2], struct ibv_cq **cqs) {
+    if (layout == LAYOUT_PER_QP) {
+        for (int i = 0; i < n; i++) {
+            cqs[i] = ctxs[i].cq;
+        }
+        return n;
+    }
+    cqs[0] = shared[0];
+    if (layout == LAYOUT_SPLIT) {
+        cqs[1] = shared[1];
+        return 2;
+    }
+    return 1;
+}
+
+static int run_load(struct rdma_context *ctxs, int n, struct ibv_cq **cqs, int ncqs,
+                    struct ibv_comp_channel *channel, double seconds, struct run_result *r) {
+    uint64_t start, end;
+    double cpu_start;
+
+    memset(r, 0, sizeof(*r));
+    for (int c = 0; c < ncqs && channel; c++) {
+        if (ibv_req_notify_cq(cqs[c], 0)) {
+            fprintf(stderr, "Failed to arm CQ\n");
+            return -1;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < QP_INFLIGHT; k++) {
+            if (post_write(&ctxs[i], i)) {
+                return -1;
+            }
+        }
+    }
+
+    cpu_start = cpu_seconds();
+    start = rdma_now_ns();
+    end = start + seconds * 1e9;
+    while (rdma_now_ns() < end) {
+        if (!channel) {
+            for (int c = 0; c < ncqs; c++) {
+                if (drain_once(ctxs, cqs[c], r) < 0) {
+                    return -1;
+                }
+                r->polls++;
+            }
+            continue;
+        }
+
+        // Event: re-arm before the final drain so nothing slips between
+        struct ibv_cq *ev_cq;
+        void *ev_ctx;
+        int got;
+
+        if (ibv_get_cq_event(channel, &ev_cq, &ev_ctx)) {
+            fprintf(stderr, "Failed to get CQ event\n");
+            return -1;
+        }
+        ibv_ack_cq_events(ev_cq, 1);
+        r->polls++;
+        if (ibv_req_notify_cq(ev_cq, 0)) {
+            fprintf(stderr, "Failed to arm CQ\n");
+            return -1;
+        }
+        do {
+            got = drain_once(ctxs, ev_cq, r);
+        } while (got > 0);
+        if (got < 0) {
+            return -1;
+        }
+    }
+    r->seconds = (rdma_now_ns() - start) / 1e9;
+    r->cpu_seconds = cpu_seconds() - cpu_start;
+    return 0;
+}
+
+static int run_point(const char *server_ip, struct ibv_context *verbs, enum cq_layout layout,
+                     enum cq_mode mode, int n, double seconds) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = BUFFER_SIZE,
+        .cq_depth = 2 * QP_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .quiet = 1,
+    };
+    struct rdma_context *ctxs;
+    struct ibv_comp_channel *channel = NULL;
+    struct ibv_cq *shared[2] = {NULL, NULL};
+    struct ibv_cq **cqs;
+    struct ibv_device_attr dev_attr;
+    struct run_result r;
+    int ncqs, made = 0;
+    int ret = -1;
+
+    ctxs = calloc(n, sizeof(*ctxs));
+    cqs = calloc(n, sizeof(*cqs));
+    if (!ctxs || !cqs) {
+        fprintf(stderr, "Failed to allocate %d connections\n", n);
+        goto out;
+    }
+
+    if (mode != MODE_POLL) {
+        channel = ibv_create_comp_channel(verbs);
+        if (!channel) {
+            fprintf(stderr, "Failed to create completion channel\n");
+            goto out;
+        }
+        attr.cq_channel = channel;
+    }
+    if (mode == MODE_MODERATED) {
+        attr.cq_moderation_count = MODERATION_COUNT;
+        attr.cq_moderation_usec = MODERATION_USEC;
+    }
+    if (layout != LAYOUT_PER_QP) {
+        int depth = n * QP_DEPTH;
+
+        if (ibv_query_device(verbs, &dev_attr) == 0 && depth > dev_attr.max_cqe) {
+            depth = dev_attr.max_cqe;
+        }
+        for (int c = 0; c < (layout == LAYOUT_SPLIT ? 2 : 1); c++) {
+            shared[c] = rdma_create_cq(verbs, depth, &attr);
+            if (!shared[c]) {
+                goto out;
+            }
+        }
+        attr.shared_cq = shared[0];
+        attr.shared_recv_cq = shared[1];
+    }
+
+    if (connect_to_servers(ctxs, n, server_ip, PORT, &attr, NULL)) {
+        goto out;
+    }
+    made = n;
+    for (int i = 0; i < n; i++) {
+        if (ctxs[i].context != verbs) {
+            fprintf(stderr, "Connection %d landed on another device\n", i);
+            goto out;
+        }
+    }
+
+    ncqs = layout_cqs(layout, ctxs, n, shared, cqs);
+    if (run_load(ctxs, n, cqs, ncqs, channel, seconds, &r)) {
+        goto out;
+    }
+    if (r.completions == 0) {
+        fprintf(stderr, "No completions with %d QPs (%s, %s)\n", n, layout_names[layout],
+                mode_names[mode]);
+        goto out;
+    }
+    printf("%5d %-7s %-6s %11.0f %9.0f %6.1f %9.3f\n", n, layout_names[layout], mode_names[mode],
+           r.completions / r.seconds, r.cpu_seconds * 1e9 / r.completions,
+           100.0 * r.cpu_seconds / r.seconds, (double)r.polls / r.completions);
+    ret = 0;
+
+out:
+    // QPs go first, then the CQs they completed on, then the channel
+    for (int i = 0; i < made; i++) {
+        close_rdma_connection(&ctxs[i]);
+    }
+    for (int c = 0; c < 2; c++) {
+        if (shared[c]) {
+            ibv_destroy_cq(shared[c]);
+        }
+    }
+    if (channel) {
+        ibv_destroy_comp_channel(channel);
+    }
+    free(cqs);
+    free(ctxs);
+    return ret;
+}
+
+static int run_client(const char *server_ip, int max_qps, double seconds) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = BUFFER_SIZE,
+        .cq_depth = 2 * QP_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .quiet = 1,
+    };
+    struct rdma_context warmup;
+    struct ibv_context *verbs;
+
+    // librdmacm opens the device on the first connection; the shared CQs
+    // have to be on the same one
+    memset(&warmup, 0, sizeof(warmup));
+    if (connect_to_servers(&warmup, 1, server_ip, PORT, &attr, NULL)) {
+        return -1;
+    }
+    verbs = warmup.context;
+    close_rdma_connection(&warmup);
+
+    printf("CQ layouts against %s, %d writes of %d bytes in flight per QP, %.1f s per point\n",
+           server_ip, QP_INFLIGHT, WRITE_SIZE, seconds);
+    printf("%5s %-7s %-6s %11s %9s %6s %9s\n", "qps", "layout", "mode", "compl/s", "cpu ns/c",
+           "cpu%", "polls/c");
+    for (int n = 1; n <= max_qps; n *= 2) {
+        for (int layout = 0; layout < LAYOUT_COUNT; layout++) {
+            for (int mode = 0; mode < MODE_COUNT; mode++) {
+                if (run_point(server_ip, verbs, layout, mode, n, seconds)) {
+                    return -1;
+                }
+            }
+        }
+    }
+    printf("(polls/c counts CQ events in the event modes)\n");
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -s [-m max_qps]\n", prog);
+    fprintf(stderr, "       %s [-m max_qps] [-d seconds] <server_ip>\n", prog);
+    fprintf(stderr, "  -s  Run the server\n");
+    fprintf(stderr, "  -m  Largest QP count, doubling from 1 (default %d)\n", DEFAULT_MAX_QPS);
+    fprintf(stderr, "  -d  Seconds per point (default 0.5)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int server = 0;
+    int max_qps = DEFAULT_MAX_QPS;
+    double seconds = 0.5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sm:d:h")) != -1) {
+        switch (opt) {
+        case 's':
+            server = 1;
+            break;
+        case 'm':
+            max_qps = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (max_qps < 1 || seconds <= 0 || (!server && optind >= argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (server) {
+        return run_server(max_qps) ? 1 : 0;
+    }
+    return run_client(argv[optind], max_qps, seconds) ? 1 : 0;
+}
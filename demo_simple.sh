@@ -99,10 +99,10 @@ echo "Building simplified RDMA application..."
 
 # Compile the simplified versions
 echo "Compiling simplified server..."
-gcc -Wall -Wextra -O2 -g -o rdma_server_simple rdma_server_simple.c -libverbs
+gcc -Wall -Wextra -O2 -g -o rdma_server_simple rdma_server_simple.c rdma_common.c -libverbs
 
 echo "Compiling simplified client..."
-gcc -Wall -Wextra -O2 -g -o rdma_client_simple rdma_client_simple.c -libverbs
+gcc -Wall -Wextra -O2 -g -o rdma_client_simple rdma_client_simple.c rdma_common.c -libverbs
 
 if [ -f "rdma_server_simple" ] && [ -f "rdma_client_simple" ]; then
     echo -e "${GREEN}✓ Build successful${NC}"
@@ -0,0 +1,333 @@
+/*
+ * Completion dispatch under skewed load: static assignment vs work stealing
+ *
+ * Connections are handed to dispatcher workers in blocks as they would be
+ * accepted (the first conns/workers to worker 0, and so on), and a few of
+ * them, all in the first block, carry most of the traffic. The same
+ * open-loop load runs against the dispatcher twice, with stealing off and
+ * on, and each request's latency is measured from when it was due to
+ * arrive until its handler finished, so queueing behind a saturated worker
+ * shows up in full.
+ *
+ * Like verbs_bench this runs against a software provider: each connection's
+ * CQ is a ring a generator thread fills with RECV_RDMA_WITH_IMM
+ * completions, read back through the normal ibv_poll_cq() path. The
+ * handler does a fixed amount of work per request (FNV-1a over a buffer,
+ * as rdma_server's compute RPC) sized so the offered load is the -l
+ * fraction of what all workers together can handle. Give it workers + 1
+ * cores.
+ *
+ * Usage: dispatch_bench [-w workers] [-c conns] [-H hot_conns] [-f hot_share]
+ *                       [-l load] [-d seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <infiniband/verbs.h>
+
+#include "rdma_common.h"
+#include "rdma_dispatch.h"
+
+#define SOFT_CQ_SIZE 4096           // completions a connection can have queued
+#define WORK_BYTES 1024
+#define MAX_CONNS 1024
+#define MAX_SAMPLES (8 * 1024 * 1024)
+#define CALIBRATION_RUNS 20000
+
+// A CQ whose completions come from a generator thread, not a device
+struct soft_cq {
+    struct ibv_cq cq;               // first: the provider op casts back
+    uint64_t head __attribute__((aligned(64)));    // worker side
+    uint64_t tail __attribute__((aligned(64)));    // generator side
+    struct ibv_wc ring[SOFT_CQ_SIZE];
+};
+
+struct bench_config {
+    int workers;
+    int conns;
+    int hot;
+    double hot_share;
+    double load;
+    double seconds;
+};
+
+struct bench_result {
+    double offered;         // requests/s
+    double throughput;      // requests/s handled during the run
+    uint64_t dropped;       // arrivals that found their CQ full
+    double p50, p99, p999;  // us
+    struct dispatch_worker_stats workers[DISPATCH_MAX_WORKERS];
+};
+
+static struct ibv_context soft_context;
+static struct soft_cq *cqs;
+static uint8_t work_buf[WORK_BYTES];
+static int work_rounds = 1;
+
+static uint64_t *samples;
+static uint64_t sample_count;       // handled requests, samples past MAX_SAMPLES dropped
+static volatile uint64_t sink;
+
+// Each CQ is polled by one worker only, so the ring is single-consumer
+static int soft_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc) {
+    struct soft_cq *s = (struct soft_cq *)cq;
+    uint64_t tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while (n < num_entries && s->head + n < tail) {
+        wc[n] = s->ring[(s->head + n) % SOFT_CQ_SIZE];
+        n++;
+    }
+    __atomic_store_n(&s->head, s->head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+static int soft_complete(struct soft_cq *s, uint64_t due) {
+    uint64_t head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+    struct ibv_wc *wc;
+
+    if (s->tail - head == SOFT_CQ_SIZE) {
+        return -1;
+    }
+    wc = &s->ring[s->tail % SOFT_CQ_SIZE];
+    memset(wc, 0, sizeof(*wc));
+    wc->wr_id = due;
+    wc->status = IBV_WC_SUCCESS;
+    wc->opcode = IBV_WC_RECV_RDMA_WITH_IMM;
+    wc->byte_len = WORK_BYTES;
+    __atomic_store_n(&s->tail, s->tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static uint64_t do_work(void) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (int r = 0; r < work_rounds; r++) {
+        for (int i = 0; i < WORK_BYTES; i++) {
+            h = (h ^ work_buf[i]) * 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+
+static void handle_request(void *arg, const struct ibv_wc *wc) {
+    uint64_t idx;
+
+    (void)arg;
+    sink = do_work();
+    idx = __atomic_fetch_add(&sample_count, 1, __ATOMIC_RELAXED);
+    if (idx < MAX_SAMPLES) {
+        samples[idx] = rdma_now_ns() - wc->wr_id;
+    }
+}
+
+// Size the handler to about 2 us, and return its cost in ns
+static double calibrate(void) {
+    uint64_t t;
+    double per_run;
+
+    t = rdma_now_ns();
+    for (int i = 0; i < CALIBRATION_RUNS / 10; i++) {
+        sink = do_work();
+    }
+    per_run = (double)(rdma_now_ns() - t) / (CALIBRATION_RUNS / 10);
+    work_rounds = per_run > 0 && per_run < 2000 ? (int)(2000 / per_run) : 1;
+
+    t = rdma_now_ns();
+    for (int i = 0; i < CALIBRATION_RUNS; i++) {
+        sink = do_work();
+    }
+    return (double)(rdma_now_ns() - t) / CALIBRATION_RUNS;
+}
+
+static uint64_t rand_next(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Open loop: arrivals are due at a fixed rate whatever the workers do, and
+// each goes to a hot connection with probability hot_share
+static uint64_t generate(const struct bench_config *cfg, double rate) {
+    uint64_t gap = 1e9 / rate;
+    uint64_t start = rdma_now_ns();
+    uint64_t end = start + cfg->seconds * 1e9;
+    uint64_t due = start;
+    uint64_t rng = 88172645463325252ULL;
+    uint64_t dropped = 0;
+
+    while (due < end) {
+        uint64_t now = rdma_now_ns();
+
+        for (; due <= now && due < end; due += gap) {
+            double u = (rand_next(&rng) >> 11) * (1.0 / 9007199254740992.0);
+            int conn;
+
+            if (u < cfg->hot_share) {
+                conn = rand_next(&rng) % cfg->hot;
+            } else {
+                conn = cfg->hot + rand_next(&rng) % (cfg->conns - cfg->hot);
+            }
+            if (soft_complete(&cqs[conn], due)) {
+                dropped++;
+            }
+        }
+    }
+    return dropped;
+}
+
+static int run_mode(const struct bench_config *cfg, int stealing, double rate,
+                    struct bench_result *r) {
+    struct dispatcher *d;
+    uint64_t handled, n;
+    int per_worker = (cfg->conns + cfg->workers - 1) / cfg->workers;
+
+    memset(r, 0, sizeof(*r));
+    for (int c = 0; c < cfg->conns; c++) {
+        cqs[c].head = cqs[c].tail = 0;
+    }
+    sample_count = 0;
+
+    d = dispatcher_create(cfg->workers, stealing);
+    if (!d) {
+        return -1;
+    }
+    for (int c = 0; c < cfg->conns; c++) {
+        if (dispatcher_add_cq(d, c / per_worker, &cqs[c].cq, handle_request, NULL)) {
+            dispatcher_destroy(d);
+            return -1;
+        }
+    }
+    if (dispatcher_start(d)) {
+        dispatcher_destroy(d);
+        return -1;
+    }
+    r->dropped = generate(cfg, rate);
+    handled = __atomic_load_n(&sample_count, __ATOMIC_RELAXED);
+    dispatcher_stop(d);
+
+    for (int w = 0; w < cfg->workers; w++) {
+        dispatcher_stats(d, w, &r->workers[w]);
+    }
+    dispatcher_destroy(d);
+
+    n = sample_count < MAX_SAMPLES ? sample_count : MAX_SAMPLES;
+    qsort(samples, n, sizeof(*samples), rdma_cmp_u64);
+    r->offered = rate;
+    r->throughput = handled / cfg->seconds;
+    if (n) {
+        r->p50 = samples[n / 2] / 1e3;
+        r->p99 = samples[n * 99 / 100] / 1e3;
+        r->p999 = samples[n * 999 / 1000] / 1e3;
+    }
+    return 0;
+}
+
+static void print_result(const char *name, const struct bench_config *cfg,
+                         const struct bench_result *r) {
+    printf("%-8s %10.0f %10.0f %8lu %9.1f %9.1f %9.1f\n", name, r->offered, r->throughput,
+           r->dropped, r->p50, r->p99, r->p999);
+    for (int w = 0; w < cfg->workers; w++) {
+        printf("         worker %2d: %9lu completions polled, %9lu handled, %9lu stolen\n", w,
+               r->workers[w].completions, r->workers[w].executed, r->workers[w].stolen);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w workers] [-c conns] [-H hot_conns] [-f hot_share] [-l load] "
+            "[-d seconds]\n", prog);
+    fprintf(stderr, "  -w  Worker threads (default 4)\n");
+    fprintf(stderr, "  -c  Connections, one CQ each (default 32)\n");
+    fprintf(stderr, "  -H  Connections carrying the hot share, all on worker 0 (default 4)\n");
+    fprintf(stderr, "  -f  Share of requests on the hot connections (default 0.8)\n");
+    fprintf(stderr, "  -l  Offered load as a fraction of all workers' capacity (default 0.7)\n");
+    fprintf(stderr, "  -d  Seconds per run (default 2)\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_config cfg = {
+        .workers = 4,
+        .conns = 32,
+        .hot = 4,
+        .hot_share = 0.8,
+        .load = 0.7,
+        .seconds = 2,
+    };
+    struct bench_result fixed, stealing;
+    double cost, rate;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:c:H:f:l:d:h")) != -1) {
+        switch (opt) {
+        case 'w':
+            cfg.workers = atoi(optarg);
+            break;
+        case 'c':
+            cfg.conns = atoi(optarg);
+            break;
+        case 'H':
+            cfg.hot = atoi(optarg);
+            break;
+        case 'f':
+            cfg.hot_share = atof(optarg);
+            break;
+        case 'l':
+            cfg.load = atof(optarg);
+            break;
+        case 'd':
+            cfg.seconds = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (cfg.workers < 1 || cfg.workers > DISPATCH_MAX_WORKERS || cfg.conns > MAX_CONNS ||
+        cfg.conns < cfg.workers || cfg.hot < 1 || cfg.hot >= cfg.conns ||
+        cfg.hot > cfg.conns / cfg.workers || cfg.load <= 0 || cfg.seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    cqs = aligned_alloc(64, cfg.conns * sizeof(*cqs));
+    samples = malloc(MAX_SAMPLES * sizeof(*samples));
+    if (!cqs || !samples) {
+        fprintf(stderr, "Failed to allocate benchmark state\n");
+        return 1;
+    }
+    memset(cqs, 0, cfg.conns * sizeof(*cqs));
+    soft_context.ops.poll_cq = soft_poll_cq;
+    for (int c = 0; c < cfg.conns; c++) {
+        cqs[c].cq.context = &soft_context;
+    }
+    for (int i = 0; i < WORK_BYTES; i++) {
+        work_buf[i] = i;
+    }
+
+    cost = calibrate();
+    rate = cfg.load * cfg.workers * 1e9 / cost;
+    printf("Completion dispatch, software CQs: %d workers, %d connections, %d hot carrying "
+           "%.0f%%\n", cfg.workers, cfg.conns, cfg.hot, cfg.hot_share * 100);
+    printf("Handler %.2f us, offered load %.0f%% of %d workers, polling %d completions per "
+           "call\n\n", cost / 1e3, cfg.load * 100, cfg.workers, DISPATCH_POLL_BATCH);
+    printf("%-8s %10s %10s %8s %9s %9s %9s\n", "mode", "offered/s", "handled/s", "dropped",
+           "p50 us", "p99 us", "p99.9 us");
+
+    if (run_mode(&cfg, 0, rate, &fixed)) {
+        return 1;
+    }
+    print_result("static", &cfg, &fixed);
+    if (run_mode(&cfg, 1, rate, &stealing)) {
+        return 1;
+    }
+    print_result("stealing", &cfg, &stealing);
+
+    free(samples);
+    free(cqs);
+    return 0;
+}
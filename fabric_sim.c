@@ -0,0 +1,590 @@
+/*
+ * Discrete-event RoCEv2 fabric model. See fabric_sim.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fabric_sim.h"
+#include "rdma_pacer.h"
+#include "sim_calendar.h"
+
+#define HEADER_BYTES 58         // Ethernet 14, IPv4 20, UDP 8, BTH 12, ICRC 4
+#define WIRE_OVERHEAD 24        // FCS 4, preamble 8, inter-frame gap 12
+#define CTRL_BYTES 64           // ACK, NAK and CNP frames
+#define CNP_INTERVAL_NS 50000   // DCQCN notification point: one CNP per QP per 50 us
+#define RTO_NS 1000000          // retransmission timeout for tail losses
+#define DCQCN_UPDATE_NS 55000   // DCQCN's rate increase timer
+#define DELAY_UPDATE_NS 50000
+#define PACKETS_PER_BLOCK 4096
+
+const char *const fabric_cc_names[FABRIC_CC_COUNT] = {"none", "dcqcn", "delay"};
+
+enum event_type {
+    EV_TX_DONE,             // a host's NIC finished a packet
+    EV_SWITCH_ARRIVE,
+    EV_EGRESS_DONE,         // the switch finished a packet to the receiver
+    EV_RECV_ARRIVE,
+    EV_ACK,                 // at the sender; data = PSN acknowledged up to
+    EV_NAK,                 // data = PSN to go back to
+    EV_CNP,
+    EV_PAUSE,               // at the sender; data = 1 XOFF, 0 XON
+    EV_WAKE,                // a paced QP of the host may send
+    EV_RTO,                 // data = timer generation
+};
+
+struct packet {
+    struct packet *next;
+    uint32_t qp;
+    uint32_t wire_bytes;
+    uint32_t payload;
+    int ecn;
+    uint64_t psn;
+};
+
+struct packet_block {
+    struct packet_block *next;
+    struct packet packets[PACKETS_PER_BLOCK];
+};
+
+struct sim_host {
+    int busy;
+    int paused;
+    uint64_t paused_since;
+    uint64_t paused_ps;
+    uint32_t rr;            // QP to look at first
+    uint64_t wake_at;       // pending EV_WAKE, 0 for none
+};
+
+struct sim_qp {
+    uint32_t host;
+    uint64_t next_psn;      // next to send
+    uint64_t acked_psn;     // everything below is acknowledged
+    uint64_t posted_psn;    // end of the posted messages
+    uint64_t sent_psn;      // end of what was ever sent, retransmits aside
+    uint64_t *started_at;   // first packet on the wire, per message slot (message % window)
+    uint64_t rto_gen;
+    int rto_armed;
+    struct rdma_pacer pacer;
+
+    // Receiver side
+    uint64_t expected;
+    int nak_sent;
+    uint64_t next_cnp;      // earliest time for the next CNP
+};
+
+struct sim {
+    const struct fabric_params *p;
+    struct fabric_result *r;
+    struct sim_calendar cal;
+    uint64_t now;
+    uint64_t warmup, end;   // ps
+    double ps_per_byte;
+    uint64_t prop;
+    uint64_t ctrl_delay;    // receiver to sender, uncongested
+    uint32_t ppm;           // packets per message
+    uint32_t last_payload;  // of a message's last packet
+    uint64_t rng;
+    int failed;
+
+    struct sim_host *hosts;
+    struct sim_qp *qps;
+    uint64_t *slots;        // started_at of every QP
+
+    // Switch port towards the receiver
+    struct packet *queue_head, *queue_tail;
+    uint32_t queue_bytes;
+    int egress_busy;
+    uint32_t *ingress_bytes;    // per sender
+    int *xoff_sent;
+    uint32_t xon_bytes;
+
+    struct packet *free_packets;
+    struct packet_block *packet_blocks;
+
+    uint64_t delivered;     // payload bytes after warm-up
+    uint64_t *lat;          // message latencies after warm-up, ps
+    size_t nlat, lat_cap;
+};
+
+static double rand_unit(struct sim *s) {
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return ((s->rng * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+}
+
+static uint64_t tx_time(const struct sim *s, uint32_t bytes) {
+    return (uint64_t)(bytes * s->ps_per_byte);
+}
+
+static void schedule(struct sim *s, uint64_t time, int type, uint32_t index, uint64_t data,
+                     void *ptr) {
+    struct sim_event *ev = sim_event_alloc(&s->cal);
+
+    if (!ev) {
+        s->failed = 1;
+        return;
+    }
+    ev->time = time;
+    ev->type = type;
+    ev->index = index;
+    ev->data = data;
+    ev->ptr = ptr;
+    sim_calendar_insert(&s->cal, ev);
+}
+
+static struct packet *packet_alloc(struct sim *s) {
+    struct packet *pkt;
+
+    if (!s->free_packets) {
+        struct packet_block *b = malloc(sizeof(*b));
+
+        if (!b) {
+            fprintf(stderr, "Failed to allocate simulator packets\n");
+            s->failed = 1;
+            return NULL;
+        }
+        b->next = s->packet_blocks;
+        s->packet_blocks = b;
+        for (int i = 0; i < PACKETS_PER_BLOCK; i++) {
+            b->packets[i].next = s->free_packets;
+            s->free_packets = &b->packets[i];
+        }
+    }
+    pkt = s->free_packets;
+    s->free_packets = pkt->next;
+    return pkt;
+}
+
+static void packet_free(struct sim *s, struct packet *pkt) {
+    pkt->next = s->free_packets;
+    s->free_packets = pkt;
+}
+
+static void arm_rto(struct sim *s, struct sim_qp *qp, uint32_t index) {
+    qp->rto_gen++;
+    qp->rto_armed = 1;
+    schedule(s, s->now + RTO_NS * 1000ULL, EV_RTO, index, qp->rto_gen, NULL);
+}
+
+// Put the next eligible packet of host h on its link, round robin over its
+// QPs. When only pacing holds them back, wake up when the first may go
+static void host_kick(struct sim *s, uint32_t h) {
+    const struct fabric_params *p = s->p;
+    struct sim_host *host = &s->hosts[h];
+    uint64_t min_wait = UINT64_MAX;
+
+    if (host->busy || host->paused) {
+        return;
+    }
+    for (int k = 0; k < p->qps; k++) {
+        uint32_t q = h * p->qps + (host->rr + k) % p->qps;
+        struct sim_qp *qp = &s->qps[q];
+        struct packet *pkt;
+        uint32_t payload, wire;
+        uint64_t tx;
+
+        if (qp->next_psn >= qp->posted_psn) {
+            continue;
+        }
+        payload = (qp->next_psn + 1) % s->ppm ? p->mtu : s->last_payload;
+        wire = payload + HEADER_BYTES + WIRE_OVERHEAD;
+        if (p->cc != FABRIC_CC_NONE) {
+            uint64_t wait = rdma_pacer_admit(&qp->pacer, wire, s->now / 1000);
+
+            if (wait) {
+                if (wait < min_wait) {
+                    min_wait = wait;
+                }
+                continue;
+            }
+        }
+
+        pkt = packet_alloc(s);
+        if (!pkt) {
+            return;
+        }
+        pkt->qp = q;
+        pkt->psn = qp->next_psn++;
+        pkt->payload = payload;
+        pkt->wire_bytes = wire;
+        pkt->ecn = 0;
+        if (pkt->psn == qp->sent_psn) {
+            if (pkt->psn % s->ppm == 0) {
+                qp->started_at[pkt->psn / s->ppm % p->window] = s->now;
+            }
+            qp->sent_psn++;
+        }
+        tx = tx_time(s, wire);
+        host->busy = 1;
+        host->rr = (host->rr + k + 1) % p->qps;
+        schedule(s, s->now + tx, EV_TX_DONE, h, 0, NULL);
+        schedule(s, s->now + tx + s->prop, EV_SWITCH_ARRIVE, q, 0, pkt);
+        if (!qp->rto_armed) {
+            arm_rto(s, qp, q);
+        }
+        s->r->packets++;
+        return;
+    }
+
+    if (min_wait != UINT64_MAX) {
+        uint64_t t = s->now + min_wait * 1000;
+
+        if (!host->wake_at || t < host->wake_at) {
+            host->wake_at = t;
+            schedule(s, t, EV_WAKE, h, 0, NULL);
+        }
+    }
+}
+
+static void egress_start(struct sim *s) {
+    struct packet *pkt = s->queue_head;
+    uint32_t h = s->qps[pkt->qp].host;
+
+    s->queue_head = pkt->next;
+    if (!s->queue_head) {
+        s->queue_tail = NULL;
+    }
+    s->queue_bytes -= pkt->wire_bytes;
+    s->ingress_bytes[h] -= pkt->wire_bytes;
+    if (s->xoff_sent[h] && s->ingress_bytes[h] <= s->xon_bytes) {
+        s->xoff_sent[h] = 0;
+        schedule(s, s->now + s->prop, EV_PAUSE, h, 0, NULL);
+    }
+    s->egress_busy = 1;
+    schedule(s, s->now + tx_time(s, pkt->wire_bytes), EV_EGRESS_DONE, 0, 0, pkt);
+}
+
+static void switch_arrive(struct sim *s, struct packet *pkt) {
+    const struct fabric_params *p = s->p;
+    uint32_t h = s->qps[pkt->qp].host;
+    uint32_t q = s->queue_bytes;
+
+    if (q + pkt->wire_bytes > p->buffer_bytes) {
+        if (s->now >= s->warmup) {
+            s->r->drops++;
+        }
+        packet_free(s, pkt);
+        return;
+    }
+    if (p->ecn_kmax_bytes && q > p->ecn_kmin_bytes) {
+        double prob = q >= p->ecn_kmax_bytes ? 1.0 :
+                      p->ecn_pmax * (q - p->ecn_kmin_bytes) / (p->ecn_kmax_bytes - p->ecn_kmin_bytes);
+
+        if (rand_unit(s) < prob) {
+            pkt->ecn = 1;
+            if (s->now >= s->warmup) {
+                s->r->ecn_marks++;
+            }
+        }
+    }
+
+    pkt->next = NULL;
+    if (s->queue_tail) {
+        s->queue_tail->next = pkt;
+    } else {
+        s->queue_head = pkt;
+    }
+    s->queue_tail = pkt;
+    s->queue_bytes += pkt->wire_bytes;
+    s->ingress_bytes[h] += pkt->wire_bytes;
+    if (s->queue_bytes > s->r->max_queue_bytes && s->now >= s->warmup) {
+        s->r->max_queue_bytes = s->queue_bytes;
+    }
+    if (p->pfc_xoff_bytes && !s->xoff_sent[h] && s->ingress_bytes[h] >= p->pfc_xoff_bytes) {
+        s->xoff_sent[h] = 1;
+        if (s->now >= s->warmup) {
+            s->r->pauses++;
+        }
+        schedule(s, s->now + s->prop, EV_PAUSE, h, 1, NULL);
+    }
+    if (!s->egress_busy) {
+        egress_start(s);
+    }
+}
+
+static void receive(struct sim *s, struct packet *pkt) {
+    struct sim_qp *qp = &s->qps[pkt->qp];
+
+    if (pkt->psn == qp->expected) {
+        qp->expected++;
+        qp->nak_sent = 0;
+        if (s->now >= s->warmup) {
+            s->delivered += pkt->payload;
+        }
+        if ((pkt->psn + 1) % s->ppm == 0) {
+            schedule(s, s->now + s->ctrl_delay, EV_ACK, pkt->qp, pkt->psn + 1, NULL);
+        }
+    } else if (pkt->psn > qp->expected && !qp->nak_sent) {
+        // Go-back-N: everything after the gap is dropped until it is filled
+        qp->nak_sent = 1;
+        schedule(s, s->now + s->ctrl_delay, EV_NAK, pkt->qp, qp->expected, NULL);
+    }
+    if (pkt->ecn && s->p->cc == FABRIC_CC_DCQCN && s->now >= qp->next_cnp) {
+        qp->next_cnp = s->now + CNP_INTERVAL_NS * 1000ULL;
+        if (s->now >= s->warmup) {
+            s->r->cnps++;
+        }
+        schedule(s, s->now + s->ctrl_delay, EV_CNP, pkt->qp, 0, NULL);
+    }
+    packet_free(s, pkt);
+}
+
+static void record_latency(struct sim *s, uint64_t lat) {
+    if (s->nlat == s->lat_cap) {
+        size_t cap = s->lat_cap ? 2 * s->lat_cap : 4096;
+        uint64_t *lat_new = realloc(s->lat, cap * sizeof(*lat_new));
+
+        if (!lat_new) {
+            fprintf(stderr, "Failed to allocate latency samples\n");
+            s->failed = 1;
+            return;
+        }
+        s->lat = lat_new;
+        s->lat_cap = cap;
+    }
+    s->lat[s->nlat++] = lat;
+}
+
+// Messages up to psn are done: record them and post as many new ones.
+// Latency runs from the first packet on the wire, like incast_bench's
+// from posting: time queued behind the QP's own window isn't the fabric's
+static void ack(struct sim *s, uint32_t q, uint64_t psn) {
+    struct sim_qp *qp = &s->qps[q];
+    const struct fabric_params *p = s->p;
+
+    if (psn <= qp->acked_psn) {
+        return;
+    }
+    for (uint64_t m = qp->acked_psn / s->ppm; m < psn / s->ppm; m++) {
+        uint64_t lat = s->now - qp->started_at[m % p->window];
+
+        if (s->now >= s->warmup) {
+            record_latency(s, lat);
+        }
+        if (p->cc == FABRIC_CC_DELAY) {
+            rdma_pacer_complete(&qp->pacer, lat / 1000, s->now / 1000);
+        }
+        qp->posted_psn += s->ppm;
+    }
+    qp->acked_psn = psn;
+    if (qp->next_psn < psn) {
+        qp->next_psn = psn;
+    }
+    if (qp->acked_psn < qp->next_psn) {
+        arm_rto(s, qp, q);
+    } else {
+        qp->rto_gen++;
+        qp->rto_armed = 0;
+    }
+    host_kick(s, qp->host);
+}
+
+static void go_back(struct sim *s, uint32_t q, uint64_t psn) {
+    struct sim_qp *qp = &s->qps[q];
+
+    if (psn < qp->acked_psn || psn >= qp->next_psn) {
+        return;
+    }
+    if (s->now >= s->warmup) {
+        s->r->retransmits += qp->next_psn - psn;
+    }
+    qp->next_psn = psn;
+    host_kick(s, qp->host);
+}
+
+static void pause_host(struct sim *s, uint32_t h, int on) {
+    struct sim_host *host = &s->hosts[h];
+
+    if (on) {
+        host->paused = 1;
+        host->paused_since = s->now;
+        return;
+    }
+    host->paused = 0;
+    if (s->now > s->warmup) {
+        host->paused_ps += s->now - (host->paused_since > s->warmup ? host->paused_since : s->warmup);
+    }
+    host_kick(s, h);
+}
+
+static void handle(struct sim *s, struct sim_event *ev) {
+    switch (ev->type) {
+    case EV_TX_DONE:
+        s->hosts[ev->index].busy = 0;
+        host_kick(s, ev->index);
+        break;
+    case EV_SWITCH_ARRIVE:
+        switch_arrive(s, ev->ptr);
+        break;
+    case EV_EGRESS_DONE:
+        schedule(s, s->now + s->prop, EV_RECV_ARRIVE, 0, 0, ev->ptr);
+        s->egress_busy = 0;
+        if (s->queue_head) {
+            egress_start(s);
+        }
+        break;
+    case EV_RECV_ARRIVE:
+        receive(s, ev->ptr);
+        break;
+    case EV_ACK:
+        ack(s, ev->index, ev->data);
+        break;
+    case EV_NAK:
+        go_back(s, ev->index, ev->data);
+        break;
+    case EV_CNP:
+        rdma_pacer_mark(&s->qps[ev->index].pacer, 1, s->now / 1000);
+        break;
+    case EV_PAUSE:
+        pause_host(s, ev->index, (int)ev->data);
+        break;
+    case EV_WAKE:
+        if (s->hosts[ev->index].wake_at == ev->time) {
+            s->hosts[ev->index].wake_at = 0;
+        }
+        host_kick(s, ev->index);
+        break;
+    case EV_RTO: {
+        struct sim_qp *qp = &s->qps[ev->index];
+
+        if (ev->data != qp->rto_gen) {
+            break;          // re-armed or disarmed since
+        }
+        qp->rto_armed = 0;
+        go_back(s, ev->index, qp->acked_psn);
+        break;
+    }
+    }
+}
+
+static int sim_init(struct sim *s, const struct fabric_params *p, struct fabric_result *r) {
+    int nqps = p->hosts * p->qps;
+    struct rdma_pacer_attr pacer = {
+        .max_rate = p->link_gbps * 1e9 / 8,
+        .burst = 2.0 * (p->mtu + HEADER_BYTES + WIRE_OVERHEAD),
+        .adaptive = 1,
+        .target_delay_ns = p->target_delay_ns,
+        .update_ns = p->cc == FABRIC_CC_DCQCN ? DCQCN_UPDATE_NS : DELAY_UPDATE_NS,
+    };
+
+    memset(s, 0, sizeof(*s));
+    s->p = p;
+    s->r = r;
+    s->warmup = p->warmup_ns * 1000;
+    s->end = p->duration_ns * 1000;
+    s->ps_per_byte = 8000.0 / p->link_gbps;
+    s->prop = p->prop_ns * 1000ULL;
+    s->ctrl_delay = 2 * (s->prop + tx_time(s, CTRL_BYTES + WIRE_OVERHEAD));
+    s->ppm = (p->msg_bytes + p->mtu - 1) / p->mtu;
+    s->last_payload = p->msg_bytes - (s->ppm - 1) * p->mtu;
+    s->rng = p->seed ? p->seed : 0x9e3779b97f4a7c15ULL;
+    // XON two full packets below XOFF
+    s->xon_bytes = p->pfc_xoff_bytes > 2 * (p->mtu + HEADER_BYTES + WIRE_OVERHEAD) ?
+                   p->pfc_xoff_bytes - 2 * (p->mtu + HEADER_BYTES + WIRE_OVERHEAD) : 0;
+
+    if (sim_calendar_init(&s->cal)) {
+        return -1;
+    }
+    s->hosts = calloc(p->hosts, sizeof(*s->hosts));
+    s->qps = calloc(nqps, sizeof(*s->qps));
+    s->slots = calloc((size_t)nqps * p->window, sizeof(*s->slots));
+    s->ingress_bytes = calloc(p->hosts, sizeof(*s->ingress_bytes));
+    s->xoff_sent = calloc(p->hosts, sizeof(*s->xoff_sent));
+    if (!s->hosts || !s->qps || !s->slots || !s->ingress_bytes || !s->xoff_sent) {
+        fprintf(stderr, "Failed to allocate simulator state\n");
+        return -1;
+    }
+    for (int q = 0; q < nqps; q++) {
+        struct sim_qp *qp = &s->qps[q];
+
+        qp->host = q / p->qps;
+        qp->started_at = &s->slots[(size_t)q * p->window];
+        qp->posted_psn = (uint64_t)p->window * s->ppm;
+        rdma_pacer_init(&qp->pacer, &pacer, 0);
+    }
+    return 0;
+}
+
+static void sim_destroy(struct sim *s) {
+    sim_calendar_destroy(&s->cal);
+    while (s->packet_blocks) {
+        struct packet_block *b = s->packet_blocks;
+
+        s->packet_blocks = b->next;
+        free(b);
+    }
+    free(s->hosts);
+    free(s->qps);
+    free(s->slots);
+    free(s->ingress_bytes);
+    free(s->xoff_sent);
+    free(s->lat);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int fabric_sim_run(const struct fabric_params *p, struct fabric_result *r) {
+    struct timespec t0, t1;
+    struct sim s;
+    struct sim_event *ev;
+    double window_s;
+    uint64_t paused = 0;
+
+    if (p->hosts < 1 || p->qps < 1 || p->window < 1 || p->msg_bytes < 1 || p->mtu < 256 ||
+        p->link_gbps <= 0 || p->duration_ns <= p->warmup_ns ||
+        p->buffer_bytes < p->mtu + HEADER_BYTES + WIRE_OVERHEAD) {
+        fprintf(stderr, "Invalid fabric simulation parameters\n");
+        return -1;
+    }
+    memset(r, 0, sizeof(*r));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (sim_init(&s, p, r)) {
+        sim_destroy(&s);
+        return -1;
+    }
+
+    for (uint32_t h = 0; h < (uint32_t)p->hosts; h++) {
+        host_kick(&s, h);
+    }
+    while (!s.failed && (ev = sim_calendar_pop(&s.cal))) {
+        if (ev->time > s.end) {
+            sim_event_release(&s.cal, ev);
+            break;
+        }
+        s.now = ev->time;
+        handle(&s, ev);
+        sim_event_release(&s.cal, ev);
+        r->events++;
+    }
+
+    // Pauses still on at the end count up to it
+    for (int h = 0; h < p->hosts; h++) {
+        if (s.hosts[h].paused) {
+            s.now = s.end;
+            pause_host(&s, h, 0);
+        }
+        paused += s.hosts[h].paused_ps;
+    }
+    window_s = (s.end - s.warmup) / 1e12;
+    r->goodput_gbps = s.delivered * 8 / window_s / 1e9;
+    r->paused_pct = 100.0 * paused / ((double)p->hosts * (s.end - s.warmup));
+    r->messages = s.nlat;
+    if (s.nlat) {
+        qsort(s.lat, s.nlat, sizeof(*s.lat), cmp_u64);
+        r->p50_us = s.lat[s.nlat / 2] / 1e6;
+        r->p99_us = s.lat[s.nlat * 99 / 100] / 1e6;
+        r->p999_us = s.lat[s.nlat * 999 / 1000] / 1e6;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    r->wall_seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    sim_destroy(&s);
+    return s.failed ? -1 : 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Discrete-event RoCEv2 fabric model for tuning what-if runs
+ *
+ * The incast of incast_bench, without the hardware: hosts senders, each
+ * with qps QPs that keep window WRITEs of msg_bytes in flight, all through
+ * one switch into one receiver. Modelled, packet by packet:
+ *
+ *   hosts     a NIC per sender serializing MTU packets onto its link,
+ *             round robin over its QPs, each QP paced by an rdma_pacer
+ *             when congestion control is on. A PFC pause stops the NIC
+ *             after the packet on the wire
+ *   switch    a shared buffer in front of the receiver's port. Packets
+ *             that don't fit are dropped. ECN marks on enqueue, RED
+ *             style between kmin and kmax. PFC accounts buffer use per
+ *             ingress port, pausing a sender at XOFF and resuming it
+ *             two packets below
+ *   receiver  in-order delivery; an ACK per message, go-back-N NAKs on a
+ *             gap, and with DCQCN a CNP per QP at most every 50 us for
+ *             ECN-marked packets
+ *
+ * ACKs, NAKs, CNPs and pause frames travel the reverse path, which an
+ * incast leaves idle, so they take a fixed delay. Congestion control is
+ * the NIC's DCQCN (rdma_pacer driven by CNPs), rdma_pacer's delay mode
+ * (message latency, as rdma_client -C) or none.
+ *
+ * Times inside are in picoseconds, on a calendar queue (sim_calendar.h).
+ * A run is self-contained, so sweeps run one per thread.
+ */
+
+#ifndef FABRIC_SIM_H
+#define FABRIC_SIM_H
+
+#include <stdint.h>
+
+enum fabric_cc {
+    FABRIC_CC_NONE,
+    FABRIC_CC_DCQCN,
+    FABRIC_CC_DELAY,
+    FABRIC_CC_COUNT,
+};
+
+extern const char *const fabric_cc_names[FABRIC_CC_COUNT];
+
+struct fabric_params {
+    // Workload, as in rdma_client and incast_bench
+    int hosts;                  // senders
+    int qps;                    // per sender
+    int window;                 // messages in flight per QP
+    uint32_t msg_bytes;
+
+    // Fabric
+    double link_gbps;
+    uint32_t prop_ns;           // per link
+    uint32_t mtu;               // RoCE payload per packet: 256..4096
+    uint32_t buffer_bytes;      // switch buffer in front of the receiver
+    uint32_t pfc_xoff_bytes;    // per ingress port, 0 for no PFC (lossy)
+    uint32_t ecn_kmin_bytes;
+    uint32_t ecn_kmax_bytes;    // 0 for no marking
+    double ecn_pmax;            // marking probability at kmax
+    enum fabric_cc cc;
+    uint32_t target_delay_ns;   // FABRIC_CC_DELAY's congestion threshold
+
+    uint64_t duration_ns;
+    uint64_t warmup_ns;         // left out of the results
+    uint64_t seed;
+};
+
+struct fabric_result {
+    double goodput_gbps;        // payload delivered in order
+    double p50_us, p99_us, p999_us;     // message latency, first packet sent to ACK
+    uint64_t messages;
+    uint64_t drops;
+    uint64_t retransmits;       // packets sent again (go-back-N, timeouts)
+    uint64_t pauses;            // XOFFs sent
+    double paused_pct;          // of sender link time
+    uint64_t ecn_marks;
+    uint64_t cnps;
+    uint32_t max_queue_bytes;
+    uint64_t packets;           // sent, retransmits included; whole run
+    uint64_t events;
+    double wall_seconds;
+};
+
+// 0 on success; the results cover warmup_ns..duration_ns
+int fabric_sim_run(const struct fabric_params *p, struct fabric_result *r);
+
+#endif
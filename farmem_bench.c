@@ -0,0 +1,417 @@
+/*
+ * Far memory benchmark: a workload bigger than the memory it may keep
+ * resident, on far memory (rdma_farmem.h) against local memory and swap
+ *
+ * The same workload runs on -S MB of
+ *
+ *   local   ordinary anonymous memory, all of it resident: the ceiling
+ *   swap    ordinary anonymous memory in a memory cgroup limited to -c MB,
+ *           the rest paged to the host's swap. Needs root, a memory
+ *           cgroup controller and swap; skipped otherwise
+ *   far     a far memory range of -p byte pages keeping -c MB resident,
+ *           the rest paged to the server's memory (rdma_server -M)
+ *
+ * in phases:
+ *
+ *   populate  write every byte, in order
+ *   scan      read every byte back, in order, checking what populate wrote
+ *   touch     read one word of each of a run of random 4 KB pages, timing
+ *             every touch: the fault latency once the range is cold
+ *   rmw       increment random words for -t seconds
+ *   hot       as rmw, but 90% of them in a tenth of the range
+ *
+ * and reports GB/s for the sequential phases, the touch latency
+ * percentiles, Mops/s for the random ones, and far memory's fault counts.
+ *
+ * Usage: farmem_bench [-S mb] [-c mb] [-p bytes] [-a pages] [-t secs]
+ *                     [-m mode,...] [server_ip]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "rdma_farmem.h"
+#include "rdma_common.h"
+
+#define PORT 18515                          // rdma_server's
+#define TOUCHES 20000
+#define OPS_BATCH 256                       // random ops between clock reads
+#define HOT_SHARE 10                        // a tenth of the range, 90% of the ops
+#define DEFAULT_MB 256
+#define DEFAULT_CACHE_MB 64
+#define DEFAULT_PAGE 4096
+#define DEFAULT_PREFETCH 8
+#define DEFAULT_SECS 2
+
+enum mode {
+    MODE_LOCAL,
+    MODE_SWAP,
+    MODE_FAR,
+    MODE_COUNT,
+};
+
+static const char *const mode_names[MODE_COUNT] = { "local", "swap", "far" };
+
+struct fm_opts {
+    size_t size;
+    size_t cache;
+    size_t page_size;
+    int prefetch;
+    int secs;
+};
+
+struct fm_result {
+    double populate_gbs;
+    double scan_gbs;
+    uint64_t wrong;
+    double touch_p50_us;
+    double touch_p99_us;
+    double touch_max_us;
+    double rmw_mops;
+    double hot_mops;
+};
+
+static uint64_t xorshift(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+// What populate leaves in word i
+static uint64_t pattern(uint64_t i) {
+    return i * 0x9e3779b97f4a7c15ULL;
+}
+
+// Random word increments for secs, hot_share% of them in the first tenth
+static double random_ops(uint64_t *words, uint64_t nwords, int hot, int secs) {
+    uint64_t seed = 0x2545f4914f6cdd1dULL + hot;
+    uint64_t hot_words = nwords / HOT_SHARE ? nwords / HOT_SHARE : 1;
+    uint64_t start = rdma_now_ns(), end = start + secs * 1000000000ULL, now, ops = 0;
+
+    do {
+        for (int i = 0; i < OPS_BATCH; i++) {
+            uint64_t r = xorshift(&seed);
+
+            if (hot && r % 100 < 90) {
+                words[(r >> 8) % hot_words]++;
+            } else {
+                words[(r >> 8) % nwords]++;
+            }
+        }
+        ops += OPS_BATCH;
+        now = rdma_now_ns();
+    } while (now < end);
+    return ops / ((now - start) / 1e3);
+}
+
+static int run_workload(char *mem, const struct fm_opts *o, struct fm_result *r) {
+    uint64_t *words = (uint64_t *)mem;
+    uint64_t nwords = o->size / sizeof(uint64_t);
+    uint64_t npages = o->size / 4096;
+    uint64_t *lat, seed = 0x9e3779b97f4a7c15ULL, start, sum = 0;
+    int touches = npages < TOUCHES ? npages : TOUCHES;
+
+    lat = malloc(touches * sizeof(*lat));
+    if (!lat) {
+        fprintf(stderr, "Failed to allocate latency samples\n");
+        return -1;
+    }
+    memset(r, 0, sizeof(*r));
+
+    start = rdma_now_ns();
+    for (uint64_t i = 0; i < nwords; i++) {
+        words[i] = pattern(i);
+    }
+    r->populate_gbs = o->size / (double)(rdma_now_ns() - start);
+
+    start = rdma_now_ns();
+    for (uint64_t i = 0; i < nwords; i++) {
+        r->wrong += words[i] != pattern(i);
+    }
+    r->scan_gbs = o->size / (double)(rdma_now_ns() - start);
+
+    for (int i = 0; i < touches; i++) {
+        uint64_t page = xorshift(&seed) % npages;
+        uint64_t t = rdma_now_ns();
+
+        sum += words[page * (4096 / sizeof(uint64_t))];
+        lat[i] = rdma_now_ns() - t;
+    }
+    qsort(lat, touches, sizeof(*lat), rdma_cmp_u64);
+    r->touch_p50_us = lat[touches / 2] / 1e3;
+    r->touch_p99_us = lat[touches * 99 / 100] / 1e3;
+    r->touch_max_us = lat[touches - 1] / 1e3;
+    free(lat);
+    // Keep the touches from being optimized away
+    if (sum == 1) {
+        printf(" ");
+    }
+
+    r->rmw_mops = random_ops(words, nwords, 0, o->secs);
+    r->hot_mops = random_ops(words, nwords, 1, o->secs);
+    return 0;
+}
+
+static int run_local(const struct fm_opts *o, struct fm_result *r) {
+    char *mem = mmap(NULL, o->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int ret;
+
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %zu MB: %s\n", o->size >> 20, strerror(errno));
+        return -1;
+    }
+    ret = run_workload(mem, o, r);
+    munmap(mem, o->size);
+    return ret;
+}
+
+static int write_file(const char *path, const char *value) {
+    FILE *f = fopen(path, "w");
+    int ret;
+
+    if (!f) {
+        return -1;
+    }
+    ret = fputs(value, f) < 0 ? -1 : 0;
+    if (fclose(f)) {
+        ret = -1;
+    }
+    return ret;
+}
+
+static int have_swap() {
+    FILE *f = fopen("/proc/swaps", "r");
+    char line[256];
+    int lines = 0;
+
+    if (!f) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        lines++;
+    }
+    fclose(f);
+    return lines > 1;   // past the header
+}
+
+// A memory cgroup holding at most limit bytes resident, in dir; procs is
+// where a process enters it
+static int cgroup_create(size_t limit, char *dir, size_t dir_len, char *procs, size_t procs_len) {
+    char path[512], value[32];
+
+    snprintf(value, sizeof(value), "%zu\n", limit);
+    if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0) {
+        // v2: the root must hand the memory controller down
+        write_file("/sys/fs/cgroup/cgroup.subtree_control", "+memory\n");
+        snprintf(dir, dir_len, "/sys/fs/cgroup/farmem_bench.%d", getpid());
+        if (mkdir(dir, 0755) && errno != EEXIST) {
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/memory.max", dir);
+    } else {
+        snprintf(dir, dir_len, "/sys/fs/cgroup/memory/farmem_bench.%d", getpid());
+        if (mkdir(dir, 0755) && errno != EEXIST) {
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/memory.limit_in_bytes", dir);
+    }
+    if (write_file(path, value)) {
+        rmdir(dir);
+        return -1;
+    }
+    snprintf(procs, procs_len, "%s/cgroup.procs", dir);
+    return 0;
+}
+
+// In a child confined to the cache size, so the rest goes to swap
+static int run_swap(const struct fm_opts *o, struct fm_result *r) {
+    char dir[256], procs[300];
+    int fds[2], status, ret = 0;
+    pid_t pid;
+
+    if (!have_swap()) {
+        printf("No swap configured: skipping swap\n");
+        return 1;
+    }
+    if (cgroup_create(o->cache, dir, sizeof(dir), procs, sizeof(procs))) {
+        printf("Cannot create a memory cgroup (%s): skipping swap\n", strerror(errno));
+        return 1;
+    }
+    if (pipe(fds)) {
+        fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+        rmdir(dir);
+        return -1;
+    }
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        rmdir(dir);
+        return -1;
+    }
+    if (pid == 0) {
+        char self[32];
+
+        close(fds[0]);
+        snprintf(self, sizeof(self), "%d\n", getpid());
+        if (write_file(procs, self)) {
+            fprintf(stderr, "Failed to enter memory cgroup %s\n", dir);
+            _exit(1);
+        }
+        if (run_local(o, r) || write(fds[1], r, sizeof(*r)) != sizeof(*r)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], r, sizeof(*r)) != sizeof(*r)) {
+        ret = -1;
+    }
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "Swap run failed%s\n", WIFSIGNALED(status) ? " (killed: out of memory?)" : "");
+        ret = -1;
+    }
+    rmdir(dir);
+    return ret;
+}
+
+static int run_far(const char *server_ip, const struct fm_opts *o, struct fm_result *r) {
+    struct farmem_attr attr = {
+        .server_ip = server_ip,
+        .port = PORT,
+        .size = o->size,
+        .page_size = o->page_size,
+        .cache_bytes = o->cache,
+        .prefetch = o->prefetch,
+    };
+    struct farmem_stats st;
+    struct farmem *fm;
+    int ret;
+
+    fm = farmem_open(&attr);
+    if (!fm) {
+        return -1;
+    }
+    ret = run_workload(farmem_base(fm), o, r);
+    farmem_get_stats(fm, &st);
+    farmem_close(fm);
+
+    printf("far: %lu faults (%.1f us mean, %.1f us max), %lu pages prefetched, "
+           "%lu first writes\n", st.faults, st.faults ? st.fault_ns / 1e3 / st.faults : 0.0,
+           st.fault_max_ns / 1e3, st.prefetched, st.wp_faults);
+    printf("far: %lu evictions, %lu written back; %.1f MB read, %.1f MB written; "
+           "dirty tracking %s\n", st.evictions, st.writebacks, st.bytes_read / 1048576.0,
+           st.bytes_written / 1048576.0, st.write_protect ? "by write-protect" : "off (all dirty)");
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-S mb] [-c mb] [-p bytes] [-a pages] [-t secs]\n"
+                    "       [-m mode,...] [server_ip]\n", prog);
+    fprintf(stderr, "  -S  Workload size, MB (default %d)\n", DEFAULT_MB);
+    fprintf(stderr, "  -c  Resident at most, MB: far memory's cache, swap's cgroup limit "
+                    "(default %d)\n", DEFAULT_CACHE_MB);
+    fprintf(stderr, "  -p  Far memory page size, %d to %d bytes (default %d)\n", FARMEM_MIN_PAGE,
+            FARMEM_MAX_PAGE, DEFAULT_PAGE);
+    fprintf(stderr, "  -a  Pages read ahead on sequential faults, at most %d (default %d)\n",
+            FARMEM_MAX_PREFETCH, DEFAULT_PREFETCH);
+    fprintf(stderr, "  -t  Seconds for each random phase (default %d)\n", DEFAULT_SECS);
+    fprintf(stderr, "  -m  Modes: local, swap, far (default all); far needs server_ip, "
+                    "an rdma_server -M\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct fm_opts o = {
+        .size = (size_t)DEFAULT_MB << 20,
+        .cache = (size_t)DEFAULT_CACHE_MB << 20,
+        .page_size = DEFAULT_PAGE,
+        .prefetch = DEFAULT_PREFETCH,
+        .secs = DEFAULT_SECS,
+    };
+    unsigned modes = (1U << MODE_COUNT) - 1;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "S:c:p:a:t:m:h")) != -1) {
+        switch (opt) {
+        case 'S':
+            o.size = (size_t)atol(optarg) << 20;
+            break;
+        case 'c':
+            o.cache = (size_t)atol(optarg) << 20;
+            break;
+        case 'p':
+            o.page_size = atol(optarg);
+            break;
+        case 'a':
+            o.prefetch = atoi(optarg);
+            break;
+        case 't':
+            o.secs = atoi(optarg);
+            break;
+        case 'm':
+            if (rdma_parse_names(optarg, mode_names, MODE_COUNT, &modes)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!o.size || !o.cache || o.secs < 1 || o.page_size < FARMEM_MIN_PAGE ||
+        o.page_size > FARMEM_MAX_PAGE || (o.page_size & (o.page_size - 1)) ||
+        o.size % o.page_size || o.prefetch < 0 || o.prefetch > FARMEM_MAX_PREFETCH ||
+        ((modes & (1U << MODE_FAR)) && optind >= argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("%zu MB workload, %zu MB resident at most, %zu byte far pages, %d read ahead\n",
+           o.size >> 20, o.cache >> 20, o.page_size, o.prefetch);
+    for (int m = 0; m < MODE_COUNT; m++) {
+        struct fm_result r;
+        int ret;
+
+        if (!(modes & (1U << m))) {
+            continue;
+        }
+        switch (m) {
+        case MODE_LOCAL:
+            ret = run_local(&o, &r);
+            break;
+        case MODE_SWAP:
+            ret = run_swap(&o, &r);
+            break;
+        default:
+            ret = run_far(argv[optind], &o, &r);
+            break;
+        }
+        if (ret) {
+            failed |= ret < 0;
+            continue;
+        }
+        printf("%-5s  populate %6.2f GB/s  scan %6.2f GB/s  %lu wrong  touch p50 %7.1f us  "
+               "p99 %7.1f us  max %8.1f us  rmw %7.2f Mops/s  hot %7.2f Mops/s\n",
+               mode_names[m], r.populate_gbs, r.scan_gbs, r.wrong, r.touch_p50_us,
+               r.touch_p99_us, r.touch_max_us, r.rmw_mops, r.hot_mops);
+        failed |= r.wrong != 0;
+    }
+    return failed ? 1 : 0;
+}
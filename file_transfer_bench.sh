@@ -0,0 +1,127 @@
+#!/bin/bash
+
+# RDMA File Transfer Benchmark
+# Moves the same file with rdma_server/rdma_client (mmap and io_uring
+# sources), nc and scp, and reports end-to-end GB/s and CPU seconds per GB
+# (sender + receiver) for each. The RDMA side busy-polls its completion
+# queue, so its CPU time includes the polling thread on both ends.
+#
+# Usage: ./file_transfer_bench.sh [SIZE_MB] [DIR]
+#   SERVER_IP=<addr> selects the RDMA address (default 127.0.0.1)
+
+set -e
+
+# Colors for output
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+SIZE_MB=${1:-1024}
+DIR=${2:-/tmp/rdma_file_bench}
+SERVER_IP=${SERVER_IP:-127.0.0.1}
+NC_PORT=18600
+SRC="$DIR/source.bin"
+DST="$DIR/dest.bin"
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+
+cleanup() {
+    pkill -f "rdma_server -m 0 -F" 2>/dev/null || true
+    rm -f "$DST" "$DIR"/*.time
+}
+trap cleanup EXIT INT TERM
+
+echo -e "${BLUE}RDMA File Transfer Benchmark${NC}"
+echo "============================="
+
+if [ ! -x "$SCRIPT_DIR/rdma_server" ] || [ ! -x "$SCRIPT_DIR/rdma_client" ]; then
+    echo -e "${RED}rdma_server/rdma_client not built. Run: make all${NC}"
+    exit 1
+fi
+
+mkdir -p "$DIR"
+if [ ! -f "$SRC" ] || [ "$(stat -c %s "$SRC")" -ne $((SIZE_MB * 1024 * 1024)) ]; then
+    echo -e "${YELLOW}Creating ${SIZE_MB} MB test file...${NC}"
+    dd if=/dev/urandom of="$SRC" bs=1M count="$SIZE_MB" status=none
+fi
+# Every method reads the source from a warm page cache
+cat "$SRC" > /dev/null
+
+now() {
+    date +%s.%N
+}
+
+# timed OUTPUT_PREFIX CMD: run CMD, logging to PREFIX.log and its user/system
+# CPU seconds (children included) to PREFIX.time
+timed() {
+    local TIMEFORMAT='%U %S'
+    { time bash -c "$2" > "$1.log" 2>&1; } 2> "$1.time"
+}
+
+# run_method LABEL RECEIVER_CMD SENDER_CMD
+run_method() {
+    local label=$1 receiver=$2 sender=$3
+    local start end recv_pid
+
+    rm -f "$DST"
+    timed "$DIR/recv" "$receiver" &
+    recv_pid=$!
+    sleep 1
+
+    start=$(now)
+    if ! timed "$DIR/send" "$sender"; then
+        echo -e "${RED}$label: sender failed (see $DIR/send.log)${NC}"
+        kill $recv_pid 2>/dev/null || true
+        wait $recv_pid 2>/dev/null || true
+        return
+    fi
+    wait $recv_pid || true
+    end=$(now)
+
+    if ! cmp -s "$SRC" "$DST"; then
+        echo -e "${RED}$label: received file differs from source${NC}"
+        return
+    fi
+
+    awk -v label="$label" -v start="$start" -v end="$end" -v mb="$SIZE_MB" \
+        -v recv="$(cat "$DIR/recv.time")" -v send="$(cat "$DIR/send.time")" 'BEGIN {
+        split(recv, r, " "); split(send, s, " ")
+        gb = mb * 1048576 / 1e9
+        secs = end - start
+        cpu = r[1] + r[2] + s[1] + s[2]
+        printf "%-22s %10.3f %10.3f %12.3f\n", label, secs, gb / secs, cpu / gb
+    }'
+}
+
+echo ""
+printf "%-22s %10s %10s %12s\n" "Method" "Seconds" "GB/s" "CPU s/GB"
+printf "%-22s %10s %10s %12s\n" "------" "-------" "----" "--------"
+
+run_method "rdma (mmap source)" \
+    "$SCRIPT_DIR/rdma_server -m 0 -F $DST" \
+    "$SCRIPT_DIR/rdma_client -F $SRC $SERVER_IP"
+run_method "rdma (io_uring source)" \
+    "$SCRIPT_DIR/rdma_server -m 0 -F $DST" \
+    "$SCRIPT_DIR/rdma_client -u -F $SRC $SERVER_IP"
+
+# OpenBSD nc closes on EOF with -N; traditional nc uses -q 0
+if command -v nc >/dev/null 2>&1; then
+    if nc -h 2>&1 | grep -q -- ' -N'; then
+        run_method "nc" "nc -l $NC_PORT > $DST" "nc -N 127.0.0.1 $NC_PORT < $SRC"
+    else
+        run_method "nc" "nc -l -p $NC_PORT > $DST" "nc -q 0 127.0.0.1 $NC_PORT < $SRC"
+    fi
+else
+    echo -e "${YELLOW}nc not installed, skipping${NC}"
+fi
+
+# scp needs key-based ssh to localhost; sshd's CPU time is not included
+if ssh -o BatchMode=yes -o StrictHostKeyChecking=no localhost true 2>/dev/null; then
+    run_method "scp (client CPU only)" "true" "scp -q $SRC localhost:$DST"
+else
+    echo -e "${YELLOW}No passwordless ssh to localhost, skipping scp${NC}"
+fi
+
+echo ""
+echo -e "${GREEN}Benchmark complete${NC} (${SIZE_MB} MB, logs in $DIR)"
@@ -0,0 +1,414 @@
+/*
+ * Incast benchmark: N senders into one receiver, with and without pacing
+ *
+ * The client opens N connections to incast_bench -s and runs a thread per
+ * connection. Each keeps up to W RDMA WRITEs of B bytes in flight into the
+ * server's buffer, so all of them converge on the server's port: the
+ * N-to-1 pattern that fills switch buffers, triggers PFC pauses and
+ * inflates tail latency. It runs twice:
+ *
+ *   off   every sender posts as fast as its window allows
+ *   cc    every sender goes through an adaptive rdma_pacer starting at
+ *         -r Mbit/s, cut when completion latency rises more than -D us
+ *         over its baseline
+ *
+ * and reports aggregate throughput, in bits and in writes per second (the
+ * exact figure for small writes), write latency (post to completion)
+ * percentiles, Jain's fairness index over the per-connection throughput,
+ * and for cc the mean paced rate and number of rate cuts.
+ *
+ * Usage: incast_bench -s [-n conns]
+ *        incast_bench [-n conns] [-w window] [-b bytes] [-t seconds]
+ *                     [-r mbps] [-D us] [-m off|cc|both] <server_ip>
+ * The server exits after conns connections, 2 * conns by default (one
+ * client running both modes). For incast from several hosts, start the
+ * server with the total and each client with the same -m.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_common.h"
+#include "rdma_connection.h"
+#include "rdma_pacer.h"
+
+#define PORT 18518
+#define SERVER_BUFFER_SIZE (1024 * 1024)    // the largest write the client may do
+#define MAX_WINDOW 64
+#define QP_DEPTH MAX_WINDOW
+#define CQ_DEPTH MAX_WINDOW
+#define POLL_BATCH 16
+#define MAX_SAMPLES (1 << 17)       // latency samples kept per connection
+#define SPIN_NS 20000               // pacing waits shorter than this spin, longer ones sleep
+#define DEFAULT_CONNS 8
+#define DEFAULT_WINDOW 8
+#define DEFAULT_BYTES (64 * 1024)
+#define DEFAULT_MBPS 25000
+#define DEFAULT_DELAY_US 50
+#define UPDATE_NS 200000
+
+struct incast_opts {
+    int conns;
+    int window;
+    uint32_t bytes;
+    double seconds;
+    double mbps;
+    double delay_us;
+};
+
+struct flow {
+    struct rdma_context *ctx;
+    struct rdma_pacer_attr pacer_attr;
+    struct rdma_pacer pacer;
+    int paced;
+    const struct incast_opts *opts;
+    const volatile int *go;
+    pthread_t thread;
+    uint64_t *lat;
+    long samples;
+    uint64_t writes;
+    double seconds;
+    int failed;
+};
+
+static int run_server(int total) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = SERVER_BUFFER_SIZE,
+        .cq_depth = 2,
+        .qp_depth = 1,
+        .quiet = 1,
+    };
+    int64_t served;
+
+    printf("Waiting for %d connections on port %d\n", total, PORT);
+    served = serve_connections(NULL, PORT, &attr, total, NULL);
+    if (served < 0) {
+        return -1;
+    }
+    printf("Served %ld connections\n", served);
+    return served == total ? 0 : -1;
+}
+
+static int post_write(struct flow *f, uint64_t slot) {
+    struct rdma_context *ctx = f->ctx;
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+
+    sge.addr = (uintptr_t)ctx->buffer;
+    sge.length = f->opts->bytes;
+    sge.lkey = ctx->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = slot;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = ctx->remote_addr;
+    wr.wr.rdma.rkey = ctx->remote_rkey;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post write\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Completions come back in posting order on RC, so the window is a ring:
+// writes are posted at head and complete at tail
+static void *flow_main(void *arg) {
+    struct flow *f = arg;
+    const struct incast_opts *o = f->opts;
+    uint64_t posted_at[MAX_WINDOW];
+    uint64_t head = 0, tail = 0;
+    uint64_t start, end, t, wait = 0;
+    struct ibv_wc wc[POLL_BATCH];
+
+    while (!__atomic_load_n(f->go, __ATOMIC_ACQUIRE)) {
+        ;
+    }
+    start = rdma_now_ns();
+    end = start + o->seconds * 1e9;
+    if (f->paced) {
+        rdma_pacer_init(&f->pacer, &f->pacer_attr, start);
+    }
+
+    for (t = start; t < end || tail < head; t = rdma_now_ns()) {
+        wait = 0;
+        while (t < end && head - tail < (uint64_t)o->window) {
+            if (f->paced && (wait = rdma_pacer_admit(&f->pacer, o->bytes, t))) {
+                break;
+            }
+            posted_at[head % o->window] = t;
+            if (post_write(f, head % o->window)) {
+                f->failed = 1;
+                return NULL;
+            }
+            head++;
+        }
+        if (tail == head && wait > SPIN_NS) {
+            struct timespec ts = {wait / 1000000000, wait % 1000000000};
+
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        int n = ibv_poll_cq(f->ctx->cq, POLL_BATCH, wc);
+        if (n < 0) {
+            fprintf(stderr, "Failed to poll CQ\n");
+            f->failed = 1;
+            return NULL;
+        }
+        if (n > 0) {
+            t = rdma_now_ns();
+        }
+        for (int i = 0; i < n; i++) {
+            uint64_t lat = t - posted_at[wc[i].wr_id];
+
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+                f->failed = 1;
+                return NULL;
+            }
+            if (f->samples < MAX_SAMPLES) {
+                f->lat[f->samples++] = lat;
+            }
+            if (f->paced) {
+                rdma_pacer_complete(&f->pacer, lat, t);
+            }
+            tail++;
+        }
+    }
+    f->writes = tail;
+    f->seconds = (rdma_now_ns() - start) / 1e9;
+    return NULL;
+}
+
+static int connect_flows(struct rdma_context *ctxs, int n, const char *server_ip,
+                         const struct incast_opts *o) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = o->bytes,
+        .cq_depth = CQ_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .quiet = 1,
+    };
+
+    if (connect_to_servers(ctxs, n, server_ip, PORT, &attr, NULL)) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (ctxs[i].remote_length < o->bytes) {
+            fprintf(stderr, "Server buffer holds %lu bytes, writes are %u\n",
+                    ctxs[i].remote_length, o->bytes);
+            for (int j = 0; j < n; j++) {
+                close_rdma_connection(&ctxs[j]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void report(const char *mode, struct flow *flows, int n, const struct incast_opts *o,
+                   uint64_t *all) {
+    double total = 0, writes = 0, sum = 0, sum_sq = 0, rate = 0;
+    uint64_t cuts = 0;
+    long samples = 0;
+
+    for (int i = 0; i < n; i++) {
+        double tput = flows[i].seconds > 0 ? flows[i].writes * (double)o->bytes / flows[i].seconds : 0;
+
+        total += tput;
+        writes += flows[i].seconds > 0 ? flows[i].writes / flows[i].seconds : 0;
+        sum += tput;
+        sum_sq += tput * tput;
+        memcpy(all + samples, flows[i].lat, flows[i].samples * sizeof(*all));
+        samples += flows[i].samples;
+        if (flows[i].paced) {
+            rate += rdma_pacer_mean_rate(&flows[i].pacer);
+            cuts += flows[i].pacer.cuts;
+        }
+    }
+    if (samples == 0) {
+        printf("%-4s no writes completed\n", mode);
+        return;
+    }
+    qsort(all, samples, sizeof(*all), rdma_cmp_u64);
+    printf("%-4s %5d %10.2f %10.4f %9.1f %9.1f %9.1f %6.3f", mode, n, total * 8 / 1e9,
+           writes / 1e6, all[samples / 2] / 1e3, all[samples * 99 / 100] / 1e3,
+           all[samples * 999 / 1000] / 1e3, sum_sq > 0 ? sum * sum / (n * sum_sq) : 0);
+    if (rate > 0) {
+        printf(" %10.2f %8lu\n", rate / n * 8 / 1e9, cuts);
+    } else {
+        printf(" %10s %8s\n", "-", "-");
+    }
+}
+
+static int run_mode(const char *server_ip, const struct incast_opts *o, int paced) {
+    struct rdma_context *ctxs;
+    struct flow *flows;
+    uint64_t *all = NULL;
+    volatile int go = 0;
+    int started = 0;
+    int ret = -1;
+
+    ctxs = calloc(o->conns, sizeof(*ctxs));
+    flows = calloc(o->conns, sizeof(*flows));
+    if (!ctxs || !flows) {
+        fprintf(stderr, "Failed to allocate %d flows\n", o->conns);
+        goto out;
+    }
+    for (int i = 0; i < o->conns; i++) {
+        flows[i].lat = malloc(MAX_SAMPLES * sizeof(*flows[i].lat));
+        if (!flows[i].lat) {
+            fprintf(stderr, "Failed to allocate latency samples\n");
+            goto out;
+        }
+    }
+    all = malloc((size_t)o->conns * MAX_SAMPLES * sizeof(*all));
+    if (!all) {
+        fprintf(stderr, "Failed to allocate latency samples\n");
+        goto out;
+    }
+    if (connect_flows(ctxs, o->conns, server_ip, o)) {
+        goto out;
+    }
+
+    for (int i = 0; i < o->conns; i++) {
+        struct flow *f = &flows[i];
+
+        f->ctx = &ctxs[i];
+        f->opts = o;
+        f->go = &go;
+        f->paced = paced;
+        f->pacer_attr.max_rate = o->mbps * 1e6 / 8;
+        f->pacer_attr.burst = o->bytes;
+        f->pacer_attr.adaptive = 1;
+        f->pacer_attr.target_delay_ns = o->delay_us * 1000;
+        f->pacer_attr.update_ns = UPDATE_NS;
+        if (pthread_create(&f->thread, NULL, flow_main, f)) {
+            fprintf(stderr, "Failed to start flow %d\n", i);
+            break;
+        }
+        started++;
+    }
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    ret = started == o->conns ? 0 : -1;
+    for (int i = 0; i < started; i++) {
+        pthread_join(flows[i].thread, NULL);
+        if (flows[i].failed) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        report(paced ? "cc" : "off", flows, o->conns, o, all);
+    }
+    for (int i = 0; i < o->conns; i++) {
+        close_rdma_connection(&ctxs[i]);
+    }
+
+out:
+    if (flows) {
+        for (int i = 0; i < o->conns; i++) {
+            free(flows[i].lat);
+        }
+    }
+    free(all);
+    free(flows);
+    free(ctxs);
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -s [-n conns]\n", prog);
+    fprintf(stderr, "       %s [-n conns] [-w window] [-b bytes] [-t seconds] [-r mbps] [-D us]\n"
+                    "       [-m off|cc|both] <server_ip>\n", prog);
+    fprintf(stderr, "  -s  Run the server; it exits after conns connections (default 2 * %d)\n",
+            DEFAULT_CONNS);
+    fprintf(stderr, "  -n  Connections, one sending thread each (default %d)\n", DEFAULT_CONNS);
+    fprintf(stderr, "  -w  Writes in flight per connection, at most %d (default %d)\n", MAX_WINDOW,
+            DEFAULT_WINDOW);
+    fprintf(stderr, "  -b  Bytes per write, at most %d (default %d)\n", SERVER_BUFFER_SIZE,
+            DEFAULT_BYTES);
+    fprintf(stderr, "  -t  Seconds per mode (default 2)\n");
+    fprintf(stderr, "  -r  Per-connection starting and highest paced rate, Mbit/s (default %d)\n",
+            DEFAULT_MBPS);
+    fprintf(stderr, "  -D  Latency over the baseline that counts as congestion, us (default %d)\n",
+            DEFAULT_DELAY_US);
+    fprintf(stderr, "  -m  Run unpaced (off), with the controller (cc) or both (default)\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct incast_opts o = {
+        .conns = DEFAULT_CONNS,
+        .window = DEFAULT_WINDOW,
+        .bytes = DEFAULT_BYTES,
+        .seconds = 2,
+        .mbps = DEFAULT_MBPS,
+        .delay_us = DEFAULT_DELAY_US,
+    };
+    const char *mode = "both";
+    int server = 0;
+    int server_conns = 0;
+    int ret = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sn:w:b:t:r:D:m:h")) != -1) {
+        switch (opt) {
+        case 's':
+            server = 1;
+            break;
+        case 'n':
+            o.conns = server_conns = atoi(optarg);
+            break;
+        case 'w':
+            o.window = atoi(optarg);
+            break;
+        case 'b':
+            o.bytes = atoi(optarg);
+            break;
+        case 't':
+            o.seconds = atof(optarg);
+            break;
+        case 'r':
+            o.mbps = atof(optarg);
+            break;
+        case 'D':
+            o.delay_us = atof(optarg);
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (o.conns < 1 || o.window < 1 || o.window > MAX_WINDOW || o.bytes < 1 ||
+        o.bytes > SERVER_BUFFER_SIZE || o.seconds <= 0 || o.mbps <= 0 ||
+        (strcmp(mode, "off") && strcmp(mode, "cc") && strcmp(mode, "both")) ||
+        (!server && optind >= argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (server) {
+        return run_server(server_conns ? server_conns : 2 * DEFAULT_CONNS) ? 1 : 0;
+    }
+
+    printf("Incast into %s: %d connections, %d writes of %u bytes in flight each, %.1f s per mode\n",
+           argv[optind], o.conns, o.window, o.bytes, o.seconds);
+    printf("%-4s %5s %10s %10s %9s %9s %9s %6s %10s %8s\n", "mode", "conns", "Gbit/s",
+           "Mwrites/s", "p50 us", "p99 us", "p99.9 us", "jain", "rate Gb/s", "cuts");
+    if (strcmp(mode, "cc")) {
+        ret |= run_mode(argv[optind], &o, 0);
+    }
+    if (strcmp(mode, "off")) {
+        ret |= run_mode(argv[optind], &o, 1);
+    }
+    return ret ? 1 : 0;
+}
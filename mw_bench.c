@@ -0,0 +1,653 @@
+/*
+ * Memory window benchmark: granting a peer per-request access to part of a
+ * buffer by binding a window against registering the part
+ *
+ * The server (mw_bench -s) registers one large buffer per client, with no
+ * remote access, and answers each request for -b bytes of it with a grant:
+ * a sub-range and an rkey for it. The client RDMA WRITEs the bytes through
+ * the grant, reports it done, and the server revokes it. How the grant is
+ * made (-m):
+ *
+ *   static  the rkey of a second, remotely writable MR over the whole
+ *           buffer: nothing per request and nothing revocable, the floor
+ *   mw      bind a type 2 memory window over the sub-range (rdma_mw.h),
+ *           invalidate it when done
+ *   reg     ibv_reg_mr() the sub-range, ibv_dereg_mr() it when done
+ *
+ * and reports, per mode and size, requests per second, the mean and p99 of
+ * a whole request (grant, write, revoke) and the server's mean cost to
+ * grant and to revoke. Binding and invalidating are work requests the HCA
+ * runs in order with the data; registering and deregistering pin and unpin
+ * pages through the kernel, so their cost grows with the size.
+ *
+ * Last, the client checks a revoked window really is closed: it writes
+ * through the rkey of its last mw grant after the server invalidated it,
+ * and expects the remote access error that ends the connection.
+ *
+ * Usage: mw_bench -s [-n conns]
+ *        mw_bench [-b bytes,...] [-k requests] [-m mode,...] <server_ip>
+ * The server exits after conns connections: 1 by default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_common.h"
+#include "rdma_connection.h"
+#include "rdma_mw.h"
+
+#define PORT 18520
+#define CTRL_SIZE 4096                      // message slots at the start of each buffer
+#define RECV_OFFSET 0
+#define SEND_OFFSET 256
+#define SLOT_SIZE (1024 * 1024)             // the largest grant
+#define SLOTS 16                            // grants rotate over these
+#define DATA_SIZE ((size_t)SLOTS * SLOT_SIZE)
+#define QP_DEPTH 4
+#define CQ_DEPTH 8
+#define DEFAULT_SIZES "4096,65536,1048576"
+#define DEFAULT_REQUESTS 2000
+#define MAX_SIZES 16
+
+enum grant_mode {
+    GRANT_STATIC,
+    GRANT_MW,
+    GRANT_REG,
+    GRANT_MODE_COUNT,
+};
+
+static const char *const grant_mode_names[GRANT_MODE_COUNT] = {"static", "mw", "reg"};
+
+enum msg_type {
+    MSG_REQUEST,        // client: a grant of length bytes by mode
+    MSG_GRANT,          // server: addr, rkey, length, status
+    MSG_DONE,           // client: finished with the grant
+    MSG_ACK,            // server: revoked; what it cost
+    MSG_BYE,
+};
+
+enum grant_status {
+    GRANT_OK,
+    GRANT_UNSUPPORTED,  // no memory windows on the server's device
+    GRANT_FAILED,
+};
+
+struct mw_msg {
+    uint32_t type;
+    uint32_t mode;
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t length;
+    uint32_t status;
+    uint32_t pad;
+    uint64_t grant_ns;
+    uint64_t revoke_ns;
+};
+
+// wr_ids, to find the completion waited for among the rest
+enum {
+    WR_SEND,
+    WR_RECV,
+    WR_WRITE,
+    WR_BIND,
+    WR_INV,
+};
+
+struct mw_result {
+    double rate;
+    double mean_us, p99_us;
+    double grant_us, revoke_us;
+    int unsupported;
+};
+
+static struct mw_msg *msg_at(struct rdma_context *ctx, size_t offset) {
+    return (struct mw_msg *)(ctx->buffer + offset);
+}
+
+static int post_recv(struct rdma_context *ctx) {
+    struct ibv_sge sge;
+    struct ibv_recv_wr wr, *bad_wr;
+
+    sge.addr = (uintptr_t)ctx->buffer + RECV_OFFSET;
+    sge.length = sizeof(struct mw_msg);
+    sge.lkey = ctx->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = WR_RECV;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    if (ibv_post_recv(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post receive\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Send the message in ctx's send slot
+static int post_msg(struct rdma_context *ctx) {
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+
+    sge.addr = (uintptr_t)ctx->buffer + SEND_OFFSET;
+    sge.length = sizeof(struct mw_msg);
+    sge.lkey = ctx->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = WR_SEND;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post send\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Poll until the completion of wr_id, into wc; any other completion must
+// have succeeded. wr_id's own status is the caller's to check
+static int wait_for(struct rdma_context *ctx, uint64_t wr_id, struct ibv_wc *wc) {
+    for (;;) {
+        int n = ibv_poll_cq(ctx->cq, 1, wc);
+
+        if (n < 0) {
+            fprintf(stderr, "Failed to poll CQ\n");
+            return -1;
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (wc->wr_id == wr_id) {
+            return 0;
+        }
+        if (wc->status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc->status));
+            return -1;
+        }
+    }
+}
+
+// wait_for() a completion that must succeed
+static int expect(struct rdma_context *ctx, uint64_t wr_id) {
+    struct ibv_wc wc;
+
+    if (wait_for(ctx, wr_id, &wc)) {
+        return -1;
+    }
+    if (wc.status != IBV_WC_SUCCESS) {
+        if (wc.status != IBV_WC_WR_FLUSH_ERR) {
+            fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc.status));
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// What the server keeps per client
+struct mw_conn {
+    struct rdma_context *ctx;
+    struct ibv_mr *static_mr;   // the whole data region, remotely writable
+    struct ibv_mw *mw;          // NULL without type 2 windows
+    struct ibv_mr *req_mr;      // the current reg grant
+    uint32_t rkey;              // the current mw grant
+    unsigned next_slot;
+    uint64_t grant_ns;
+};
+
+static void grant(struct mw_conn *c, const struct mw_msg *req, struct mw_msg *resp) {
+    struct rdma_context *ctx = c->ctx;
+    char *addr = ctx->buffer + CTRL_SIZE + (size_t)(c->next_slot++ % SLOTS) * SLOT_SIZE;
+    uint64_t start = rdma_now_ns();
+
+    resp->type = MSG_GRANT;
+    resp->addr = (uintptr_t)addr;
+    resp->length = req->length;
+    resp->status = GRANT_OK;
+    if (req->length < 1 || req->length > SLOT_SIZE) {
+        resp->status = GRANT_FAILED;
+        return;
+    }
+    switch (req->mode) {
+    case GRANT_STATIC:
+        resp->rkey = c->static_mr->rkey;
+        break;
+    case GRANT_MW:
+        if (!c->mw) {
+            resp->status = GRANT_UNSUPPORTED;
+            return;
+        }
+        if (rdma_mw_bind(ctx->qp, c->mw, ctx->mr, addr, req->length, IBV_ACCESS_REMOTE_WRITE,
+                         WR_BIND, &c->rkey) ||
+            expect(ctx, WR_BIND)) {
+            resp->status = GRANT_FAILED;
+            return;
+        }
+        resp->rkey = c->rkey;
+        break;
+    default:
+        c->req_mr = ibv_reg_mr(ctx->pd, addr, req->length,
+                               IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+        if (!c->req_mr) {
+            fprintf(stderr, "Failed to register %u bytes\n", req->length);
+            resp->status = GRANT_FAILED;
+            return;
+        }
+        resp->rkey = c->req_mr->rkey;
+        break;
+    }
+    c->grant_ns = rdma_now_ns() - start;
+}
+
+static int revoke(struct mw_conn *c, const struct mw_msg *req, struct mw_msg *resp) {
+    uint64_t start = rdma_now_ns();
+
+    switch (req->mode) {
+    case GRANT_STATIC:
+        break;
+    case GRANT_MW:
+        if (rdma_mw_invalidate(c->ctx->qp, c->rkey, WR_INV) || expect(c->ctx, WR_INV)) {
+            return -1;
+        }
+        break;
+    default:
+        if (c->req_mr && ibv_dereg_mr(c->req_mr)) {
+            fprintf(stderr, "Failed to deregister a grant\n");
+            return -1;
+        }
+        c->req_mr = NULL;
+        break;
+    }
+    resp->type = MSG_ACK;
+    resp->grant_ns = c->grant_ns;
+    resp->revoke_ns = rdma_now_ns() - start;
+    return 0;
+}
+
+// Answer requests until the client says bye or the connection fails
+static void serve(struct mw_conn *c) {
+    struct rdma_context *ctx = c->ctx;
+    struct mw_msg *req = msg_at(ctx, RECV_OFFSET);
+    struct mw_msg *resp = msg_at(ctx, SEND_OFFSET);
+
+    if (post_recv(ctx)) {
+        return;
+    }
+    for (;;) {
+        struct mw_msg m;
+
+        if (expect(ctx, WR_RECV)) {
+            return;
+        }
+        m = *req;
+        if (m.type == MSG_BYE || post_recv(ctx)) {
+            return;
+        }
+        memset(resp, 0, sizeof(*resp));
+        if (m.type == MSG_REQUEST) {
+            grant(c, &m, resp);
+        } else if (m.type == MSG_DONE) {
+            if (revoke(c, &m, resp)) {
+                return;
+            }
+        } else {
+            fprintf(stderr, "Unexpected message type %u\n", m.type);
+            return;
+        }
+        if (post_msg(ctx) || expect(ctx, WR_SEND)) {
+            return;
+        }
+    }
+}
+
+static int run_server(int total) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = CTRL_SIZE + DATA_SIZE,
+        .cq_depth = CQ_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_MW_BIND,
+        .quiet = 1,
+    };
+    struct rdma_context listener;
+    struct rdma_cm_event *event;
+    int served = 0, failed = 0;
+
+    memset(&listener, 0, sizeof(listener));
+    if (listen_rdma_connections(&listener, NULL, PORT)) {
+        close_rdma_connection(&listener);
+        return -1;
+    }
+    printf("Waiting for %d connections on port %d\n", total, PORT);
+
+    // One client at a time
+    while (served < total) {
+        struct rdma_context ctx;
+        struct mw_conn c;
+
+        if (rdma_get_cm_event(listener.cm_channel, &event)) {
+            fprintf(stderr, "Failed to get CM event\n");
+            break;
+        }
+        if (event->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
+            rdma_ack_cm_event(event);
+            continue;
+        }
+        memset(&ctx, 0, sizeof(ctx));
+        memset(&c, 0, sizeof(c));
+        c.ctx = &ctx;
+        served++;
+        if (accept_connect_request(&ctx, event, &attr, NULL)) {
+            rdma_ack_cm_event(event);
+            close_rdma_connection(&ctx);
+            failed++;
+            continue;
+        }
+        rdma_ack_cm_event(event);
+
+        c.static_mr = ibv_reg_mr(ctx.pd, ctx.buffer + CTRL_SIZE, DATA_SIZE,
+                                 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+        if (!c.static_mr) {
+            fprintf(stderr, "Failed to register the static grant region\n");
+        }
+        if (rdma_mw_supported(ctx.context)) {
+            c.mw = ibv_alloc_mw(ctx.pd, IBV_MW_TYPE_2);
+            if (!c.mw) {
+                fprintf(stderr, "Failed to allocate a memory window\n");
+            }
+        } else {
+            fprintf(stderr, "%s has no type 2 memory windows, refusing mw grants\n",
+                    ibv_get_device_name(ctx.context->device));
+        }
+        if (c.static_mr) {
+            serve(&c);
+        } else {
+            failed++;
+        }
+
+        // The client hangs up, also after its revocation check failed its QP
+        while (!rdma_get_cm_event(listener.cm_channel, &event)) {
+            enum rdma_cm_event_type type = event->event;
+
+            rdma_ack_cm_event(event);
+            if (type == RDMA_CM_EVENT_DISCONNECTED || type == RDMA_CM_EVENT_CONNECT_ERROR ||
+                type == RDMA_CM_EVENT_UNREACHABLE || type == RDMA_CM_EVENT_REJECTED) {
+                break;
+            }
+        }
+        if (c.req_mr) {
+            ibv_dereg_mr(c.req_mr);
+        }
+        if (c.mw) {
+            ibv_dealloc_mw(c.mw);
+        }
+        if (c.static_mr) {
+            ibv_dereg_mr(c.static_mr);
+        }
+        close_rdma_connection(&ctx);
+    }
+
+    printf("Served %d connections\n", served);
+    close_rdma_connection(&listener);
+    return served == total && !failed ? 0 : -1;
+}
+
+static int post_write(struct rdma_context *ctx, const struct mw_msg *g) {
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+
+    sge.addr = (uintptr_t)ctx->buffer + CTRL_SIZE;
+    sge.length = g->length;
+    sge.lkey = ctx->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = WR_WRITE;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = g->addr;
+    wr.wr.rdma.rkey = g->rkey;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post write\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Send the message in the send slot and wait for the answer; NULL on failure
+static struct mw_msg *exchange(struct rdma_context *ctx) {
+    if (post_recv(ctx) || post_msg(ctx) || expect(ctx, WR_SEND) || expect(ctx, WR_RECV)) {
+        return NULL;
+    }
+    return msg_at(ctx, RECV_OFFSET);
+}
+
+// One request: grant, write, done. The grant in *g, the server's costs in
+// *ack
+static int request(struct rdma_context *ctx, enum grant_mode mode, uint32_t bytes,
+                   struct mw_msg *g, struct mw_msg *ack) {
+    struct mw_msg *send = msg_at(ctx, SEND_OFFSET), *resp;
+
+    memset(send, 0, sizeof(*send));
+    send->type = MSG_REQUEST;
+    send->mode = mode;
+    send->length = bytes;
+    if (!(resp = exchange(ctx))) {
+        return -1;
+    }
+    *g = *resp;
+    if (g->type != MSG_GRANT || g->status != GRANT_OK) {
+        return -1;
+    }
+
+    if (post_write(ctx, g) || expect(ctx, WR_WRITE)) {
+        return -1;
+    }
+
+    memset(send, 0, sizeof(*send));
+    send->type = MSG_DONE;
+    send->mode = mode;
+    if (!(resp = exchange(ctx))) {
+        return -1;
+    }
+    *ack = *resp;
+    return ack->type == MSG_ACK ? 0 : -1;
+}
+
+static int run_case(struct rdma_context *ctx, enum grant_mode mode, uint32_t bytes, int requests,
+                    uint64_t *lat, struct mw_result *r) {
+    struct mw_msg g, ack;
+    uint64_t grant_ns = 0, revoke_ns = 0, start = rdma_now_ns();
+    double sum = 0;
+
+    memset(r, 0, sizeof(*r));
+    memset(&g, 0, sizeof(g));
+    for (int i = 0; i < requests; i++) {
+        uint64_t t = rdma_now_ns();
+
+        if (request(ctx, mode, bytes, &g, &ack)) {
+            r->unsupported = g.type == MSG_GRANT && g.status == GRANT_UNSUPPORTED;
+            return -1;
+        }
+        lat[i] = rdma_now_ns() - t;
+        sum += lat[i];
+        grant_ns += ack.grant_ns;
+        revoke_ns += ack.revoke_ns;
+    }
+    r->rate = requests / ((rdma_now_ns() - start) / 1e9);
+    qsort(lat, requests, sizeof(*lat), rdma_cmp_u64);
+    r->mean_us = sum / requests / 1e3;
+    r->p99_us = lat[(size_t)requests * 99 / 100] / 1e3;
+    r->grant_us = grant_ns / (double)requests / 1e3;
+    r->revoke_us = revoke_ns / (double)requests / 1e3;
+    return 0;
+}
+
+static int send_bye(struct rdma_context *ctx) {
+    memset(msg_at(ctx, SEND_OFFSET), 0, sizeof(struct mw_msg));
+    msg_at(ctx, SEND_OFFSET)->type = MSG_BYE;
+    return post_msg(ctx) || expect(ctx, WR_SEND) ? -1 : 0;
+}
+
+// Write through a window after its revocation; 0 when the server refuses.
+// Either way the connection is done
+static int check_revoked(struct rdma_context *ctx, uint32_t bytes) {
+    struct mw_msg g, ack;
+    struct ibv_wc wc;
+
+    if (request(ctx, GRANT_MW, bytes, &g, &ack)) {
+        return -1;
+    }
+    if (send_bye(ctx) || post_write(ctx, &g) ||
+        wait_for(ctx, WR_WRITE, &wc)) {
+        return -1;
+    }
+    if (wc.status == IBV_WC_SUCCESS) {
+        printf("Revoked rkey 0x%x: write went through\n", g.rkey);
+        return -1;
+    }
+    printf("Revoked rkey 0x%x: write refused (%s)\n", g.rkey, ibv_wc_status_str(wc.status));
+    return wc.status == IBV_WC_REM_ACCESS_ERR ? 0 : -1;
+}
+
+static int run_client(const char *server_ip, const uint32_t *sizes, int nsizes, int requests,
+                      unsigned modes) {
+    uint32_t max_bytes = 0;
+    struct rdma_resource_attr attr = {
+        .cq_depth = CQ_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .fill_pattern = 1,
+        .quiet = 1,
+    };
+    struct rdma_context ctx;
+    uint64_t *lat = malloc(requests * sizeof(*lat));
+    int mw_ok = 0, ret = 0;
+
+    for (int i = 0; i < nsizes; i++) {
+        max_bytes = sizes[i] > max_bytes ? sizes[i] : max_bytes;
+    }
+    attr.buffer_size = CTRL_SIZE + max_bytes;
+    memset(&ctx, 0, sizeof(ctx));
+    if (!lat) {
+        fprintf(stderr, "Failed to allocate %d latencies\n", requests);
+        return -1;
+    }
+    if (connect_to_server(&ctx, server_ip, PORT, &attr)) {
+        free(lat);
+        return -1;
+    }
+
+    printf("%d requests per case\n", requests);
+    printf("%-7s %8s %10s %9s %9s %9s %10s\n", "mode", "bytes", "req/s", "mean us", "p99 us",
+           "grant us", "revoke us");
+    for (int s = 0; s < nsizes; s++) {
+        for (int m = 0; m < GRANT_MODE_COUNT; m++) {
+            struct mw_result r;
+
+            if (!(modes & (1U << m))) {
+                continue;
+            }
+            if (run_case(&ctx, m, sizes[s], requests, lat, &r)) {
+                if (r.unsupported) {
+                    printf("%-7s %8u unsupported by the server's device\n", grant_mode_names[m],
+                           sizes[s]);
+                    modes &= ~(1U << m);
+                    continue;
+                }
+                printf("%-7s %8u failed\n", grant_mode_names[m], sizes[s]);
+                send_bye(&ctx);
+                ret = -1;
+                goto close;
+            }
+            mw_ok |= m == GRANT_MW;
+            printf("%-7s %8u %10.0f %9.2f %9.2f %9.2f %10.2f\n", grant_mode_names[m], sizes[s],
+                   r.rate, r.mean_us, r.p99_us, r.grant_us, r.revoke_us);
+        }
+    }
+
+    ret = mw_ok ? check_revoked(&ctx, sizes[0]) : send_bye(&ctx);
+
+close:
+    close_rdma_connection(&ctx);
+    free(lat);
+    return ret;
+}
+
+// Comma list of sizes, each 1..SLOT_SIZE; how many, or -1
+static int parse_sizes(char *list, uint32_t *sizes) {
+    int n = 0;
+
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        long v = atol(tok);
+
+        if (n == MAX_SIZES || v < 1 || v > SLOT_SIZE) {
+            return -1;
+        }
+        sizes[n++] = v;
+    }
+    return n ? n : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -s [-n conns]\n", prog);
+    fprintf(stderr, "       %s [-b bytes,...] [-k requests] [-m mode,...] <server_ip>\n", prog);
+    fprintf(stderr, "  -s  Run the server; it exits after conns connections (default 1)\n");
+    fprintf(stderr, "  -b  Bytes per request, at most %d each (default %s)\n", SLOT_SIZE,
+            DEFAULT_SIZES);
+    fprintf(stderr, "  -k  Requests per mode and size (default %d)\n", DEFAULT_REQUESTS);
+    fprintf(stderr, "  -m  Grant modes: static, mw, reg (default all)\n");
+}
+
+int main(int argc, char *argv[]) {
+    char default_sizes[] = DEFAULT_SIZES;
+    uint32_t sizes[MAX_SIZES];
+    int nsizes = parse_sizes(default_sizes, sizes);
+    int requests = DEFAULT_REQUESTS;
+    unsigned modes = (1U << GRANT_MODE_COUNT) - 1;
+    int server = 0;
+    int server_conns = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sn:b:k:m:h")) != -1) {
+        switch (opt) {
+        case 's':
+            server = 1;
+            break;
+        case 'n':
+            server_conns = atoi(optarg);
+            break;
+        case 'b':
+            nsizes = parse_sizes(optarg, sizes);
+            if (nsizes < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'k':
+            requests = atoi(optarg);
+            break;
+        case 'm':
+            if (rdma_parse_names(optarg, grant_mode_names, GRANT_MODE_COUNT, &modes)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (server_conns < 1 || requests < 1 || (!server && optind >= argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (server) {
+        return run_server(server_conns) ? 1 : 0;
+    }
+    return run_client(argv[optind], sizes, nsizes, requests, modes) ? 1 : 0;
+}
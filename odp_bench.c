@@ -0,0 +1,420 @@
+/*
+ * On-demand paging benchmark: pinned against ODP registration of a large,
+ * sparsely used buffer
+ *
+ * For each registration mode (rdma_mr_mode) and access pattern the client
+ * connects to odp_bench -s with a fresh -S GB buffer registered that way,
+ * and RDMA READs -b byte chunks of the server's buffer into -k chunks of
+ * its own, picked by the pattern:
+ *
+ *   dense   consecutive chunks from the start of the buffer
+ *   stride  evenly spread over the whole buffer
+ *   random  uniformly at random over the whole buffer
+ *   hot     nine in ten within the first 64th of the buffer, the rest anywhere
+ *
+ * and reports:
+ *
+ *   setup ms   mapping and registering the buffer (pinned: allocating,
+ *              zeroing and pinning all of it)
+ *   pin MB     locked memory after registration (VmPin)
+ *   cold us    mean and p99 read latency on the first pass over the chunks,
+ *              one read at a time; with ODP, each new page is a fault the
+ *              device has to have resolved
+ *   warm us    the same on the second pass, every page resident
+ *   Gbit/s     steady state: -w reads in flight over the chunks for -t s
+ *   RSS MB     resident at the end, which for ODP is what the pattern touched
+ *
+ * With -p the chunks are prefetched (rdma_mr_prefetch()) before the cold
+ * pass and the prefetch time is added to setup. A mode the device lacks
+ * falls back (see rdma_common.h) and shows as "wanted>got".
+ *
+ * Usage: odp_bench -s [-n conns]
+ *        odp_bench [-S gb] [-b bytes] [-k chunks] [-w window] [-t seconds]
+ *                  [-m mode,...] [-a pattern,...] [-p] <server_ip>
+ * The server exits after conns connections, one per mode and pattern:
+ * 12 by default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_common.h"
+#include "rdma_connection.h"
+
+#define PORT 18519
+#define SERVER_BUFFER_SIZE (1024 * 1024)    // the largest read the client may do
+#define MAX_WINDOW 64
+#define QP_DEPTH MAX_WINDOW
+#define CQ_DEPTH MAX_WINDOW
+#define DEFAULT_GB 4.0
+#define DEFAULT_BYTES (64 * 1024)
+#define DEFAULT_CHUNKS 4096
+#define DEFAULT_WINDOW 16
+#define HOT_SHARE 90                        // percent of hot accesses...
+#define HOT_FRACTION 64                     // ...to this fraction of the buffer
+
+enum pattern {
+    PATTERN_DENSE,
+    PATTERN_STRIDE,
+    PATTERN_RANDOM,
+    PATTERN_HOT,
+    PATTERN_COUNT,
+};
+
+static const char *const pattern_names[PATTERN_COUNT] = {"dense", "stride", "random", "hot"};
+
+struct odp_opts {
+    size_t size;
+    uint32_t bytes;
+    int chunks;
+    int window;
+    double seconds;
+    int prefetch;
+};
+
+struct odp_result {
+    enum rdma_mr_mode mode;         // what the buffer got
+    double setup_ms;
+    double pin_mb;
+    double cold_us, cold_p99_us;
+    double warm_us, warm_p99_us;
+    double gbps;
+    double rss_mb;
+};
+
+// A "Vm...:" line of /proc/self/status, in MB
+static double status_mb(const char *key) {
+    FILE *f = fopen("/proc/self/status", "r");
+    size_t len = strlen(key);
+    char line[256];
+    double mb = 0;
+
+    if (!f) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, key, len) && line[len] == ':') {
+            mb = strtoul(line + len + 1, NULL, 10) / 1024.0;
+            break;
+        }
+    }
+    fclose(f);
+    return mb;
+}
+
+static int run_server(int total) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = SERVER_BUFFER_SIZE,
+        .cq_depth = 2,
+        .qp_depth = 1,
+        .fill_pattern = 1,
+        .quiet = 1,
+    };
+    int64_t served;
+
+    printf("Waiting for %d connections on port %d\n", total, PORT);
+    served = serve_connections(NULL, PORT, &attr, total, NULL);
+    if (served < 0) {
+        return -1;
+    }
+    printf("Served %ld connections\n", served);
+    return served == total ? 0 : -1;
+}
+
+// Chunk indices (of bytes each) into the buffer for pattern
+static void pick_chunks(enum pattern pattern, const struct odp_opts *o, uint64_t *chunk) {
+    uint64_t nchunks = o->size / o->bytes;
+    uint64_t hot = nchunks / HOT_FRACTION ? nchunks / HOT_FRACTION : 1;
+
+    for (int i = 0; i < o->chunks; i++) {
+        switch (pattern) {
+        case PATTERN_DENSE:
+            chunk[i] = i;
+            break;
+        case PATTERN_STRIDE:
+            chunk[i] = i * (nchunks / o->chunks);
+            break;
+        case PATTERN_RANDOM:
+            chunk[i] = ((uint64_t)rand() << 31 | rand()) % nchunks;
+            break;
+        default:
+            chunk[i] = ((uint64_t)rand() << 31 | rand()) % (rand() % 100 < HOT_SHARE ? hot : nchunks);
+            break;
+        }
+    }
+}
+
+static int post_read(struct rdma_context *ctx, const struct odp_opts *o, uint64_t chunk,
+                     uint64_t wr_id) {
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+
+    sge.addr = (uintptr_t)ctx->buffer + chunk * o->bytes;
+    sge.length = o->bytes;
+    sge.lkey = ctx->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = wr_id;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = ctx->remote_addr;
+    wr.wr.rdma.rkey = ctx->remote_rkey;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post read\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Up to n completions, waiting for at least one; how many, or -1
+static int wait_completions(struct rdma_context *ctx, struct ibv_wc *wc, int n) {
+    int got;
+
+    while ((got = ibv_poll_cq(ctx->cq, n, wc)) == 0) {
+        ;
+    }
+    if (got < 0) {
+        fprintf(stderr, "Failed to poll CQ\n");
+        return -1;
+    }
+    for (int i = 0; i < got; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+            return -1;
+        }
+    }
+    return got;
+}
+
+// One read at a time over every chunk; mean and p99 latency in us
+static int latency_pass(struct rdma_context *ctx, const struct odp_opts *o, const uint64_t *chunk,
+                        uint64_t *lat, double *mean_us, double *p99_us) {
+    struct ibv_wc wc;
+    double sum = 0;
+
+    for (int i = 0; i < o->chunks; i++) {
+        uint64_t start = rdma_now_ns();
+
+        if (post_read(ctx, o, chunk[i], i) || wait_completions(ctx, &wc, 1) < 0) {
+            return -1;
+        }
+        lat[i] = rdma_now_ns() - start;
+        sum += lat[i];
+    }
+    qsort(lat, o->chunks, sizeof(*lat), rdma_cmp_u64);
+    *mean_us = sum / o->chunks / 1e3;
+    *p99_us = lat[(size_t)o->chunks * 99 / 100] / 1e3;
+    return 0;
+}
+
+// window reads in flight, round and round the chunks, for o->seconds
+static int throughput_pass(struct rdma_context *ctx, const struct odp_opts *o, const uint64_t *chunk,
+                           double *gbps) {
+    struct ibv_wc wc[MAX_WINDOW];
+    uint64_t head = 0, tail = 0;
+    uint64_t start = rdma_now_ns(), end = start + o->seconds * 1e9, t = start;
+
+    while (t < end || tail < head) {
+        while (t < end && head - tail < (uint64_t)o->window) {
+            if (post_read(ctx, o, chunk[head % o->chunks], head)) {
+                return -1;
+            }
+            head++;
+        }
+        int n = wait_completions(ctx, wc, MAX_WINDOW);
+        if (n < 0) {
+            return -1;
+        }
+        tail += n;
+        t = rdma_now_ns();
+    }
+    *gbps = tail * (double)o->bytes * 8 / (t - start);
+    return 0;
+}
+
+static int run_case(const char *server_ip, const struct odp_opts *o, enum rdma_mr_mode mode,
+                    enum pattern pattern, struct odp_result *r) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = o->size,
+        .cq_depth = CQ_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .mr_mode = mode,
+        .quiet = 1,
+    };
+    struct rdma_setup_timing timing;
+    struct rdma_context ctx;
+    uint64_t *chunk = malloc(o->chunks * sizeof(*chunk));
+    uint64_t *lat = malloc(o->chunks * sizeof(*lat));
+    int ret = -1;
+
+    memset(r, 0, sizeof(*r));
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&timing, 0, sizeof(timing));
+    if (!chunk || !lat) {
+        fprintf(stderr, "Failed to allocate %d chunk offsets\n", o->chunks);
+        goto out;
+    }
+    pick_chunks(pattern, o, chunk);
+
+    ctx.timing = &timing;
+    if (connect_to_server(&ctx, server_ip, PORT, &attr)) {
+        goto close;
+    }
+    if (ctx.remote_length < o->bytes) {
+        fprintf(stderr, "Server buffer holds %lu bytes, reads are %u\n", ctx.remote_length, o->bytes);
+        goto close;
+    }
+    r->mode = ctx.mr_mode;
+    r->setup_ms = timing.ns[RDMA_PHASE_MR] / 1e6;
+    r->pin_mb = status_mb("VmPin");
+
+    if (o->prefetch) {
+        uint64_t start = rdma_now_ns();
+
+        for (int i = 0; i < o->chunks; i++) {
+            if (rdma_mr_prefetch(&ctx, chunk[i] * o->bytes, o->bytes, 1)) {
+                goto close;
+            }
+        }
+        r->setup_ms += (rdma_now_ns() - start) / 1e6;
+    }
+    if (latency_pass(&ctx, o, chunk, lat, &r->cold_us, &r->cold_p99_us) ||
+        latency_pass(&ctx, o, chunk, lat, &r->warm_us, &r->warm_p99_us) ||
+        throughput_pass(&ctx, o, chunk, &r->gbps)) {
+        goto close;
+    }
+    r->rss_mb = status_mb("VmRSS");
+    ret = 0;
+
+close:
+    close_rdma_connection(&ctx);
+out:
+    free(lat);
+    free(chunk);
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -s [-n conns]\n", prog);
+    fprintf(stderr, "       %s [-S gb] [-b bytes] [-k chunks] [-w window] [-t seconds]\n"
+                    "       [-m mode,...] [-a pattern,...] [-p] <server_ip>\n", prog);
+    fprintf(stderr, "  -s  Run the server; it exits after conns connections (default %d)\n",
+            RDMA_MR_MODE_COUNT * PATTERN_COUNT);
+    fprintf(stderr, "  -S  Client buffer size, GB (default %.0f)\n", DEFAULT_GB);
+    fprintf(stderr, "  -b  Bytes per read, at most %d (default %d)\n", SERVER_BUFFER_SIZE,
+            DEFAULT_BYTES);
+    fprintf(stderr, "  -k  Chunks of the buffer each pattern reads into (default %d)\n",
+            DEFAULT_CHUNKS);
+    fprintf(stderr, "  -w  Reads in flight for the throughput pass, at most %d (default %d)\n",
+            MAX_WINDOW, DEFAULT_WINDOW);
+    fprintf(stderr, "  -t  Seconds of the throughput pass (default 2)\n");
+    fprintf(stderr, "  -m  Registration modes: pinned, odp, implicit (default all)\n");
+    fprintf(stderr, "  -a  Access patterns: dense, stride, random, hot (default all)\n");
+    fprintf(stderr, "  -p  Prefetch the chunks before the first pass\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct odp_opts o = {
+        .size = DEFAULT_GB * (1UL << 30),
+        .bytes = DEFAULT_BYTES,
+        .chunks = DEFAULT_CHUNKS,
+        .window = DEFAULT_WINDOW,
+        .seconds = 2,
+    };
+    unsigned modes = (1U << RDMA_MR_MODE_COUNT) - 1;
+    unsigned patterns = (1U << PATTERN_COUNT) - 1;
+    int server = 0;
+    int server_conns = RDMA_MR_MODE_COUNT * PATTERN_COUNT;
+    int ret = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sn:S:b:k:w:t:m:a:ph")) != -1) {
+        switch (opt) {
+        case 's':
+            server = 1;
+            break;
+        case 'n':
+            server_conns = atoi(optarg);
+            break;
+        case 'S':
+            o.size = atof(optarg) * (1UL << 30);
+            break;
+        case 'b':
+            o.bytes = atoi(optarg);
+            break;
+        case 'k':
+            o.chunks = atoi(optarg);
+            break;
+        case 'w':
+            o.window = atoi(optarg);
+            break;
+        case 't':
+            o.seconds = atof(optarg);
+            break;
+        case 'm':
+            if (rdma_parse_names(optarg, rdma_mr_mode_names, RDMA_MR_MODE_COUNT, &modes)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'a':
+            if (rdma_parse_names(optarg, pattern_names, PATTERN_COUNT, &patterns)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'p':
+            o.prefetch = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (server_conns < 1 || o.bytes < 1 || o.bytes > SERVER_BUFFER_SIZE || o.chunks < 1 ||
+        o.window < 1 || o.window > MAX_WINDOW || o.seconds <= 0 ||
+        o.size / o.bytes < (size_t)o.chunks || (!server && optind >= argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (server) {
+        return run_server(server_conns) ? 1 : 0;
+    }
+
+    printf("%.1f GB buffer, %d reads of %u bytes per pass, %d in flight for %.1f s%s\n",
+           o.size / (double)(1UL << 30), o.chunks, o.bytes, o.window, o.seconds,
+           o.prefetch ? ", prefetched" : "");
+    printf("%-16s %-7s %9s %8s %8s %8s %8s %8s %8s %9s\n", "mode", "pattern", "setup ms", "pin MB",
+           "cold us", "p99", "warm us", "p99", "Gbit/s", "RSS MB");
+    for (int m = 0; m < RDMA_MR_MODE_COUNT; m++) {
+        for (int p = 0; p < PATTERN_COUNT; p++) {
+            struct odp_result r;
+            char mode[32];
+
+            if (!(modes & (1U << m)) || !(patterns & (1U << p))) {
+                continue;
+            }
+            if (run_case(argv[optind], &o, m, p, &r)) {
+                printf("%-16s %-7s failed\n", rdma_mr_mode_names[m], pattern_names[p]);
+                ret = 1;
+                continue;
+            }
+            if (r.mode == (enum rdma_mr_mode)m) {
+                snprintf(mode, sizeof(mode), "%s", rdma_mr_mode_names[m]);
+            } else {
+                snprintf(mode, sizeof(mode), "%s>%s", rdma_mr_mode_names[m], rdma_mr_mode_names[r.mode]);
+            }
+            printf("%-16s %-7s %9.1f %8.0f %8.1f %8.1f %8.1f %8.1f %8.2f %9.0f\n", mode,
+                   pattern_names[p], r.setup_ms, r.pin_mb, r.cold_us, r.cold_p99_us, r.warm_us,
+                   r.warm_p99_us, r.gbps, r.rss_mb);
+        }
+    }
+    return ret;
+}
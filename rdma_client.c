@@ -7,26 +7,37 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <infiniband/verbs.h>
-#include <rdma/rdma_cma.h>
-#include <rdma/rdma_verbs.h>
 #include <time.h>
 #include <signal.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "rdma_common.h"
+#include "rdma_connection.h"
+#include "rdma_trace.h"
+#include "rdma_file.h"
+#include "rdma_rpc.h"
+#include "rdma_kv.h"
+#include "rdma_stripe.h"
+#include "rdma_pacer.h"
+#include "rdma_tune.h"
+#include "rdma_replay.h"
+#include "rdma_recovery.h"
 
 #define BUFFER_SIZE (1024 * 1024)  // 1MB buffer
 #define PORT 18515
-
-struct rdma_context {
-    struct ibv_context *context;
-    struct ibv_pd *pd;
-    struct ibv_cq *cq;
-    struct ibv_qp *qp;
-    struct ibv_mr *mr;
-    char *buffer;
-    struct rdma_cm_id *cm_id;
-    int connected;
-    uint64_t bytes_transferred;
-    struct timespec start_time, end_time;
-};
+#define QP_DEPTH 16                // room for the file transfer pipeline
+#define CQ_DEPTH (2 * QP_DEPTH)
+#define RPC_POINT_NS 1000000000ULL  // how long each RPC benchmark point runs
+#define RPC_MAX_SAMPLES (1 << 20)
+#define KV_RECORDS (KV_SLOTS / 2)      // half full, as loaded before each run
+#define KV_VALUE_LEN 32
+#define KV_BENCH_OPS 200000
+#define ZIPF_THETA 0.99                // YCSB's default request skew
+#define PACE_SPIN_NS 20000             // pacing waits shorter than this spin, longer ones sleep
+#define PACE_TARGET_DELAY_NS 50000     // -C: latency over the baseline that counts as congestion
+#define PACE_UPDATE_NS 200000
+#define PROFILE_SECONDS 10.0           // how long -P runs a tuned profile
 
 static volatile int running = 1;
 
@@ -35,205 +46,35 @@ void signal_handler(int sig) {
     running = 0;
 }
 
-int setup_rdma_resources(struct rdma_context *ctx) {
-    struct ibv_device **dev_list;
-    int num_devices;
-    struct ibv_device *device;
-    struct ibv_qp_init_attr qp_init_attr;
-    struct ibv_port_attr port_attr;
-    
-    // Get device list
-    dev_list = ibv_get_device_list(&num_devices);
-    if (!dev_list) {
-        fprintf(stderr, "Failed to get IB device list\n");
-        return -1;
-    }
-    
-    if (num_devices == 0) {
-        fprintf(stderr, "No IB devices found\n");
-        return -1;
-    }
-    
-    // Use first available device
-    device = dev_list[0];
-    printf("Using device: %s\n", ibv_get_device_name(device));
-    
-    // Open device context
-    ctx->context = ibv_open_device(device);
-    if (!ctx->context) {
-        fprintf(stderr, "Failed to open device context\n");
-        return -1;
-    }
-    
-    // Allocate protection domain
-    ctx->pd = ibv_alloc_pd(ctx->context);
-    if (!ctx->pd) {
-        fprintf(stderr, "Failed to allocate protection domain\n");
-        return -1;
-    }
-    
-    // Query port attributes
-    if (ibv_query_port(ctx->context, 1, &port_attr)) {
-        fprintf(stderr, "Failed to query port attributes\n");
-        return -1;
-    }
-    
-    printf("Port state: %s\n", ibv_port_state_str(port_attr.state));
-    if (port_attr.state != IBV_PORT_ACTIVE) {
-        fprintf(stderr, "Port is not active\n");
-        return -1;
-    }
-    
-    // Create completion queue
-    ctx->cq = ibv_create_cq(ctx->context, 10, NULL, NULL, 0);
-    if (!ctx->cq) {
-        fprintf(stderr, "Failed to create completion queue\n");
-        return -1;
-    }
-    
-    // Allocate and register memory
-    ctx->buffer = malloc(BUFFER_SIZE);
-    if (!ctx->buffer) {
-        fprintf(stderr, "Failed to allocate buffer\n");
-        return -1;
-    }
-    
-    // Fill buffer with test data
-    for (int i = 0; i < BUFFER_SIZE; i++) {
-        ctx->buffer[i] = (char)(i % 256);
-    }
-    
-    ctx->mr = ibv_reg_mr(ctx->pd, ctx->buffer, BUFFER_SIZE, 
-                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | 
-                        IBV_ACCESS_REMOTE_READ);
-    if (!ctx->mr) {
-        fprintf(stderr, "Failed to register memory region\n");
-        return -1;
-    }
-    
-    // Create queue pair
-    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-    qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.send_cq = ctx->cq;
-    qp_init_attr.recv_cq = ctx->cq;
-    qp_init_attr.cap.max_send_wr = 10;
-    qp_init_attr.cap.max_recv_wr = 10;
-    qp_init_attr.cap.max_send_sge = 1;
-    qp_init_attr.cap.max_recv_sge = 1;
-    
-    ctx->qp = ibv_create_qp(ctx->pd, &qp_init_attr);
-    if (!ctx->qp) {
-        fprintf(stderr, "Failed to create queue pair\n");
-        return -1;
-    }
-    
-    ibv_free_device_list(dev_list);
-    return 0;
-}
+// Hold until pacer lets bytes go, or we are interrupted
+static void pace(struct rdma_pacer *pacer, uint32_t bytes) {
+    uint64_t wait;
 
-int connect_to_server(struct rdma_context *ctx, const char *server_ip) {
-    struct rdma_cm_id *cm_id;
-    struct rdma_addrinfo hints, *res;
-    struct ibv_qp_attr qp_attr;
-    int flags;
-    int ret;
-    
-    // Initialize RDMA CM
-    ret = rdma_create_id(NULL, &cm_id, NULL, RDMA_PS_TCP);
-    if (ret) {
-        fprintf(stderr, "Failed to create RDMA CM ID\n");
-        return -1;
-    }
-    
-    // Set up address info
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_port_space = RDMA_PS_TCP;
-    
-    char port_str[16];
-    snprintf(port_str, sizeof(port_str), "%d", PORT);
-    
-    ret = rdma_getaddrinfo(server_ip, port_str, &hints, &res);
-    if (ret) {
-        fprintf(stderr, "Failed to get address info\n");
-        return -1;
-    }
-    
-    // Connect to server
-    ret = rdma_connect(cm_id, res->ai_dst_addr, res->ai_dst_len);
-    if (ret) {
-        fprintf(stderr, "Failed to connect to server\n");
-        return -1;
-    }
-    
-    // Wait for connection established
-    struct rdma_cm_event *event;
-    ret = rdma_get_cm_event(cm_id->channel, &cm_id, &event);
-    if (ret) {
-        fprintf(stderr, "Failed to get CM event\n");
-        return -1;
-    }
-    
-    if (event->event != RDMA_CM_EVENT_ESTABLISHED) {
-        fprintf(stderr, "Connection not established: %d\n", event->event);
-        return -1;
-    }
-    
-    ctx->cm_id = cm_id;
-    
-    // Transition QP to RTR
-    memset(&qp_attr, 0, sizeof(qp_attr));
-    qp_attr.qp_state = IBV_QPS_RTR;
-    qp_attr.path_mtu = IBV_MTU_1024;
-    qp_attr.dest_qp_num = ctx->qp->qp_num;
-    qp_attr.rq_psn = 0;
-    qp_attr.max_dest_rd_atomic = 1;
-    qp_attr.min_rnr_timer = 12;
-    qp_attr.ah_attr.is_global = 0;
-    qp_attr.ah_attr.dlid = cm_id->route.addr.addr.ibaddr.dlid;
-    qp_attr.ah_attr.sl = 0;
-    qp_attr.ah_attr.src_path_bits = 0;
-    qp_attr.ah_attr.port_num = 1;
-    
-    flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
-            IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
-    
-    ret = ibv_modify_qp(ctx->qp, &qp_attr, flags);
-    if (ret) {
-        fprintf(stderr, "Failed to modify QP to RTR\n");
-        return -1;
-    }
-    
-    // Transition QP to RTS
-    qp_attr.qp_state = IBV_QPS_RTS;
-    qp_attr.timeout = 14;
-    qp_attr.retry_cnt = 7;
-    qp_attr.rnr_retry = 7;
-    qp_attr.sq_psn = 0;
-    qp_attr.max_rd_atomic = 1;
-    
-    flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
-            IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
-    
-    ret = ibv_modify_qp(ctx->qp, &qp_attr, flags);
-    if (ret) {
-        fprintf(stderr, "Failed to modify QP to RTS\n");
-        return -1;
+    while (running && (wait = rdma_pacer_admit(pacer, bytes, rdma_now_ns()))) {
+        if (wait > PACE_SPIN_NS) {
+            struct timespec ts = {wait / 1000000000, wait % 1000000000};
+
+            nanosleep(&ts, NULL);
+        }
     }
-    
-    ctx->connected = 1;
-    printf("Connected to RDMA server at %s:%d\n", server_ip, PORT);
-    
-    rdma_freeaddrinfo(res);
-    return 0;
 }
 
-void perform_rdma_operations(struct rdma_context *ctx) {
+// Write the buffer to the peer 1000 times, each write going through pacer
+// (and its completion latency back into it) unless pacer is NULL. With rec,
+// a failed write recovers the QP and is replayed rather than ending the run
+void perform_rdma_operations(struct rdma_context *ctx, struct rdma_pacer *pacer,
+                             struct rdma_recovery *rec) {
     struct ibv_sge sge;
     struct ibv_send_wr send_wr, *bad_wr;
     struct ibv_wc wc;
+    uint64_t posted_at = 0;
+    uint64_t poll_start, polled_at;
+    uint32_t empty_polls;
     int ret;
     int iterations = 1000;
     int i;
+    // Write our buffer into the peer's, as much of it as fits
+    uint32_t length = ctx->buffer_size < ctx->remote_length ? ctx->buffer_size : ctx->remote_length;
     
     printf("Starting RDMA operations...\n");
     clock_gettime(CLOCK_MONOTONIC, &ctx->start_time);
@@ -242,40 +83,75 @@ void perform_rdma_operations(struct rdma_context *ctx) {
         // Prepare send work request
         memset(&sge, 0, sizeof(sge));
         sge.addr = (uintptr_t)ctx->buffer;
-        sge.length = BUFFER_SIZE;
+        sge.length = length;
         sge.lkey = ctx->mr->lkey;
         
         memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.wr_id = i;
         send_wr.sg_list = &sge;
         send_wr.num_sge = 1;
         send_wr.opcode = IBV_WR_RDMA_WRITE;
         send_wr.send_flags = IBV_SEND_SIGNALED;
-        send_wr.wr.rdma.remote_addr = (uintptr_t)ctx->buffer;
-        send_wr.wr.rdma.rkey = ctx->mr->rkey;
+        send_wr.wr.rdma.remote_addr = ctx->remote_addr;
+        send_wr.wr.rdma.rkey = ctx->remote_rkey;
         
         // Post send
-        ret = ibv_post_send(ctx->qp, &send_wr, &bad_wr);
+        if (pacer) {
+            pace(pacer, length);
+            posted_at = rdma_now_ns();
+        }
+        rdma_trace_post(send_wr.wr_id, send_wr.opcode, length);
+        if (rec) {
+            rdma_recovery_inject(rec, rdma_now_ns());
+            ret = rdma_recovery_post(rec, &send_wr);
+        } else {
+            ret = ibv_post_send(ctx->qp, &send_wr, &bad_wr);
+        }
         if (ret) {
             fprintf(stderr, "Failed to post send: %d\n", ret);
             break;
         }
         
-        // Wait for completion
-        do {
-            ret = ibv_poll_cq(ctx->cq, 1, &wc);
-        } while (ret == 0 && running);
+        // Wait for completion, or for the replayed write's after a recovery
+        for (;;) {
+            poll_start = rdma_trace_poll_begin();
+            empty_polls = 0;
+            while ((ret = ibv_poll_cq(ctx->cq, 1, &wc)) == 0 && running) {
+                empty_polls++;
+            }
+            polled_at = rdma_trace_poll_end(poll_start, ret, empty_polls);
+            if (ret <= 0) {
+                break;
+            }
+            rdma_trace_completion(&wc, polled_at);
+            if (!rec || rdma_recovery_complete(rec, &wc) >= 0) {
+                break;
+            }
+            fprintf(stderr, "Work completion error: %s, recovering\n",
+                    ibv_wc_status_str(wc.status));
+            if (rdma_recovery_recover(rec, &running)) {
+                break;
+            }
+        }
         
         if (ret < 0) {
             fprintf(stderr, "Failed to poll CQ\n");
             break;
         }
-        
+        if (ret == 0) {
+            break;  // interrupted while waiting
+        }
         if (wc.status != IBV_WC_SUCCESS) {
             fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc.status));
             break;
         }
+        if (pacer) {
+            uint64_t t = rdma_now_ns();
+
+            rdma_pacer_complete(pacer, t - posted_at, t);
+        }
         
-        ctx->bytes_transferred += BUFFER_SIZE;
+        ctx->bytes_transferred += length;
         
         if (i % 100 == 0) {
             printf("Completed %d operations, %lu bytes transferred\n", 
@@ -284,82 +160,692 @@ void perform_rdma_operations(struct rdma_context *ctx) {
     }
     
     clock_gettime(CLOCK_MONOTONIC, &ctx->end_time);
-    
-    // Calculate throughput
-    double elapsed = (ctx->end_time.tv_sec - ctx->start_time.tv_sec) + 
-                     (ctx->end_time.tv_nsec - ctx->start_time.tv_nsec) / 1e9;
-    double throughput_mbps = (ctx->bytes_transferred * 8.0) / (elapsed * 1e6);
-    
-    printf("\n=== RDMA Performance Results ===\n");
-    printf("Operations completed: %d\n", i);
-    printf("Total bytes transferred: %lu\n", ctx->bytes_transferred);
-    printf("Elapsed time: %.3f seconds\n", elapsed);
-    printf("Throughput: %.2f Mbps\n", throughput_mbps);
-    printf("Throughput: %.2f MB/s\n", ctx->bytes_transferred / (elapsed * 1e6));
+    report_rdma_results(ctx, i);
+    if (pacer) {
+        printf("Paced at %.2f Gbit/s on average, %lu rate cuts\n",
+               rdma_pacer_mean_rate(pacer) * 8 / 1e9, pacer->cuts);
+    }
+    if (rec) {
+        rdma_recovery_report(rec);
+    }
 }
 
-void cleanup_rdma_resources(struct rdma_context *ctx) {
-    if (ctx->qp) {
-        ibv_destroy_qp(ctx->qp);
+// Keep `concurrency` calls in flight for RPC_POINT_NS, then print RPCs/s and
+// latency percentiles. Calls finished in one poll are replaced by one flush,
+// so batches grow with concurrency
+static int rpc_point(struct rpc_client *cli, uint16_t method, enum rpc_resp_mode mode,
+                     const char *payload, uint32_t len, int concurrency, uint64_t *lat) {
+    struct rpc_completion done[RPC_BATCH];
+    uint64_t start = rdma_now_ns(), end = start + RPC_POINT_NS, t = start;
+    long calls = 0;
+    int k;
+
+    while (running) {
+        while (t < end && rpc_client_outstanding(cli) < concurrency) {
+            if (rpc_call_start(cli, method, mode, payload, len, t) < 0) {
+                return -1;
+            }
+        }
+        if (rpc_client_flush(cli)) {
+            return -1;
+        }
+        if (rpc_client_outstanding(cli) == 0) {
+            break;
+        }
+        k = rpc_client_poll(cli, done, RPC_BATCH);
+        if (k < 0) {
+            return -1;
+        }
+        t = rdma_now_ns();
+        for (int i = 0; i < k; i++) {
+            if (done[i].status != RPC_OK ||
+                (method == RPC_METHOD_ECHO && (done[i].resp_len != len ||
+                                               memcmp(done[i].resp, payload, len)))) {
+                fprintf(stderr, "RPC failed with status %d\n", done[i].status);
+                return -1;
+            }
+            if (calls < RPC_MAX_SAMPLES) {
+                lat[calls] = t - done[i].cookie;
+            }
+            calls++;
+        }
+    }
+    if (calls == 0) {
+        return 0;
+    }
+
+    long samples = calls < RPC_MAX_SAMPLES ? calls : RPC_MAX_SAMPLES;
+    qsort(lat, samples, sizeof(*lat), rdma_cmp_u64);
+    printf("%-8s %-5s %4d %12.0f %9.2f %9.2f %9.2f\n",
+           method == RPC_METHOD_ECHO ? "echo" : "compute", mode == RPC_RESP_IMM ? "imm" : "flag",
+           concurrency, calls / ((t - start) / 1e9), lat[samples / 2] / 1e3,
+           lat[samples * 99 / 100] / 1e3, lat[samples * 999 / 1000] / 1e3);
+    return 0;
+}
+
+// Tell the server we are done; it stops serving once this is answered
+static int rpc_say_bye(struct rpc_client *cli) {
+    struct rpc_completion bye;
+
+    if (rpc_call_start(cli, RPC_METHOD_BYE, RPC_RESP_IMM, NULL, 0, 0) < 0 ||
+        rpc_client_flush(cli)) {
+        return -1;
     }
-    if (ctx->mr) {
-        ibv_dereg_mr(ctx->mr);
+    while (running && rpc_client_outstanding(cli)) {
+        if (rpc_client_poll(cli, &bye, 1) < 0) {
+            return -1;
+        }
     }
-    if (ctx->cq) {
-        ibv_destroy_cq(ctx->cq);
+    return 0;
+}
+
+// Sweep concurrency for echo (64 B) and compute (1 KB) in both response
+// modes, then tell the server we are done
+int run_rpc_benchmark(struct rdma_context *ctx) {
+    static const struct {
+        uint16_t method;
+        uint32_t len;
+    } workloads[] = {
+        {RPC_METHOD_ECHO, 64},
+        {RPC_METHOD_COMPUTE, 1024},
+    };
+    struct rpc_client *cli;
+    char payload[1024];
+    uint64_t *lat;
+    int ret = -1;
+
+    lat = malloc(RPC_MAX_SAMPLES * sizeof(*lat));
+    cli = rpc_client_create(ctx);
+    if (!lat || !cli) {
+        fprintf(stderr, "Failed to set up RPC benchmark\n");
+        goto out;
     }
-    if (ctx->pd) {
-        ibv_dealloc_pd(ctx->pd);
+    for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = (char)(i * 7);
     }
-    if (ctx->context) {
-        ibv_close_device(ctx->context);
+
+    printf("%-8s %-5s %4s %12s %9s %9s %9s\n", "method", "resp", "conc", "RPCs/s",
+           "p50 us", "p99 us", "p99.9 us");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        for (int mode = RPC_RESP_IMM; mode <= RPC_RESP_FLAG; mode++) {
+            for (int c = 1; c <= RPC_SLOTS && running; c *= 2) {
+                if (rpc_point(cli, workloads[w].method, mode, payload, workloads[w].len, c, lat)) {
+                    goto out;
+                }
+            }
+        }
     }
-    if (ctx->buffer) {
-        free(ctx->buffer);
+
+    ret = rpc_say_bye(cli);
+out:
+    if (cli) {
+        rpc_client_destroy(cli);
     }
-    if (ctx->cm_id) {
-        rdma_destroy_id(ctx->cm_id);
+    free(lat);
+    return ret;
+}
+
+// YCSB's Zipfian generator (Gray et al., "Quickly Generating Billion-Record
+// Synthetic Databases"): rank 0 is the hottest of n items
+struct zipf {
+    uint64_t n;
+    double theta, alpha, zetan, eta;
+};
+
+static void zipf_init(struct zipf *z, uint64_t n, double theta) {
+    double zeta2 = 1.0 + pow(0.5, theta);
+
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1.0 / (1.0 - theta);
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+        z->zetan += 1.0 / pow((double)i, theta);
     }
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(const struct zipf *z, double u) {
+    double uz = u * z->zetan;
+    uint64_t rank;
+
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    rank = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+// xorshift64*, uniform in [0, 1)
+static double rand_unit(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+}
+
+// Values start with their key, so every GET can be checked
+static void kv_value(char *value, uint64_t key, uint64_t version) {
+    memset(value, (int)(key & 0xff), KV_VALUE_LEN);
+    memcpy(value, &key, sizeof(key));
+    memcpy(value + sizeof(key), &version, sizeof(version));
+}
+
+static double percentile_us(uint64_t *lat, long n, int permille) {
+    if (n == 0) {
+        return 0;
+    }
+    return lat[n * permille / 1000] / 1e3;
+}
+
+// One YCSB-style run: KV_BENCH_OPS operations on Zipfian keys, read_pct of
+// them GETs (one-sided READs) and the rest PUTs (RPCs)
+static int kv_workload(struct kv_client *kv, const char *name, int read_pct,
+                       const struct zipf *z, uint64_t *get_lat, uint64_t *put_lat) {
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    uint64_t retries = kv_client_retries(kv);
+    uint64_t start, t, elapsed;
+    long gets = 0, puts = 0;
+    char value[KV_VALUE_MAX];
+    uint32_t len;
+
+    start = rdma_now_ns();
+    for (long i = 0; i < KV_BENCH_OPS && running; i++) {
+        uint64_t key = 1 + zipf_next(z, rand_unit(&rng));
+
+        t = rdma_now_ns();
+        if (rand_unit(&rng) * 100 < read_pct) {
+            if (kv_get(kv, key, value, &len) != 1 || len != KV_VALUE_LEN ||
+                memcmp(value, &key, sizeof(key))) {
+                fprintf(stderr, "KV get of key %lu returned a wrong value\n", key);
+                return -1;
+            }
+            get_lat[gets++] = rdma_now_ns() - t;
+        } else {
+            kv_value(value, key, i);
+            if (kv_put(kv, key, value, KV_VALUE_LEN)) {
+                return -1;
+            }
+            put_lat[puts++] = rdma_now_ns() - t;
+        }
+    }
+    elapsed = rdma_now_ns() - start;
+
+    qsort(get_lat, gets, sizeof(*get_lat), rdma_cmp_u64);
+    qsort(put_lat, puts, sizeof(*put_lat), rdma_cmp_u64);
+    printf("%-14s %10.0f %8.2f %8.2f %8.2f %8.2f %8lu\n", name, (gets + puts) / (elapsed / 1e9),
+           percentile_us(get_lat, gets, 500), percentile_us(get_lat, gets, 990),
+           percentile_us(put_lat, puts, 500), percentile_us(put_lat, puts, 990),
+           kv_client_retries(kv) - retries);
+    return 0;
+}
+
+// Load KV_RECORDS keys, then run YCSB workloads C, B and A against them
+int run_kv_benchmark(struct rdma_context *ctx) {
+    static const struct {
+        const char *name;
+        int read_pct;
+    } workloads[] = {
+        {"C (100% get)", 100},
+        {"B (95% get)", 95},
+        {"A (50% get)", 50},
+    };
+    struct rpc_client *cli = NULL;
+    struct kv_client *kv = NULL;
+    uint64_t *get_lat, *put_lat;
+    struct zipf z;
+    char value[KV_VALUE_LEN];
+    uint64_t start;
+    int ret = -1;
+
+    get_lat = malloc(KV_BENCH_OPS * sizeof(*get_lat));
+    put_lat = malloc(KV_BENCH_OPS * sizeof(*put_lat));
+    cli = rpc_client_create(ctx);
+    if (cli) {
+        kv = kv_client_create(ctx, cli);
+    }
+    if (!get_lat || !put_lat || !kv) {
+        fprintf(stderr, "Failed to set up KV benchmark\n");
+        goto out;
+    }
+
+    start = rdma_now_ns();
+    for (uint64_t key = 1; key <= KV_RECORDS && running; key++) {
+        kv_value(value, key, 0);
+        if (kv_put(kv, key, value, sizeof(value))) {
+            goto out;
+        }
+    }
+    printf("Loaded %d records in %.3f s\n", KV_RECORDS, (rdma_now_ns() - start) / 1e9);
+
+    zipf_init(&z, KV_RECORDS, ZIPF_THETA);
+    printf("%-14s %10s %8s %8s %8s %8s %8s\n", "workload", "ops/s", "get p50", "get p99",
+           "put p50", "put p99", "retries");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]) && running; w++) {
+        if (kv_workload(kv, workloads[w].name, workloads[w].read_pct, &z, get_lat, put_lat)) {
+            goto out;
+        }
+    }
+    printf("(latencies in us)\n");
+
+    ret = rpc_say_bye(cli);
+out:
+    kv_client_destroy(kv);
+    if (cli) {
+        rpc_client_destroy(cli);
+    }
+    free(get_lat);
+    free(put_lat);
+    return ret;
+}
+
+// Split a comma-separated list in place into at most max entries
+static int split_list(char *list, char **out, int max) {
+    int n = 0;
+
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        if (n == max) {
+            fprintf(stderr, "More than %d entries in list\n", max);
+            return -1;
+        }
+        out[n++] = tok;
+    }
+    return n;
+}
+
+// Write the stripe region STRIPE_PASSES times over one connection per
+// device in devices, to the server addresses in servers in turn
+int run_stripe(char *devices, char *servers) {
+    struct rdma_device_sel sels[STRIPE_MAX_LANES];
+    char *names[STRIPE_MAX_LANES], *ips[STRIPE_MAX_LANES];
+    struct rdma_stripe stripe;
+    struct rdma_stripe_stats stats;
+    int nlanes, nservers;
+    int ret;
+
+    nlanes = split_list(devices, names, STRIPE_MAX_LANES);
+    nservers = split_list(servers, ips, STRIPE_MAX_LANES);
+    if (nlanes <= 0 || nservers <= 0) {
+        return -1;
+    }
+    for (int i = 0; i < nlanes; i++) {
+        if (rdma_parse_device_sel(names[i], &sels[i])) {
+            return -1;
+        }
+    }
+
+    ret = rdma_stripe_connect(&stripe, sels, nlanes, (const char *const *)ips, nservers, PORT);
+    if (ret == 0) {
+        ret = rdma_stripe_write(&stripe, STRIPE_PASSES, &running, &stats);
+    }
+    if (ret == 0) {
+        rdma_stripe_report(&stripe, &stats);
+    }
+    rdma_stripe_close(&stripe);
+    return ret;
+}
+
+// Search for the fastest write configuration against rdma_server -A and
+// save it to profile_path
+int run_autotune(const char *server_ip, const struct rdma_tune_space *space,
+                 enum rdma_tune_goal goal, const char *profile_path) {
+    struct rdma_tune_config best;
+    struct rdma_tune_result r;
+
+    printf("Auto-tuning writes to %s:%d for %s\n", server_ip, PORT,
+           goal == TUNE_GOAL_OPS ? "writes/s" : "bandwidth");
+    if (rdma_tune_search(server_ip, PORT, space, goal, &running, &best, &r)) {
+        return -1;
+    }
+    printf("Best: %.2f Gbit/s, %.3f Mwrites/s with ", r.gbps, r.mops);
+    rdma_tune_print(&best);
+    if (rdma_tune_profile_save(profile_path, &best, &r, goal)) {
+        return -1;
+    }
+    printf("Profile written to %s\n", profile_path);
+    return 0;
+}
+
+// Run the configuration tuned into profile_path for PROFILE_SECONDS
+int run_profile(const char *server_ip, const char *profile_path) {
+    struct rdma_tune_config cfg;
+    struct rdma_tune_result r;
+
+    if (rdma_tune_profile_load(profile_path, &cfg)) {
+        return -1;
+    }
+    printf("Running %s against %s:%d: ", profile_path, server_ip, PORT);
+    rdma_tune_print(&cfg);
+    if (rdma_tune_trial(server_ip, PORT, &cfg, PROFILE_SECONDS, &running, &r)) {
+        return -1;
+    }
+    printf("%.2f Gbit/s, %.3f Mwrites/s over %.1f s\n", r.gbps, r.mops, r.seconds);
+    return 0;
+}
+
+// Compile the capture (or read the schedule) at replay_path; save it to
+// schedule_path, or replay it against rdma_server -A
+int run_replay(const char *server_ip, const char *replay_path, const char *schedule_path,
+               const struct rdma_replay_opts *opts) {
+    struct rdma_replay_schedule *s = malloc(sizeof(*s));
+    int ret = -1;
+
+    if (!s) {
+        fprintf(stderr, "Failed to allocate a replay schedule\n");
+        return -1;
+    }
+    if (rdma_replay_read(replay_path, s)) {
+        goto out;
+    }
+    printf("Workload of %s: ", replay_path);
+    rdma_replay_print(s);
+    if (schedule_path) {
+        if (rdma_replay_save(schedule_path, s, replay_path) == 0) {
+            printf("Schedule written to %s\n", schedule_path);
+            ret = 0;
+        }
+        goto out;
+    }
+    ret = rdma_replay_run(server_ip, PORT, s, opts, &running);
+
+out:
+    free(s);
+    return ret;
 }
 
 int main(int argc, char *argv[]) {
     struct rdma_context ctx = {0};
+    struct rdma_resource_attr attr = {
+        .buffer_size = BUFFER_SIZE,
+        .cq_depth = CQ_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .fill_pattern = 1,
+    };
     int ret;
     const char *server_ip = "127.0.0.1";
-    
-    if (argc > 1) {
-        server_ip = argv[1];
+    const char *trace_path = NULL;
+    const char *file_path = NULL;
+    enum file_source source = FILE_SOURCE_MMAP;
+    enum compress_codec codec = COMPRESS_NONE;
+    int adaptive = 0;
+    struct file_xfer_stats file_stats;
+    struct rdma_device_sel device;
+    struct sockaddr_storage local;
+    int use_device = 0;
+    char *stripe_devices = NULL;
+    struct rdma_pacer_attr pacer_attr = {
+        .target_delay_ns = PACE_TARGET_DELAY_NS,
+        .update_ns = PACE_UPDATE_NS,
+    };
+    struct rdma_pacer pacer;
+    struct rdma_tune_space space;
+    enum rdma_tune_goal goal = TUNE_GOAL_BANDWIDTH;
+    const char *tune_path = NULL;
+    const char *profile_path = NULL;
+    const char *replay_path = NULL;
+    const char *schedule_path = NULL;
+    struct rdma_replay_opts replay_opts = {0};
+    struct rdma_recovery_attr recovery_attr = {0};
+    struct rdma_recovery recovery;
+    struct rdma_fault_attr fault = {0};
+    int recover = 0;
+    int rpc = 0;
+    int kv = 0;
+    int opt;
+    
+    rdma_tune_default_space(&space);
+    while ((opt = getopt(argc, argv, "t:F:uz:RKd:S:r:CA:k:g:P:W:w:x:L:E:J:h")) != -1) {
+        switch (opt) {
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'F':
+            file_path = optarg;
+            break;
+        case 'u':
+            source = FILE_SOURCE_READ;
+            break;
+        case 'z':
+            // auto: the adaptive controller, over lz4 when built in
+            adaptive = !strcmp(optarg, "auto");
+            if (adaptive) {
+                codec = compress_codec_available(COMPRESS_LZ4) ? COMPRESS_LZ4 : COMPRESS_ZSTD;
+                break;
+            }
+            for (codec = COMPRESS_LZ4; codec < COMPRESS_CODEC_COUNT; codec++) {
+                if (!strcmp(optarg, compress_codec_names[codec])) {
+                    break;
+                }
+            }
+            if (codec == COMPRESS_CODEC_COUNT) {
+                fprintf(stderr, "-z takes lz4, zstd or auto\n");
+                return 1;
+            }
+            break;
+        case 'R':
+            rpc = 1;
+            break;
+        case 'K':
+            kv = 1;
+            break;
+        case 'd':
+            if (rdma_parse_device_sel(optarg, &device)) {
+                return 1;
+            }
+            use_device = 1;
+            break;
+        case 'S':
+            stripe_devices = optarg;
+            break;
+        case 'r':
+            pacer_attr.max_rate = atof(optarg) * 1e6 / 8;
+            break;
+        case 'C':
+            pacer_attr.adaptive = 1;
+            break;
+        case 'A':
+            tune_path = optarg;
+            break;
+        case 'k':
+            if (rdma_tune_restrict(&space, optarg)) {
+                return 1;
+            }
+            break;
+        case 'g':
+            if (!strcmp(optarg, "ops")) {
+                goal = TUNE_GOAL_OPS;
+            } else if (strcmp(optarg, "bw")) {
+                fprintf(stderr, "-g takes bw or ops\n");
+                return 1;
+            }
+            break;
+        case 'P':
+            profile_path = optarg;
+            break;
+        case 'W':
+            replay_path = optarg;
+            break;
+        case 'w':
+            schedule_path = optarg;
+            break;
+        case 'x':
+            replay_opts.speed = atof(optarg);
+            break;
+        case 'L':
+            replay_opts.seconds = atof(optarg);
+            break;
+        case 'E':
+            for (recovery_attr.mode = 0; recovery_attr.mode < RECOVERY_MODE_COUNT;
+                 recovery_attr.mode++) {
+                if (!strcmp(optarg, rdma_recovery_mode_names[recovery_attr.mode])) {
+                    break;
+                }
+            }
+            if (recovery_attr.mode == RECOVERY_MODE_COUNT) {
+                fprintf(stderr, "-E takes reset, reconnect or auto\n");
+                return 1;
+            }
+            recover = 1;
+            break;
+        case 'J':
+            if (rdma_fault_parse(optarg, &fault)) {
+                return 1;
+            }
+            break;
+        default:
+            printf("Usage: %s [-t trace.json] [-d dev[:port[:gid]]] [-r mbps [-C]]\n"
+                   "       [-E mode [-J fault]] [-F file [-u] [-z codec] | -R | -K] [server_ip]\n"
+                   "       %s -S dev[:port[:gid]],dev... server_ip[,server_ip...]\n"
+                   "       %s -A profile [-g bw|ops] [-k knob=v1,v2...]... [server_ip]\n"
+                   "       %s -P profile [server_ip]\n"
+                   "       %s -W capture|schedule [-w schedule | -x speed] [-L seconds] [server_ip]\n",
+                   argv[0], argv[0], argv[0], argv[0], argv[0]);
+            printf("  -t FILE  Trace work requests to FILE (Chrome trace / Perfetto JSON)\n");
+            printf("  -F FILE  Send FILE to the server instead of the test pattern\n");
+            printf("  -u       Read the file into registered buffers (io_uring) instead of\n");
+            printf("           registering its mmap'ed pages\n");
+            printf("  -z CODEC Compress file chunks on the way out: lz4, zstd, or auto to let\n");
+            printf("           the adaptive controller send raw whenever compressing does not pay\n");
+            printf("  -R       Benchmark echo and compute RPCs against rdma_server -R\n");
+            printf("  -K       Benchmark the key-value store of rdma_server -K (YCSB A/B/C)\n");
+            printf("  -d DEV   Connect from device DEV, port and GID index optional (the address\n");
+            printf("           in the GID, first IPv4 one by default)\n");
+            printf("  -S DEVS  Stripe one transfer over a connection per device against\n");
+            printf("           rdma_server -S, lane i to the i-th server address (round robin)\n");
+            printf("  -r MBPS  Pace the test writes to MBPS Mbit/s\n");
+            printf("  -C       With -r, back off from MBPS when write latency shows congestion\n");
+            printf("  -A FILE  Auto-tune window, message size, signaling, inline, QPs and\n");
+            printf("           threads against rdma_server -A; save the best to FILE\n");
+            printf("  -g GOAL  Tune for bandwidth (bw, default) or writes per second (ops)\n");
+            printf("  -k SPEC  Search only these values of a knob, e.g. msg_size=4096,65536\n");
+            printf("  -P FILE  Run a profile saved by -A against rdma_server -A\n");
+            printf("  -W FILE  Replay the RoCEv2 workload of a pcap capture, or of a schedule\n");
+            printf("           compiled from one, against rdma_server -A\n");
+            printf("  -w FILE  With -W, save the compiled schedule to FILE instead of replaying\n");
+            printf("  -x N     Replay N times as fast as captured (default 1)\n");
+            printf("  -L SECS  Replay for SECS seconds (default the capture's span)\n");
+            printf("  -E MODE  Recover from failed test writes and replay them: reset the QP in\n");
+            printf("           place (reset), reconnect (reconnect, against rdma_server -A) or\n");
+            printf("           reset, then reconnect if that does not take (auto)\n");
+            printf("  -J SPEC  With -E, inject faults: qp:MS forces a QP error every MS ms,\n");
+            printf("           link:MS:DOWN_MS takes the link down for DOWN_MS ms (rxe, root)\n");
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc) {
+        server_ip = argv[optind];
+    }
+    if (pacer_attr.adaptive && pacer_attr.max_rate <= 0) {
+        fprintf(stderr, "-C needs a rate to start from (-r)\n");
+        return 1;
+    }
+    if (codec != COMPRESS_NONE && !file_path) {
+        fprintf(stderr, "-z compresses a file transfer (-F)\n");
+        return 1;
+    }
+    if (!compress_codec_available(codec)) {
+        fprintf(stderr, "Built without %s compression\n", compress_codec_names[codec]);
+        return 1;
+    }
+    if (fault.kind != RDMA_FAULT_NONE && !recover) {
+        fprintf(stderr, "-J needs a way to recover (-E)\n");
+        return 1;
+    }
+    if (rpc || kv) {
+        attr.qp_depth = kv ? KV_QP_DEPTH : RPC_QP_DEPTH;
+        attr.cq_depth = RPC_CQ_DEPTH;
     }
     
     // Set up signal handlers
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
+    if (replay_path) {
+        ret = run_replay(server_ip, replay_path, schedule_path, &replay_opts);
+        printf("RDMA client shutdown complete\n");
+        return ret ? 1 : 0;
+    }
+    if (tune_path || profile_path) {
+        ret = tune_path ? run_autotune(server_ip, &space, goal, tune_path)
+                        : run_profile(server_ip, profile_path);
+        printf("RDMA client shutdown complete\n");
+        return ret ? 1 : 0;
+    }
+    if (stripe_devices) {
+        char servers[256];
+
+        snprintf(servers, sizeof(servers), "%s", server_ip);
+        ret = run_stripe(stripe_devices, servers);
+        printf("RDMA client shutdown complete\n");
+        return ret ? 1 : 0;
+    }
+    if (use_device) {
+        if (rdma_device_sel_addr(&device, &local)) {
+            return 1;
+        }
+        attr.src_addr = (struct sockaddr *)&local;
+    }
+    
     printf("RDMA RoCEv2 Client Starting...\n");
     printf("Connecting to server at %s:%d\n", server_ip, PORT);
     
-    // Set up RDMA resources
-    ret = setup_rdma_resources(&ctx);
-    if (ret) {
-        fprintf(stderr, "Failed to set up RDMA resources\n");
-        cleanup_rdma_resources(&ctx);
+    if (trace_path && rdma_trace_start(trace_path)) {
+        fprintf(stderr, "Failed to start tracing\n");
         return 1;
     }
+    rdma_trace_thread_name("client data path");
     
-    // Connect to server
-    ret = connect_to_server(&ctx, server_ip);
+    // Connect to server; RDMA resources are set up on the device it routes through
+    ret = connect_to_server(&ctx, server_ip, PORT, &attr);
     if (ret) {
         fprintf(stderr, "Failed to connect to server\n");
-        cleanup_rdma_resources(&ctx);
+        close_rdma_connection(&ctx);
+        rdma_trace_stop();
         return 1;
     }
     
-    // Perform RDMA operations
-    perform_rdma_operations(&ctx);
+    // Perform RDMA operations, send a file or benchmark RPCs
+    if (file_path) {
+        ret = file_send(ctx.pd, ctx.qp, ctx.cq, file_path, source, codec, adaptive, &running,
+                        &file_stats);
+        if (ret == 0) {
+            file_xfer_report("Sent", &file_stats);
+        }
+    } else if (rpc) {
+        ret = run_rpc_benchmark(&ctx);
+    } else if (kv) {
+        ret = run_kv_benchmark(&ctx);
+    } else {
+        if (pacer_attr.max_rate > 0) {
+            rdma_pacer_init(&pacer, &pacer_attr, rdma_now_ns());
+        }
+        if (recover) {
+            recovery_attr.server_ip = server_ip;
+            recovery_attr.port = PORT;
+            recovery_attr.conn = attr;
+            if (rdma_recovery_init(&recovery, &ctx, QP_DEPTH, &recovery_attr)) {
+                recover = 0;
+                ret = 1;
+            } else if (rdma_recovery_set_fault(&recovery, &fault)) {
+                ret = 1;
+            }
+        }
+        if (ret == 0) {
+            perform_rdma_operations(&ctx, pacer_attr.max_rate > 0 ? &pacer : NULL,
+                                    recover ? &recovery : NULL);
+        }
+        if (recover) {
+            rdma_recovery_destroy(&recovery);
+        }
+    }
     
     // Cleanup
-    cleanup_rdma_resources(&ctx);
+    close_rdma_connection(&ctx);
+    rdma_trace_stop();
     
     printf("RDMA client shutdown complete\n");
-    return 0;
+    return ret ? 1 : 0;
 }
@@ -0,0 +1,526 @@
+/*
+ * Ring collectives over RDMA. See rdma_coll.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <rdma/rdma_cma.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "rdma_coll.h"
+#include "rdma_connection.h"
+
+#define QP_DEPTH (2 * COLL_RECVS)
+#define CQ_DEPTH (4 * COLL_RECVS)
+#define POLL_BATCH 16
+#define REGION_ALIGN 4096
+#define CONNECT_RETRY_NS 10000000ULL
+
+const char *const coll_dtype_names[COLL_DTYPE_COUNT] = {"float", "double", "int32", "int64"};
+const size_t coll_dtype_size[COLL_DTYPE_COUNT] = {4, 8, 4, 8};
+const char *const coll_simd_names[COLL_SIMD_COUNT] = {"scalar", "avx2", "avx512"};
+
+// One collective as the ring engine runs it: the chunks every rank sends
+// and receives, in order
+struct ring_op {
+    size_t es;                  // bytes per element (1 for broadcast)
+    enum coll_dtype dtype;
+    size_t total;               // elements in the buffer
+    size_t chunk_elems;
+    uint64_t nchunks;           // per block
+    int rs_steps;               // reduce-scatter steps, then
+    int ag_steps;               // allgather steps
+    int root;                   // broadcast: the root, -1 for ring collectives
+};
+
+// Reduction kernels: scalar, and AVX2/AVX-512 built for those targets
+// alone so the rest of the library still runs on any x86-64
+
+#define SCALAR_SUM(name, type)                                          \
+static void name(void *dst, const void *src, size_t n) {               \
+    type *d = dst;                                                      \
+    const type *s = src;                                                \
+    for (size_t i = 0; i < n; i++) {                                    \
+        d[i] += s[i];                                                   \
+    }                                                                   \
+}
+
+SCALAR_SUM(sum_float_scalar, float)
+SCALAR_SUM(sum_double_scalar, double)
+SCALAR_SUM(sum_int32_scalar, int32_t)
+SCALAR_SUM(sum_int64_scalar, int64_t)
+
+#if defined(__x86_64__)
+#define SIMD_SUM(name, isa, type, width, load, store, add)              \
+__attribute__((target(isa)))                                            \
+static void name(void *dst, const void *src, size_t n) {               \
+    type *d = dst;                                                      \
+    const type *s = src;                                                \
+    size_t i = 0;                                                       \
+    for (; i + (width) <= n; i += (width)) {                            \
+        store(d + i, add(load(d + i), load(s + i)));                    \
+    }                                                                   \
+    for (; i < n; i++) {                                                \
+        d[i] += s[i];                                                   \
+    }                                                                   \
+}
+
+#define LOAD_I256(p) _mm256_loadu_si256((const __m256i *)(p))
+#define STORE_I256(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+
+SIMD_SUM(sum_float_avx2, "avx2", float, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_add_ps)
+SIMD_SUM(sum_double_avx2, "avx2", double, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd)
+SIMD_SUM(sum_int32_avx2, "avx2", int32_t, 8, LOAD_I256, STORE_I256, _mm256_add_epi32)
+SIMD_SUM(sum_int64_avx2, "avx2", int64_t, 4, LOAD_I256, STORE_I256, _mm256_add_epi64)
+
+SIMD_SUM(sum_float_avx512, "avx512f", float, 16, _mm512_loadu_ps, _mm512_storeu_ps,
+         _mm512_add_ps)
+SIMD_SUM(sum_double_avx512, "avx512f", double, 8, _mm512_loadu_pd, _mm512_storeu_pd,
+         _mm512_add_pd)
+SIMD_SUM(sum_int32_avx512, "avx512f", int32_t, 16, _mm512_loadu_si512, _mm512_storeu_si512,
+         _mm512_add_epi32)
+SIMD_SUM(sum_int64_avx512, "avx512f", int64_t, 8, _mm512_loadu_si512, _mm512_storeu_si512,
+         _mm512_add_epi64)
+#endif
+
+typedef void (*sum_fn)(void *dst, const void *src, size_t n);
+
+static const sum_fn sums[COLL_SIMD_COUNT][COLL_DTYPE_COUNT] = {
+    {sum_float_scalar, sum_double_scalar, sum_int32_scalar, sum_int64_scalar},
+#if defined(__x86_64__)
+    {sum_float_avx2, sum_double_avx2, sum_int32_avx2, sum_int64_avx2},
+    {sum_float_avx512, sum_double_avx512, sum_int32_avx512, sum_int64_avx512},
+#endif
+};
+
+int coll_simd_available(enum coll_simd simd) {
+    switch (simd) {
+    case COLL_SIMD_SCALAR:
+        return 1;
+#if defined(__x86_64__)
+    case COLL_SIMD_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case COLL_SIMD_AVX512:
+        return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+        return 0;
+    }
+}
+
+enum coll_simd coll_simd_best(void) {
+    if (coll_simd_available(COLL_SIMD_AVX512)) {
+        return COLL_SIMD_AVX512;
+    }
+    if (coll_simd_available(COLL_SIMD_AVX2)) {
+        return COLL_SIMD_AVX2;
+    }
+    return COLL_SIMD_SCALAR;
+}
+
+void coll_reduce_sum(enum coll_simd simd, enum coll_dtype dtype, void *dst, const void *src,
+                     size_t n) {
+    sums[simd][dtype](dst, src, n);
+}
+
+// Connections
+
+static int post_recvs(struct rdma_context *ctx, int n) {
+    struct ibv_recv_wr wr = {0}, *bad_wr;
+
+    for (int i = 0; i < n; i++) {
+        if (ibv_post_recv(ctx->qp, &wr, &bad_wr)) {
+            fprintf(stderr, "Failed to post receive\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void conn_attr(const struct coll_comm *c, struct rdma_resource_attr *attr) {
+    memset(attr, 0, sizeof(*attr));
+    attr->buffer = c->region;
+    attr->buffer_size = c->region_size;
+    attr->cq_depth = CQ_DEPTH;
+    attr->qp_depth = QP_DEPTH;
+    attr->split_cqs = 1;
+    attr->quiet = 1;
+}
+
+// Keep trying until next is listening: ranks start in any order
+static int connect_next(struct coll_comm *c, const struct coll_attr *attr) {
+    struct rdma_resource_attr rattr;
+    int peer = (c->rank + 1) % c->size;
+    uint64_t deadline = rdma_now_ns() + COLL_CONNECT_NS;
+
+    conn_attr(c, &rattr);
+    while (connect_to_servers(&c->next, 1, attr->hosts[peer], attr->port + peer, &rattr, NULL)) {
+        struct timespec ts = {0, CONNECT_RETRY_NS};
+
+        if (rdma_now_ns() > deadline) {
+            fprintf(stderr, "Rank %d: no rank %d at %s:%d\n", c->rank, peer, attr->hosts[peer],
+                    attr->port + peer);
+            return -1;
+        }
+        nanosleep(&ts, NULL);
+    }
+    return post_recvs(&c->next, COLL_RECVS);
+}
+
+static int accept_prev(struct coll_comm *c) {
+    struct rdma_context *ctx = &c->prev;
+    struct rdma_resource_attr rattr;
+    struct rdma_cm_event *event;
+
+    conn_attr(c, &rattr);
+    for (;;) {
+        int ret = 0;
+
+        if (rdma_get_cm_event(ctx->cm_channel, &event)) {
+            fprintf(stderr, "Failed to get CM event\n");
+            return -1;
+        }
+        switch (event->event) {
+        case RDMA_CM_EVENT_CONNECT_REQUEST:
+            ret = accept_connect_request(ctx, event, &rattr, NULL);
+            break;
+        case RDMA_CM_EVENT_ESTABLISHED:
+            ctx->connected = 1;
+            break;
+        default:
+            fprintf(stderr, "Unexpected CM event: %s\n", rdma_event_str(event->event));
+            ret = -1;
+            break;
+        }
+        rdma_ack_cm_event(event);
+        if (ret) {
+            return -1;
+        }
+        if (ctx->connected) {
+            return post_recvs(ctx, COLL_RECVS);
+        }
+    }
+}
+
+int coll_init(struct coll_comm *c, const struct coll_attr *attr) {
+    uint32_t chunk = attr->chunk ? attr->chunk : COLL_DEFAULT_CHUNK;
+
+    memset(c, 0, sizeof(*c));
+    if (attr->size < 1 || attr->rank < 0 || attr->rank >= attr->size) {
+        fprintf(stderr, "Rank %d of %d is out of range\n", attr->rank, attr->size);
+        return -1;
+    }
+    if (chunk % 8 || chunk < 64) {
+        fprintf(stderr, "Chunk must be a multiple of 8 bytes, at least 64\n");
+        return -1;
+    }
+    if (!coll_simd_available(attr->simd)) {
+        fprintf(stderr, "This CPU has no %s\n", coll_simd_names[attr->simd]);
+        return -1;
+    }
+    c->rank = attr->rank;
+    c->size = attr->size;
+    c->max_bytes = (attr->max_bytes + 7) & ~(size_t)7;
+    c->chunk = chunk;
+    c->simd = attr->simd;
+    c->region_size = (c->max_bytes + (size_t)COLL_SLOTS * chunk + REGION_ALIGN - 1) &
+                     ~(size_t)(REGION_ALIGN - 1);
+    c->region = aligned_alloc(REGION_ALIGN, c->region_size);
+    if (!c->region) {
+        fprintf(stderr, "Failed to allocate %zu bytes\n", c->region_size);
+        return -1;
+    }
+    memset(c->region, 0, c->region_size);
+    c->buf = c->region;
+    if (c->size == 1) {
+        return 0;
+    }
+
+    // Listen first, then connect in a chain: rank 0 connects to 1 while
+    // everyone else waits for prev before connecting to next, so no two
+    // ranks wait on each other
+    if (listen_rdma_connections(&c->prev, NULL, attr->port + c->rank)) {
+        goto fail;
+    }
+    if (c->rank == 0) {
+        if (connect_next(c, attr) || accept_prev(c)) {
+            goto fail;
+        }
+    } else if (accept_prev(c) || connect_next(c, attr)) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    coll_destroy(c);
+    return -1;
+}
+
+void coll_destroy(struct coll_comm *c) {
+    close_rdma_connection(&c->next);
+    close_rdma_connection(&c->prev);
+    free(c->region);
+    c->region = NULL;
+    c->buf = NULL;
+}
+
+// The ring engine
+
+static int mod(int a, int n) {
+    return ((a % n) + n) % n;
+}
+
+static uint64_t msgs_sent(const struct coll_comm *c, const struct ring_op *op) {
+    if (op->root < 0) {
+        return (uint64_t)(op->rs_steps + op->ag_steps) * op->nchunks;
+    }
+    return c->rank == mod(op->root - 1, c->size) ? 0 : op->nchunks;
+}
+
+static uint64_t msgs_received(const struct coll_comm *c, const struct ring_op *op) {
+    if (op->root < 0) {
+        return (uint64_t)(op->rs_steps + op->ag_steps) * op->nchunks;
+    }
+    return c->rank == op->root ? 0 : op->nchunks;
+}
+
+// Chunks rank must have received before it can send its chunk m
+static uint64_t msgs_needed(const struct coll_comm *c, const struct ring_op *op, uint64_t m) {
+    if (op->root >= 0) {
+        return c->rank == op->root ? 0 : m + 1;
+    }
+    return m < op->nchunks ? 0 : m - op->nchunks + 1;
+}
+
+// Where the m-th chunk rank sends sits in the buffer (the same place on
+// every rank), and whether it is summed at the receiver
+static void msg_layout(const struct coll_comm *c, const struct ring_op *op, int rank, uint64_t m,
+                       size_t *offset, size_t *len, int *staged) {
+    int step = m / op->nchunks;
+    uint64_t chunk = m % op->nchunks;
+    size_t lo = 0, hi = op->total;
+    int block;
+
+    *staged = step < op->rs_steps;
+    if (op->root < 0) {
+        block = *staged ? mod(rank - step - 1, c->size) : mod(rank - (step - op->rs_steps), c->size);
+        lo = op->total * block / c->size;
+        hi = op->total * (block + 1) / c->size;
+    }
+    lo += chunk * op->chunk_elems;
+    if (lo > hi) {
+        lo = hi;
+    }
+    *offset = lo * op->es;
+    *len = (hi - lo < op->chunk_elems ? hi - lo : op->chunk_elems) * op->es;
+}
+
+static int post_write(struct rdma_context *ctx, uint64_t wr_id, const void *addr, size_t len,
+                      uint64_t remote_offset, uint32_t imm) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)addr,
+        .length = len,
+        .lkey = ctx->mr->lkey,
+    };
+    struct ibv_send_wr wr = {
+        .wr_id = wr_id,
+        .sg_list = len ? &sge : NULL,
+        .num_sge = len ? 1 : 0,
+        .opcode = IBV_WR_RDMA_WRITE_WITH_IMM,
+        .send_flags = IBV_SEND_SIGNALED,
+        .imm_data = htonl(imm),
+    }, *bad_wr;
+
+    wr.wr.rdma.remote_addr = ctx->remote_addr + remote_offset;
+    wr.wr.rdma.rkey = ctx->remote_rkey;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post write\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Poll cq for up to max completions; -1 on an error
+static int poll_cq(struct ibv_cq *cq, struct ibv_wc *wc, int max) {
+    int n = ibv_poll_cq(cq, max, wc);
+
+    if (n < 0) {
+        fprintf(stderr, "Failed to poll CQ\n");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Collective completion error: %s\n", ibv_wc_status_str(wc[i].status));
+            return -1;
+        }
+    }
+    return n;
+}
+
+static int run_ring(struct coll_comm *c, const struct ring_op *op) {
+    const size_t staging = c->max_bytes;
+    int prev_rank = mod(c->rank - 1, c->size);
+    uint64_t nsend = msgs_sent(c, op), nrecv = msgs_received(c, op);
+    uint64_t sent = 0, granted = 0;     // to next: chunks written, and allowed
+    uint64_t recvd = 0, given = 0;      // from prev: chunks consumed, and allowed
+    int writes = 0, grants = 0;         // writes in flight to next, grants to prev
+    struct ibv_wc wc[POLL_BATCH];
+    uint64_t g;
+    int n;
+
+    // Nothing may land here before this collective has begun
+    if (nrecv) {
+        given = nrecv < COLL_SLOTS ? nrecv : COLL_SLOTS;
+        if (post_write(&c->prev, 0, NULL, 0, 0, given)) {
+            return -1;
+        }
+        grants++;
+    }
+
+    while (sent < nsend || recvd < nrecv || writes || grants) {
+        // Chunks next has room for and we have
+        while (sent < nsend && sent < granted && recvd >= msgs_needed(c, op, sent) &&
+               writes < QP_DEPTH) {
+            size_t off, len;
+            int staged;
+
+            msg_layout(c, op, c->rank, sent, &off, &len, &staged);
+            if (post_write(&c->next, sent, c->buf + off, len,
+                           staged ? staging + (sent % COLL_SLOTS) * c->chunk : off, sent)) {
+                return -1;
+            }
+            c->bytes_sent += len;
+            sent++;
+            writes++;
+        }
+
+        // Grants from next; no grant comes for a collective next has not
+        // entered, so whatever is here is ours
+        if (granted < nsend) {
+            if ((n = poll_cq(c->next.recv_cq, wc, POLL_BATCH)) < 0 || post_recvs(&c->next, n)) {
+                return -1;
+            }
+            for (int i = 0; i < n; i++) {
+                uint32_t g = ntohl(wc[i].imm_data);
+
+                granted = g > granted ? g : granted;
+            }
+        }
+
+        // Chunks from prev, in order; take no more than this collective's
+        if (recvd < nrecv) {
+            int max = nrecv - recvd < POLL_BATCH ? nrecv - recvd : POLL_BATCH;
+
+            if ((n = poll_cq(c->prev.recv_cq, wc, max)) < 0) {
+                return -1;
+            }
+            for (int i = 0; i < n; i++, recvd++) {
+                size_t off, len;
+                int staged;
+
+                if (ntohl(wc[i].imm_data) != (uint32_t)recvd) {
+                    fprintf(stderr, "Rank %d: chunk %u arrived for chunk %lu\n", c->rank,
+                            ntohl(wc[i].imm_data), recvd);
+                    return -1;
+                }
+                msg_layout(c, op, prev_rank, recvd, &off, &len, &staged);
+                if (staged && len) {
+                    uint64_t t = rdma_now_ns();
+
+                    coll_reduce_sum(c->simd, op->dtype, c->buf + off,
+                                    c->buf + staging + (recvd % COLL_SLOTS) * c->chunk,
+                                    len / op->es);
+                    c->reduce_ns += rdma_now_ns() - t;
+                }
+            }
+            if (n && post_recvs(&c->prev, n)) {
+                return -1;
+            }
+        }
+        // Slots consumed go back to prev, a few at a time but the last at once
+        g = recvd + COLL_SLOTS < nrecv ? recvd + COLL_SLOTS : nrecv;
+        if (g != given && (g - given >= COLL_GRANT_BATCH || g == nrecv) && grants < QP_DEPTH) {
+            if (post_write(&c->prev, 0, NULL, 0, 0, g)) {
+                return -1;
+            }
+            given = g;
+            grants++;
+        }
+
+        // Send completions, both ways
+        if (writes) {
+            if ((n = poll_cq(c->next.cq, wc, POLL_BATCH)) < 0) {
+                return -1;
+            }
+            writes -= n;
+        }
+        if (grants) {
+            if ((n = poll_cq(c->prev.cq, wc, POLL_BATCH)) < 0) {
+                return -1;
+            }
+            grants -= n;
+        }
+    }
+    return 0;
+}
+
+static int ring_collective(struct coll_comm *c, size_t total, enum coll_dtype dtype, int rs, int ag) {
+    struct ring_op op = {
+        .es = coll_dtype_size[dtype],
+        .dtype = dtype,
+        .total = total,
+        .rs_steps = rs ? c->size - 1 : 0,
+        .ag_steps = ag ? c->size - 1 : 0,
+        .root = -1,
+    };
+    size_t block = (total + c->size - 1) / c->size;
+
+    if (total * op.es > c->max_bytes) {
+        fprintf(stderr, "%zu bytes is more than the communicator's %zu\n", total * op.es,
+                c->max_bytes);
+        return -1;
+    }
+    if (c->size == 1) {
+        return 0;
+    }
+    op.chunk_elems = c->chunk / op.es;
+    op.nchunks = block ? (block + op.chunk_elems - 1) / op.chunk_elems : 1;
+    return run_ring(c, &op);
+}
+
+int coll_allreduce(struct coll_comm *c, size_t count, enum coll_dtype dtype) {
+    return ring_collective(c, count, dtype, 1, 1);
+}
+
+int coll_reduce_scatter(struct coll_comm *c, size_t count, enum coll_dtype dtype) {
+    return ring_collective(c, count * c->size, dtype, 1, 0);
+}
+
+int coll_allgather(struct coll_comm *c, size_t count, enum coll_dtype dtype) {
+    return ring_collective(c, count * c->size, dtype, 0, 1);
+}
+
+int coll_broadcast(struct coll_comm *c, size_t bytes, int root) {
+    struct ring_op op = {
+        .es = 1,
+        .total = bytes,
+        .chunk_elems = c->chunk,
+        .root = root,
+    };
+
+    if (bytes > c->max_bytes || root < 0 || root >= c->size) {
+        fprintf(stderr, "Broadcast of %zu bytes from rank %d does not fit the communicator\n",
+                bytes, root);
+        return -1;
+    }
+    if (c->size == 1) {
+        return 0;
+    }
+    op.nchunks = bytes ? (bytes + c->chunk - 1) / c->chunk : 1;
+    return run_ring(c, &op);
+}
@@ -0,0 +1,125 @@
+/*
+ * Ring collectives over RDMA: allreduce, reduce-scatter, allgather and
+ * broadcast (librdmademo)
+ *
+ * N processes, local or on other hosts, each connect to the next one
+ * round a ring (rank r's "next" connection is to rank r + 1, which accepted
+ * it as its "prev"). Every collective works in place on the communicator's
+ * registered buffer and moves data only from prev to next:
+ *
+ *   reduce-scatter  the buffer in N blocks; in N - 1 steps every rank
+ *                   passes a block on to next, which adds its own into it,
+ *                   until rank r holds block r summed over all ranks
+ *   allgather       rank r's block r is passed round N - 1 steps, into
+ *                   the same place in every rank's buffer
+ *   allreduce       reduce-scatter, then allgather of the summed blocks:
+ *                   2 (N - 1) / N of the buffer over each link, whatever N
+ *   broadcast       root's buffer down the chain root, root + 1, ..,
+ *                   root - 1
+ *
+ * There are no tree variants. A tree rank talks to its parent and two
+ * children, which the ring's two connections per rank cannot carry; and
+ * at the sizes where pipelined rings fall behind trees (small buffers over
+ * many ranks, where N - 1 latencies dominate) a demo on a few hosts never
+ * gets far enough out to show it.
+ *
+ * Blocks go in chunks (coll_attr.chunk bytes) so every link stays busy:
+ * a rank passes chunk c on as soon as it has it, while the chunks after it
+ * are still arriving. Each chunk is one RDMA WRITE WITH IMM. Chunks that
+ * are to be summed land in one of COLL_SLOTS staging slots after next's
+ * buffer and are added in from there; the others land straight in place.
+ * A rank may only write as far as next has granted: next grants
+ * COLL_SLOTS chunks ahead of what it has consumed, with zero-byte WRITE
+ * WITH IMMs back along the same connection, and grants nothing for a
+ * collective it has not entered yet (so nothing lands in a buffer still
+ * in use).
+ *
+ * Sums are float32, float64, int32 or int64, with AVX-512 or AVX2 kernels
+ * where the CPU has them (chosen at run time; scalar otherwise).
+ *
+ * coll_bench reports algorithm and bus bandwidth per size and rank count,
+ * as NCCL's tests do.
+ */
+
+#ifndef RDMA_COLL_H
+#define RDMA_COLL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rdma_common.h"
+
+#define COLL_SLOTS 16               // chunks in flight per link, staging slots per rank
+#define COLL_GRANT_BATCH 4          // chunks consumed between grants
+#define COLL_RECVS (2 * COLL_SLOTS) // receives kept posted on each connection
+#define COLL_CONNECT_NS 30000000000ULL  // how long a rank waits for its neighbors
+#define COLL_DEFAULT_CHUNK (128 * 1024)
+
+enum coll_dtype {
+    COLL_FLOAT,
+    COLL_DOUBLE,
+    COLL_INT32,
+    COLL_INT64,
+    COLL_DTYPE_COUNT,
+};
+
+extern const char *const coll_dtype_names[COLL_DTYPE_COUNT];
+extern const size_t coll_dtype_size[COLL_DTYPE_COUNT];
+
+enum coll_simd {
+    COLL_SIMD_SCALAR,
+    COLL_SIMD_AVX2,
+    COLL_SIMD_AVX512,
+    COLL_SIMD_COUNT,
+};
+
+extern const char *const coll_simd_names[COLL_SIMD_COUNT];
+
+// The widest kernels this CPU runs, and whether it runs simd's
+enum coll_simd coll_simd_best(void);
+int coll_simd_available(enum coll_simd simd);
+// dst[i] += src[i] for n elements of dtype
+void coll_reduce_sum(enum coll_simd simd, enum coll_dtype dtype, void *dst, const void *src,
+                     size_t n);
+
+struct coll_attr {
+    int rank;
+    int size;
+    const char *const *hosts;   // size addresses, rank i listening on hosts[i]
+    int port;                   // rank i listens on port + i
+    size_t max_bytes;           // the largest buffer a collective works on
+    uint32_t chunk;             // bytes, a multiple of 8; 0 for COLL_DEFAULT_CHUNK
+    enum coll_simd simd;
+};
+
+struct coll_comm {
+    int rank;
+    int size;
+    char *buf;                  // max_bytes, in and out of every collective
+    size_t max_bytes;
+    uint32_t chunk;
+    enum coll_simd simd;
+    char *region;               // buf, then the staging slots; registered on both links
+    size_t region_size;
+    struct rdma_context next;   // we write to rank + 1
+    struct rdma_context prev;   // rank - 1 writes to us
+
+    uint64_t bytes_sent;
+    uint64_t reduce_ns;
+};
+
+// Connect the ring: returns once this rank is connected to both neighbors
+int coll_init(struct coll_comm *c, const struct coll_attr *attr);
+void coll_destroy(struct coll_comm *c);
+
+// count elements summed over all ranks, in every rank's buf
+int coll_allreduce(struct coll_comm *c, size_t count, enum coll_dtype dtype);
+// buf holds size * count elements; rank r's count from r * count on are
+// summed over all ranks
+int coll_reduce_scatter(struct coll_comm *c, size_t count, enum coll_dtype dtype);
+// Rank r's count elements from r * count on, into every rank's buf
+int coll_allgather(struct coll_comm *c, size_t count, enum coll_dtype dtype);
+// bytes of root's buf into every rank's
+int coll_broadcast(struct coll_comm *c, size_t bytes, int root);
+
+#endif
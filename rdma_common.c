@@ -0,0 +1,481 @@
+/*
+ * Shared RDMA resource setup and teardown. See rdma_common.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rdma_common.h"
+
+#define DEFAULT_ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ)
+// What the code here does with ctx->mr on RC: messages and RDMA both ways
+#define ODP_RC_CAPS (IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV | IBV_ODP_SUPPORT_WRITE | \
+                     IBV_ODP_SUPPORT_READ)
+#define PREFETCH_CHUNK (1U << 30)   // an SGE's length is 32 bits
+
+const char *const rdma_phase_names[RDMA_PHASE_COUNT] = {
+    "device", "pd", "cq", "mr", "qp", "addr", "route", "connect",
+};
+
+const char *const rdma_mr_mode_names[RDMA_MR_MODE_COUNT] = {
+    "pinned", "odp", "implicit",
+};
+
+uint64_t rdma_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int rdma_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int rdma_parse_names(char *list, const char *const *names, int count, unsigned *mask) {
+    *mask = 0;
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int i = 0;
+
+        while (i < count && strcmp(tok, names[i])) {
+            i++;
+        }
+        if (i == count) {
+            fprintf(stderr, "Unknown name: %s\n", tok);
+            return -1;
+        }
+        *mask |= 1U << i;
+    }
+    return *mask ? 0 : -1;
+}
+
+void rdma_phase_begin(struct rdma_context *ctx) {
+    if (ctx->timing) {
+        ctx->timing->mark = rdma_now_ns();
+    }
+}
+
+void rdma_phase_end(struct rdma_context *ctx, enum rdma_setup_phase phase) {
+    if (ctx->timing) {
+        uint64_t now = rdma_now_ns();
+        ctx->timing->ns[phase] += now - ctx->timing->mark;
+        ctx->timing->mark = now;
+    }
+}
+
+static void print_device_names(struct ibv_device **dev_list, int num_devices) {
+    fprintf(stderr, "Available devices:");
+    for (int i = 0; i < num_devices; i++) {
+        fprintf(stderr, " %s", ibv_get_device_name(dev_list[i]));
+    }
+    fprintf(stderr, "\n");
+}
+
+// Open the device called name, or the first one when name is NULL; the
+// device list is released on every path
+static struct ibv_context *open_device(const char *name, int quiet) {
+    struct ibv_device **dev_list;
+    struct ibv_device *dev = NULL;
+    struct ibv_context *context;
+    int num_devices;
+
+    dev_list = ibv_get_device_list(&num_devices);
+    if (!dev_list) {
+        fprintf(stderr, "Failed to get IB device list\n");
+        return NULL;
+    }
+
+    if (num_devices == 0) {
+        fprintf(stderr, "No IB devices found\n");
+        ibv_free_device_list(dev_list);
+        return NULL;
+    }
+
+    for (int i = 0; i < num_devices && !dev; i++) {
+        if (!name || !strcmp(ibv_get_device_name(dev_list[i]), name)) {
+            dev = dev_list[i];
+        }
+    }
+    if (!dev) {
+        fprintf(stderr, "No IB device named %s\n", name);
+        print_device_names(dev_list, num_devices);
+        ibv_free_device_list(dev_list);
+        return NULL;
+    }
+
+    if (!quiet) {
+        printf("Using device: %s\n", ibv_get_device_name(dev));
+    }
+    context = ibv_open_device(dev);
+    ibv_free_device_list(dev_list);
+    if (!context) {
+        fprintf(stderr, "Failed to open device context\n");
+    }
+    return context;
+}
+
+// The closest mode to want that the device says it supports
+static enum rdma_mr_mode supported_mr_mode(struct ibv_context *context, enum rdma_mr_mode want) {
+    struct ibv_device_attr_ex dev_attr;
+
+    if (want == RDMA_MR_PINNED) {
+        return want;
+    }
+    memset(&dev_attr, 0, sizeof(dev_attr));
+    if (ibv_query_device_ex(context, NULL, &dev_attr)) {
+        fprintf(stderr, "Failed to query on-demand paging support, registering pinned\n");
+        return RDMA_MR_PINNED;
+    }
+    if (!(dev_attr.odp_caps.general_caps & IBV_ODP_SUPPORT) ||
+        (dev_attr.odp_caps.per_transport_caps.rc_odp_caps & ODP_RC_CAPS) != ODP_RC_CAPS) {
+        fprintf(stderr, "%s has no on-demand paging for RC, registering pinned\n",
+                ibv_get_device_name(context->device));
+        return RDMA_MR_PINNED;
+    }
+    if (want == RDMA_MR_ODP_IMPLICIT &&
+        !(dev_attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT)) {
+        fprintf(stderr, "%s has no implicit on-demand paging, registering the buffer alone\n",
+                ibv_get_device_name(context->device));
+        return RDMA_MR_ODP;
+    }
+    return want;
+}
+
+static struct ibv_mr *register_buffer(struct rdma_context *ctx, enum rdma_mr_mode mode, int access) {
+    switch (mode) {
+    case RDMA_MR_ODP_IMPLICIT:
+        return ibv_reg_mr(ctx->pd, NULL, SIZE_MAX, access | IBV_ACCESS_ON_DEMAND);
+    case RDMA_MR_ODP:
+        return ibv_reg_mr(ctx->pd, ctx->buffer, ctx->buffer_size, access | IBV_ACCESS_ON_DEMAND);
+    default:
+        return ibv_reg_mr(ctx->pd, ctx->buffer, ctx->buffer_size, access);
+    }
+}
+
+int setup_rdma_resources(struct rdma_context *ctx, const struct rdma_resource_attr *attr) {
+    struct ibv_port_attr port_attr;
+    enum rdma_mr_mode mode;
+
+    rdma_phase_begin(ctx);
+    if (!ctx->context) {
+        ctx->context = open_device(attr->device, attr->quiet);
+        if (!ctx->context) {
+            return -1;
+        }
+        ctx->owns_context = 1;
+        ctx->port_num = attr->port_num;
+    }
+    rdma_phase_end(ctx, RDMA_PHASE_DEVICE);
+    if (!ctx->port_num) {
+        ctx->port_num = 1;
+    }
+
+    // Allocate protection domain
+    ctx->pd = ibv_alloc_pd(ctx->context);
+    if (!ctx->pd) {
+        fprintf(stderr, "Failed to allocate protection domain\n");
+        return -1;
+    }
+
+    // Query port attributes
+    if (ibv_query_port(ctx->context, ctx->port_num, &port_attr)) {
+        fprintf(stderr, "Failed to query port attributes\n");
+        return -1;
+    }
+
+    if (!attr->quiet) {
+        printf("Port state: %s\n", ibv_port_state_str(port_attr.state));
+    }
+    if (port_attr.state != IBV_PORT_ACTIVE) {
+        fprintf(stderr, "Port is not active\n");
+        return -1;
+    }
+    rdma_phase_end(ctx, RDMA_PHASE_PD);
+
+    // Completion queues: shared ones, or our own
+    if (attr->shared_cq) {
+        ctx->cq = attr->shared_cq;
+        ctx->recv_cq = attr->shared_recv_cq;
+    } else {
+        ctx->owns_cqs = 1;
+        ctx->cq = rdma_create_cq(ctx->context, attr->cq_depth, attr);
+        if (!ctx->cq) {
+            return -1;
+        }
+        if (attr->split_cqs) {
+            ctx->recv_cq = rdma_create_cq(ctx->context, attr->cq_depth, attr);
+            if (!ctx->recv_cq) {
+                return -1;
+            }
+        }
+    }
+    rdma_phase_end(ctx, RDMA_PHASE_CQ);
+
+    // Allocate and register memory; the caller's memory is registered as it
+    // is. On-demand buffers are mapped and left alone, so that a page only
+    // takes memory once something touches it
+    mode = supported_mr_mode(ctx->context, attr->mr_mode);
+    if (attr->buffer) {
+        ctx->buffer = attr->buffer;
+        ctx->buffer_size = attr->buffer_size;
+    } else if (mode != RDMA_MR_PINNED) {
+        ctx->buffer = mmap(NULL, attr->buffer_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ctx->buffer == MAP_FAILED) {
+            ctx->buffer = NULL;
+            fprintf(stderr, "Failed to map %zu byte buffer: %s\n", attr->buffer_size, strerror(errno));
+            return -1;
+        }
+        ctx->buffer_size = attr->buffer_size;
+        ctx->owns_buffer = 1;
+        ctx->buffer_mapped = 1;
+    } else {
+        ctx->buffer = malloc(attr->buffer_size);
+        if (!ctx->buffer) {
+            fprintf(stderr, "Failed to allocate buffer\n");
+            return -1;
+        }
+        ctx->buffer_size = attr->buffer_size;
+        ctx->owns_buffer = 1;
+
+        if (attr->fill_pattern) {
+            for (size_t i = 0; i < attr->buffer_size; i++) {
+                ctx->buffer[i] = (char)(i % 256);
+            }
+        } else {
+            memset(ctx->buffer, 0, attr->buffer_size);
+        }
+    }
+
+    // The device may still refuse what it claims; step down a mode at a time
+    while (!(ctx->mr = register_buffer(ctx, mode, attr->access ? attr->access : DEFAULT_ACCESS)) &&
+           mode != RDMA_MR_PINNED) {
+        fprintf(stderr, "Failed to register %s memory region (%s), trying %s\n",
+                rdma_mr_mode_names[mode], strerror(errno), rdma_mr_mode_names[mode - 1]);
+        mode = (enum rdma_mr_mode)(mode - 1);
+    }
+    if (!ctx->mr) {
+        fprintf(stderr, "Failed to register memory region\n");
+        return -1;
+    }
+    ctx->mr_mode = mode;
+    if (!attr->quiet && mode != RDMA_MR_PINNED) {
+        printf("Buffer registered for on-demand paging (%s)\n", rdma_mr_mode_names[mode]);
+    }
+    rdma_phase_end(ctx, RDMA_PHASE_MR);
+
+    return 0;
+}
+
+struct ibv_cq *rdma_create_cq(struct ibv_context *context, int depth,
+                              const struct rdma_resource_attr *attr) {
+    struct ibv_modify_cq_attr mod;
+    struct ibv_cq *cq;
+    int ret;
+
+    cq = ibv_create_cq(context, depth, NULL, attr->cq_channel, 0);
+    if (!cq) {
+        fprintf(stderr, "Failed to create completion queue\n");
+        return NULL;
+    }
+    if (attr->cq_moderation_count || attr->cq_moderation_usec) {
+        memset(&mod, 0, sizeof(mod));
+        mod.attr_mask = IBV_CQ_ATTR_MODERATE;
+        mod.moderate.cq_count = attr->cq_moderation_count;
+        mod.moderate.cq_period = attr->cq_moderation_usec;
+        ret = ibv_modify_cq(cq, &mod);
+        if (ret) {
+            fprintf(stderr, "CQ moderation not available (%s), continuing without\n",
+                    strerror(ret));
+        }
+    }
+    return cq;
+}
+
+void rdma_qp_init_attr(const struct rdma_context *ctx, const struct rdma_resource_attr *attr,
+                       struct ibv_qp_init_attr *qp_init_attr) {
+    memset(qp_init_attr, 0, sizeof(*qp_init_attr));
+    qp_init_attr->qp_type = IBV_QPT_RC;
+    qp_init_attr->send_cq = ctx->cq;
+    qp_init_attr->recv_cq = ctx->recv_cq ? ctx->recv_cq : ctx->cq;
+    qp_init_attr->cap.max_send_wr = attr->qp_depth;
+    qp_init_attr->cap.max_recv_wr = attr->qp_depth;
+    qp_init_attr->cap.max_send_sge = 1;
+    qp_init_attr->cap.max_recv_sge = 1;
+    qp_init_attr->cap.max_inline_data = attr->max_inline;
+}
+
+int create_rdma_qp(struct rdma_context *ctx, const struct rdma_resource_attr *attr) {
+    struct ibv_qp_init_attr qp_init_attr;
+
+    rdma_phase_begin(ctx);
+    rdma_qp_init_attr(ctx, attr, &qp_init_attr);
+    ctx->qp = ibv_create_qp(ctx->pd, &qp_init_attr);
+    if (!ctx->qp) {
+        fprintf(stderr, "Failed to create queue pair\n");
+        return -1;
+    }
+    rdma_phase_end(ctx, RDMA_PHASE_QP);
+    return 0;
+}
+
+void cleanup_rdma_resources(struct rdma_context *ctx) {
+    if (ctx->qp) {
+        ibv_destroy_qp(ctx->qp);
+        ctx->qp = NULL;
+    }
+    if (ctx->mr) {
+        ibv_dereg_mr(ctx->mr);
+        ctx->mr = NULL;
+    }
+    if (ctx->recv_cq && ctx->owns_cqs) {
+        ibv_destroy_cq(ctx->recv_cq);
+    }
+    ctx->recv_cq = NULL;
+    if (ctx->cq && ctx->owns_cqs) {
+        ibv_destroy_cq(ctx->cq);
+    }
+    ctx->cq = NULL;
+    ctx->owns_cqs = 0;
+    if (ctx->pd) {
+        ibv_dealloc_pd(ctx->pd);
+        ctx->pd = NULL;
+    }
+    if (ctx->context && ctx->owns_context) {
+        ibv_close_device(ctx->context);
+    }
+    ctx->context = NULL;
+    ctx->owns_context = 0;
+    if (ctx->owns_buffer && ctx->buffer_mapped) {
+        munmap(ctx->buffer, ctx->buffer_size);
+    } else if (ctx->owns_buffer) {
+        free(ctx->buffer);
+    }
+    ctx->owns_buffer = 0;
+    ctx->buffer_mapped = 0;
+    ctx->mr_mode = RDMA_MR_PINNED;
+    ctx->buffer = NULL;
+    ctx->buffer_size = 0;
+}
+
+int rdma_mr_prefetch(const struct rdma_context *ctx, size_t offset, size_t length, int write) {
+    enum ibv_advise_mr_advice advice = write ? IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE
+                                             : IBV_ADVISE_MR_ADVICE_PREFETCH;
+
+    if (ctx->mr_mode == RDMA_MR_PINNED) {
+        return 0;
+    }
+    while (length > 0) {
+        struct ibv_sge sge = {
+            .addr = (uintptr_t)ctx->buffer + offset,
+            .length = length < PREFETCH_CHUNK ? length : PREFETCH_CHUNK,
+            .lkey = ctx->mr->lkey,
+        };
+        int ret = ibv_advise_mr(ctx->pd, advice, IBV_ADVISE_MR_FLAG_FLUSH, &sge, 1);
+
+        if (ret) {
+            fprintf(stderr, "Failed to prefetch on-demand pages: %s\n", strerror(ret));
+            return -1;
+        }
+        offset += sge.length;
+        length -= sge.length;
+    }
+    return 0;
+}
+
+int rdma_parse_device_sel(const char *spec, struct rdma_device_sel *sel) {
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    int port = 1;
+
+    memset(sel, 0, sizeof(*sel));
+    sel->gid_index = -1;
+    if (len == 0 || len >= sizeof(sel->name)) {
+        fprintf(stderr, "Bad device name in '%s'\n", spec);
+        return -1;
+    }
+    memcpy(sel->name, spec, len);
+    if (colon && sscanf(colon + 1, "%d:%d", &port, &sel->gid_index) < 1) {
+        fprintf(stderr, "Bad port in '%s', expected name[:port[:gid_index]]\n", spec);
+        return -1;
+    }
+    if (port < 1 || port > 255) {
+        fprintf(stderr, "Bad port %d in '%s'\n", port, spec);
+        return -1;
+    }
+    sel->port_num = port;
+    return 0;
+}
+
+static int gid_is_ipv4(const union ibv_gid *gid) {
+    static const uint8_t v4_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    return !memcmp(gid->raw, v4_prefix, sizeof(v4_prefix));
+}
+
+int rdma_device_sel_addr(const struct rdma_device_sel *sel, struct sockaddr_storage *addr) {
+    struct ibv_context *context;
+    struct ibv_port_attr port_attr;
+    union ibv_gid gid;
+    int found = -1;
+
+    context = open_device(sel->name, 1);
+    if (!context) {
+        return -1;
+    }
+    if (ibv_query_port(context, sel->port_num, &port_attr)) {
+        fprintf(stderr, "Failed to query port %d of %s\n", sel->port_num, sel->name);
+        ibv_close_device(context);
+        return -1;
+    }
+    for (int i = 0; i < port_attr.gid_tbl_len && found < 0; i++) {
+        if (sel->gid_index >= 0 && i != sel->gid_index) {
+            continue;
+        }
+        if (ibv_query_gid(context, sel->port_num, i, &gid)) {
+            continue;
+        }
+        if (sel->gid_index >= 0 || gid_is_ipv4(&gid)) {
+            found = i;
+        }
+    }
+    ibv_close_device(context);
+
+    if (found < 0) {
+        if (sel->gid_index >= 0) {
+            fprintf(stderr, "%s port %d has no GID %d\n", sel->name, sel->port_num, sel->gid_index);
+        } else {
+            fprintf(stderr, "%s port %d has no IPv4 GID\n", sel->name, sel->port_num);
+        }
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    if (gid_is_ipv4(&gid)) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, &gid.raw[12], 4);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, gid.raw, 16);
+    }
+    return 0;
+}
+
+void report_rdma_results(const struct rdma_context *ctx, int operations) {
+    double elapsed = (ctx->end_time.tv_sec - ctx->start_time.tv_sec) +
+                     (ctx->end_time.tv_nsec - ctx->start_time.tv_nsec) / 1e9;
+    double throughput_mbps = (ctx->bytes_transferred * 8.0) / (elapsed * 1e6);
+
+    printf("\n=== RDMA Performance Results ===\n");
+    printf("Operations completed: %d\n", operations);
+    printf("Total bytes transferred: %lu\n", ctx->bytes_transferred);
+    printf("Elapsed time: %.3f seconds\n", elapsed);
+    printf("Throughput: %.2f Mbps\n", throughput_mbps);
+    printf("Throughput: %.2f MB/s\n", ctx->bytes_transferred / (elapsed * 1e6));
+}
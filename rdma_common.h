@@ -0,0 +1,189 @@
+/*
+ * Shared RDMA context, resource setup and teardown (librdmademo)
+ *
+ * Every program in this repo builds the same stack of verbs objects: a
+ * device context, one protection domain, one completion queue, a single
+ * registered buffer and an RC queue pair. This is that code, once.
+ *
+ * The buffer is pinned by default. For buffers far larger than what is
+ * ever touched, attr->mr_mode asks for on-demand paging instead: the
+ * buffer is mapped but left untouched, and the device faults pages in as
+ * it uses them, so registration is quick and only the touched pages take
+ * memory. RDMA_MR_ODP_IMPLICIT goes further and registers the whole
+ * address space, so any address in it works with ctx->mr's keys. Note
+ * that this means the peer's rkey reaches all of this process's memory.
+ * A mode the device lacks steps down to the next one (implicit, explicit,
+ * pinned), and ctx->mr_mode says what the buffer got.
+ *
+ * Servers with many QPs can instead have them complete on CQs shared
+ * across connections (attr->shared_cq, made with rdma_create_cq()), split
+ * sends and receives onto separate CQs, and moderate CQ events. Code in
+ * this repo polls ctx->cq for everything; a split receive CQ
+ * (ctx->recv_cq) is for callers that poll it themselves.
+ *
+ * setup_rdma_resources() either opens a device itself (attr->device, or the
+ * first one) or, when ctx->context is already set (by rdma_cm, see
+ * rdma_connection.h), builds on that device. With rdma_cm the device
+ * follows the local address a connection is bound to; rdma_device_sel
+ * turns a device, port and GID index into that address.
+ *
+ * On failure setup_rdma_resources() leaves whatever it did create in ctx,
+ * and cleanup_rdma_resources() releases exactly that, so callers always
+ * pair the two no matter how far setup got. Cleanup is idempotent.
+ *
+ * This file needs only libibverbs; connection management lives in
+ * rdma_connection.c so the verbs-only demos don't pull in librdmacm.
+ */
+
+#ifndef RDMA_COMMON_H
+#define RDMA_COMMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rdma_cm_id;
+struct rdma_event_channel;
+struct rdma_conn_pool;
+
+// Connection setup phases, timed into ctx->timing when it is set
+enum rdma_setup_phase {
+    RDMA_PHASE_DEVICE,      // device list and open (rdma_cm opens devices itself)
+    RDMA_PHASE_PD,          // protection domain and port query
+    RDMA_PHASE_CQ,
+    RDMA_PHASE_MR,          // buffer allocation, fill and registration
+    RDMA_PHASE_QP,          // creation, or a pooled QP's move to INIT
+    RDMA_PHASE_ADDR,        // rdma_getaddrinfo and address resolution
+    RDMA_PHASE_ROUTE,
+    RDMA_PHASE_CONNECT,     // connect/accept until established (a pooled QP's RTR/RTS)
+    RDMA_PHASE_COUNT,
+};
+
+struct rdma_setup_timing {
+    uint64_t ns[RDMA_PHASE_COUNT];
+    uint64_t mark;          // end of the last timed phase
+};
+
+extern const char *const rdma_phase_names[RDMA_PHASE_COUNT];
+
+// How the buffer is registered, see above; in order of falling back
+enum rdma_mr_mode {
+    RDMA_MR_PINNED,
+    RDMA_MR_ODP,            // IBV_ACCESS_ON_DEMAND over the buffer
+    RDMA_MR_ODP_IMPLICIT,   // IBV_ACCESS_ON_DEMAND over the whole address space
+    RDMA_MR_MODE_COUNT,
+};
+
+extern const char *const rdma_mr_mode_names[RDMA_MR_MODE_COUNT];
+
+struct rdma_resource_attr {
+    size_t buffer_size;
+    int cq_depth;
+    int qp_depth;           // send and receive WRs each
+    uint32_t max_inline;    // bytes a send WR may carry inline, 0 for none
+    int access;             // MR access flags, 0 for local/remote read+write
+    int fill_pattern;       // fill the buffer with i % 256 rather than zeros (pinned only)
+    enum rdma_mr_mode mr_mode;
+    int quiet;              // no progress output, for setup benchmarks
+    const char *device;     // device to open by name, NULL for the first (not with rdma_cm)
+    uint8_t port_num;       // 0 for port 1 (not with rdma_cm)
+    const struct sockaddr *src_addr;    // bind rdma_cm connections here, NULL for any
+    char *buffer;           // register this memory (buffer_size bytes) instead of allocating
+    struct ibv_cq *shared_cq;       // complete on this CQ rather than one of ctx's own
+    struct ibv_cq *shared_recv_cq;  // with shared_cq: receives on this one, NULL for shared_cq
+    int split_cqs;          // own CQs: a receive CQ apart from the send CQ
+    struct ibv_comp_channel *cq_channel;    // own CQs: events on this channel
+    uint16_t cq_moderation_count;   // CQ event moderation: completions per event,
+    uint16_t cq_moderation_usec;    //   or at most this delay; 0/0 for none
+};
+
+// A device port and the GID on it, as given on the command line:
+// "name[:port[:gid_index]]"
+struct rdma_device_sel {
+    char name[IBV_SYSFS_NAME_MAX];
+    uint8_t port_num;
+    int gid_index;          // -1 for the first IPv4 GID
+};
+
+struct rdma_context {
+    struct ibv_context *context;
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    struct ibv_cq *recv_cq; // NULL when receives complete on cq
+    struct ibv_qp *qp;
+    struct ibv_mr *mr;
+    char *buffer;
+    size_t buffer_size;
+    int owns_context;       // opened by setup_rdma_resources(), not rdma_cm
+    int owns_buffer;        // allocated by setup_rdma_resources(), not attr->buffer
+    int buffer_mapped;      // that allocation is an mmap (on-demand paging), not malloc
+    enum rdma_mr_mode mr_mode;
+    int owns_cqs;           // cq/recv_cq are ctx's own, not attr->shared_cq
+    uint8_t port_num;
+
+    // Connection management, see rdma_connection.h
+    struct rdma_event_channel *cm_channel;
+    struct rdma_cm_id *listen_id;
+    struct rdma_cm_id *cm_id;
+    uint64_t remote_addr;   // peer's buffer, exchanged in CM private data
+    uint32_t remote_rkey;
+    uint64_t remote_length;
+    int connected;
+    struct rdma_conn_pool *pool;    // verbs resources lent by a pool, see rdma_connection.h
+    struct rdma_setup_timing *timing;
+
+    uint64_t bytes_transferred;
+    struct timespec start_time, end_time;
+};
+
+int setup_rdma_resources(struct rdma_context *ctx, const struct rdma_resource_attr *attr);
+
+// A CQ of depth entries with attr's channel and moderation, for sharing
+// among connections. Moderation the device lacks is reported and skipped
+struct ibv_cq *rdma_create_cq(struct ibv_context *context, int depth,
+                              const struct rdma_resource_attr *attr);
+
+// RC QP on ctx's PD with ctx->cq for sends, and receives unless ctx->recv_cq
+void rdma_qp_init_attr(const struct rdma_context *ctx, const struct rdma_resource_attr *attr,
+                       struct ibv_qp_init_attr *qp_init_attr);
+int create_rdma_qp(struct rdma_context *ctx, const struct rdma_resource_attr *attr);
+
+void cleanup_rdma_resources(struct rdma_context *ctx);
+
+// Fault length bytes of the buffer at offset in ahead of use, for writing
+// or only reading, and wait for it. Nothing to do for pinned buffers;
+// on-demand ones return -1 if the device can't prefetch
+int rdma_mr_prefetch(const struct rdma_context *ctx, size_t offset, size_t length, int write);
+
+int rdma_parse_device_sel(const char *spec, struct rdma_device_sel *sel);
+// The IP address in sel's GID (RoCE GIDs carry the netdev's addresses).
+// Binding a connection to it puts the connection on that device and port
+int rdma_device_sel_addr(const struct rdma_device_sel *sel, struct sockaddr_storage *addr);
+
+// Start timing at the current time, then charge everything since the last
+// mark to phase. Both do nothing when ctx->timing is NULL
+void rdma_phase_begin(struct rdma_context *ctx);
+void rdma_phase_end(struct rdma_context *ctx, enum rdma_setup_phase phase);
+
+// The "=== RDMA Performance Results ===" summary from start/end_time
+void report_rdma_results(const struct rdma_context *ctx, int operations);
+
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t rdma_now_ns(void);
+// qsort() comparator for uint64_t, for latency percentiles
+int rdma_cmp_u64(const void *a, const void *b);
+// Comma list of names (an option's argument, cut up in place) into a mask of
+// their indices in names[0..count-1]; -1 on an unknown name or an empty list
+int rdma_parse_names(char *list, const char *const *names, int count, unsigned *mask);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
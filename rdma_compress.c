@@ -0,0 +1,323 @@
+/*
+ * Chunk compression stage: codecs, worker pool and adaptive controller.
+ * See rdma_compress.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "rdma_compress.h"
+#include "rdma_common.h"
+
+#define EWMA_WEIGHT 4               // each chunk moves the ratio a quarter of the way
+
+const char *const compress_codec_names[COMPRESS_CODEC_COUNT] = {"none", "lz4", "zstd"};
+
+struct compress_worker {
+    struct compress_pool *pool;
+    pthread_t thread;
+    int started;
+#ifdef HAVE_LZ4
+    void *lz4;                      // LZ4_compress_fast_extState() state
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+#endif
+};
+
+struct compress_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct compress_job *queue[COMPRESS_QUEUE];
+    uint64_t head;                  // next to queue
+    uint64_t tail;                  // next to run
+    int stop;
+    int nworkers;
+    struct compress_worker workers[COMPRESS_MAX_WORKERS];
+};
+
+int compress_codec_available(enum compress_codec codec) {
+    switch (codec) {
+    case COMPRESS_NONE:
+        return 1;
+    case COMPRESS_LZ4:
+#ifdef HAVE_LZ4
+        return 1;
+#else
+        return 0;
+#endif
+    case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+        return 1;
+#else
+        return 0;
+#endif
+    default:
+        return 0;
+    }
+}
+
+// Payload bytes for src_len raw bytes at most, 0 when it did not fit
+static size_t codec_compress(struct compress_worker *w, const struct compress_job *j, char *out,
+                             size_t cap) {
+    switch (j->codec) {
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4: {
+        int n;
+
+        if (!w->lz4 && !(w->lz4 = malloc(LZ4_sizeofState()))) {
+            return 0;
+        }
+        n = LZ4_compress_fast_extState(w->lz4, j->src, out, j->src_len, cap, 1);
+        return n > 0 ? (size_t)n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t n;
+
+        if (!w->cctx && !(w->cctx = ZSTD_createCCtx())) {
+            return 0;
+        }
+        n = ZSTD_compressCCtx(w->cctx, out, cap, j->src, j->src_len, j->level);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        (void)w;
+        (void)out;
+        (void)cap;
+        return 0;
+    }
+}
+
+// 0 when exactly raw_len bytes came out
+static int codec_decompress(struct compress_worker *w, enum compress_codec codec, const char *in,
+                            size_t in_len, char *out, size_t raw_len) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4:
+        return LZ4_decompress_safe(in, out, in_len, raw_len) == (int)raw_len ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t n;
+
+        if (!w->dctx && !(w->dctx = ZSTD_createDCtx())) {
+            return -1;
+        }
+        n = ZSTD_decompressDCtx(w->dctx, out, raw_len, in, in_len);
+        return !ZSTD_isError(n) && n == raw_len ? 0 : -1;
+    }
+#endif
+    default:
+        (void)w;
+        (void)in;
+        (void)in_len;
+        (void)out;
+        (void)raw_len;
+        return -1;
+    }
+}
+
+static void run_job(struct compress_worker *w, struct compress_job *j) {
+    const size_t hdr_len = sizeof(struct compress_hdr);
+
+    j->out_len = 0;
+    j->status = 0;
+    if (j->op == COMPRESS_OP_COMPRESS) {
+        struct compress_hdr *h = (struct compress_hdr *)j->dst;
+        // Staged, the chunk must come out smaller than raw or it is no use
+        size_t cap = j->src_len > hdr_len ? j->src_len - hdr_len - 1 : 0;
+        size_t n;
+
+        if (j->dst_cap < hdr_len) {
+            j->status = -1;
+            return;
+        }
+        if (cap > j->dst_cap - hdr_len) {
+            cap = j->dst_cap - hdr_len;
+        }
+        n = cap ? codec_compress(w, j, j->dst + hdr_len, cap) : 0;
+        if (n) {
+            h->codec = j->codec;
+            h->raw_len = j->src_len;
+            h->comp_len = n;
+            h->seq = j->seq;
+            j->out_len = hdr_len + n;
+        }
+    } else {
+        struct compress_hdr h;
+
+        if (j->src_len < hdr_len) {
+            j->status = -1;
+            return;
+        }
+        memcpy(&h, j->src, hdr_len);
+        if (h.comp_len > j->src_len - hdr_len || h.raw_len > j->dst_cap ||
+            codec_decompress(w, h.codec, j->src + hdr_len, h.comp_len, j->dst, h.raw_len)) {
+            j->status = -1;
+            return;
+        }
+        j->out_len = h.raw_len;
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct compress_worker *w = arg;
+    struct compress_pool *p = w->pool;
+
+    for (;;) {
+        struct compress_job *j;
+        uint64_t start;
+
+        pthread_mutex_lock(&p->lock);
+        while (p->head == p->tail && !p->stop) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->head == p->tail) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        j = p->queue[p->tail++ & (COMPRESS_QUEUE - 1)];
+        pthread_mutex_unlock(&p->lock);
+
+        start = rdma_now_ns();
+        run_job(w, j);
+        j->ns = rdma_now_ns() - start;
+        __atomic_store_n(&j->done, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+struct compress_pool *compress_pool_create(int workers) {
+    struct compress_pool *p;
+
+    if (workers < 1 || workers > COMPRESS_MAX_WORKERS) {
+        fprintf(stderr, "Compression workers must be 1..%d\n", COMPRESS_MAX_WORKERS);
+        return NULL;
+    }
+    p = calloc(1, sizeof(*p));
+    if (!p) {
+        fprintf(stderr, "Failed to allocate compression pool\n");
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    for (int i = 0; i < workers; i++) {
+        p->workers[i].pool = p;
+        if (pthread_create(&p->workers[i].thread, NULL, worker_main, &p->workers[i])) {
+            fprintf(stderr, "Failed to start compression worker %d\n", i);
+            compress_pool_destroy(p);
+            return NULL;
+        }
+        p->workers[i].started = 1;
+        p->nworkers++;
+    }
+    return p;
+}
+
+// Workers finish what is queued before they exit
+void compress_pool_destroy(struct compress_pool *p) {
+    if (!p) {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < COMPRESS_MAX_WORKERS; i++) {
+        struct compress_worker *w = &p->workers[i];
+
+        if (w->started) {
+            pthread_join(w->thread, NULL);
+        }
+#ifdef HAVE_LZ4
+        free(w->lz4);
+#endif
+#ifdef HAVE_ZSTD
+        ZSTD_freeCCtx(w->cctx);
+        ZSTD_freeDCtx(w->dctx);
+#endif
+    }
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+int compress_pool_submit(struct compress_pool *p, struct compress_job *job) {
+    job->done = 0;
+    pthread_mutex_lock(&p->lock);
+    if (p->head - p->tail == COMPRESS_QUEUE) {
+        pthread_mutex_unlock(&p->lock);
+        return 1;
+    }
+    p->queue[p->head++ & (COMPRESS_QUEUE - 1)] = job;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+int compress_job_done(const struct compress_job *job) {
+    return __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+}
+
+void compress_ctl_init(struct compress_ctl *c, enum compress_codec codec, int adaptive,
+                       double min_ratio) {
+    memset(c, 0, sizeof(*c));
+    c->codec = codec;
+    c->adaptive = adaptive;
+    c->min_ratio = min_ratio > 0 ? min_ratio : COMPRESS_MIN_RATIO;
+}
+
+enum compress_decision compress_ctl_decide(struct compress_ctl *c, int worker_free, int wire_idle) {
+    if (c->codec == COMPRESS_NONE) {
+        return COMPRESS_SKIP_RATIO;
+    }
+    if (!c->adaptive) {
+        return worker_free ? COMPRESS_DO : COMPRESS_WAIT;
+    }
+
+    // Not compressing lately: send raw, but keep sampling in case that changed
+    if (c->ratio && c->ratio < c->min_ratio) {
+        if (++c->since_probe < COMPRESS_PROBE_EVERY || !worker_free) {
+            c->skip_ratio++;
+            return COMPRESS_SKIP_RATIO;
+        }
+        c->since_probe = 0;
+        c->probes++;
+        return COMPRESS_DO;
+    }
+
+    // Compressing pays, if there is CPU for it. Otherwise a raw chunk beats
+    // a wire running dry, but not one already busy
+    if (worker_free) {
+        return COMPRESS_DO;
+    }
+    if (wire_idle) {
+        c->skip_cpu++;
+        return COMPRESS_SKIP_CPU;
+    }
+    return COMPRESS_WAIT;
+}
+
+void compress_ctl_update(struct compress_ctl *c, uint32_t raw_len, uint32_t out_len) {
+    double sample = out_len ? (double)raw_len / out_len : 1.0;
+
+    if (out_len) {
+        c->compressed++;
+    } else {
+        c->stored++;
+    }
+    c->ratio = c->ratio ? c->ratio + (sample - c->ratio) / EWMA_WEIGHT : sample;
+}
@@ -0,0 +1,117 @@
+/*
+ * Chunk compression stage for bandwidth-bound transfers (librdmademo)
+ *
+ * When the link, not the CPU, limits a transfer, compressing chunks on the
+ * way out buys bandwidth with cores. The stage has three parts:
+ *
+ *   codecs      LZ4 (HAVE_LZ4) for speed and Zstandard (HAVE_ZSTD) for
+ *               ratio, each built in when its library is installed
+ *   pool        worker threads that compress a raw chunk into a staged
+ *               chunk (a compress_hdr and the compressed bytes; in the
+ *               sender's pre-registered staging buffers, ready to WRITE) or
+ *               decompress a staged chunk where its raw bytes belong. Each
+ *               worker keeps its own codec state
+ *   controller  decides per chunk whether compressing it pays: not while
+ *               chunks have been shrinking less than min_ratio (it still
+ *               probes one in COMPRESS_PROBE_EVERY to notice the data
+ *               changing), and not when every worker is busy but the wire
+ *               is idle. Then the raw chunk goes out instead, at no CPU cost
+ *
+ * A chunk that does not come out smaller than it went in is never staged:
+ * the job reports it and the caller sends the raw chunk.
+ *
+ * compress_bench drives the stage over RDMA WRITE and reports goodput
+ * against the raw transfer.
+ */
+
+#ifndef RDMA_COMPRESS_H
+#define RDMA_COMPRESS_H
+
+#include <stdint.h>
+
+#define COMPRESS_MAX_WORKERS 64
+#define COMPRESS_QUEUE 256              // jobs queued in a pool, power of two
+#define COMPRESS_MIN_RATIO 1.1
+#define COMPRESS_PROBE_EVERY 32         // chunks skipped for ratio between probes
+
+enum compress_codec {
+    COMPRESS_NONE,
+    COMPRESS_LZ4,
+    COMPRESS_ZSTD,
+    COMPRESS_CODEC_COUNT,
+};
+
+extern const char *const compress_codec_names[COMPRESS_CODEC_COUNT];
+
+// 1 when codec is built in (COMPRESS_NONE always is)
+int compress_codec_available(enum compress_codec codec);
+
+// Start of a staged chunk; comp_len compressed bytes follow
+struct compress_hdr {
+    uint32_t codec;
+    uint32_t raw_len;
+    uint32_t comp_len;
+    uint32_t seq;           // the caller's chunk number
+};
+
+enum compress_op {
+    COMPRESS_OP_COMPRESS,   // raw src into a staged chunk at dst
+    COMPRESS_OP_DECOMPRESS, // staged chunk at src into raw bytes at dst
+};
+
+struct compress_job {
+    enum compress_op op;
+    enum compress_codec codec;  // compress only; decompress reads the header
+    int level;                  // zstd compression level
+    const char *src;
+    uint32_t src_len;
+    char *dst;
+    uint32_t dst_cap;
+    uint32_t seq;
+
+    // Valid once compress_job_done()
+    uint32_t out_len;           // staged or raw bytes written; 0 when a compressed
+                                // chunk would not have been smaller than raw
+    int status;                 // 0, or -1 for a corrupt or oversized chunk
+    uint64_t ns;                // the worker's time on it
+    int done;
+};
+
+struct compress_pool;
+
+struct compress_pool *compress_pool_create(int workers);
+void compress_pool_destroy(struct compress_pool *p);
+// 0 when queued, 1 with the queue full. job must stay put until done
+int compress_pool_submit(struct compress_pool *p, struct compress_job *job);
+int compress_job_done(const struct compress_job *job);
+
+enum compress_decision {
+    COMPRESS_DO,
+    COMPRESS_SKIP_RATIO,    // send raw: the data has not been compressing
+    COMPRESS_SKIP_CPU,      // send raw: no worker free and the wire idle
+    COMPRESS_WAIT,          // no worker free and the wire busy: decide later
+};
+
+struct compress_ctl {
+    enum compress_codec codec;  // COMPRESS_NONE sends everything raw
+    int adaptive;               // 0 compresses every chunk, waiting for workers
+    double min_ratio;
+    double ratio;               // moving average of raw / staged bytes, 0 before any
+    uint64_t since_probe;
+
+    uint64_t compressed;        // chunks staged
+    uint64_t stored;            // compressed but no smaller, sent raw
+    uint64_t skip_ratio;
+    uint64_t skip_cpu;
+    uint64_t probes;
+};
+
+void compress_ctl_init(struct compress_ctl *c, enum compress_codec codec, int adaptive,
+                       double min_ratio);
+// For the next chunk; worker_free: a worker (and a staging buffer) is
+// free, wire_idle: the wire is close to running dry
+enum compress_decision compress_ctl_decide(struct compress_ctl *c, int worker_free, int wire_idle);
+// With each compressed chunk's outcome (out_len 0 when stored raw)
+void compress_ctl_update(struct compress_ctl *c, uint32_t raw_len, uint32_t out_len);
+
+#endif
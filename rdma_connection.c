@@ -0,0 +1,657 @@
+/*
+ * RC connection setup over rdma_cm. See rdma_connection.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_connection.h"
+
+#define SERVE_POLL_MS 200   // how often serve_connections() looks at *running
+#define CM_RD_ATOMIC 1      // RDMA READs in flight each way (responder/initiator depth)
+
+// Carried in the connect request and in the accept reply
+struct rdma_buffer_info {
+    uint64_t addr;          // big endian
+    uint32_t rkey;
+    uint32_t pad;
+    uint64_t length;        // on-demand buffers can be well over 4 GB
+};
+
+struct rdma_conn_pool {
+    struct ibv_context *verbs;
+    struct rdma_resource_attr attr;
+    int size;
+    int count;
+    struct rdma_context entries[];  // [0, count) are ready
+};
+
+static void local_buffer_info(const struct rdma_context *ctx, struct rdma_buffer_info *info) {
+    info->addr = htobe64((uintptr_t)ctx->buffer);
+    info->rkey = htobe32(ctx->mr->rkey);
+    info->pad = 0;
+    info->length = htobe64(ctx->buffer_size);
+}
+
+static int read_buffer_info(struct rdma_context *ctx, const struct rdma_cm_event *event) {
+    struct rdma_buffer_info info;
+
+    if (!event->param.conn.private_data ||
+        event->param.conn.private_data_len < sizeof(info)) {
+        fprintf(stderr, "Peer did not send its buffer address\n");
+        return -1;
+    }
+    memcpy(&info, event->param.conn.private_data, sizeof(info));
+    ctx->remote_addr = be64toh(info.addr);
+    ctx->remote_rkey = be32toh(info.rkey);
+    ctx->remote_length = be64toh(info.length);
+    return 0;
+}
+
+// Next event on the channel, which must be `expected`; the caller acks it
+static int wait_cm_event(struct rdma_context *ctx, enum rdma_cm_event_type expected,
+                         struct rdma_cm_event **event) {
+    if (rdma_get_cm_event(ctx->cm_channel, event)) {
+        fprintf(stderr, "Failed to get CM event\n");
+        return -1;
+    }
+    if ((*event)->event != expected) {
+        fprintf(stderr, "Unexpected CM event: %s (status %d), expected %s\n",
+                rdma_event_str((*event)->event), (*event)->status, rdma_event_str(expected));
+        rdma_ack_cm_event(*event);
+        return -1;
+    }
+    return 0;
+}
+
+// Move a QP we created ourselves (pool-style, not rdma_create_qp()) to
+// state with the attributes rdma_cm has for the connection
+static int cm_modify_qp(struct rdma_context *ctx, enum ibv_qp_state state) {
+    struct ibv_qp_attr qp_attr;
+    int mask;
+
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.qp_state = state;
+    if (rdma_init_qp_attr(ctx->cm_id, &qp_attr, &mask)) {
+        fprintf(stderr, "Failed to get QP attributes\n");
+        return -1;
+    }
+    if (state == IBV_QPS_RTR) {
+        qp_attr.max_dest_rd_atomic = CM_RD_ATOMIC;
+    } else if (state == IBV_QPS_RTS) {
+        qp_attr.max_rd_atomic = CM_RD_ATOMIC;
+    }
+    if (ibv_modify_qp(ctx->qp, &qp_attr, mask)) {
+        fprintf(stderr, "Failed to modify QP to state %d\n", state);
+        return -1;
+    }
+    return 0;
+}
+
+static void pool_take(struct rdma_conn_pool *pool, struct rdma_context *ctx) {
+    const struct rdma_context *e = &pool->entries[--pool->count];
+
+    ctx->pd = e->pd;
+    ctx->cq = e->cq;
+    ctx->recv_cq = e->recv_cq;
+    ctx->owns_cqs = e->owns_cqs;
+    ctx->qp = e->qp;
+    ctx->mr = e->mr;
+    ctx->buffer = e->buffer;
+    ctx->buffer_size = e->buffer_size;
+    ctx->owns_buffer = e->owns_buffer;
+    ctx->buffer_mapped = e->buffer_mapped;
+    ctx->mr_mode = e->mr_mode;
+}
+
+// Reset the QP and hand ctx's resources back to its pool. With the pool
+// full, or the reset failing, they stay in ctx for cleanup_rdma_resources().
+// The buffer keeps whatever the last connection left in it
+static void pool_recycle(struct rdma_context *ctx) {
+    struct rdma_conn_pool *pool = ctx->pool;
+    struct ibv_qp_attr qp_attr;
+    struct ibv_wc wc[16];
+    struct rdma_context *e;
+
+    if (pool->count == pool->size) {
+        return;
+    }
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.qp_state = IBV_QPS_RESET;
+    if (ibv_modify_qp(ctx->qp, &qp_attr, IBV_QP_STATE)) {
+        return;
+    }
+    // Nothing of the old connection may show up on the next one. Shared
+    // CQs are left to their owner, who knows whose completions are whose
+    if (ctx->owns_cqs) {
+        while (ibv_poll_cq(ctx->cq, 16, wc) > 0) {
+        }
+        while (ctx->recv_cq && ibv_poll_cq(ctx->recv_cq, 16, wc) > 0) {
+        }
+    }
+
+    e = &pool->entries[pool->count++];
+    memset(e, 0, sizeof(*e));
+    e->context = ctx->context;
+    e->pd = ctx->pd;
+    e->cq = ctx->cq;
+    e->recv_cq = ctx->recv_cq;
+    e->owns_cqs = ctx->owns_cqs;
+    e->qp = ctx->qp;
+    e->mr = ctx->mr;
+    e->buffer = ctx->buffer;
+    e->buffer_size = ctx->buffer_size;
+    e->owns_buffer = ctx->owns_buffer;
+    e->buffer_mapped = ctx->buffer_mapped;
+    e->mr_mode = ctx->mr_mode;
+
+    ctx->pd = NULL;
+    ctx->cq = NULL;
+    ctx->recv_cq = NULL;
+    ctx->owns_cqs = 0;
+    ctx->qp = NULL;
+    ctx->mr = NULL;
+    ctx->buffer = NULL;
+    ctx->buffer_size = 0;
+    ctx->owns_buffer = 0;
+    ctx->buffer_mapped = 0;
+    ctx->mr_mode = RDMA_MR_PINNED;
+}
+
+// Verbs resources on the device rdma_cm picked. When pool serves that
+// device they come from the pool (or are built the same way on a miss, so
+// they can go back to it) and the QP is ours to drive; otherwise rdma_cm
+// creates and drives the QP
+static int setup_cm_resources(struct rdma_context *ctx, const struct rdma_resource_attr *attr,
+                              struct rdma_conn_pool *pool) {
+    struct ibv_qp_init_attr qp_init_attr;
+
+    ctx->context = ctx->cm_id->verbs;
+    ctx->port_num = ctx->cm_id->port_num;
+
+    if (pool && pool->verbs == ctx->context) {
+        ctx->pool = pool;
+        if (pool->count > 0) {
+            pool_take(pool, ctx);
+        } else if (setup_rdma_resources(ctx, &pool->attr) || create_rdma_qp(ctx, &pool->attr)) {
+            return -1;
+        }
+        if (cm_modify_qp(ctx, IBV_QPS_INIT)) {
+            return -1;
+        }
+    } else {
+        if (setup_rdma_resources(ctx, attr)) {
+            return -1;
+        }
+        rdma_qp_init_attr(ctx, attr, &qp_init_attr);
+        if (rdma_create_qp(ctx->cm_id, ctx->pd, &qp_init_attr)) {
+            fprintf(stderr, "Failed to create queue pair\n");
+            return -1;
+        }
+        ctx->qp = ctx->cm_id->qp;
+    }
+    rdma_phase_end(ctx, RDMA_PHASE_QP);
+    return 0;
+}
+
+static void conn_param_init(struct rdma_conn_param *param, const struct rdma_buffer_info *info,
+                            const struct rdma_context *ctx) {
+    memset(param, 0, sizeof(*param));
+    param->private_data = info;
+    param->private_data_len = sizeof(*info);
+    param->responder_resources = CM_RD_ATOMIC;
+    param->initiator_depth = CM_RD_ATOMIC;
+    param->retry_count = 7;
+    param->rnr_retry_count = 7;
+    if (ctx->pool) {
+        param->qp_num = ctx->qp->qp_num;
+    }
+}
+
+int listen_rdma_connections(struct rdma_context *listener, const struct sockaddr *local, int port) {
+    struct sockaddr_storage addr;
+
+    listener->cm_channel = rdma_create_event_channel();
+    if (!listener->cm_channel) {
+        fprintf(stderr, "Failed to create CM event channel\n");
+        return -1;
+    }
+
+    if (rdma_create_id(listener->cm_channel, &listener->listen_id, NULL, RDMA_PS_TCP)) {
+        fprintf(stderr, "Failed to create RDMA CM ID\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    if (local && local->sa_family == AF_INET6) {
+        memcpy(&addr, local, sizeof(struct sockaddr_in6));
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(port);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+        if (local) {
+            memcpy(sin, local, sizeof(*sin));
+        } else {
+            sin->sin_family = AF_INET;
+            sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        }
+        sin->sin_port = htons(port);
+    }
+    if (rdma_bind_addr(listener->listen_id, (struct sockaddr *)&addr)) {
+        fprintf(stderr, "Failed to bind address\n");
+        return -1;
+    }
+
+    if (rdma_listen(listener->listen_id, LISTEN_BACKLOG)) {
+        fprintf(stderr, "Failed to listen for connections\n");
+        return -1;
+    }
+
+    printf("RDMA server listening on port %d\n", port);
+    return 0;
+}
+
+int accept_connect_request(struct rdma_context *ctx, struct rdma_cm_event *request,
+                           const struct rdma_resource_attr *attr, struct rdma_conn_pool *pool) {
+    struct rdma_buffer_info info;
+    struct rdma_conn_param param;
+
+    rdma_phase_begin(ctx);
+    ctx->cm_id = request->id;
+    ctx->cm_id->context = ctx;
+    if (read_buffer_info(ctx, request) || setup_cm_resources(ctx, attr, pool)) {
+        rdma_reject(ctx->cm_id, NULL, 0);
+        return -1;
+    }
+
+    // rdma_accept() only moves QPs rdma_cm created; as on the connecting
+    // side, RTR and RTS count toward the connect phase
+    if (ctx->pool && (cm_modify_qp(ctx, IBV_QPS_RTR) || cm_modify_qp(ctx, IBV_QPS_RTS))) {
+        rdma_reject(ctx->cm_id, NULL, 0);
+        return -1;
+    }
+
+    local_buffer_info(ctx, &info);
+    conn_param_init(&param, &info, ctx);
+    if (rdma_accept(ctx->cm_id, &param)) {
+        fprintf(stderr, "Failed to accept connection\n");
+        return -1;
+    }
+    return 0;
+}
+
+int accept_rdma_connection(struct rdma_context *ctx, int port, const struct rdma_resource_attr *attr) {
+    struct rdma_cm_event *event;
+    int ret;
+
+    if (listen_rdma_connections(ctx, attr->src_addr, port)) {
+        return -1;
+    }
+
+    if (wait_cm_event(ctx, RDMA_CM_EVENT_CONNECT_REQUEST, &event)) {
+        return -1;
+    }
+    ret = accept_connect_request(ctx, event, attr, NULL);
+    rdma_ack_cm_event(event);
+    if (ret) {
+        return -1;
+    }
+
+    if (wait_cm_event(ctx, RDMA_CM_EVENT_ESTABLISHED, &event)) {
+        return -1;
+    }
+    rdma_ack_cm_event(event);
+    rdma_phase_end(ctx, RDMA_PHASE_CONNECT);
+
+    ctx->connected = 1;
+    printf("RDMA connection established\n");
+    return 0;
+}
+
+// serve_connections() keeps a list, so whatever is still open at exit is closed
+struct served_conn {
+    struct rdma_context ctx;    // first: events carry &ctx as id->context
+    struct served_conn *prev, *next;
+};
+
+static void served_close(struct served_conn **conns, struct served_conn *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        *conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    close_rdma_connection(&c->ctx);
+    free(c);
+}
+
+int64_t serve_connections(const struct sockaddr *local, int port,
+                          const struct rdma_resource_attr *attr, int64_t total,
+                          volatile int *running) {
+    struct rdma_context listener;
+    struct served_conn *conns = NULL;
+    struct rdma_cm_event *event;
+    struct pollfd pfd;
+    int64_t served = 0, finished = 0;
+
+    memset(&listener, 0, sizeof(listener));
+    if (listen_rdma_connections(&listener, local, port)) {
+        close_rdma_connection(&listener);
+        return -1;
+    }
+    pfd.fd = listener.cm_channel->fd;
+    pfd.events = POLLIN;
+
+    while ((!running || *running) && (!total || finished < total)) {
+        enum rdma_cm_event_type type;
+        struct served_conn *c;
+        int n = poll(&pfd, 1, SERVE_POLL_MS);
+
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "Failed to poll CM events: %s\n", strerror(errno));
+            served = -1;
+            break;
+        }
+        if (n <= 0) {
+            continue;
+        }
+        if (rdma_get_cm_event(listener.cm_channel, &event)) {
+            fprintf(stderr, "Failed to get CM event\n");
+            served = -1;
+            break;
+        }
+        type = event->event;
+        if (type == RDMA_CM_EVENT_CONNECT_REQUEST) {
+            c = calloc(1, sizeof(*c));
+            if (!c) {
+                fprintf(stderr, "Failed to allocate a connection\n");
+                rdma_reject(event->id, NULL, 0);
+                rdma_ack_cm_event(event);
+                finished++;
+                continue;
+            }
+            c->next = conns;
+            if (conns) {
+                conns->prev = c;
+            }
+            conns = c;
+            if (accept_connect_request(&c->ctx, event, attr, NULL)) {
+                rdma_ack_cm_event(event);
+                served_close(&conns, c);
+                finished++;
+                continue;
+            }
+            rdma_ack_cm_event(event);
+            served++;
+            continue;
+        }
+
+        c = event->id->context;
+        rdma_ack_cm_event(event);
+        if (!c) {
+            continue;
+        }
+        if (type == RDMA_CM_EVENT_ESTABLISHED) {
+            c->ctx.connected = 1;
+        } else if (type == RDMA_CM_EVENT_DISCONNECTED || type == RDMA_CM_EVENT_REJECTED ||
+                   type == RDMA_CM_EVENT_CONNECT_ERROR || type == RDMA_CM_EVENT_UNREACHABLE) {
+            c->ctx.connected = 0;
+            served_close(&conns, c);
+            finished++;
+        }
+    }
+
+    while (conns) {
+        served_close(&conns, conns);
+    }
+    close_rdma_connection(&listener);
+    return served;
+}
+
+// Advance one connection of connect_to_servers() on its next event.
+// Returns 1 once it is connected, 0 while in progress, -1 on failure
+static int connect_step(struct rdma_context *ctx, struct rdma_cm_event *event,
+                        const struct rdma_resource_attr *attr, struct rdma_conn_pool *pool) {
+    struct rdma_buffer_info info;
+    struct rdma_conn_param param;
+
+    switch (event->event) {
+    case RDMA_CM_EVENT_ADDR_RESOLVED:
+        rdma_phase_end(ctx, RDMA_PHASE_ADDR);
+        if (rdma_resolve_route(ctx->cm_id, RDMA_CM_TIMEOUT_MS)) {
+            fprintf(stderr, "Failed to resolve route\n");
+            return -1;
+        }
+        return 0;
+
+    case RDMA_CM_EVENT_ROUTE_RESOLVED:
+        rdma_phase_end(ctx, RDMA_PHASE_ROUTE);
+        if (setup_cm_resources(ctx, attr, pool)) {
+            return -1;
+        }
+        local_buffer_info(ctx, &info);
+        conn_param_init(&param, &info, ctx);
+        if (rdma_connect(ctx->cm_id, &param)) {
+            fprintf(stderr, "Failed to connect to server\n");
+            return -1;
+        }
+        return 0;
+
+    case RDMA_CM_EVENT_CONNECT_RESPONSE:
+        // Only for QPs rdma_cm did not create: bring ours up, then confirm
+        if (read_buffer_info(ctx, event) || cm_modify_qp(ctx, IBV_QPS_RTR) ||
+            cm_modify_qp(ctx, IBV_QPS_RTS)) {
+            return -1;
+        }
+        if (rdma_establish(ctx->cm_id)) {
+            fprintf(stderr, "Failed to establish connection\n");
+            return -1;
+        }
+        break;
+
+    case RDMA_CM_EVENT_ESTABLISHED:
+        if (read_buffer_info(ctx, event)) {
+            return -1;
+        }
+        break;
+
+    default:
+        fprintf(stderr, "Unexpected CM event: %s (status %d)\n",
+                rdma_event_str(event->event), event->status);
+        return -1;
+    }
+
+    rdma_phase_end(ctx, RDMA_PHASE_CONNECT);
+    ctx->connected = 1;
+    return 1;
+}
+
+// One batch of connect_to_servers(), n at most LISTEN_BACKLOG
+static int connect_batch(struct rdma_context *ctxs, int n, const char *server_ip, int port,
+                         const struct rdma_resource_attr *attr, struct rdma_conn_pool *pool) {
+    struct rdma_addrinfo hints, *res = NULL;
+    struct rdma_event_channel *channel;
+    struct rdma_cm_event *event;
+    char port_str[16];
+    int pending = n;
+    int ret;
+
+    for (int i = 0; i < n; i++) {
+        rdma_phase_begin(&ctxs[i]);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_port_space = RDMA_PS_TCP;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    if (rdma_getaddrinfo(server_ip, port_str, &hints, &res)) {
+        fprintf(stderr, "Failed to get address info for %s\n", server_ip);
+        return -1;
+    }
+
+    channel = rdma_create_event_channel();
+    if (!channel) {
+        fprintf(stderr, "Failed to create CM event channel\n");
+        rdma_freeaddrinfo(res);
+        return -1;
+    }
+    // A single connection keeps the channel; several share it until they
+    // are all up, so their resolutions overlap
+    if (n == 1) {
+        ctxs[0].cm_channel = channel;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (rdma_create_id(channel, &ctxs[i].cm_id, &ctxs[i], RDMA_PS_TCP)) {
+            fprintf(stderr, "Failed to create RDMA CM ID\n");
+            goto fail;
+        }
+        if (rdma_resolve_addr(ctxs[i].cm_id, (struct sockaddr *)attr->src_addr, res->ai_dst_addr, RDMA_CM_TIMEOUT_MS)) {
+            fprintf(stderr, "Failed to resolve address %s\n", server_ip);
+            goto fail;
+        }
+    }
+    rdma_freeaddrinfo(res);
+    res = NULL;
+
+    while (pending > 0) {
+        if (rdma_get_cm_event(channel, &event)) {
+            fprintf(stderr, "Failed to get CM event\n");
+            goto fail;
+        }
+        ret = connect_step(event->id->context, event, attr, pool);
+        rdma_ack_cm_event(event);
+        if (ret < 0) {
+            goto fail;
+        }
+        pending -= ret;
+    }
+
+    if (n > 1) {
+        for (int i = 0; i < n; i++) {
+            ctxs[i].cm_channel = rdma_create_event_channel();
+            if (!ctxs[i].cm_channel || rdma_migrate_id(ctxs[i].cm_id, ctxs[i].cm_channel)) {
+                fprintf(stderr, "Failed to move connection to its own channel\n");
+                goto fail;
+            }
+        }
+        rdma_destroy_event_channel(channel);
+    }
+    return 0;
+
+fail:
+    if (res) {
+        rdma_freeaddrinfo(res);
+    }
+    for (int i = 0; i < n; i++) {
+        close_rdma_connection(&ctxs[i]);
+    }
+    if (n > 1) {
+        rdma_destroy_event_channel(channel);
+    }
+    return -1;
+}
+
+int connect_to_servers(struct rdma_context *ctxs, int n, const char *server_ip, int port,
+                       const struct rdma_resource_attr *attr, struct rdma_conn_pool *pool) {
+    // More requests at once than the server queues would be refused
+    for (int made = 0; made < n; made += LISTEN_BACKLOG) {
+        int k = LISTEN_BACKLOG < n - made ? LISTEN_BACKLOG : n - made;
+
+        if (connect_batch(ctxs + made, k, server_ip, port, attr, pool)) {
+            for (int i = 0; i < made; i++) {
+                close_rdma_connection(&ctxs[i]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int connect_to_server(struct rdma_context *ctx, const char *server_ip, int port,
+                      const struct rdma_resource_attr *attr) {
+    if (connect_to_servers(ctx, 1, server_ip, port, attr, NULL)) {
+        return -1;
+    }
+    printf("Connected to RDMA server at %s:%d\n", server_ip, port);
+    return 0;
+}
+
+void close_rdma_connection(struct rdma_context *ctx) {
+    if (ctx->connected) {
+        rdma_disconnect(ctx->cm_id);
+        ctx->connected = 0;
+    }
+    if (ctx->pool) {
+        if (ctx->qp) {
+            pool_recycle(ctx);
+        }
+        ctx->pool = NULL;
+    } else if (ctx->cm_id && ctx->qp) {
+        // The QP belongs to the cm_id and must go before the PD and CQ
+        rdma_destroy_qp(ctx->cm_id);
+        ctx->qp = NULL;
+    }
+    cleanup_rdma_resources(ctx);
+    if (ctx->cm_id) {
+        rdma_destroy_id(ctx->cm_id);
+        ctx->cm_id = NULL;
+    }
+    if (ctx->listen_id) {
+        rdma_destroy_id(ctx->listen_id);
+        ctx->listen_id = NULL;
+    }
+    if (ctx->cm_channel) {
+        rdma_destroy_event_channel(ctx->cm_channel);
+        ctx->cm_channel = NULL;
+    }
+}
+
+struct rdma_conn_pool *rdma_conn_pool_create(struct ibv_context *verbs,
+                                             const struct rdma_resource_attr *attr, int size) {
+    struct rdma_conn_pool *pool;
+
+    pool = calloc(1, sizeof(*pool) + size * sizeof(pool->entries[0]));
+    if (!pool) {
+        fprintf(stderr, "Failed to allocate connection pool\n");
+        return NULL;
+    }
+    pool->verbs = verbs;
+    pool->attr = *attr;
+    pool->attr.quiet = 1;
+    pool->size = size;
+
+    for (int i = 0; i < size; i++) {
+        struct rdma_context *e = &pool->entries[i];
+
+        e->context = verbs;
+        if (setup_rdma_resources(e, &pool->attr) || create_rdma_qp(e, &pool->attr)) {
+            cleanup_rdma_resources(e);
+            rdma_conn_pool_destroy(pool);
+            return NULL;
+        }
+        pool->count++;
+    }
+    return pool;
+}
+
+int rdma_conn_pool_available(const struct rdma_conn_pool *pool) {
+    return pool->count;
+}
+
+void rdma_conn_pool_destroy(struct rdma_conn_pool *pool) {
+    if (!pool) {
+        return;
+    }
+    for (int i = 0; i < pool->count; i++) {
+        cleanup_rdma_resources(&pool->entries[i]);
+    }
+    free(pool);
+}
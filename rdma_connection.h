@@ -0,0 +1,84 @@
+/*
+ * RC connection setup over rdma_cm (librdmademo)
+ *
+ * The passive side listens, takes the first connect request and accepts it;
+ * the active side resolves the address and route and connects. Either way
+ * the verbs resources are built on the device rdma_cm bound the connection
+ * to (which attr->src_addr pins, see rdma_device_sel_addr()), the QP is
+ * created through rdma_cm so it walks INIT/RTR/RTS on its own, and the two
+ * sides swap their buffer's address, rkey and length in the
+ * connection private data (ctx->remote_*).
+ *
+ * Fast path for services that connect often: a pool holds ready verbs
+ * resources (PD, CQ, registered buffer and a QP in RESET) for one device.
+ * A connection on that device borrows an entry instead of building one,
+ * drives the QP through its states with rdma_init_qp_attr(), and on close
+ * the QP is reset and the entry goes back to the pool, MR and all. The
+ * active side can also bring up many connections at once, with every
+ * address and route resolution in flight together.
+ */
+
+#ifndef RDMA_CONNECTION_H
+#define RDMA_CONNECTION_H
+
+#include "rdma_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RDMA_CM_TIMEOUT_MS 2000
+#define LISTEN_BACKLOG 16   // connect requests a listener queues before refusing more
+
+struct rdma_cm_event;
+
+int accept_rdma_connection(struct rdma_context *ctx, int port, const struct rdma_resource_attr *attr);
+int connect_to_server(struct rdma_context *ctx, const char *server_ip, int port,
+                      const struct rdma_resource_attr *attr);
+
+// Disconnect and release everything, verbs resources included (or return
+// them to their pool); safe after a failed accept/connect
+void close_rdma_connection(struct rdma_context *ctx);
+
+// Listen on port of local (NULL for any address) with listener's channel
+// and listen ID, for callers that accept many connections themselves
+int listen_rdma_connections(struct rdma_context *listener, const struct sockaddr *local, int port);
+
+// Accept a CONNECT_REQUEST event taken from a listener's channel into ctx,
+// on an entry of pool (may be NULL) when it serves the request's device.
+// The caller acks the event. ctx's events keep arriving on the listener's
+// channel with event->id->context == ctx; the caller sets ctx->connected
+// on RDMA_CM_EVENT_ESTABLISHED
+int accept_connect_request(struct rdma_context *ctx, struct rdma_cm_event *request,
+                           const struct rdma_resource_attr *attr, struct rdma_conn_pool *pool);
+
+// Accept connections on port of local (NULL for any address), each with
+// resources of its own built from attr, and close each as its peer leaves,
+// until total of them have come and gone (0: no limit) or *running drops
+// (running NULL: never); whatever is still open then is closed. A request
+// that fails to be accepted counts towards total. Returns how many were
+// accepted, -1 on failure
+int64_t serve_connections(const struct sockaddr *local, int port,
+                          const struct rdma_resource_attr *attr, int64_t total,
+                          volatile int *running);
+
+// Connect n contexts to the server at once, resolving every address and
+// route in parallel, LISTEN_BACKLOG at a time so the server's listener
+// never has more requests pending than it queues; afterwards each has its
+// own event channel. On failure all of them are closed
+int connect_to_servers(struct rdma_context *ctxs, int n, const char *server_ip, int port,
+                       const struct rdma_resource_attr *attr, struct rdma_conn_pool *pool);
+
+// size entries of attr-sized resources on verbs, the device context rdma_cm
+// hands out (cm_id->verbs, rdma_get_devices()). Must outlive the
+// connections using it
+struct rdma_conn_pool *rdma_conn_pool_create(struct ibv_context *verbs,
+                                             const struct rdma_resource_attr *attr, int size);
+int rdma_conn_pool_available(const struct rdma_conn_pool *pool);
+void rdma_conn_pool_destroy(struct rdma_conn_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,461 @@
+/*
+ * C++20 coroutine API for RDMA operations (librdmademo)
+ *
+ *     task<void> copy(async_qp &qp, ...) {
+ *         op_result r = co_await qp.read(buf, len, lkey, remote, rkey);
+ *         if (r.ok()) {
+ *             r = co_await qp.write(buf, len, lkey, other_remote, other_rkey);
+ *         }
+ *     }
+ *     reactor.spawn(copy(qp, ...));
+ *     reactor.run();
+ *
+ * Each operation is one signaled WR whose wr_id is the address of its
+ * awaiter. The awaiter lives in the suspended coroutine's frame, so it needs
+ * no allocation. A reactor owns a CQ and resumes the awaiting coroutine
+ * when that wr_id completes. When more coroutines post than the send queue
+ * holds, the extra awaiters wait in an intrusive FIFO on the async_qp and
+ * are posted as slots free up.
+ *
+ * Coroutine frames come from a thread-local pool of fixed-size blocks, so
+ * once the pool has grown to the peak number of live coroutines, spawning
+ * and finishing them allocates nothing. Reactors, queue pairs and the
+ * coroutines using them belong to one thread; run one reactor per thread.
+ */
+
+#ifndef RDMA_CORO_HPP
+#define RDMA_CORO_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <utility>
+#include <infiniband/verbs.h>
+
+namespace rdmademo {
+
+// Fixed-size coroutine frame blocks, carved from slabs and never returned to
+// the heap until the thread exits. Frames larger than a block use the heap
+class frame_pool {
+public:
+    static constexpr size_t block_size = 512;
+    static constexpr size_t blocks_per_slab = 256;
+
+    static void *allocate(size_t size) {
+        if (size > block_size) {
+            return ::operator new(size);
+        }
+        frame_pool &pool = local();
+        if (!pool.free_) {
+            pool.grow();
+        }
+        free_block *block = pool.free_;
+        pool.free_ = block->next;
+        return block;
+    }
+
+    static void deallocate(void *p, size_t size) noexcept {
+        if (size > block_size) {
+            ::operator delete(p);
+            return;
+        }
+        frame_pool &pool = local();
+        free_block *block = static_cast<free_block *>(p);
+        block->next = pool.free_;
+        pool.free_ = block;
+    }
+
+    // Slabs this thread has taken from the heap so far
+    static size_t slabs() { return local().num_slabs_; }
+
+    frame_pool(const frame_pool &) = delete;
+    frame_pool &operator=(const frame_pool &) = delete;
+
+    ~frame_pool() {
+        while (slabs_) {
+            slab *next = slabs_->next;
+            ::operator delete(slabs_);
+            slabs_ = next;
+        }
+    }
+
+private:
+    struct free_block {
+        free_block *next;
+    };
+    struct slab {
+        slab *next;
+        alignas(std::max_align_t) unsigned char blocks[blocks_per_slab][block_size];
+    };
+
+    frame_pool() = default;
+
+    static frame_pool &local() {
+        static thread_local frame_pool pool;
+        return pool;
+    }
+
+    void grow() {
+        slab *s = static_cast<slab *>(::operator new(sizeof(slab)));
+        s->next = slabs_;
+        slabs_ = s;
+        num_slabs_++;
+        for (size_t i = 0; i < blocks_per_slab; i++) {
+            free_block *block = reinterpret_cast<free_block *>(s->blocks[i]);
+            block->next = free_;
+            free_ = block;
+        }
+    }
+
+    free_block *free_ = nullptr;
+    slab *slabs_ = nullptr;
+    size_t num_slabs_ = 0;
+};
+
+class reactor;
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct promise_base {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    reactor *owner = nullptr;       // set for tasks started with reactor::spawn()
+
+    static void *operator new(size_t size) { return frame_pool::allocate(size); }
+    static void operator delete(void *p, size_t size) noexcept { frame_pool::deallocate(p, size); }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    // The data path reports errors through op_result, never by throwing
+    void unhandled_exception() noexcept { std::terminate(); }
+};
+
+inline void spawned_task_done(reactor *owner);
+
+// Hand control to whoever awaited the task, or free a spawned one
+struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+        promise_base &promise = h.promise();
+        if (promise.owner) {
+            reactor *owner = promise.owner;
+            h.destroy();
+            spawned_task_done(owner);
+            return std::noop_coroutine();
+        }
+        return promise.continuation;
+    }
+
+    void await_resume() noexcept {}
+};
+
+template <typename T>
+struct promise : promise_base {
+    alignas(T) unsigned char storage[sizeof(T)];
+    bool has_value = false;
+
+    task<T> get_return_object() noexcept;
+    final_awaiter final_suspend() noexcept { return {}; }
+
+    void return_value(T value) {
+        new (storage) T(std::move(value));
+        has_value = true;
+    }
+    T take() { return std::move(*std::launder(reinterpret_cast<T *>(storage))); }
+
+    ~promise() {
+        if (has_value) {
+            std::launder(reinterpret_cast<T *>(storage))->~T();
+        }
+    }
+};
+
+template <>
+struct promise<void> : promise_base {
+    task<void> get_return_object() noexcept;
+    final_awaiter final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void take() noexcept {}
+};
+
+}  // namespace detail
+
+// Lazily started coroutine; co_await it from another task, or hand it to
+// reactor::spawn()
+template <typename T>
+class [[nodiscard]] task {
+public:
+    using promise_type = detail::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> h) noexcept : handle_(h) {}
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    task &operator=(task &&other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    ~task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+    T await_resume() { return handle_.promise().take(); }
+
+private:
+    friend class reactor;
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> promise<T>::get_return_object() noexcept {
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept {
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+}  // namespace detail
+
+struct op_result {
+    ibv_wc_status status;
+    uint32_t byte_len;          // receives
+    uint32_t imm_data;          // receives carrying immediate data, network order
+
+    bool ok() const { return status == IBV_WC_SUCCESS; }
+};
+
+class async_qp;
+
+// One posted WR. Lives in the awaiting coroutine's frame; its address is
+// the wr_id
+class op_awaiter {
+public:
+    op_awaiter(async_qp *qp, ibv_wr_opcode opcode, const void *addr, uint32_t length, uint32_t lkey,
+               uint64_t remote_addr = 0, uint32_t rkey = 0)
+        : qp_(qp), is_recv_(false) {
+        sge_.addr = reinterpret_cast<uintptr_t>(addr);
+        sge_.length = length;
+        sge_.lkey = lkey;
+        wr_.send.wr_id = reinterpret_cast<uintptr_t>(this);
+        wr_.send.sg_list = &sge_;
+        wr_.send.num_sge = 1;
+        wr_.send.opcode = opcode;
+        wr_.send.send_flags = IBV_SEND_SIGNALED;
+        wr_.send.wr.rdma.remote_addr = remote_addr;
+        wr_.send.wr.rdma.rkey = rkey;
+    }
+
+    op_awaiter(async_qp *qp, void *addr, uint32_t length, uint32_t lkey) : qp_(qp), is_recv_(true) {
+        sge_.addr = reinterpret_cast<uintptr_t>(addr);
+        sge_.length = length;
+        sge_.lkey = lkey;
+        wr_.recv.wr_id = reinterpret_cast<uintptr_t>(this);
+        wr_.recv.sg_list = &sge_;
+        wr_.recv.num_sge = 1;
+    }
+
+    // wr_id and sg_list point into the awaiter
+    op_awaiter(const op_awaiter &) = delete;
+    op_awaiter &operator=(const op_awaiter &) = delete;
+
+    bool await_ready() const noexcept { return false; }
+    inline bool await_suspend(std::coroutine_handle<> h) noexcept;
+    op_result await_resume() const noexcept { return result_; }
+
+private:
+    friend class async_qp;
+    friend class reactor;
+
+    // Record the outcome and resume the coroutine
+    void complete(ibv_wc_status status, uint32_t byte_len = 0, uint32_t imm_data = 0) {
+        result_ = {status, byte_len, imm_data};
+        handle_.resume();
+    }
+
+    async_qp *qp_;
+    bool is_recv_;
+    ibv_sge sge_{};
+    union wr {
+        wr() : send{} {}
+        ibv_send_wr send;
+        ibv_recv_wr recv;
+    } wr_;
+    std::coroutine_handle<> handle_;
+    op_result result_{IBV_WC_GENERAL_ERR, 0, 0};
+    op_awaiter *next_ = nullptr;    // send queue full: waiting to be posted
+};
+
+// Awaitable operations on a connected QP. `depth` is the send queue size:
+// at most that many sends are posted at once, the rest wait their turn
+class async_qp {
+public:
+    async_qp(ibv_qp *qp, unsigned depth) : qp_(qp), depth_(depth) {}
+
+    async_qp(const async_qp &) = delete;
+    async_qp &operator=(const async_qp &) = delete;
+
+    op_awaiter write(const void *addr, uint32_t length, uint32_t lkey, uint64_t remote_addr,
+                     uint32_t rkey) {
+        return op_awaiter(this, IBV_WR_RDMA_WRITE, addr, length, lkey, remote_addr, rkey);
+    }
+    op_awaiter read(void *addr, uint32_t length, uint32_t lkey, uint64_t remote_addr, uint32_t rkey) {
+        return op_awaiter(this, IBV_WR_RDMA_READ, addr, length, lkey, remote_addr, rkey);
+    }
+    op_awaiter send(const void *addr, uint32_t length, uint32_t lkey) {
+        return op_awaiter(this, IBV_WR_SEND, addr, length, lkey);
+    }
+    // Completes when a message (or a write with immediate) lands in addr
+    op_awaiter recv(void *addr, uint32_t length, uint32_t lkey) {
+        return op_awaiter(this, addr, length, lkey);
+    }
+
+    ibv_qp *get() const { return qp_; }
+    unsigned inflight() const { return inflight_; }
+
+private:
+    friend class op_awaiter;
+    friend class reactor;
+
+    // Post now if the send queue has room, otherwise queue. False means the
+    // post failed and op already carries the error
+    bool submit(op_awaiter *op) {
+        if (op->is_recv_) {
+            ibv_recv_wr *bad_wr;
+            if (ibv_post_recv(qp_, &op->wr_.recv, &bad_wr)) {
+                op->result_ = {IBV_WC_LOC_QP_OP_ERR, 0, 0};
+                return false;
+            }
+            return true;
+        }
+        if (inflight_ == depth_) {
+            if (wait_tail_) {
+                wait_tail_->next_ = op;
+            } else {
+                wait_head_ = op;
+            }
+            wait_tail_ = op;
+            return true;
+        }
+        return post(op);
+    }
+
+    bool post(op_awaiter *op) {
+        ibv_send_wr *bad_wr;
+        if (ibv_post_send(qp_, &op->wr_.send, &bad_wr)) {
+            op->result_ = {IBV_WC_LOC_QP_OP_ERR, 0, 0};
+            return false;
+        }
+        inflight_++;
+        return true;
+    }
+
+    // A send completed: post the longest-waiting one in its slot
+    void retire() {
+        inflight_--;
+        while (wait_head_ && inflight_ < depth_) {
+            op_awaiter *op = wait_head_;
+            wait_head_ = op->next_;
+            if (!wait_head_) {
+                wait_tail_ = nullptr;
+            }
+            if (!post(op)) {
+                op->handle_.resume();
+            }
+        }
+    }
+
+    ibv_qp *qp_;
+    unsigned depth_;
+    unsigned inflight_ = 0;
+    op_awaiter *wait_head_ = nullptr;
+    op_awaiter *wait_tail_ = nullptr;
+};
+
+inline bool op_awaiter::await_suspend(std::coroutine_handle<> h) noexcept {
+    handle_ = h;
+    return qp_->submit(this);
+}
+
+// Per-thread completion reactor: polls one CQ and resumes the coroutine
+// waiting on each completed wr_id. Every WR on the CQ must come from an
+// async_qp
+class reactor {
+public:
+    static constexpr int poll_batch = 16;
+
+    explicit reactor(ibv_cq *cq) : cq_(cq) {}
+
+    reactor(const reactor &) = delete;
+    reactor &operator=(const reactor &) = delete;
+
+    // Start a task now; it is freed when it finishes
+    void spawn(task<void> t) {
+        std::coroutine_handle<detail::promise<void>> h = std::exchange(t.handle_, nullptr);
+        h.promise().owner = this;
+        live_++;
+        h.resume();
+    }
+
+    // Dispatch one batch of completions; the number dispatched, or -1 if
+    // polling the CQ failed
+    int poll() {
+        ibv_wc wc[poll_batch];
+        int n = ibv_poll_cq(cq_, poll_batch, wc);
+
+        for (int i = 0; i < n; i++) {
+            op_awaiter *op = reinterpret_cast<op_awaiter *>(wc[i].wr_id);
+            if (!op->is_recv_) {
+                op->qp_->retire();
+            }
+            op->complete(wc[i].status, wc[i].byte_len,
+                         (wc[i].wc_flags & IBV_WC_WITH_IMM) ? wc[i].imm_data : 0);
+        }
+        return n;
+    }
+
+    // Poll until every spawned task has finished, polling fails, or
+    // *running clears. Returns 0 once all tasks are done
+    int run(const volatile int *running = nullptr) {
+        while (live_ && (!running || *running)) {
+            if (poll() < 0) {
+                return -1;
+            }
+        }
+        return live_ ? -1 : 0;
+    }
+
+    size_t live() const { return live_; }
+
+private:
+    friend void detail::spawned_task_done(reactor *owner);
+
+    ibv_cq *cq_;
+    size_t live_ = 0;
+};
+
+inline void detail::spawned_task_done(reactor *owner) {
+    owner->live_--;
+}
+
+}  // namespace rdmademo
+
+#endif
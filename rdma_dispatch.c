@@ -0,0 +1,277 @@
+/*
+ * Completion dispatcher with work stealing. See rdma_dispatch.h.
+ *
+ * The deque is the Chase-Lev one in the C11 formulation of Lê et al.
+ * ("Correct and Efficient Work-Stealing for Weak Memory Models"), with a
+ * fixed ring: the owner pushes and pops at the bottom, thieves CAS the
+ * top. Items are copied in and out by value; a thief's copy can only be
+ * stale when its CAS on top is about to fail, because the owner never
+ * reuses a slot until top has moved past it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "rdma_dispatch.h"
+
+#define DEQUE_MASK (DISPATCH_DEQUE_SIZE - 1)
+#define IDLE_SPINS 1024         // empty rounds before yielding the core
+
+struct dispatch_cq {
+    struct ibv_cq *cq;
+    dispatch_fn fn;
+    void *arg;
+};
+
+struct dispatch_item {
+    const struct dispatch_cq *src;
+    struct ibv_wc wc;
+};
+
+struct ws_deque {
+    int64_t top __attribute__((aligned(64)));       // thieves take here
+    int64_t bottom __attribute__((aligned(64)));    // the owner works here
+    struct dispatch_item items[DISPATCH_DEQUE_SIZE];
+};
+
+struct dispatch_worker {
+    struct dispatcher *d;
+    pthread_t thread;
+    int index;
+    int ncqs;
+    uint64_t rng;
+    struct dispatch_worker_stats stats;     // written by this worker only
+    struct dispatch_cq cqs[DISPATCH_MAX_CQS];
+    struct ws_deque deque;
+} __attribute__((aligned(64)));
+
+struct dispatcher {
+    int nworkers;
+    int stealing;
+    int running;
+    int started;
+    struct dispatch_worker *workers;
+};
+
+_Static_assert((DISPATCH_DEQUE_SIZE & DEQUE_MASK) == 0, "deque size must be a power of two");
+
+static int ws_push(struct ws_deque *q, const struct dispatch_item *item) {
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+
+    if (b - t >= DISPATCH_DEQUE_SIZE) {
+        return -1;
+    }
+    q->items[b & DEQUE_MASK] = *item;
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int ws_pop(struct ws_deque *q, struct dispatch_item *item) {
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+    int64_t t;
+    int ok = 1;
+
+    __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    *item = q->items[b & DEQUE_MASK];
+    if (t == b) {
+        // The last item: whoever moves top first gets it
+        ok = __atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST,
+                                         __ATOMIC_RELAXED);
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return ok;
+}
+
+static int ws_steal(struct ws_deque *q, struct dispatch_item *item) {
+    int64_t t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    int64_t b;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) {
+        return 0;
+    }
+    *item = q->items[t & DEQUE_MASK];
+    return __atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_RELAXED);
+}
+
+static void run_item(struct dispatch_worker *w, const struct dispatch_item *item) {
+    item->src->fn(item->src->arg, &item->wc);
+    w->stats.executed++;
+}
+
+// One batch from each of the worker's CQs onto its deque. A batch is
+// pushed newest first so the owner, popping from the same end, still
+// handles it in completion order; thieves take the newest
+static int poll_cqs(struct dispatch_worker *w) {
+    struct ibv_wc wc[DISPATCH_POLL_BATCH];
+    struct dispatch_item item;
+    int total = 0;
+
+    for (int c = 0; c < w->ncqs; c++) {
+        int n = ibv_poll_cq(w->cqs[c].cq, DISPATCH_POLL_BATCH, wc);
+
+        if (n < 0) {
+            fprintf(stderr, "Worker %d failed to poll CQ %d\n", w->index, c);
+            continue;
+        }
+        if (n == 0) {
+            continue;
+        }
+        w->stats.polls++;
+        w->stats.completions += n;
+        total += n;
+        item.src = &w->cqs[c];
+        for (int i = n - 1; i >= 0; i--) {
+            item.wc = wc[i];
+            if (ws_push(&w->deque, &item)) {
+                run_item(w, &item);     // deque full: no point queueing
+            }
+        }
+    }
+    return total;
+}
+
+static int steal_one(struct dispatch_worker *w, struct dispatch_item *item) {
+    struct dispatcher *d = w->d;
+    int victim;
+
+    // xorshift64: a random first victim keeps thieves from piling onto one
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    victim = w->rng % d->nworkers;
+    for (int i = 0; i < d->nworkers; i++, victim = (victim + 1) % d->nworkers) {
+        if (victim != w->index && ws_steal(&d->workers[victim].deque, item)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    struct dispatch_worker *w = arg;
+    struct dispatcher *d = w->d;
+    struct dispatch_item item;
+    unsigned idle = 0;
+
+    for (;;) {
+        int got = poll_cqs(w);
+
+        while (ws_pop(&w->deque, &item)) {
+            run_item(w, &item);
+        }
+        if (got) {
+            idle = 0;
+            continue;
+        }
+        if (d->stealing && steal_one(w, &item)) {
+            run_item(w, &item);
+            w->stats.stolen++;
+            idle = 0;
+            continue;
+        }
+        if (!__atomic_load_n(&d->running, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (++idle == IDLE_SPINS) {
+            sched_yield();
+            idle = 0;
+        }
+    }
+    return NULL;
+}
+
+struct dispatcher *dispatcher_create(int nworkers, int stealing) {
+    struct dispatcher *d;
+
+    if (nworkers < 1 || nworkers > DISPATCH_MAX_WORKERS) {
+        fprintf(stderr, "Dispatcher takes 1 to %d workers\n", DISPATCH_MAX_WORKERS);
+        return NULL;
+    }
+    d = calloc(1, sizeof(*d));
+    if (!d) {
+        fprintf(stderr, "Failed to allocate dispatcher\n");
+        return NULL;
+    }
+    d->workers = aligned_alloc(64, nworkers * sizeof(*d->workers));
+    if (!d->workers) {
+        fprintf(stderr, "Failed to allocate dispatcher workers\n");
+        free(d);
+        return NULL;
+    }
+    memset(d->workers, 0, nworkers * sizeof(*d->workers));
+    d->nworkers = nworkers;
+    d->stealing = stealing;
+    for (int i = 0; i < nworkers; i++) {
+        d->workers[i].d = d;
+        d->workers[i].index = i;
+        d->workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+    return d;
+}
+
+int dispatcher_add_cq(struct dispatcher *d, int worker, struct ibv_cq *cq, dispatch_fn fn,
+                      void *arg) {
+    struct dispatch_worker *w;
+
+    if (d->started || worker < 0 || worker >= d->nworkers) {
+        fprintf(stderr, "Cannot add a CQ to worker %d\n", worker);
+        return -1;
+    }
+    w = &d->workers[worker];
+    if (w->ncqs == DISPATCH_MAX_CQS) {
+        fprintf(stderr, "Worker %d already polls %d CQs\n", worker, DISPATCH_MAX_CQS);
+        return -1;
+    }
+    w->cqs[w->ncqs].cq = cq;
+    w->cqs[w->ncqs].fn = fn;
+    w->cqs[w->ncqs].arg = arg;
+    w->ncqs++;
+    return 0;
+}
+
+int dispatcher_start(struct dispatcher *d) {
+    d->running = 1;
+    for (int i = 0; i < d->nworkers; i++) {
+        if (pthread_create(&d->workers[i].thread, NULL, worker_main, &d->workers[i])) {
+            fprintf(stderr, "Failed to start dispatcher worker %d\n", i);
+            dispatcher_stop(d);
+            return -1;
+        }
+        d->started++;
+    }
+    return 0;
+}
+
+void dispatcher_stop(struct dispatcher *d) {
+    __atomic_store_n(&d->running, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < d->started; i++) {
+        pthread_join(d->workers[i].thread, NULL);
+    }
+    d->started = 0;
+}
+
+void dispatcher_stats(const struct dispatcher *d, int worker, struct dispatch_worker_stats *stats) {
+    *stats = d->workers[worker].stats;
+}
+
+void dispatcher_destroy(struct dispatcher *d) {
+    if (!d) {
+        return;
+    }
+    dispatcher_stop(d);
+    free(d->workers);
+    free(d);
+}
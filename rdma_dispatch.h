@@ -0,0 +1,53 @@
+/*
+ * Completion dispatcher with work stealing (librdmademo)
+ *
+ * For servers with many connections. Each worker thread owns some CQs
+ * (typically one per connection, assigned as they are accepted) and polls
+ * them DISPATCH_POLL_BATCH completions at a time. Every completion becomes
+ * a work item on the worker's own Chase-Lev deque, which the worker then
+ * works through. A worker with nothing of its own to do steals items from
+ * the other end of someone else's deque, so a few busy connections that
+ * happen to share a worker no longer pin that one core while the rest
+ * idle.
+ *
+ * The catch: with stealing on, completions of one CQ can be handled on
+ * several threads at once and finish out of order. Handlers must be safe
+ * to run concurrently for the same arg and must not rely on ordering
+ * (per-slot RPC requests are fine; a byte stream is not).
+ */
+
+#ifndef RDMA_DISPATCH_H
+#define RDMA_DISPATCH_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+#define DISPATCH_MAX_WORKERS 64
+#define DISPATCH_MAX_CQS 256            // per worker
+#define DISPATCH_POLL_BATCH 32
+#define DISPATCH_DEQUE_SIZE 1024        // power of two
+
+typedef void (*dispatch_fn)(void *arg, const struct ibv_wc *wc);
+
+struct dispatch_worker_stats {
+    uint64_t polls;             // non-empty ibv_poll_cq calls
+    uint64_t completions;       // taken off this worker's CQs
+    uint64_t executed;          // handled on this worker, stolen ones included
+    uint64_t stolen;            // taken from other workers' deques
+};
+
+struct dispatcher;
+
+// stealing = 0 gives the static assignment: each worker handles exactly
+// the completions of its own CQs
+struct dispatcher *dispatcher_create(int nworkers, int stealing);
+// Before dispatcher_start() only
+int dispatcher_add_cq(struct dispatcher *d, int worker, struct ibv_cq *cq, dispatch_fn fn,
+                      void *arg);
+int dispatcher_start(struct dispatcher *d);
+// Stops and joins the workers; items still queued are handled first
+void dispatcher_stop(struct dispatcher *d);
+void dispatcher_stats(const struct dispatcher *d, int worker, struct dispatch_worker_stats *stats);
+void dispatcher_destroy(struct dispatcher *d);
+
+#endif
@@ -0,0 +1,415 @@
+/*
+ * RoCEv2 fabric simulator: rank tuning choices before trying them on a
+ * real fabric
+ *
+ * Every option takes a comma-separated list; the simulator runs every
+ * combination (fabric_sim.h) on a pool of threads, one run per thread at
+ * a time, and prints them ranked by p99 message latency (or -r goodput /
+ * p999), each with its goodput, latency, drops, retransmissions, PFC pause
+ * time, ECN marks and CNPs, followed by how fast the simulator itself ran.
+ *
+ * The workload options are those of incast_bench: senders (-n), QPs each
+ * (-q), window (-w) and message size (-b), so a run can be compared with
+ * the same workload on hardware.
+ *
+ * Usage: rdma_fabric_sim [-n senders] [-q qps] [-w window] [-b bytes]
+ *                        [-M mtu] [-B buffer_kb] [-P xoff_kb]
+ *                        [-E off|kmin_kb:kmax_kb[:pmax]] [-c none|dcqcn|delay]
+ *                        [-L gbps] [-d prop_ns] [-D target_us]
+ *                        [-t ms] [-W warmup_ms] [-r p99|p999|goodput] [-j threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "fabric_sim.h"
+
+#define MAX_VALUES 16               // per option
+#define MAX_RUNS 4096
+#define DEFAULT_ECN_PMAX 0.01       // DCQCN's recommended marking curve: 5 KB, 200 KB, 1%
+
+struct value_list {
+    int n;
+    double v[MAX_VALUES];
+};
+
+struct ecn_setting {
+    uint32_t kmin, kmax;            // bytes, kmax 0 for off
+    double pmax;
+};
+
+struct run {
+    struct fabric_params params;
+    struct fabric_result result;
+    int failed;
+};
+
+struct sweep {
+    struct run *runs;
+    int nruns;
+    int next;                       // taken with __atomic_fetch_add
+};
+
+enum rank_key { RANK_P99, RANK_P999, RANK_GOODPUT };
+
+static enum rank_key rank_key = RANK_P99;
+
+// "a,b,c" into list; values must be positive unless zero_ok
+static int parse_values(const char *arg, struct value_list *list, int zero_ok) {
+    char buf[256], *tok, *end;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+    list->n = 0;
+    for (tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        double v = strtod(tok, &end);
+
+        if (*end || v < 0 || (v == 0 && !zero_ok) || list->n == MAX_VALUES) {
+            fprintf(stderr, "Bad value list: %s\n", arg);
+            return -1;
+        }
+        list->v[list->n++] = v;
+    }
+    return list->n ? 0 : -1;
+}
+
+static int parse_ecn(const char *arg, struct ecn_setting *ecn, int *n) {
+    char buf[256], *tok;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+    *n = 0;
+    for (tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        double kmin, kmax, pmax = DEFAULT_ECN_PMAX;
+        int got;
+
+        if (*n == MAX_VALUES) {
+            fprintf(stderr, "More than %d ECN settings\n", MAX_VALUES);
+            return -1;
+        }
+        if (strcmp(tok, "off") == 0) {
+            ecn[(*n)++] = (struct ecn_setting){0, 0, 0};
+            continue;
+        }
+        got = sscanf(tok, "%lf:%lf:%lf", &kmin, &kmax, &pmax);
+        if (got < 2 || kmin < 0 || kmax <= kmin || pmax <= 0 || pmax > 1) {
+            fprintf(stderr, "Bad ECN setting %s, want off or kmin_kb:kmax_kb[:pmax]\n", tok);
+            return -1;
+        }
+        ecn[(*n)++] = (struct ecn_setting){(uint32_t)(kmin * 1024), (uint32_t)(kmax * 1024), pmax};
+    }
+    return *n ? 0 : -1;
+}
+
+static int parse_cc(const char *arg, enum fabric_cc *cc, int *n) {
+    char buf[256], *tok;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+    *n = 0;
+    for (tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        int c;
+
+        for (c = 0; c < FABRIC_CC_COUNT && strcmp(tok, fabric_cc_names[c]); c++) {
+            ;
+        }
+        if (c == FABRIC_CC_COUNT || *n == MAX_VALUES) {
+            fprintf(stderr, "Bad congestion control %s, want none, dcqcn or delay\n", tok);
+            return -1;
+        }
+        cc[(*n)++] = c;
+    }
+    return *n ? 0 : -1;
+}
+
+// Next digit of a mixed-radix combination number
+static int digit(long *rest, int radix) {
+    int d = *rest % radix;
+
+    *rest /= radix;
+    return d;
+}
+
+static void *sweep_worker(void *arg) {
+    struct sweep *sw = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&sw->next, 1, __ATOMIC_RELAXED)) < sw->nruns) {
+        struct run *run = &sw->runs[i];
+
+        run->failed = fabric_sim_run(&run->params, &run->result) != 0;
+    }
+    return NULL;
+}
+
+static double rank_value(const struct run *run) {
+    if (run->failed) {
+        return 1e300;
+    }
+    switch (rank_key) {
+    case RANK_P999:
+        return run->result.p999_us;
+    case RANK_GOODPUT:
+        return -run->result.goodput_gbps;
+    default:
+        return run->result.p99_us;
+    }
+}
+
+static int cmp_runs(const void *a, const void *b) {
+    double x = rank_value(a), y = rank_value(b);
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_ranked(struct run *runs, int nruns) {
+    printf("%4s %6s %4s %7s %5s %6s %6s %11s %5s | %7s %8s %8s %8s %7s %7s %6s %7s\n", "rank",
+           "load", "win", "msg", "mtu", "buf KB", "xoff", "ecn KB", "cc", "Gbit/s", "p50 us",
+           "p99 us", "p99.9 us", "drops", "retx", "pause%", "cnps");
+    for (int i = 0; i < nruns; i++) {
+        const struct fabric_params *p = &runs[i].params;
+        const struct fabric_result *r = &runs[i].result;
+        char load[16], ecn[24], xoff[16];
+
+        snprintf(load, sizeof(load), "%dx%d", p->hosts, p->qps);
+        if (p->ecn_kmax_bytes) {
+            snprintf(ecn, sizeof(ecn), "%u:%u", p->ecn_kmin_bytes / 1024, p->ecn_kmax_bytes / 1024);
+        } else {
+            snprintf(ecn, sizeof(ecn), "off");
+        }
+        if (p->pfc_xoff_bytes) {
+            snprintf(xoff, sizeof(xoff), "%u", p->pfc_xoff_bytes / 1024);
+        } else {
+            snprintf(xoff, sizeof(xoff), "off");
+        }
+        printf("%4d %6s %4d %7u %5u %6u %6s %11s %5s | ", i + 1, load, p->window, p->msg_bytes,
+               p->mtu, p->buffer_bytes / 1024, xoff, ecn, fabric_cc_names[p->cc]);
+        if (runs[i].failed) {
+            printf("failed\n");
+            continue;
+        }
+        printf("%7.2f %8.1f %8.1f %8.1f %7lu %7lu %6.1f %7lu\n", r->goodput_gbps, r->p50_us,
+               r->p99_us, r->p999_us, r->drops, r->retransmits, r->paused_pct, r->cnps);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options], every value a comma-separated list to sweep\n", prog);
+    fprintf(stderr, "  -n  Senders (default 8)\n");
+    fprintf(stderr, "  -q  QPs per sender (default 1)\n");
+    fprintf(stderr, "  -w  Messages in flight per QP (default 8)\n");
+    fprintf(stderr, "  -b  Message bytes (default 65536)\n");
+    fprintf(stderr, "  -M  RoCE MTU (default 1024,4096)\n");
+    fprintf(stderr, "  -B  Switch buffer in front of the receiver, KB (default 1024)\n");
+    fprintf(stderr, "  -P  PFC XOFF per ingress port, KB, 0 for lossy (default 0,64,256)\n");
+    fprintf(stderr, "  -E  ECN marking: off or kmin_kb:kmax_kb[:pmax] (default off,5:200)\n");
+    fprintf(stderr, "  -c  Congestion control: none, dcqcn, delay (default all)\n");
+    fprintf(stderr, "  -L  Link Gbit/s (default 25)\n");
+    fprintf(stderr, "  -d  Propagation delay per link, ns (default 1000)\n");
+    fprintf(stderr, "  -D  delay: latency over the baseline that counts as congestion, us (default 20)\n");
+    fprintf(stderr, "  -t  Simulated ms per run (default 10), -W of them warm-up (default 2)\n");
+    fprintf(stderr, "  -r  Rank by p99 (default), p999 or goodput\n");
+    fprintf(stderr, "  -j  Threads (default: online CPUs)\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct value_list hosts, qps, window, msg, mtu, buffer, xoff, link, prop, target;
+    struct ecn_setting ecn[MAX_VALUES];
+    enum fabric_cc cc[MAX_VALUES];
+    int necn, ncc;
+    double ms = 10, warmup_ms = 2;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    struct sweep sw = {0};
+    pthread_t *tids;
+    struct timespec t0, t1;
+    uint64_t packets = 0, events = 0;
+    double cpu = 0, wall;
+    int started = 0;
+    int opt;
+
+    parse_values("8", &hosts, 0);
+    parse_values("1", &qps, 0);
+    parse_values("8", &window, 0);
+    parse_values("65536", &msg, 0);
+    parse_values("1024,4096", &mtu, 0);
+    parse_values("1024", &buffer, 0);
+    parse_values("0,64,256", &xoff, 1);
+    parse_values("25", &link, 0);
+    parse_values("1000", &prop, 1);
+    parse_values("20", &target, 0);
+    parse_ecn("off,5:200", ecn, &necn);
+    parse_cc("none,dcqcn,delay", cc, &ncc);
+
+    while ((opt = getopt(argc, argv, "n:q:w:b:M:B:P:E:c:L:d:D:t:W:r:j:h")) != -1) {
+        int ret = 0;
+
+        switch (opt) {
+        case 'n':
+            ret = parse_values(optarg, &hosts, 0);
+            break;
+        case 'q':
+            ret = parse_values(optarg, &qps, 0);
+            break;
+        case 'w':
+            ret = parse_values(optarg, &window, 0);
+            break;
+        case 'b':
+            ret = parse_values(optarg, &msg, 0);
+            break;
+        case 'M':
+            ret = parse_values(optarg, &mtu, 0);
+            break;
+        case 'B':
+            ret = parse_values(optarg, &buffer, 0);
+            break;
+        case 'P':
+            ret = parse_values(optarg, &xoff, 1);
+            break;
+        case 'E':
+            ret = parse_ecn(optarg, ecn, &necn);
+            break;
+        case 'c':
+            ret = parse_cc(optarg, cc, &ncc);
+            break;
+        case 'L':
+            ret = parse_values(optarg, &link, 0);
+            break;
+        case 'd':
+            ret = parse_values(optarg, &prop, 1);
+            break;
+        case 'D':
+            ret = parse_values(optarg, &target, 0);
+            break;
+        case 't':
+            ms = atof(optarg);
+            break;
+        case 'W':
+            warmup_ms = atof(optarg);
+            break;
+        case 'r':
+            if (strcmp(optarg, "p99") == 0) {
+                rank_key = RANK_P99;
+            } else if (strcmp(optarg, "p999") == 0) {
+                rank_key = RANK_P999;
+            } else if (strcmp(optarg, "goodput") == 0) {
+                rank_key = RANK_GOODPUT;
+            } else {
+                ret = -1;
+            }
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+        if (ret) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (ms <= warmup_ms || warmup_ms < 0 || threads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    sw.runs = calloc(MAX_RUNS, sizeof(*sw.runs));
+    if (!sw.runs) {
+        fprintf(stderr, "Failed to allocate runs\n");
+        return 1;
+    }
+    // Every combination, numbered in mixed radix with the workload options
+    // most significant
+    for (long combo = 0;; combo++) {
+        struct fabric_params *p;
+        long rest = combo;
+        int l = digit(&rest, target.n);
+        int k = digit(&rest, ncc);
+        int j = digit(&rest, necn);
+        int i = digit(&rest, xoff.n);
+        int h = digit(&rest, buffer.n);
+        int g = digit(&rest, mtu.n);
+        int f = digit(&rest, prop.n);
+        int e = digit(&rest, link.n);
+        int d = digit(&rest, msg.n);
+        int c = digit(&rest, window.n);
+        int b = digit(&rest, qps.n);
+        int a = digit(&rest, hosts.n);
+
+        if (rest) {
+            break;
+        }
+        if (cc[k] != FABRIC_CC_DELAY && l > 0) {
+            continue;       // the target only matters to delay
+        }
+        if (sw.nruns == MAX_RUNS) {
+            fprintf(stderr, "More than %d combinations\n", MAX_RUNS);
+            free(sw.runs);
+            return 1;
+        }
+        p = &sw.runs[sw.nruns++].params;
+        p->hosts = (int)hosts.v[a];
+        p->qps = (int)qps.v[b];
+        p->window = (int)window.v[c];
+        p->msg_bytes = (uint32_t)msg.v[d];
+        p->link_gbps = link.v[e];
+        p->prop_ns = (uint32_t)prop.v[f];
+        p->mtu = (uint32_t)mtu.v[g];
+        p->buffer_bytes = (uint32_t)(buffer.v[h] * 1024);
+        p->pfc_xoff_bytes = (uint32_t)(xoff.v[i] * 1024);
+        p->ecn_kmin_bytes = ecn[j].kmin;
+        p->ecn_kmax_bytes = ecn[j].kmax;
+        p->ecn_pmax = ecn[j].pmax;
+        p->cc = cc[k];
+        p->target_delay_ns = (uint32_t)(target.v[l] * 1000);
+        p->duration_ns = (uint64_t)(ms * 1e6);
+        p->warmup_ns = (uint64_t)(warmup_ms * 1e6);
+        p->seed = 0x9e3779b97f4a7c15ULL * (sw.nruns + 1);
+    }
+
+    if (threads > sw.nruns) {
+        threads = sw.nruns;
+    }
+    tids = calloc(threads, sizeof(*tids));
+    if (!tids) {
+        fprintf(stderr, "Failed to allocate threads\n");
+        free(sw.runs);
+        return 1;
+    }
+    printf("Simulating %d configurations, %.1f ms each (%.1f ms warm-up), on %d threads\n",
+           sw.nruns, ms, warmup_ms, threads);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, sweep_worker, &sw)) {
+            fprintf(stderr, "Failed to start sweep thread %d\n", i);
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        sweep_worker(&sw);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    for (int i = 0; i < sw.nruns; i++) {
+        packets += sw.runs[i].result.packets;
+        events += sw.runs[i].result.events;
+        cpu += sw.runs[i].result.wall_seconds;
+    }
+    qsort(sw.runs, sw.nruns, sizeof(*sw.runs), cmp_runs);
+    print_ranked(sw.runs, sw.nruns);
+    printf("%lu packets, %lu events in %.2f s: %.2f Mpkt/s and %.2f Mevents/s per thread, "
+           "%.2f Mpkt/s overall\n", packets, events, wall, cpu > 0 ? packets / cpu / 1e6 : 0,
+           cpu > 0 ? events / cpu / 1e6 : 0, packets / wall / 1e6);
+
+    free(tids);
+    free(sw.runs);
+    return 0;
+}
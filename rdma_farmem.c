@@ -0,0 +1,569 @@
+/*
+ * Far memory over RDMA with userfaultfd. See rdma_farmem.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/userfaultfd.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_farmem.h"
+#include "rdma_common.h"
+#include "rdma_connection.h"
+
+#define UFFD_MSG_BATCH 16
+
+struct farmem {
+    struct rdma_context ctx;    // frames registered, the donated buffer remote
+    char *map;                  // the reservation, page_size aligned within
+    size_t map_size;
+    char *base;
+    size_t size;
+    size_t page_size;
+    uint64_t npages;
+    int prefetch;
+
+    int uffd;
+    int stop_fd;
+    pthread_t thread;
+    int thread_started;
+    int wp;
+
+    // Resident pages: a slot each, at most nslots
+    uint32_t nslots;
+    int64_t *slot_page;         // -1 when free
+    uint8_t *slot_ref;
+    uint8_t *slot_dirty;
+    uint32_t *free_slots;
+    uint32_t nfree;
+    uint32_t hand;
+    int32_t *page_slot;         // -1 when not resident
+
+    // Sequential fault detection
+    uint64_t next_expected;
+    int window;
+
+    char *frames;               // nframes bounce frames for READs and WRITEs
+    int nframes;
+
+    struct farmem_stats stats;
+};
+
+static char *page_addr(const struct farmem *fm, uint64_t page) {
+    return fm->base + page * fm->page_size;
+}
+
+static char *frame_addr(const struct farmem *fm, int frame) {
+    return fm->frames + (size_t)frame * fm->page_size;
+}
+
+// READ or WRITE n pages between frames 0..n-1 and the donated buffer, and
+// wait for all of them
+static int remote_io(struct farmem *fm, enum ibv_wr_opcode opcode, const uint64_t *pages, int n) {
+    struct rdma_context *ctx = &fm->ctx;
+    struct ibv_wc wc[FARMEM_MAX_PREFETCH + 1];
+    int done = 0;
+
+    for (int i = 0; i < n; i++) {
+        struct ibv_sge sge = {
+            .addr = (uintptr_t)frame_addr(fm, i),
+            .length = fm->page_size,
+            .lkey = ctx->mr->lkey,
+        };
+        struct ibv_send_wr wr = {
+            .wr_id = i,
+            .sg_list = &sge,
+            .num_sge = 1,
+            .opcode = opcode,
+            .send_flags = IBV_SEND_SIGNALED,
+        }, *bad_wr;
+
+        wr.wr.rdma.remote_addr = ctx->remote_addr + pages[i] * fm->page_size;
+        wr.wr.rdma.rkey = ctx->remote_rkey;
+        if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+            fprintf(stderr, "Failed to post far memory %s\n",
+                    opcode == IBV_WR_RDMA_READ ? "read" : "write");
+            return -1;
+        }
+    }
+    while (done < n) {
+        int got = ibv_poll_cq(ctx->cq, n - done, wc);
+
+        if (got < 0) {
+            fprintf(stderr, "Failed to poll CQ\n");
+            return -1;
+        }
+        for (int i = 0; i < got; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Far memory %s failed: %s\n",
+                        opcode == IBV_WR_RDMA_READ ? "read" : "write",
+                        ibv_wc_status_str(wc[i].status));
+                return -1;
+            }
+        }
+        done += got;
+    }
+    return 0;
+}
+
+static int wake(struct farmem *fm, uint64_t page) {
+    struct uffdio_range range = {
+        .start = (uintptr_t)page_addr(fm, page),
+        .len = fm->page_size,
+    };
+
+    if (ioctl(fm->uffd, UFFDIO_WAKE, &range)) {
+        fprintf(stderr, "Failed to wake faulting threads: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int write_protect(struct farmem *fm, uint64_t page, int protect) {
+    struct uffdio_writeprotect wp = {
+        .range = {
+            .start = (uintptr_t)page_addr(fm, page),
+            .len = fm->page_size,
+        },
+        .mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+    };
+
+    if (ioctl(fm->uffd, UFFDIO_WRITEPROTECT, &wp)) {
+        fprintf(stderr, "Failed to %s page %lu: %s\n", protect ? "write-protect" : "unprotect",
+                page, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// CLOCK: the first resident page not referenced since the hand last passed
+static uint32_t clock_victim(struct farmem *fm) {
+    for (;;) {
+        uint32_t s = fm->hand;
+
+        fm->hand = (fm->hand + 1) % fm->nslots;
+        if (fm->slot_page[s] < 0) {
+            continue;
+        }
+        if (!fm->slot_ref[s]) {
+            return s;
+        }
+        fm->slot_ref[s] = 0;
+        // A dirty page has been writable since its first write; protect it
+        // again so the next one counts as a reference
+        if (fm->wp && fm->slot_dirty[s]) {
+            write_protect(fm, fm->slot_page[s], 1);
+        }
+    }
+}
+
+// Evict until need slots are free, writing dirty victims back together
+static int make_room(struct farmem *fm, int need) {
+    while (fm->nfree < (uint32_t)need) {
+        uint32_t victims[FARMEM_MAX_PREFETCH + 1];
+        uint64_t vpages[FARMEM_MAX_PREFETCH + 1];
+        uint64_t dirty[FARMEM_MAX_PREFETCH + 1];
+        int nv = 0, nw = 0;
+
+        while (nv < need - (int)fm->nfree && nv < fm->nframes) {
+            uint32_t s = clock_victim(fm);
+            uint64_t page = fm->slot_page[s];
+
+            // Out of the clock so the hand does not take it twice
+            fm->slot_page[s] = -1;
+            victims[nv] = s;
+            vpages[nv++] = page;
+            if (!fm->slot_dirty[s]) {
+                continue;
+            }
+            // Writers wait on the protection until the page is gone
+            if (fm->wp && write_protect(fm, page, 1)) {
+                return -1;
+            }
+            memcpy(frame_addr(fm, nw), page_addr(fm, page), fm->page_size);
+            dirty[nw++] = page;
+        }
+        if (nw && remote_io(fm, IBV_WR_RDMA_WRITE, dirty, nw)) {
+            return -1;
+        }
+        fm->stats.writebacks += nw;
+        fm->stats.bytes_written += (uint64_t)nw * fm->page_size;
+
+        for (int i = 0; i < nv; i++) {
+            if (madvise(page_addr(fm, vpages[i]), fm->page_size, MADV_DONTNEED)) {
+                fprintf(stderr, "Failed to drop page %lu: %s\n", vpages[i], strerror(errno));
+                return -1;
+            }
+            fm->page_slot[vpages[i]] = -1;
+            fm->slot_ref[victims[i]] = 0;
+            fm->slot_dirty[victims[i]] = 0;
+            fm->free_slots[fm->nfree++] = victims[i];
+            fm->stats.evictions++;
+        }
+    }
+    return 0;
+}
+
+// Map frame's page in; only the demand page wakes the threads waiting on it
+static int install(struct farmem *fm, uint64_t page, int frame, int demand) {
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t)page_addr(fm, page),
+        .src = (uintptr_t)frame_addr(fm, frame),
+        .len = fm->page_size,
+        .mode = (fm->wp ? UFFDIO_COPY_MODE_WP : 0) | (demand ? 0 : UFFDIO_COPY_MODE_DONTWAKE),
+    };
+    uint32_t s;
+    int ret;
+
+    // EAGAIN while the address space changes under us (a fork, say)
+    while ((ret = ioctl(fm->uffd, UFFDIO_COPY, &copy)) && errno == EAGAIN) {
+        if (copy.copy > 0) {
+            copy.dst += copy.copy;
+            copy.src += copy.copy;
+            copy.len -= copy.copy;
+        }
+    }
+    if (ret && errno != EEXIST) {
+        fprintf(stderr, "Failed to install page %lu: %s\n", page, strerror(errno));
+        return -1;
+    }
+    if (copy.copy == -EEXIST) {
+        // Mapped behind our back; the data there wins
+        return demand ? wake(fm, page) : 0;
+    }
+    s = fm->free_slots[--fm->nfree];
+    fm->slot_page[s] = page;
+    fm->slot_ref[s] = demand;
+    fm->slot_dirty[s] = !fm->wp;
+    fm->page_slot[page] = s;
+    return 0;
+}
+
+static int handle_missing(struct farmem *fm, uint64_t page) {
+    uint64_t pages[FARMEM_MAX_PREFETCH + 1];
+    uint64_t start = rdma_now_ns(), ns;
+    int n = 1;
+
+    if (fm->page_slot[page] >= 0) {
+        // Another thread faulted on it first
+        return wake(fm, page);
+    }
+    if (fm->prefetch && page == fm->next_expected) {
+        fm->window = fm->window ? fm->window * 2 : 1;
+        if (fm->window > fm->prefetch) {
+            fm->window = fm->prefetch;
+        }
+    } else {
+        fm->window = 0;
+    }
+    pages[0] = page;
+    for (uint64_t q = page + 1; n <= fm->window && q < fm->npages && (uint32_t)n < fm->nslots; q++) {
+        if (fm->page_slot[q] >= 0) {
+            break;
+        }
+        pages[n++] = q;
+    }
+    fm->next_expected = pages[n - 1] + 1;
+
+    if (make_room(fm, n) || remote_io(fm, IBV_WR_RDMA_READ, pages, n)) {
+        return -1;
+    }
+    // Read-ahead first, so the demand page wakes its thread last
+    for (int i = n - 1; i >= 0; i--) {
+        if (install(fm, pages[i], i, i == 0)) {
+            return -1;
+        }
+    }
+
+    ns = rdma_now_ns() - start;
+    fm->stats.faults++;
+    fm->stats.prefetched += n - 1;
+    fm->stats.bytes_read += (uint64_t)n * fm->page_size;
+    fm->stats.fault_ns += ns;
+    if (ns > fm->stats.fault_max_ns) {
+        fm->stats.fault_max_ns = ns;
+    }
+    return 0;
+}
+
+static int handle_write(struct farmem *fm, uint64_t page) {
+    int32_t s = fm->page_slot[page];
+
+    if (s < 0) {
+        // Evicted while the writer waited: it faults again as missing
+        return wake(fm, page);
+    }
+    if (!fm->slot_dirty[s]) {
+        fm->slot_dirty[s] = 1;
+        fm->stats.wp_faults++;
+    }
+    fm->slot_ref[s] = 1;
+    return write_protect(fm, page, 0);
+}
+
+static void *fault_handler(void *arg) {
+    struct farmem *fm = arg;
+    struct pollfd pfd[2] = {
+        { .fd = fm->uffd, .events = POLLIN },
+        { .fd = fm->stop_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        struct uffd_msg msgs[UFFD_MSG_BATCH];
+        ssize_t got;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to poll userfaultfd: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        got = read(fm->uffd, msgs, sizeof(msgs));
+        if (got < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to read userfaultfd: %s\n", strerror(errno));
+            break;
+        }
+        for (size_t i = 0; i < got / sizeof(msgs[0]); i++) {
+            uint64_t addr = msgs[i].arg.pagefault.address;
+            uint64_t page = (addr - (uintptr_t)fm->base) / fm->page_size;
+            int ret;
+
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+            if (msgs[i].arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) {
+                ret = handle_write(fm, page);
+            } else {
+                ret = handle_missing(fm, page);
+            }
+            if (ret) {
+                // As for a swap-in that fails: the faulting thread cannot go on
+                fprintf(stderr, "Far memory lost page %lu\n", page);
+                raise(SIGBUS);
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int setup_uffd(struct farmem *fm) {
+    struct uffdio_api api = { .api = UFFD_API };
+    struct uffdio_register reg = {
+        .range = { .start = (uintptr_t)fm->base, .len = fm->size },
+    };
+    int registered;
+
+    fm->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fm->uffd < 0) {
+        fprintf(stderr, "Failed to open userfaultfd: %s (unprivileged use needs "
+                "vm.unprivileged_userfaultfd=1)\n", strerror(errno));
+        return -1;
+    }
+    if (ioctl(fm->uffd, UFFDIO_API, &api)) {
+        fprintf(stderr, "Failed to negotiate userfaultfd API: %s\n", strerror(errno));
+        return -1;
+    }
+    fm->wp = !!(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING | (fm->wp ? UFFDIO_REGISTER_MODE_WP : 0);
+    registered = !ioctl(fm->uffd, UFFDIO_REGISTER, &reg);
+    if (!registered && fm->wp) {
+        // Write-protect for shmem or hugetlb only: every page dirty then
+        fm->wp = 0;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        registered = !ioctl(fm->uffd, UFFDIO_REGISTER, &reg);
+    }
+    if (!registered) {
+        fprintf(stderr, "Failed to register the range with userfaultfd: %s\n", strerror(errno));
+        return -1;
+    }
+    if (fm->wp && !(reg.ioctls & (1ULL << _UFFDIO_WRITEPROTECT))) {
+        fm->wp = 0;
+    }
+    if (!(reg.ioctls & (1ULL << _UFFDIO_COPY))) {
+        fprintf(stderr, "userfaultfd cannot copy pages into the range\n");
+        return -1;
+    }
+    return 0;
+}
+
+struct farmem *farmem_open(const struct farmem_attr *attr) {
+    struct rdma_resource_attr rattr = {
+        .quiet = 1,
+    };
+    size_t ps = attr->page_size;
+    struct farmem *fm;
+
+    if (ps < FARMEM_MIN_PAGE || ps > FARMEM_MAX_PAGE || (ps & (ps - 1))) {
+        fprintf(stderr, "Far memory pages are a power of two from %d to %d bytes\n",
+                FARMEM_MIN_PAGE, FARMEM_MAX_PAGE);
+        return NULL;
+    }
+    if (attr->size < ps || attr->cache_bytes < ps) {
+        fprintf(stderr, "Far memory range and cache take a page at least\n");
+        return NULL;
+    }
+    if (attr->prefetch < 0 || attr->prefetch > FARMEM_MAX_PREFETCH) {
+        fprintf(stderr, "Far memory prefetch is 0 to %d pages\n", FARMEM_MAX_PREFETCH);
+        return NULL;
+    }
+
+    fm = calloc(1, sizeof(*fm));
+    if (!fm) {
+        fprintf(stderr, "Failed to allocate far memory state\n");
+        return NULL;
+    }
+    fm->uffd = -1;
+    fm->stop_fd = -1;
+    fm->page_size = ps;
+    fm->size = (attr->size + ps - 1) & ~(ps - 1);
+    fm->npages = fm->size / ps;
+    fm->nslots = attr->cache_bytes / ps < fm->npages ? attr->cache_bytes / ps : fm->npages;
+    fm->prefetch = attr->prefetch;
+    fm->nframes = attr->prefetch + 1;
+    fm->next_expected = UINT64_MAX;
+
+    fm->slot_page = malloc(fm->nslots * sizeof(*fm->slot_page));
+    fm->slot_ref = calloc(fm->nslots, 1);
+    fm->slot_dirty = calloc(fm->nslots, 1);
+    fm->free_slots = malloc(fm->nslots * sizeof(*fm->free_slots));
+    fm->page_slot = malloc(fm->npages * sizeof(*fm->page_slot));
+    fm->frames = aligned_alloc(FARMEM_MIN_PAGE, (size_t)fm->nframes * ps);
+    if (!fm->slot_page || !fm->slot_ref || !fm->slot_dirty || !fm->free_slots ||
+        !fm->page_slot || !fm->frames) {
+        fprintf(stderr, "Failed to allocate far memory page tables\n");
+        goto fail;
+    }
+    for (uint32_t s = 0; s < fm->nslots; s++) {
+        fm->slot_page[s] = -1;
+        fm->free_slots[s] = fm->nslots - 1 - s;
+    }
+    fm->nfree = fm->nslots;
+    memset(fm->page_slot, 0xff, fm->npages * sizeof(*fm->page_slot));
+
+    rattr.buffer = fm->frames;
+    rattr.buffer_size = (size_t)fm->nframes * ps;
+    rattr.qp_depth = fm->nframes;
+    rattr.cq_depth = fm->nframes;
+    if (connect_to_servers(&fm->ctx, 1, attr->server_ip, attr->port, &rattr, NULL)) {
+        goto fail;
+    }
+    if (fm->ctx.remote_length < fm->size) {
+        fprintf(stderr, "Server donates %lu MB, %zu MB asked for\n",
+                fm->ctx.remote_length >> 20, fm->size >> 20);
+        goto fail;
+    }
+
+    // Reserved, never backed but by the handler: page_size aligned
+    fm->map_size = fm->size + ps;
+    fm->map = mmap(NULL, fm->map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (fm->map == MAP_FAILED) {
+        fprintf(stderr, "Failed to reserve %zu MB: %s\n", fm->size >> 20, strerror(errno));
+        fm->map = NULL;
+        goto fail;
+    }
+    fm->base = (char *)(((uintptr_t)fm->map + ps - 1) & ~(uintptr_t)(ps - 1));
+    // Eviction drops page_size at a time; no huge pages to split
+    madvise(fm->base, fm->size, MADV_NOHUGEPAGE);
+
+    if (setup_uffd(fm)) {
+        goto fail;
+    }
+    fm->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (fm->stop_fd < 0) {
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+        goto fail;
+    }
+    if (pthread_create(&fm->thread, NULL, fault_handler, fm)) {
+        fprintf(stderr, "Failed to start the fault handler\n");
+        goto fail;
+    }
+    fm->thread_started = 1;
+    return fm;
+
+fail:
+    farmem_close(fm);
+    return NULL;
+}
+
+void farmem_close(struct farmem *fm) {
+    if (!fm) {
+        return;
+    }
+    if (fm->thread_started) {
+        uint64_t one = 1;
+
+        if (write(fm->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+            fprintf(stderr, "Failed to stop the fault handler\n");
+        }
+        pthread_join(fm->thread, NULL);
+    }
+    if (fm->stop_fd >= 0) {
+        close(fm->stop_fd);
+    }
+    if (fm->uffd >= 0) {
+        close(fm->uffd);
+    }
+    if (fm->map) {
+        munmap(fm->map, fm->map_size);
+    }
+    close_rdma_connection(&fm->ctx);
+    free(fm->frames);
+    free(fm->page_slot);
+    free(fm->free_slots);
+    free(fm->slot_dirty);
+    free(fm->slot_ref);
+    free(fm->slot_page);
+    free(fm);
+}
+
+void *farmem_base(const struct farmem *fm) {
+    return fm->base;
+}
+
+void farmem_get_stats(const struct farmem *fm, struct farmem_stats *stats) {
+    *stats = fm->stats;
+    stats->write_protect = fm->wp;
+}
+
+int farmem_serve(const struct sockaddr *local, int port, size_t bytes, volatile int *running) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = bytes,
+        .cq_depth = 2,
+        .qp_depth = 1,
+        .mr_mode = RDMA_MR_ODP,
+        .quiet = 1,
+        .src_addr = local,
+    };
+    int64_t served;
+
+    // A fresh buffer per client: its pages read as zeros until written
+    printf("Donating %zu MB of far memory per client on port %d\n", bytes >> 20, port);
+    served = serve_connections(local, port, &attr, 0, running);
+    if (served < 0) {
+        return -1;
+    }
+    printf("Served %ld far memory clients\n", served);
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Far memory: paging a virtual range to and from a memory donor over RDMA
+ * (librdmademo)
+ *
+ * A host short on RAM borrows it from a server that registers a large
+ * buffer for remote read and write (farmem_serve(), rdma_server -M). The
+ * client reserves a range as big as the loan and has userfaultfd deliver
+ * its page faults to a handler thread, which
+ *
+ *   on a missing page     RDMA READs it from the server into a registered
+ *                         bounce frame and installs it (UFFDIO_COPY). Pages
+ *                         are page_size bytes, 4 KB to 2 MB, at the same
+ *                         offset in the range and in the donated buffer
+ *   on sequential faults  reads up to prefetch pages ahead along with the
+ *                         faulting one, doubling the run on each fault that
+ *                         follows the last
+ *   on a full cache       keeps at most cache_bytes of the range resident
+ *                         and evicts by CLOCK: the hand clears referenced
+ *                         bits and takes the first page found clear. A
+ *                         dirty victim is RDMA WRITTEN back first, then
+ *                         dropped (MADV_DONTNEED) so its next touch faults
+ *
+ * Dirty and referenced bits come from write-protect faults where the
+ * kernel has them for anonymous memory (UFFD_FEATURE_PAGEFAULT_FLAG_WP):
+ * pages go in write-protected, the first write marks them dirty, and the
+ * hand protects again what it passes so a later write counts as a
+ * reference. Reads of a resident page never fault, so only writes and
+ * faults keep a page warm. Without write-protect (before Linux 5.7) every
+ * page is written back, and a store racing the eviction of its page may be
+ * lost.
+ *
+ * One thread handles every fault, so concurrent faults wait their turn. A
+ * page that cannot be fetched or written back raises SIGBUS, as a failed
+ * swap-in does.
+ *
+ * farmem_bench runs a memory-hungry workload on far memory against local
+ * memory and swap.
+ */
+
+#ifndef RDMA_FARMEM_H
+#define RDMA_FARMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define FARMEM_MIN_PAGE 4096
+#define FARMEM_MAX_PAGE (2 * 1024 * 1024)
+#define FARMEM_MAX_PREFETCH 16          // pages read ahead on a sequential fault
+
+struct farmem_attr {
+    const char *server_ip;
+    int port;
+    size_t size;                // bytes of the range, at most the server's donation
+    size_t page_size;           // power of two, FARMEM_MIN_PAGE to FARMEM_MAX_PAGE
+    size_t cache_bytes;         // resident at most, at least a page
+    int prefetch;               // pages ahead at most, 0 for none
+};
+
+struct farmem_stats {
+    uint64_t faults;            // missing pages fetched on demand
+    uint64_t wp_faults;         // first writes to clean pages
+    uint64_t prefetched;
+    uint64_t evictions;
+    uint64_t writebacks;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t fault_ns;          // handling missing faults, in all
+    uint64_t fault_max_ns;
+    int write_protect;          // dirty tracking by write-protect faults
+};
+
+struct farmem;
+
+// Connect to the donor and reserve the range; faults are served from now on
+struct farmem *farmem_open(const struct farmem_attr *attr);
+// Stop serving faults and release everything; the range is gone after
+void farmem_close(struct farmem *fm);
+void *farmem_base(const struct farmem *fm);
+// A snapshot, exact once nothing is faulting
+void farmem_get_stats(const struct farmem *fm, struct farmem_stats *stats);
+
+// Donor side: accept far-memory clients on port of local (NULL for any),
+// each with a buffer of bytes (on-demand paged where the device can, so
+// memory is only taken as clients write it), until *running drops
+int farmem_serve(const struct sockaddr *local, int port, size_t bytes, volatile int *running);
+
+#endif
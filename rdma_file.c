@@ -0,0 +1,907 @@
+/*
+ * Zero-copy file transfer: chunk pipeline, credit flow control and disk I/O.
+ * See rdma_file.h for the protocol.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "rdma_file.h"
+#include "rdma_trace.h"
+
+#define POLL_BATCH 16
+#define WIRE_LOW 2          // chunks in flight below which the wire runs dry
+
+enum file_msg_type {
+    FILE_MSG_ADVERT = 1,
+    FILE_MSG_CREDIT,
+    FILE_MSG_DONE,          // file is on disk; nothing more will be sent
+};
+
+// Control message, receiver -> sender
+struct file_msg {
+    uint32_t type;
+    uint32_t num_slots;
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t chunk_size;
+    uint32_t codecs;        // advert: a bit per codec the receiver decompresses
+    uint64_t freed;         // chunks below this have been written to disk
+    double cpu;             // done: the receiver's CPU seconds
+};
+
+// Disk I/O queue over nbufs registered chunk buffers. Completions carry the
+// chunk sequence number as their tag.
+struct disk_io {
+    int fd;
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#else
+    // Synchronous fallback: the I/O happens at submit, completions queue up
+    struct {
+        uint64_t tag;
+        int res;
+    } done[FILE_XFER_SLOTS];
+    int num_done;
+#endif
+};
+
+static int disk_io_init(struct disk_io *io, int fd, char *bufs, size_t buf_len, int nbufs) {
+    io->fd = fd;
+#ifdef HAVE_LIBURING
+    struct iovec iov[2 * FILE_XFER_SLOTS];
+    int ret;
+
+    ret = io_uring_queue_init(FILE_XFER_SLOTS * 2, &io->ring, 0);
+    if (ret) {
+        fprintf(stderr, "Failed to set up io_uring: %s\n", strerror(-ret));
+        return -1;
+    }
+    // Fixed buffers: the kernel pins them once instead of on every I/O
+    for (int i = 0; i < nbufs; i++) {
+        iov[i].iov_base = bufs ? bufs + i * buf_len : NULL;
+        iov[i].iov_len = buf_len;
+    }
+    if (bufs && (ret = io_uring_register_buffers(&io->ring, iov, nbufs))) {
+        fprintf(stderr, "Failed to register io_uring buffers: %s\n", strerror(-ret));
+        io_uring_queue_exit(&io->ring);
+        return -1;
+    }
+#else
+    (void)bufs;
+    (void)buf_len;
+    (void)nbufs;
+    io->num_done = 0;
+#endif
+    return 0;
+}
+
+static int disk_io_submit(struct disk_io *io, int write, int slot, char *buf, size_t len,
+                          off_t offset, uint64_t tag) {
+#ifdef HAVE_LIBURING
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+    int ret;
+
+    if (!sqe) {
+        fprintf(stderr, "io_uring submission queue full\n");
+        return -1;
+    }
+    if (write) {
+        io_uring_prep_write_fixed(sqe, io->fd, buf, len, offset, slot);
+    } else {
+        io_uring_prep_read_fixed(sqe, io->fd, buf, len, offset, slot);
+    }
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)tag);
+    ret = io_uring_submit(&io->ring);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring submit failed: %s\n", strerror(-ret));
+        return -1;
+    }
+#else
+    ssize_t res;
+
+    (void)slot;
+    res = write ? pwrite(io->fd, buf, len, offset) : pread(io->fd, buf, len, offset);
+    io->done[io->num_done].tag = tag;
+    io->done[io->num_done].res = res < 0 ? -errno : (int)res;
+    io->num_done++;
+#endif
+    return 0;
+}
+
+// Returns 1 with a completion, 0 if none is ready, -1 on error
+static int disk_io_reap(struct disk_io *io, uint64_t *tag, int *res) {
+#ifdef HAVE_LIBURING
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    ret = io_uring_peek_cqe(&io->ring, &cqe);
+    if (ret == -EAGAIN) {
+        return 0;
+    }
+    if (ret) {
+        fprintf(stderr, "io_uring completion failed: %s\n", strerror(-ret));
+        return -1;
+    }
+    *tag = (uint64_t)(uintptr_t)io_uring_cqe_get_data(cqe);
+    *res = cqe->res;
+    io_uring_cqe_seen(&io->ring, cqe);
+    return 1;
+#else
+    if (!io->num_done) {
+        return 0;
+    }
+    io->num_done--;
+    *tag = io->done[io->num_done].tag;
+    *res = io->done[io->num_done].res;
+    return 1;
+#endif
+}
+
+static void disk_io_exit(struct disk_io *io) {
+#ifdef HAVE_LIBURING
+    io_uring_queue_exit(&io->ring);
+#else
+    (void)io;
+#endif
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_sec(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// Every chunk is full size except the last one
+static uint32_t chunk_len(uint64_t file_size, uint64_t seq) {
+    uint64_t offset = seq * FILE_CHUNK_SIZE;
+    return file_size - offset < FILE_CHUNK_SIZE ? file_size - offset : FILE_CHUNK_SIZE;
+}
+
+static int post_recv(struct ibv_qp *qp, uint64_t wr_id, struct file_msg *msg, uint32_t lkey) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)msg,
+        .length = sizeof(*msg),
+        .lkey = lkey,
+    };
+    struct ibv_recv_wr wr = {
+        .wr_id = wr_id,
+        .sg_list = msg ? &sge : NULL,
+        .num_sge = msg ? 1 : 0,
+    };
+    struct ibv_recv_wr *bad_wr;
+
+    return ibv_post_recv(qp, &wr, &bad_wr);
+}
+
+static int post_msg(struct ibv_qp *qp, struct file_msg *msg, uint32_t lkey) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)msg,
+        .length = sizeof(*msg),
+        .lkey = lkey,
+    };
+    struct ibv_send_wr wr = {
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_SEND,
+        .send_flags = IBV_SEND_SIGNALED,
+    };
+    struct ibv_send_wr *bad_wr;
+
+    return ibv_post_send(qp, &wr, &bad_wr);
+}
+
+// Chunk seq goes to remote slot seq % slots, with seq and flags as the immediate
+static int post_chunk(struct ibv_qp *qp, const struct file_msg *advert, uint64_t seq,
+                      uint32_t flags, const void *addr, uint32_t len, uint32_t lkey) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)addr,
+        .length = len,
+        .lkey = lkey,
+    };
+    struct ibv_send_wr wr = {
+        .wr_id = seq,
+        .sg_list = len ? &sge : NULL,
+        .num_sge = len ? 1 : 0,
+        .opcode = IBV_WR_RDMA_WRITE_WITH_IMM,
+        .send_flags = IBV_SEND_SIGNALED,
+        .imm_data = htonl((uint32_t)seq | flags),
+    };
+    struct ibv_send_wr *bad_wr;
+
+    wr.wr.rdma.remote_addr = advert->addr + (seq % advert->num_slots) * advert->chunk_size;
+    wr.wr.rdma.rkey = advert->rkey;
+    rdma_trace_post(seq, wr.opcode, len);
+    return ibv_post_send(qp, &wr, &bad_wr);
+}
+
+// Poll a batch of completions; trace it only when it returned something
+static int poll_batch(struct ibv_cq *cq, struct ibv_wc *wc, uint64_t *poll_start,
+                      uint32_t *empty_polls, uint64_t *polled_at) {
+    int n = ibv_poll_cq(cq, POLL_BATCH, wc);
+
+    if (n == 0) {
+        (*empty_polls)++;
+        return 0;
+    }
+    *polled_at = rdma_trace_poll_end(*poll_start, n, *empty_polls);
+    *poll_start = rdma_trace_poll_begin();
+    *empty_polls = 0;
+    if (n < 0) {
+        fprintf(stderr, "Failed to poll CQ\n");
+    }
+    return n;
+}
+
+// mmap source: keep at most two windows of the file registered, and only
+// drop a window once every chunk posted from it has completed
+struct file_windows {
+    struct ibv_pd *pd;
+    char *map;
+    uint64_t size;
+    uint64_t window_size;
+    uint64_t chunks_per_window;
+    struct ibv_mr *mr[2];
+    int64_t index[2];
+};
+
+// Returns 1 when the window holding chunk seq is registered, 0 if it must
+// wait for completions, -1 on error
+static int window_for(struct file_windows *fw, uint64_t seq, uint64_t completed, struct ibv_mr **mr) {
+    int64_t w = seq / fw->chunks_per_window;
+    int k = w & 1;
+    uint64_t offset, len;
+
+    if (fw->index[k] == w) {
+        *mr = fw->mr[k];
+        return 1;
+    }
+    if (fw->mr[k]) {
+        if (completed < (uint64_t)(fw->index[k] + 1) * fw->chunks_per_window) {
+            return 0;
+        }
+        ibv_dereg_mr(fw->mr[k]);
+        fw->mr[k] = NULL;
+    }
+
+    offset = w * fw->window_size;
+    len = fw->size - offset < fw->window_size ? fw->size - offset : fw->window_size;
+    // Only local reads of the page cache, so no access flags are needed
+    fw->mr[k] = ibv_reg_mr(fw->pd, fw->map + offset, len, 0);
+    if (!fw->mr[k]) {
+        fprintf(stderr, "Failed to register file window at offset %lu: %s\n", offset, strerror(errno));
+        return -1;
+    }
+    fw->index[k] = w;
+    *mr = fw->mr[k];
+    return 1;
+}
+
+int file_send(struct ibv_pd *pd, struct ibv_qp *qp, struct ibv_cq *cq, const char *path,
+              enum file_source source, enum compress_codec codec, int adaptive,
+              volatile int *running, struct file_xfer_stats *stats) {
+    struct file_msg *msgs = NULL, advert = {0};
+    struct ibv_mr *msg_mr = NULL, *buf_mr = NULL, *stage_mr = NULL, *mr;
+    struct file_windows fw = { .pd = pd, .index = {-1, -1} };
+    struct disk_io io = {0};
+    struct ibv_wc wc[POLL_BATCH];
+    struct stat st;
+    struct compress_pool *pool = NULL;
+    struct compress_ctl ctl;
+    struct compress_job jobs[FILE_XFER_SLOTS];     // chunk seq's in jobs[seq % slots]
+    int staged[FILE_XFER_SLOTS] = {0};             // jobs[k] holds a compression to post
+    char *bufs = NULL, *stage = NULL;
+    uint64_t nchunks, next_read = 0, next_stage = 0, next_post = 0, completed = 0, freed = 0;
+    uint64_t ready[FILE_XFER_SLOTS] = {0};
+    uint64_t poll_start = 0, polled_at = 0, tag;
+    uint32_t empty_polls = 0;
+    double t0, cpu0;
+    int fd, io_ready = 0, have_advert = 0, done = 0, io_res, res, n, ret = -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    compress_ctl_init(&ctl, codec, adaptive, COMPRESS_MIN_RATIO);
+
+    // Receive buffers for the advert and one credit per outstanding chunk
+    msgs = calloc(FILE_XFER_SLOTS + 1, sizeof(*msgs));
+    if (!msgs || !(msg_mr = ibv_reg_mr(pd, msgs, (FILE_XFER_SLOTS + 1) * sizeof(*msgs),
+                                       IBV_ACCESS_LOCAL_WRITE))) {
+        fprintf(stderr, "Failed to register control buffers\n");
+        goto out;
+    }
+    for (int i = 0; i <= FILE_XFER_SLOTS; i++) {
+        if (post_recv(qp, i, &msgs[i], msg_mr->lkey)) {
+            fprintf(stderr, "Failed to post receive\n");
+            goto out;
+        }
+    }
+
+    if (source == FILE_SOURCE_MMAP && st.st_size) {
+        fw.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (fw.map == MAP_FAILED) {
+            perror("mmap");
+            fw.map = NULL;
+            goto out;
+        }
+        madvise(fw.map, st.st_size, MADV_SEQUENTIAL);
+        fw.size = st.st_size;
+    } else if (source == FILE_SOURCE_READ) {
+        bufs = aligned_alloc(4096, (size_t)FILE_XFER_SLOTS * FILE_CHUNK_SIZE);
+        if (!bufs || !(buf_mr = ibv_reg_mr(pd, bufs, (size_t)FILE_XFER_SLOTS * FILE_CHUNK_SIZE,
+                                           IBV_ACCESS_LOCAL_WRITE))) {
+            fprintf(stderr, "Failed to register read buffers\n");
+            goto out;
+        }
+        if (disk_io_init(&io, fd, bufs, FILE_CHUNK_SIZE, FILE_XFER_SLOTS)) {
+            goto out;
+        }
+        io_ready = 1;
+    }
+    if (codec != COMPRESS_NONE) {
+        if (!compress_codec_available(codec)) {
+            fprintf(stderr, "Built without %s compression\n", compress_codec_names[codec]);
+            goto out;
+        }
+        // Staged chunks are only read by the HCA, like the file windows
+        stage = aligned_alloc(4096, (size_t)FILE_XFER_SLOTS * FILE_CHUNK_SIZE);
+        if (!stage || !(stage_mr = ibv_reg_mr(pd, stage, (size_t)FILE_XFER_SLOTS * FILE_CHUNK_SIZE, 0))) {
+            fprintf(stderr, "Failed to register staging buffers\n");
+            goto out;
+        }
+        pool = compress_pool_create(FILE_COMPRESS_WORKERS);
+        if (!pool) {
+            goto out;
+        }
+    }
+
+    printf("Waiting for receiver buffer advertisement...\n");
+    while (!have_advert) {
+        if (!*running) {
+            goto out;
+        }
+        n = ibv_poll_cq(cq, 1, wc);
+        if (n < 0 || (n && wc[0].status != IBV_WC_SUCCESS)) {
+            fprintf(stderr, "Failed to receive advertisement: %s\n",
+                    n < 0 ? "poll error" : ibv_wc_status_str(wc[0].status));
+            goto out;
+        }
+        if (n && wc[0].opcode == IBV_WC_RECV && msgs[wc[0].wr_id].type == FILE_MSG_ADVERT) {
+            advert = msgs[wc[0].wr_id];
+            if (post_recv(qp, wc[0].wr_id, &msgs[wc[0].wr_id], msg_mr->lkey)) {
+                fprintf(stderr, "Failed to post receive\n");
+                goto out;
+            }
+            have_advert = 1;
+        }
+    }
+    if (advert.num_slots == 0 || advert.num_slots > FILE_XFER_SLOTS ||
+        advert.chunk_size != FILE_CHUNK_SIZE) {
+        fprintf(stderr, "Unsupported receiver layout: %u slots of %u bytes\n",
+                advert.num_slots, advert.chunk_size);
+        goto out;
+    }
+    if (codec != COMPRESS_NONE && !(advert.codecs & (1u << codec))) {
+        fprintf(stderr, "Receiver cannot decompress %s\n", compress_codec_names[codec]);
+        goto out;
+    }
+    fw.window_size = FILE_WINDOW_SIZE / FILE_CHUNK_SIZE * FILE_CHUNK_SIZE;
+    fw.chunks_per_window = fw.window_size / FILE_CHUNK_SIZE;
+
+    nchunks = (st.st_size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+    printf("Sending %s: %ld bytes in %lu chunks (%s source, %s%s)\n", path, (long)st.st_size,
+           nchunks, source == FILE_SOURCE_MMAP ? "mmap" : "read", compress_codec_names[codec],
+           pool && adaptive ? " adaptive" : "");
+
+    t0 = now_sec();
+    cpu0 = cpu_sec();
+    poll_start = rdma_trace_poll_begin();
+
+    while (completed < nchunks) {
+        if (!*running) {
+            fprintf(stderr, "File transfer interrupted\n");
+            goto out;
+        }
+
+        // Read ahead into local buffers whose previous chunk has completed
+        if (source == FILE_SOURCE_READ) {
+            while (next_read < nchunks && next_read < completed + FILE_XFER_SLOTS) {
+                int slot = next_read % FILE_XFER_SLOTS;
+                if (disk_io_submit(&io, 0, slot, bufs + (size_t)slot * FILE_CHUNK_SIZE,
+                                   chunk_len(st.st_size, next_read), next_read * FILE_CHUNK_SIZE, next_read)) {
+                    goto out;
+                }
+                next_read++;
+            }
+            while ((res = disk_io_reap(&io, &tag, &io_res)) == 1) {
+                if (io_res < 0 || (uint32_t)io_res != chunk_len(st.st_size, tag)) {
+                    fprintf(stderr, "Short read at offset %lu: %s\n", tag * FILE_CHUNK_SIZE,
+                            io_res < 0 ? strerror(-io_res) : "file changed while sending?");
+                    goto out;
+                }
+                ready[tag % FILE_XFER_SLOTS] = tag + 1;
+            }
+            if (res < 0) {
+                goto out;
+            }
+        }
+
+        // Compress ahead of posting, into the staging buffer of the chunk's
+        // slot once the chunk before it there has completed
+        while (pool && next_stage < nchunks && next_stage < completed + FILE_XFER_SLOTS) {
+            int k = next_stage % FILE_XFER_SLOTS, busy = 0;
+            enum compress_decision d;
+
+            if (source == FILE_SOURCE_READ && ready[k] != next_stage + 1) {
+                break;
+            }
+            for (uint64_t s = next_post; s < next_stage; s++) {
+                busy += staged[s % FILE_XFER_SLOTS] && !compress_job_done(&jobs[s % FILE_XFER_SLOTS]);
+            }
+            d = compress_ctl_decide(&ctl, busy < FILE_COMPRESS_WORKERS,
+                                    next_post - completed < WIRE_LOW);
+            if (d == COMPRESS_WAIT) {
+                break;
+            }
+            if (d == COMPRESS_DO) {
+                struct compress_job *j = &jobs[k];
+
+                memset(j, 0, sizeof(*j));
+                j->op = COMPRESS_OP_COMPRESS;
+                j->codec = codec;
+                j->level = FILE_COMPRESS_LEVEL;
+                j->src = source == FILE_SOURCE_MMAP ? fw.map + next_stage * FILE_CHUNK_SIZE
+                                                    : bufs + (size_t)k * FILE_CHUNK_SIZE;
+                j->src_len = chunk_len(st.st_size, next_stage);
+                j->dst = stage + (size_t)k * FILE_CHUNK_SIZE;
+                j->dst_cap = FILE_CHUNK_SIZE;
+                j->seq = next_stage;
+                if (compress_pool_submit(pool, j)) {
+                    break;
+                }
+            }
+            staged[k] = d == COMPRESS_DO;
+            next_stage++;
+        }
+
+        // Push chunks in order while the receiver has free slots
+        while (next_post < nchunks && next_post < freed + advert.num_slots) {
+            uint32_t len = chunk_len(st.st_size, next_post);
+            const char *addr;
+
+            if (pool) {
+                int k = next_post % FILE_XFER_SLOTS;
+                struct compress_job *j = &jobs[k];
+
+                if (next_post == next_stage || (staged[k] && !compress_job_done(j))) {
+                    break;
+                }
+                if (staged[k]) {
+                    if (j->status) {
+                        fprintf(stderr, "Chunk %lu failed to compress\n", next_post);
+                        goto out;
+                    }
+                    staged[k] = 0;
+                    compress_ctl_update(&ctl, len, j->out_len);
+                    // A chunk that would not shrink goes raw below
+                    if (j->out_len) {
+                        if (post_chunk(qp, &advert, next_post, FILE_CHUNK_COMPRESSED, j->dst,
+                                       j->out_len, stage_mr->lkey)) {
+                            fprintf(stderr, "Failed to post chunk %lu\n", next_post);
+                            goto out;
+                        }
+                        stats->wire_bytes += j->out_len;
+                        stats->compressed++;
+                        next_post++;
+                        continue;
+                    }
+                }
+            }
+            if (source == FILE_SOURCE_MMAP) {
+                res = window_for(&fw, next_post, completed, &mr);
+                if (res < 0) {
+                    goto out;
+                }
+                if (res == 0) {
+                    break;
+                }
+                addr = fw.map + next_post * FILE_CHUNK_SIZE;
+            } else {
+                if (ready[next_post % FILE_XFER_SLOTS] != next_post + 1) {
+                    break;
+                }
+                mr = buf_mr;
+                addr = bufs + (size_t)(next_post % FILE_XFER_SLOTS) * FILE_CHUNK_SIZE;
+            }
+            if (post_chunk(qp, &advert, next_post, 0, addr, len, mr->lkey)) {
+                fprintf(stderr, "Failed to post chunk %lu\n", next_post);
+                goto out;
+            }
+            stats->wire_bytes += len;
+            next_post++;
+        }
+
+        n = poll_batch(cq, wc, &poll_start, &empty_polls, &polled_at);
+        if (n < 0) {
+            goto out;
+        }
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+                goto out;
+            }
+            if (wc[i].opcode == IBV_WC_RECV) {
+                struct file_msg *msg = &msgs[wc[i].wr_id];
+                if (msg->type == FILE_MSG_CREDIT && msg->freed > freed) {
+                    freed = msg->freed;
+                }
+                if (post_recv(qp, wc[i].wr_id, msg, msg_mr->lkey)) {
+                    fprintf(stderr, "Failed to post receive\n");
+                    goto out;
+                }
+            } else {
+                // Send queue completions arrive in posting order
+                rdma_trace_completion(&wc[i], polled_at);
+                completed++;
+                stats->bytes += chunk_len(st.st_size, wc[i].wr_id);
+            }
+        }
+    }
+
+    // End of file marker. The receiver answers once the file is on disk;
+    // until then it may still send credits, so keep receives posted.
+    if (post_chunk(qp, &advert, FILE_XFER_DONE, 0, NULL, 0, 0)) {
+        fprintf(stderr, "Failed to post end of file\n");
+        goto out;
+    }
+    while (!done && *running) {
+        n = ibv_poll_cq(cq, POLL_BATCH, wc);
+        if (n < 0) {
+            fprintf(stderr, "Failed to poll CQ\n");
+            goto out;
+        }
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+                goto out;
+            }
+            if (wc[i].opcode != IBV_WC_RECV) {
+                continue;
+            }
+            if (msgs[wc[i].wr_id].type == FILE_MSG_DONE) {
+                stats->peer_cpu = msgs[wc[i].wr_id].cpu;
+                done = 1;
+            }
+            if (!done && post_recv(qp, wc[i].wr_id, &msgs[wc[i].wr_id], msg_mr->lkey)) {
+                fprintf(stderr, "Failed to post receive\n");
+                goto out;
+            }
+        }
+    }
+
+    stats->elapsed = now_sec() - t0;
+    stats->cpu = cpu_sec() - cpu0;
+    ret = done ? 0 : -1;
+
+out:
+    // Before anything a queued job reads from goes away
+    compress_pool_destroy(pool);
+    if (io_ready) {
+        disk_io_exit(&io);
+    }
+    for (int k = 0; k < 2; k++) {
+        if (fw.mr[k]) {
+            ibv_dereg_mr(fw.mr[k]);
+        }
+    }
+    if (fw.map) {
+        munmap(fw.map, fw.size);
+    }
+    if (buf_mr) {
+        ibv_dereg_mr(buf_mr);
+    }
+    if (stage_mr) {
+        ibv_dereg_mr(stage_mr);
+    }
+    if (msg_mr) {
+        ibv_dereg_mr(msg_mr);
+    }
+    free(bufs);
+    free(stage);
+    free(msgs);
+    close(fd);
+    return ret;
+}
+
+int file_receive(struct ibv_pd *pd, struct ibv_qp *qp, struct ibv_cq *cq, const char *path,
+                 volatile int *running, struct file_xfer_stats *stats) {
+    struct file_msg *msgs = NULL;
+    struct ibv_mr *msg_mr = NULL, *slot_mr = NULL;
+    struct disk_io io = {0};
+    struct ibv_wc wc[POLL_BATCH];
+    struct compress_pool *pool = NULL;
+    struct compress_job jobs[FILE_XFER_SLOTS];     // decompressing slot k into bounce k
+    int decoding[FILE_XFER_SLOTS] = {0};
+    char *slots = NULL, *bounce;
+    uint32_t codecs = 0;
+    uint64_t written[FILE_XFER_SLOTS] = {0};
+    uint64_t freed = 0, credited = 0, credits_sent = 0, tag;
+    uint64_t poll_start = 0, polled_at = 0;
+    uint32_t empty_polls = 0;
+    double t0, cpu0;
+    int fd, io_ready = 0, inflight = 0, sends_outstanding = 0, done = 0, io_res, res, n, ret = -1;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    for (int c = COMPRESS_NONE + 1; c < COMPRESS_CODEC_COUNT; c++) {
+        codecs |= compress_codec_available(c) << c;
+    }
+
+    // The slots, then a bounce buffer per slot when there is a codec to
+    // decompress with; only the slots are remote writable
+    slots = aligned_alloc(4096, (size_t)(codecs ? 2 : 1) * FILE_XFER_SLOTS * FILE_CHUNK_SIZE);
+    if (!slots || !(slot_mr = ibv_reg_mr(pd, slots, (size_t)FILE_XFER_SLOTS * FILE_CHUNK_SIZE,
+                                         IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE))) {
+        fprintf(stderr, "Failed to register receive slots\n");
+        goto out;
+    }
+    bounce = slots + (size_t)FILE_XFER_SLOTS * FILE_CHUNK_SIZE;
+
+    // Send buffers: one per credit that can be in flight, the advert and done
+    msgs = calloc(FILE_XFER_SLOTS + 2, sizeof(*msgs));
+    if (!msgs || !(msg_mr = ibv_reg_mr(pd, msgs, (FILE_XFER_SLOTS + 2) * sizeof(*msgs), 0))) {
+        fprintf(stderr, "Failed to register control buffers\n");
+        goto out;
+    }
+    if (disk_io_init(&io, fd, slots, FILE_CHUNK_SIZE, (codecs ? 2 : 1) * FILE_XFER_SLOTS)) {
+        goto out;
+    }
+    io_ready = 1;
+
+    // WRITE WITH IMM consumes a receive; data lands in the slots, not here
+    for (int i = 0; i <= FILE_XFER_SLOTS; i++) {
+        if (post_recv(qp, i, NULL, 0)) {
+            fprintf(stderr, "Failed to post receive\n");
+            goto out;
+        }
+    }
+
+    msgs[FILE_XFER_SLOTS] = (struct file_msg){
+        .type = FILE_MSG_ADVERT,
+        .num_slots = FILE_XFER_SLOTS,
+        .addr = (uintptr_t)slots,
+        .rkey = slot_mr->rkey,
+        .chunk_size = FILE_CHUNK_SIZE,
+        .codecs = codecs,
+    };
+    if (post_msg(qp, &msgs[FILE_XFER_SLOTS], msg_mr->lkey)) {
+        fprintf(stderr, "Failed to send buffer advertisement\n");
+        goto out;
+    }
+    sends_outstanding++;
+    printf("Receiving into %s (%d slots of %d bytes)\n", path, FILE_XFER_SLOTS, FILE_CHUNK_SIZE);
+
+    t0 = now_sec();
+    cpu0 = cpu_sec();
+    poll_start = rdma_trace_poll_begin();
+
+    while (!done || inflight) {
+        if (!*running) {
+            fprintf(stderr, "File transfer interrupted\n");
+            goto out;
+        }
+
+        n = poll_batch(cq, wc, &poll_start, &empty_polls, &polled_at);
+        if (n < 0) {
+            goto out;
+        }
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+                goto out;
+            }
+            if (wc[i].opcode == IBV_WC_SEND) {
+                sends_outstanding--;
+                continue;
+            }
+            if (wc[i].opcode != IBV_WC_RECV_RDMA_WITH_IMM) {
+                continue;
+            }
+
+            uint32_t imm = ntohl(wc[i].imm_data);
+            uint64_t seq = imm & ~FILE_CHUNK_COMPRESSED;
+            if (post_recv(qp, wc[i].wr_id, NULL, 0)) {
+                fprintf(stderr, "Failed to post receive\n");
+                goto out;
+            }
+            if (imm == FILE_XFER_DONE) {
+                done = 1;
+                continue;
+            }
+            int slot = seq % FILE_XFER_SLOTS;
+            wc[i].wr_id = seq;
+            rdma_trace_completion(&wc[i], polled_at);
+            stats->wire_bytes += wc[i].byte_len;
+            inflight++;
+            // Compressed: decompress into the slot's bounce buffer, to disk from there
+            if (imm & FILE_CHUNK_COMPRESSED) {
+                struct compress_job *j = &jobs[slot];
+
+                if (!codecs) {
+                    fprintf(stderr, "Compressed chunk %lu, but built without codecs\n", seq);
+                    goto out;
+                }
+                if (!pool && !(pool = compress_pool_create(FILE_COMPRESS_WORKERS))) {
+                    goto out;
+                }
+                memset(j, 0, sizeof(*j));
+                j->op = COMPRESS_OP_DECOMPRESS;
+                j->src = slots + (size_t)slot * FILE_CHUNK_SIZE;
+                j->src_len = wc[i].byte_len;
+                j->dst = bounce + (size_t)slot * FILE_CHUNK_SIZE;
+                j->dst_cap = FILE_CHUNK_SIZE;
+                j->seq = seq;
+                if (compress_pool_submit(pool, j)) {
+                    fprintf(stderr, "Decompression queue full\n");
+                    goto out;
+                }
+                decoding[slot] = 1;
+                stats->compressed++;
+                continue;
+            }
+            // Raw: persist it straight from the slot (traced by its sequence number)
+            if (disk_io_submit(&io, 1, slot, slots + (size_t)slot * FILE_CHUNK_SIZE, wc[i].byte_len,
+                               seq * FILE_CHUNK_SIZE, seq | ((uint64_t)wc[i].byte_len << 32))) {
+                goto out;
+            }
+        }
+
+        for (int k = 0; k < FILE_XFER_SLOTS; k++) {
+            struct compress_job *j = &jobs[k];
+
+            if (!decoding[k] || !compress_job_done(j)) {
+                continue;
+            }
+            decoding[k] = 0;
+            if (j->status) {
+                fprintf(stderr, "Chunk %u failed to decompress\n", j->seq);
+                goto out;
+            }
+            if (disk_io_submit(&io, 1, FILE_XFER_SLOTS + k, j->dst, j->out_len,
+                               (uint64_t)j->seq * FILE_CHUNK_SIZE,
+                               j->seq | ((uint64_t)j->out_len << 32))) {
+                goto out;
+            }
+        }
+
+        while ((res = disk_io_reap(&io, &tag, &io_res)) == 1) {
+            uint64_t seq = tag & 0xffffffffu;
+            uint32_t len = tag >> 32;
+            if (io_res < 0 || (uint32_t)io_res != len) {
+                fprintf(stderr, "Short write at offset %lu: %s\n", seq * FILE_CHUNK_SIZE,
+                        io_res < 0 ? strerror(-io_res) : "disk full?");
+                goto out;
+            }
+            written[seq % FILE_XFER_SLOTS] = seq + 1;
+            stats->bytes += len;
+            inflight--;
+        }
+        if (res < 0) {
+            goto out;
+        }
+
+        // Slots are handed back in order, even if the disk finishes out of
+        // order. Credits are cumulative, so one can wait for a send buffer.
+        while (written[freed % FILE_XFER_SLOTS] == freed + 1) {
+            freed++;
+        }
+        if (freed != credited && sends_outstanding < FILE_XFER_SLOTS) {
+            struct file_msg *msg = &msgs[credits_sent++ % FILE_XFER_SLOTS];
+            msg->type = FILE_MSG_CREDIT;
+            msg->freed = freed;
+            if (post_msg(qp, msg, msg_mr->lkey)) {
+                fprintf(stderr, "Failed to send credit\n");
+                goto out;
+            }
+            credited = freed;
+            sends_outstanding++;
+        }
+    }
+
+    if (fdatasync(fd)) {
+        perror("fdatasync");
+        goto out;
+    }
+    stats->elapsed = now_sec() - t0;
+    stats->cpu = cpu_sec() - cpu0;
+
+    // Tell the sender it can tear down, and make sure that went out
+    msgs[FILE_XFER_SLOTS + 1].type = FILE_MSG_DONE;
+    msgs[FILE_XFER_SLOTS + 1].cpu = stats->cpu;
+    if (post_msg(qp, &msgs[FILE_XFER_SLOTS + 1], msg_mr->lkey)) {
+        fprintf(stderr, "Failed to send completion\n");
+        goto out;
+    }
+    sends_outstanding++;
+    while (sends_outstanding && *running) {
+        n = ibv_poll_cq(cq, POLL_BATCH, wc);
+        if (n < 0) {
+            fprintf(stderr, "Failed to poll CQ\n");
+            goto out;
+        }
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+                goto out;
+            }
+            sends_outstanding -= wc[i].opcode == IBV_WC_SEND;
+        }
+    }
+    ret = sends_outstanding ? -1 : 0;
+
+out:
+    // Before the slots a queued job reads from go away
+    compress_pool_destroy(pool);
+    if (io_ready) {
+        disk_io_exit(&io);
+    }
+    if (slot_mr) {
+        ibv_dereg_mr(slot_mr);
+    }
+    if (msg_mr) {
+        ibv_dereg_mr(msg_mr);
+    }
+    free(slots);
+    free(msgs);
+    close(fd);
+    return ret;
+}
+
+void file_xfer_report(const char *what, const struct file_xfer_stats *stats) {
+    double gb = stats->bytes / 1e9;
+
+    printf("\n=== RDMA File Transfer Results ===\n");
+    printf("%s: %lu bytes\n", what, stats->bytes);
+    if (stats->compressed) {
+        printf("On the wire: %lu bytes (%.2fx), %lu chunks compressed\n", stats->wire_bytes,
+               (double)stats->bytes / stats->wire_bytes, stats->compressed);
+    }
+    printf("Elapsed time: %.3f seconds\n", stats->elapsed);
+    if (stats->elapsed > 0) {
+        printf("Throughput: %.3f GB/s\n", gb / stats->elapsed);
+    }
+    printf("CPU time: %.3f seconds", stats->cpu);
+    if (gb > 0) {
+        printf(" (%.3f CPU seconds per GB)", stats->cpu / gb);
+    }
+    printf("\n");
+}
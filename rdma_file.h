@@ -0,0 +1,66 @@
+/*
+ * Zero-copy file transfer over an established RC queue pair
+ *
+ * The receiver registers a ring of FILE_XFER_SLOTS chunk buffers and
+ * advertises it with a SEND. The sender pushes chunk N with an RDMA WRITE
+ * WITH IMM into slot N % slots, the immediate carrying N. As each chunk
+ * lands, the receiver writes it to disk at offset N * chunk size and hands
+ * slots back, in order, with small credit SENDs. The network and the disk
+ * therefore overlap, and no chunk is ever copied in user space.
+ *
+ * The sender either registers the mmap'ed file a window at a time, so
+ * chunks go on the wire straight from the page cache, or reads the file
+ * into pre-registered buffers. Disk I/O goes through io_uring when built
+ * with liburing (HAVE_LIBURING) and falls back to pread/pwrite otherwise.
+ *
+ * With a codec, the sender puts chunks through the compression stage
+ * (rdma_compress.h) on the way out, if the receiver's advert lists that
+ * codec. A compressed chunk goes from a registered staging buffer into the
+ * same slot, a compress_hdr first, with FILE_CHUNK_COMPRESSED set in the
+ * immediate. The receiver decompresses it into a bounce buffer of the
+ * slot's own and writes it to disk from there. Chunks that would not
+ * shrink, or that the adaptive controller skips, go raw as before.
+ */
+
+#ifndef RDMA_FILE_H
+#define RDMA_FILE_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+#include "rdma_compress.h"
+
+#define FILE_CHUNK_SIZE (1024 * 1024)
+#define FILE_XFER_SLOTS 8
+#define FILE_WINDOW_SIZE (64 * 1024 * 1024)    // mmap source registration window
+#define FILE_XFER_DONE 0xffffffffu             // immediate marking end of file
+#define FILE_CHUNK_COMPRESSED 0x80000000u      // immediate flag: the slot holds a staged chunk
+#define FILE_COMPRESS_WORKERS 4                // compression threads per side
+#define FILE_COMPRESS_LEVEL 1                  // zstd level
+
+enum file_source {
+    FILE_SOURCE_MMAP,       // register mmap'ed windows of the file
+    FILE_SOURCE_READ,       // read into pre-registered buffers
+};
+
+struct file_xfer_stats {
+    uint64_t bytes;
+    uint64_t wire_bytes;    // chunk bytes on the wire, after compression
+    uint64_t compressed;    // chunks that went compressed
+    double elapsed;         // seconds
+    double cpu;             // user + system seconds
+    double peer_cpu;        // file_send: the receiver's, from its done message
+};
+
+// Both sides need at least FILE_XFER_SLOTS + 1 send and receive WRs and a
+// CQ of twice that. codec COMPRESS_NONE sends every chunk raw; adaptive
+// lets the controller skip compression when it does not pay
+int file_send(struct ibv_pd *pd, struct ibv_qp *qp, struct ibv_cq *cq, const char *path,
+              enum file_source source, enum compress_codec codec, int adaptive,
+              volatile int *running, struct file_xfer_stats *stats);
+int file_receive(struct ibv_pd *pd, struct ibv_qp *qp, struct ibv_cq *cq, const char *path,
+                 volatile int *running, struct file_xfer_stats *stats);
+
+void file_xfer_report(const char *what, const struct file_xfer_stats *stats);
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ * One-sided key-value store in the server's registered memory. See rdma_kv.h.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rdma_kv.h"
+#include "rdma_trace.h"
+
+#define KV_GET_ATTEMPTS 64
+#define KV_MAX_PROBE 512        // how far past the neighbourhood to look for a free slot
+#define KV_READ_LEN (KV_NEIGHBORHOOD * sizeof(struct kv_slot))
+
+struct kv_table {
+    struct kv_slot *slots;
+    uint32_t nslots;
+    uint64_t items;
+};
+
+struct kv_client {
+    struct rdma_context *ctx;
+    struct rpc_client *rpc;
+    struct kv_slot *scratch;    // READ target, after the RPC region
+    uint32_t nslots;
+    uint64_t retries;
+};
+
+struct kv_put_req {
+    uint64_t key;
+    uint32_t len;
+    uint32_t pad;
+    char value[KV_VALUE_MAX];
+};
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+// Home slots stop KV_NEIGHBORHOOD - 1 short of the end, so a neighbourhood
+// never wraps and is always one contiguous READ
+static uint32_t kv_home(uint64_t key, uint32_t nslots) {
+    return mix64(key) % (nslots - KV_NEIGHBORHOOD + 1);
+}
+
+static uint32_t table_slots(size_t buffer_size) {
+    return buffer_size > KV_TABLE_OFFSET ? (buffer_size - KV_TABLE_OFFSET) / sizeof(struct kv_slot) : 0;
+}
+
+// Seqlock write: both versions odd, contents, then both even again with the
+// end version first, so no reader can pair an old start with a new end
+static void slot_write(struct kv_slot *s, uint64_t key, const void *value, uint32_t len,
+                       uint16_t flags) {
+    uint32_t v = s->version;
+
+    __atomic_store_n(&s->version, v + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->version_end, v + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->key = key;
+    s->len = len;
+    s->flags = flags;
+    if (value != s->value) {
+        memcpy(s->value, value, len);
+    }
+    __atomic_store_n(&s->version_end, v + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->version, v + 2, __ATOMIC_RELEASE);
+}
+
+static int slot_stable(const struct kv_slot *s) {
+    return s->version == s->version_end && !(s->version & 1);
+}
+
+int kv_table_put(struct kv_table *t, uint64_t key, const void *value, uint32_t len) {
+    uint32_t home = kv_home(key, t->nslots);
+    uint32_t free_slot = UINT32_MAX;
+    uint32_t j;
+
+    if (len > KV_VALUE_MAX) {
+        return -1;
+    }
+    for (uint32_t i = home; i < home + KV_NEIGHBORHOOD; i++) {
+        struct kv_slot *s = &t->slots[i];
+        if (!(s->flags & KV_SLOT_USED)) {
+            if (free_slot == UINT32_MAX) {
+                free_slot = i;
+            }
+        } else if (s->key == key) {
+            slot_write(s, key, value, len, KV_SLOT_USED);
+            return 0;
+        }
+    }
+    if (free_slot != UINT32_MAX) {
+        slot_write(&t->slots[free_slot], key, value, len, KV_SLOT_USED);
+        t->items++;
+        return 0;
+    }
+
+    // Hopscotch: take the nearest free slot past the neighbourhood and move
+    // it closer by swapping it with items that may legally live there
+    for (j = home + KV_NEIGHBORHOOD; j < t->nslots && j < home + KV_MAX_PROBE; j++) {
+        if (!(t->slots[j].flags & KV_SLOT_USED)) {
+            break;
+        }
+    }
+    if (j >= t->nslots || j >= home + KV_MAX_PROBE) {
+        return -1;
+    }
+    while (j >= home + KV_NEIGHBORHOOD) {
+        uint32_t k;
+
+        for (k = j - KV_NEIGHBORHOOD + 1; k < j; k++) {
+            struct kv_slot *s = &t->slots[k];
+            if (kv_home(s->key, t->nslots) + KV_NEIGHBORHOOD > j) {
+                // Copy before clearing: a GET racing the move sees the item
+                // in at least one of the two slots
+                slot_write(&t->slots[j], s->key, s->value, s->len, KV_SLOT_USED);
+                slot_write(s, 0, s->value, 0, 0);
+                break;
+            }
+        }
+        if (k == j) {
+            return -1;
+        }
+        j = k;
+    }
+    slot_write(&t->slots[j], key, value, len, KV_SLOT_USED);
+    t->items++;
+    return 0;
+}
+
+static int kv_put_handler(void *arg, const void *req, uint32_t req_len, void *resp,
+                          uint32_t resp_max) {
+    const struct kv_put_req *put = req;
+
+    (void)resp;
+    (void)resp_max;
+    if (req_len < offsetof(struct kv_put_req, value) ||
+        put->len > req_len - offsetof(struct kv_put_req, value)) {
+        return -1;
+    }
+    return kv_table_put(arg, put->key, put->value, put->len);
+}
+
+struct kv_table *kv_table_create(struct rdma_context *ctx, struct rpc_server *srv) {
+    struct kv_table *t;
+    uint32_t nslots = table_slots(ctx->buffer_size);
+
+    if (nslots < KV_NEIGHBORHOOD) {
+        fprintf(stderr, "No room for a KV table after the RPC region\n");
+        return NULL;
+    }
+    t = calloc(1, sizeof(*t));
+    if (!t) {
+        fprintf(stderr, "Failed to allocate KV table\n");
+        return NULL;
+    }
+    t->slots = (struct kv_slot *)(ctx->buffer + KV_TABLE_OFFSET);
+    t->nslots = nslots;
+    memset(t->slots, 0, (size_t)nslots * sizeof(struct kv_slot));
+    if (rpc_server_register(srv, RPC_METHOD_KV_PUT, kv_put_handler, t)) {
+        free(t);
+        return NULL;
+    }
+    printf("KV table: %u slots of %zu bytes\n", nslots, sizeof(struct kv_slot));
+    return t;
+}
+
+void kv_table_destroy(struct kv_table *t) {
+    if (t) {
+        printf("KV table held %lu items\n", t->items);
+    }
+    free(t);
+}
+
+struct kv_client *kv_client_create(struct rdma_context *ctx, struct rpc_client *rpc) {
+    struct kv_client *c;
+    uint32_t nslots = table_slots(ctx->remote_length);
+
+    if (nslots < KV_NEIGHBORHOOD) {
+        fprintf(stderr, "Server buffer has no KV table\n");
+        return NULL;
+    }
+    if (ctx->buffer_size < KV_TABLE_OFFSET + KV_READ_LEN) {
+        fprintf(stderr, "No room for KV reads after the RPC region\n");
+        return NULL;
+    }
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        fprintf(stderr, "Failed to allocate KV client\n");
+        return NULL;
+    }
+    c->ctx = ctx;
+    c->rpc = rpc;
+    c->scratch = (struct kv_slot *)(ctx->buffer + KV_TABLE_OFFSET);
+    c->nslots = nslots;
+    return c;
+}
+
+// READ the neighbourhood starting at home into the scratch slots
+static int read_neighborhood(struct kv_client *c, uint32_t home) {
+    struct rdma_context *ctx = c->ctx;
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+    struct ibv_wc wc;
+    uint64_t poll_start, polled_at;
+    uint32_t empty_polls = 0;
+    int n;
+
+    memset(&sge, 0, sizeof(sge));
+    sge.addr = (uintptr_t)c->scratch;
+    sge.length = KV_READ_LEN;
+    sge.lkey = ctx->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = home;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = ctx->remote_addr + KV_TABLE_OFFSET + (uint64_t)home * sizeof(struct kv_slot);
+    wr.wr.rdma.rkey = ctx->remote_rkey;
+
+    rdma_trace_post(wr.wr_id, wr.opcode, sge.length);
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post KV read\n");
+        return -1;
+    }
+
+    poll_start = rdma_trace_poll_begin();
+    for (;;) {
+        while ((n = ibv_poll_cq(ctx->cq, 1, &wc)) == 0) {
+            empty_polls++;
+        }
+        polled_at = rdma_trace_poll_end(poll_start, n, empty_polls);
+        if (n < 0) {
+            fprintf(stderr, "Failed to poll CQ\n");
+            return -1;
+        }
+        if (wc.status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc.status));
+            return -1;
+        }
+        rdma_trace_completion(&wc, polled_at);
+        if (wc.opcode == IBV_WC_RDMA_READ) {
+            return 0;
+        }
+        if (wc.opcode != IBV_WC_RDMA_WRITE) {
+            fprintf(stderr, "Unexpected completion opcode %d\n", wc.opcode);
+            return -1;
+        }
+        // A PUT's request write completing late
+        rpc_client_retire(c->rpc, &wc);
+        poll_start = rdma_trace_poll_begin();
+        empty_polls = 0;
+    }
+}
+
+int kv_get(struct kv_client *c, uint64_t key, void *value, uint32_t *len) {
+    uint32_t home = kv_home(key, c->nslots);
+
+    for (int attempt = 0; attempt < KV_GET_ATTEMPTS; attempt++) {
+        int torn = 0;
+
+        if (read_neighborhood(c, home)) {
+            return -1;
+        }
+        for (int i = 0; i < KV_NEIGHBORHOOD; i++) {
+            const struct kv_slot *s = &c->scratch[i];
+            if (!slot_stable(s)) {
+                torn = 1;
+            } else if ((s->flags & KV_SLOT_USED) && s->key == key) {
+                *len = s->len <= KV_VALUE_MAX ? s->len : KV_VALUE_MAX;
+                memcpy(value, s->value, *len);
+                return 1;
+            }
+        }
+        if (!torn) {
+            return 0;
+        }
+        c->retries++;
+    }
+    fprintf(stderr, "KV read of key %lu kept racing server writes\n", key);
+    return -1;
+}
+
+int kv_put(struct kv_client *c, uint64_t key, const void *value, uint32_t len) {
+    struct kv_put_req req;
+    struct rpc_completion done;
+    int n;
+
+    if (len > KV_VALUE_MAX) {
+        fprintf(stderr, "KV value of %u bytes exceeds %d\n", len, KV_VALUE_MAX);
+        return -1;
+    }
+    req.key = key;
+    req.len = len;
+    req.pad = 0;
+    memcpy(req.value, value, len);
+    if (rpc_call_start(c->rpc, RPC_METHOD_KV_PUT, RPC_RESP_FLAG, &req,
+                       offsetof(struct kv_put_req, value) + len, key) < 0 ||
+        rpc_client_flush(c->rpc)) {
+        return -1;
+    }
+    // The flush is deferred while the send queue is full
+    while ((n = rpc_client_poll(c->rpc, &done, 1)) == 0) {
+        if (rpc_client_flush(c->rpc)) {
+            return -1;
+        }
+    }
+    if (n < 0) {
+        return -1;
+    }
+    if (done.status != RPC_OK) {
+        fprintf(stderr, "KV put of key %lu failed with status %d\n", key, done.status);
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t kv_client_retries(const struct kv_client *c) {
+    return c->retries;
+}
+
+void kv_client_destroy(struct kv_client *c) {
+    free(c);
+}
@@ -0,0 +1,70 @@
+/*
+ * One-sided key-value store in the server's registered memory (librdmademo)
+ *
+ * The table is a hopscotch hash of 64-byte slots placed right after the RPC
+ * region of the server's buffer, which the client already has the address
+ * and rkey of. A key always lives within KV_NEIGHBORHOOD slots of its home
+ * slot, so a GET is a single RDMA READ of that neighbourhood, validated on
+ * the client; the CPU on the server never sees it. PUTs are RPCs
+ * (RPC_METHOD_KV_PUT) handled by the server, the table's only writer.
+ *
+ * Each slot carries its version at both ends. The server makes both odd
+ * before touching a slot and even again afterwards, end first; a reader
+ * that sees the same even version at both ends read the slot whole. Like
+ * the RPC flag mode this relies on a READ fetching memory in address order.
+ * When the server has to displace an item to make room, it writes the copy
+ * before clearing the original, so a concurrent GET always finds it in one
+ * place or the other. A torn read just costs another READ.
+ */
+
+#ifndef RDMA_KV_H
+#define RDMA_KV_H
+
+#include <stdint.h>
+
+#include "rdma_common.h"
+#include "rdma_rpc.h"
+
+#define KV_NEIGHBORHOOD 8
+#define KV_VALUE_MAX 44
+#define KV_SLOTS 16384
+#define KV_TABLE_OFFSET RPC_REGION_SIZE
+#define KV_TABLE_SIZE (KV_SLOTS * 64)
+#define KV_BUFFER_SIZE (KV_TABLE_OFFSET + KV_TABLE_SIZE)
+#define KV_QP_DEPTH (RPC_QP_DEPTH + 1)  // one GET READ beside the RPC traffic
+
+#define RPC_METHOD_KV_PUT 3
+
+#define KV_SLOT_USED 0x1
+
+struct kv_slot {
+    uint32_t version;           // odd while the server is rewriting the slot
+    uint16_t len;
+    uint16_t flags;
+    uint64_t key;
+    char value[KV_VALUE_MAX];
+    uint32_t version_end;
+};
+
+_Static_assert(sizeof(struct kv_slot) == 64, "a slot must be one cache line");
+
+struct kv_table;
+struct kv_client;
+
+// Server: the table lives in ctx->buffer at KV_TABLE_OFFSET and fills the
+// rest of it. PUTs arrive through srv
+struct kv_table *kv_table_create(struct rdma_context *ctx, struct rpc_server *srv);
+// Returns -1 when the key's neighbourhood cannot be made room in
+int kv_table_put(struct kv_table *t, uint64_t key, const void *value, uint32_t len);
+void kv_table_destroy(struct kv_table *t);
+
+// Client: GETs and PUTs are synchronous; rpc must have no calls in flight
+struct kv_client *kv_client_create(struct rdma_context *ctx, struct rpc_client *rpc);
+// Returns 1 and fills value/len when found, 0 when absent, -1 on error
+int kv_get(struct kv_client *c, uint64_t key, void *value, uint32_t *len);
+int kv_put(struct kv_client *c, uint64_t key, const void *value, uint32_t len);
+// READs that had to be repeated because they raced a server write
+uint64_t kv_client_retries(const struct kv_client *c);
+void kv_client_destroy(struct kv_client *c);
+
+#endif
@@ -0,0 +1,447 @@
+/*
+ * RDMA server metrics registry and Prometheus/OpenMetrics exporter
+ * See rdma_metrics.h for the threading model.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rdma_metrics.h"
+
+#define POLL_TIMEOUT_MS 200
+#define MAX_REQUEST 4096
+
+static const char *opcode_names[METRICS_NUM_OPCODES] = {
+    "RDMA_WRITE", "RDMA_WRITE_WITH_IMM", "SEND", "SEND_WITH_IMM", "RDMA_READ",
+    "ATOMIC_CMP_AND_SWP", "ATOMIC_FETCH_AND_ADD", "LOCAL_INV", "BIND_MW",
+    "SEND_WITH_INV", "TSO", "DRIVER1", NULL, NULL, NULL, "OTHER"
+};
+
+static const char *status_names[METRICS_NUM_STATUSES] = {
+    "SUCCESS", "LOC_LEN_ERR", "LOC_QP_OP_ERR", "LOC_EEC_OP_ERR", "LOC_PROT_ERR",
+    "WR_FLUSH_ERR", "MW_BIND_ERR", "BAD_RESP_ERR", "LOC_ACCESS_ERR", "REM_INV_REQ_ERR",
+    "REM_ACCESS_ERR", "REM_OP_ERR", "RETRY_EXC_ERR", "RNR_RETRY_EXC_ERR", "LOC_RDD_VIOL_ERR",
+    "REM_INV_RD_REQ_ERR", "REM_ABORT_ERR", "INV_EECN_ERR", "INV_EEC_STATE_ERR", "FATAL_ERR",
+    "RESP_TIMEOUT_ERR", "GENERAL_ERR", "TM_ERR", "TM_RNDV_INCOMPLETE", NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, "OTHER"
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct rdma_conn_metrics *conns[METRICS_MAX_CONNECTIONS];
+    int num_conns;
+    struct rdma_conn_metrics retired;   // totals of slots reused after close
+    uint64_t mr_registrations;
+    uint64_t mr_deregistrations;
+    int64_t mr_registered_bytes;
+
+    pthread_t thread;
+    int listen_fd;
+    volatile int running;
+} registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .listen_fd = -1,
+};
+
+static uint64_t load(const uint64_t *c) {
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static int64_t load_gauge(const int64_t *g) {
+    return __atomic_load_n(g, __ATOMIC_RELAXED);
+}
+
+// Snapshot src into dst (dst += src when accumulate is set)
+static void snapshot(struct rdma_conn_metrics *dst, const struct rdma_conn_metrics *src, int accumulate) {
+    if (!accumulate) {
+        memset(dst, 0, sizeof(*dst));
+    }
+    dst->bytes += load(&src->bytes);
+    dst->completions += load(&src->completions);
+    dst->latency_sum_ns += load(&src->latency_sum_ns);
+    dst->latency_count += load(&src->latency_count);
+    dst->outstanding += load_gauge(&src->outstanding);
+    dst->cq_depth += load_gauge(&src->cq_depth);
+    for (int i = 0; i < METRICS_NUM_OPCODES; i++) {
+        dst->wrs_posted[i] += load(&src->wrs_posted[i]);
+    }
+    for (int i = 0; i < METRICS_NUM_STATUSES; i++) {
+        dst->errors[i] += load(&src->errors[i]);
+    }
+    for (int i = 0; i <= METRICS_LATENCY_BUCKETS; i++) {
+        dst->latency_buckets[i] += load(&src->latency_buckets[i]);
+    }
+}
+
+struct rdma_conn_metrics *rdma_metrics_conn_register(const char *label, int cq_depth) {
+    struct rdma_conn_metrics *m;
+    int slot = -1;
+
+    pthread_mutex_lock(&registry.lock);
+    if (registry.num_conns < METRICS_MAX_CONNECTIONS) {
+        slot = registry.num_conns++;
+    } else {
+        // Reuse a closed slot, folding its totals into the retired bucket so
+        // aggregate counters stay monotonic
+        for (int i = 0; i < registry.num_conns; i++) {
+            if (!registry.conns[i]->active) {
+                snapshot(&registry.retired, registry.conns[i], 1);
+                free(registry.conns[i]);
+                slot = i;
+                break;
+            }
+        }
+    }
+    if (slot < 0 || posix_memalign((void **)&m, 64, sizeof(*m))) {
+        pthread_mutex_unlock(&registry.lock);
+        return NULL;
+    }
+    memset(m, 0, sizeof(*m));
+    snprintf(m->label, sizeof(m->label), "%s", label);
+    m->cq_depth = cq_depth;
+    m->active = 1;
+    registry.conns[slot] = m;
+    pthread_mutex_unlock(&registry.lock);
+    return m;
+}
+
+void rdma_metrics_conn_unregister(struct rdma_conn_metrics *m) {
+    if (!m) {
+        return;
+    }
+    pthread_mutex_lock(&registry.lock);
+    m->active = 0;
+    m->outstanding = 0;
+    m->cq_depth = 0;
+    pthread_mutex_unlock(&registry.lock);
+}
+
+void rdma_metrics_mr_registered(uint64_t bytes) {
+    __atomic_fetch_add(&registry.mr_registrations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&registry.mr_registered_bytes, (int64_t)bytes, __ATOMIC_RELAXED);
+}
+
+void rdma_metrics_mr_deregistered(uint64_t bytes) {
+    __atomic_fetch_add(&registry.mr_deregistrations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&registry.mr_registered_bytes, (int64_t)bytes, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------ exposition */
+
+struct exposition {
+    FILE *out;
+    int openmetrics;
+};
+
+// Emit the HELP/TYPE header. Counter families are named without the _total
+// suffix in OpenMetrics and with it in the Prometheus text format.
+static void family(struct exposition *e, const char *name, const char *type, const char *help) {
+    const char *suffix = strcmp(type, "counter") == 0 && !e->openmetrics ? "_total" : "";
+    fprintf(e->out, "# HELP %s%s %s\n", name, suffix, help);
+    fprintf(e->out, "# TYPE %s%s %s\n", name, suffix, type);
+}
+
+// Write "name[suffix]{labels,extra} " ready for the value
+static void series(struct exposition *e, const char *name, const char *suffix,
+                   const char *labels, const char *extra) {
+    fprintf(e->out, "%s%s", name, suffix);
+    if (*labels || *extra) {
+        fprintf(e->out, "{%s%s%s}", labels, *labels && *extra ? "," : "", extra);
+    }
+    fputc(' ', e->out);
+}
+
+static void write_histogram(struct exposition *e, const char *name, const char *labels,
+                            const struct rdma_conn_metrics *m) {
+    uint64_t cumulative = 0;
+    char le[32];
+
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        cumulative += m->latency_buckets[i];
+        snprintf(le, sizeof(le), "le=\"%.9g\"", (double)(1ULL << (METRICS_LATENCY_SHIFT + i)) / 1e9);
+        series(e, name, "_bucket", labels, le);
+        fprintf(e->out, "%lu\n", cumulative);
+    }
+    cumulative += m->latency_buckets[METRICS_LATENCY_BUCKETS];
+    series(e, name, "_bucket", labels, "le=\"+Inf\"");
+    fprintf(e->out, "%lu\n", cumulative);
+    series(e, name, "_sum", labels, "");
+    fprintf(e->out, "%.9f\n", m->latency_sum_ns / 1e9);
+    series(e, name, "_count", labels, "");
+    fprintf(e->out, "%lu\n", m->latency_count);
+}
+
+struct metric_set {
+    char labels[METRICS_LABEL_LEN + 32];
+    const struct rdma_conn_metrics *m;
+};
+
+// Write every family for a group of metric sets, either the server aggregate
+// (prefix rdma_server, no labels) or the connections (prefix
+// rdma_connection, one connection label each). Samples of one family must
+// be contiguous, so families are the outer loop.
+static void write_metric_sets(struct exposition *e, const char *prefix,
+                              const struct metric_set *sets, int n) {
+    char name[128], extra[64];
+
+    if (n == 0) {
+        return;
+    }
+
+    snprintf(name, sizeof(name), "%s_bytes", prefix);
+    family(e, name, "counter", "Bytes moved by successful work requests");
+    for (int s = 0; s < n; s++) {
+        series(e, name, "_total", sets[s].labels, "");
+        fprintf(e->out, "%lu\n", sets[s].m->bytes);
+    }
+
+    snprintf(name, sizeof(name), "%s_work_requests", prefix);
+    family(e, name, "counter", "Work requests posted, by opcode");
+    for (int s = 0; s < n; s++) {
+        for (int i = 0; i < METRICS_NUM_OPCODES; i++) {
+            if (opcode_names[i] && (sets[s].m->wrs_posted[i] || i == IBV_WR_RDMA_WRITE)) {
+                snprintf(extra, sizeof(extra), "opcode=\"%s\"", opcode_names[i]);
+                series(e, name, "_total", sets[s].labels, extra);
+                fprintf(e->out, "%lu\n", sets[s].m->wrs_posted[i]);
+            }
+        }
+    }
+
+    snprintf(name, sizeof(name), "%s_completions", prefix);
+    family(e, name, "counter", "Work completions polled");
+    for (int s = 0; s < n; s++) {
+        series(e, name, "_total", sets[s].labels, "");
+        fprintf(e->out, "%lu\n", sets[s].m->completions);
+    }
+
+    snprintf(name, sizeof(name), "%s_completion_errors", prefix);
+    family(e, name, "counter", "Failed work completions, by ibv_wc_status");
+    for (int s = 0; s < n; s++) {
+        for (int i = 1; i < METRICS_NUM_STATUSES; i++) {
+            if (status_names[i] && (sets[s].m->errors[i] || i == IBV_WC_RETRY_EXC_ERR)) {
+                snprintf(extra, sizeof(extra), "status=\"%s\"", status_names[i]);
+                series(e, name, "_total", sets[s].labels, extra);
+                fprintf(e->out, "%lu\n", sets[s].m->errors[i]);
+            }
+        }
+    }
+
+    snprintf(name, sizeof(name), "%s_outstanding_work_requests", prefix);
+    family(e, name, "gauge", "Work requests posted and not yet completed");
+    for (int s = 0; s < n; s++) {
+        series(e, name, "", sets[s].labels, "");
+        fprintf(e->out, "%ld\n", sets[s].m->outstanding);
+    }
+
+    snprintf(name, sizeof(name), "%s_cq_depth", prefix);
+    family(e, name, "gauge", "Completion queue capacity in entries");
+    for (int s = 0; s < n; s++) {
+        series(e, name, "", sets[s].labels, "");
+        fprintf(e->out, "%ld\n", sets[s].m->cq_depth);
+    }
+
+    snprintf(name, sizeof(name), "%s_wr_latency_seconds", prefix);
+    family(e, name, "histogram", "Post-to-completion latency of successful work requests");
+    for (int s = 0; s < n; s++) {
+        write_histogram(e, name, sets[s].labels, sets[s].m);
+    }
+}
+
+static void write_exposition(struct exposition *e) {
+    struct rdma_conn_metrics *snap, total;
+    struct metric_set *sets, server;
+    int n, active = 0;
+
+    snap = calloc(METRICS_MAX_CONNECTIONS, sizeof(*snap));
+    sets = calloc(METRICS_MAX_CONNECTIONS, sizeof(*sets));
+    if (!snap || !sets) {
+        free(snap);
+        free(sets);
+        return;
+    }
+
+    pthread_mutex_lock(&registry.lock);
+    n = registry.num_conns;
+    snapshot(&total, &registry.retired, 0);
+    for (int i = 0; i < n; i++) {
+        snapshot(&total, registry.conns[i], 1);
+        if (!registry.conns[i]->active) {
+            continue;
+        }
+        snapshot(&snap[active], registry.conns[i], 0);
+        snprintf(sets[active].labels, sizeof(sets[active].labels), "connection=\"%s\"",
+                 registry.conns[i]->label);
+        sets[active].m = &snap[active];
+        active++;
+    }
+    pthread_mutex_unlock(&registry.lock);
+
+    server.labels[0] = '\0';
+    server.m = &total;
+    write_metric_sets(e, "rdma_server", &server, 1);
+
+    family(e, "rdma_server_connections", "gauge", "Currently connected clients");
+    fprintf(e->out, "rdma_server_connections %d\n", active);
+
+    family(e, "rdma_server_mr_registrations", "counter", "Memory regions registered");
+    fprintf(e->out, "rdma_server_mr_registrations_total %lu\n",
+            __atomic_load_n(&registry.mr_registrations, __ATOMIC_RELAXED));
+    family(e, "rdma_server_mr_deregistrations", "counter", "Memory regions deregistered");
+    fprintf(e->out, "rdma_server_mr_deregistrations_total %lu\n",
+            __atomic_load_n(&registry.mr_deregistrations, __ATOMIC_RELAXED));
+    family(e, "rdma_server_mr_registered_bytes", "gauge", "Bytes currently registered");
+    fprintf(e->out, "rdma_server_mr_registered_bytes %ld\n",
+            __atomic_load_n(&registry.mr_registered_bytes, __ATOMIC_RELAXED));
+
+    write_metric_sets(e, "rdma_connection", sets, active);
+
+    if (e->openmetrics) {
+        fprintf(e->out, "# EOF\n");
+    }
+    free(snap);
+    free(sets);
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void handle_client(int fd) {
+    char request[MAX_REQUEST + 1], header[256];
+    struct exposition e;
+    char *body = NULL;
+    size_t body_len = 0, used = 0;
+
+    // Read until the end of the request headers
+    while (used < MAX_REQUEST) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        ssize_t n;
+
+        if (poll(&pfd, 1, 1000) <= 0) {
+            return;
+        }
+        n = recv(fd, request + used, MAX_REQUEST - used, 0);
+        if (n <= 0) {
+            return;
+        }
+        used += n;
+        request[used] = '\0';
+        if (strstr(request, "\r\n\r\n")) {
+            break;
+        }
+    }
+    request[used] = '\0';
+
+    if (strncmp(request, "GET /metrics", 12) != 0 || (request[12] != ' ' && request[12] != '?')) {
+        static const char not_found[] =
+            "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        write_all(fd, not_found, sizeof(not_found) - 1);
+        return;
+    }
+
+    e.openmetrics = strstr(request, "application/openmetrics-text") != NULL;
+    e.out = open_memstream(&body, &body_len);
+    if (!e.out) {
+        return;
+    }
+    write_exposition(&e);
+    fclose(e.out);
+
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+             e.openmetrics ? "application/openmetrics-text; version=1.0.0; charset=utf-8"
+                           : "text/plain; version=0.0.4; charset=utf-8",
+             body_len);
+    write_all(fd, header, strlen(header));
+    write_all(fd, body, body_len);
+    free(body);
+}
+
+static void *exporter_thread(void *arg) {
+    (void)arg;
+
+    while (registry.running) {
+        struct pollfd pfd = { .fd = registry.listen_fd, .events = POLLIN };
+        int fd;
+
+        if (poll(&pfd, 1, POLL_TIMEOUT_MS) <= 0) {
+            continue;
+        }
+        fd = accept(registry.listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        handle_client(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int rdma_metrics_start(int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    if (port <= 0) {
+        return 0;
+    }
+
+    registry.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (registry.listen_fd < 0) {
+        fprintf(stderr, "Failed to create metrics socket: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(registry.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(registry.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(registry.listen_fd, 16)) {
+        fprintf(stderr, "Failed to listen on metrics port %d: %s\n", port, strerror(errno));
+        close(registry.listen_fd);
+        registry.listen_fd = -1;
+        return -1;
+    }
+
+    registry.running = 1;
+    if (pthread_create(&registry.thread, NULL, exporter_thread, NULL)) {
+        fprintf(stderr, "Failed to start metrics exporter\n");
+        registry.running = 0;
+        close(registry.listen_fd);
+        registry.listen_fd = -1;
+        return -1;
+    }
+
+    printf("Metrics available at http://127.0.0.1:%d/metrics\n", port);
+    return 0;
+}
+
+void rdma_metrics_stop(void) {
+    if (!registry.running) {
+        return;
+    }
+    registry.running = 0;
+    pthread_join(registry.thread, NULL);
+    close(registry.listen_fd);
+    registry.listen_fd = -1;
+}
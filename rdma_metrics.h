@@ -0,0 +1,96 @@
+/*
+ * RDMA server metrics with an embedded Prometheus/OpenMetrics endpoint
+ *
+ * Every connection owns a cache-line aligned block of counters that only
+ * its data-path thread writes, with plain relaxed atomic stores (no locked
+ * read-modify-write, no shared cache lines between connections). The
+ * exporter thread only ever reads them, so a scrape never stalls or
+ * slows the hot path. The registry lock is taken when connections come and
+ * go and by the exporter, never per work request.
+ *
+ * GET http://127.0.0.1:<port>/metrics
+ */
+
+#ifndef RDMA_METRICS_H
+#define RDMA_METRICS_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+#define METRICS_DEFAULT_PORT 9464
+#define METRICS_MAX_CONNECTIONS 64
+#define METRICS_LABEL_LEN 64
+#define METRICS_NUM_OPCODES 16
+#define METRICS_NUM_STATUSES 32
+#define METRICS_LATENCY_SHIFT 10       // first bucket: <= 1.024 us
+#define METRICS_LATENCY_BUCKETS 22     // last finite bucket: <= ~2.1 s
+
+struct rdma_conn_metrics {
+    // Written only by the owning data-path thread
+    uint64_t bytes;
+    uint64_t wrs_posted[METRICS_NUM_OPCODES];
+    uint64_t completions;
+    uint64_t errors[METRICS_NUM_STATUSES];
+    int64_t outstanding;
+    uint64_t latency_buckets[METRICS_LATENCY_BUCKETS + 1];
+    uint64_t latency_sum_ns;
+    uint64_t latency_count;
+    int64_t cq_depth;
+
+    // Set at registration, read-only afterwards
+    char label[METRICS_LABEL_LEN];
+    int active;
+} __attribute__((aligned(64)));
+
+// Single-writer counter update: a relaxed load/store pair is enough because
+// only the owning thread writes, and readers tolerate a slightly stale value.
+static inline void metrics_add(uint64_t *counter, uint64_t v) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_gauge_add(int64_t *gauge, int64_t v) {
+    __atomic_store_n(gauge, __atomic_load_n(gauge, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline void rdma_metrics_wr_posted(struct rdma_conn_metrics *m, enum ibv_wr_opcode opcode) {
+    metrics_add(&m->wrs_posted[(unsigned)opcode < METRICS_NUM_OPCODES ? opcode : METRICS_NUM_OPCODES - 1], 1);
+    metrics_gauge_add(&m->outstanding, 1);
+}
+
+static inline void rdma_metrics_completion(struct rdma_conn_metrics *m, enum ibv_wc_status status,
+                                           uint64_t bytes, uint64_t latency_ns) {
+    unsigned bucket = 0;
+
+    metrics_gauge_add(&m->outstanding, -1);
+    metrics_add(&m->completions, 1);
+    if (status != IBV_WC_SUCCESS) {
+        metrics_add(&m->errors[(unsigned)status < METRICS_NUM_STATUSES ? status : METRICS_NUM_STATUSES - 1], 1);
+        return;
+    }
+    metrics_add(&m->bytes, bytes);
+
+    // Bucket i holds latencies up to 2^(METRICS_LATENCY_SHIFT + i) ns
+    if (latency_ns > (1ULL << METRICS_LATENCY_SHIFT)) {
+        bucket = 64 - __builtin_clzll(latency_ns - 1) - METRICS_LATENCY_SHIFT;
+    }
+    if (bucket > METRICS_LATENCY_BUCKETS) {
+        bucket = METRICS_LATENCY_BUCKETS;
+    }
+    metrics_add(&m->latency_buckets[bucket], 1);
+    metrics_add(&m->latency_sum_ns, latency_ns);
+    metrics_add(&m->latency_count, 1);
+}
+
+// Connection lifecycle (not on the data path)
+struct rdma_conn_metrics *rdma_metrics_conn_register(const char *label, int cq_depth);
+void rdma_metrics_conn_unregister(struct rdma_conn_metrics *m);
+
+// Memory registration accounting
+void rdma_metrics_mr_registered(uint64_t bytes);
+void rdma_metrics_mr_deregistered(uint64_t bytes);
+
+// Exporter thread; port 0 disables it
+int rdma_metrics_start(int port);
+void rdma_metrics_stop(void);
+
+#endif
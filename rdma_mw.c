@@ -0,0 +1,59 @@
+/*
+ * Memory windows: revocable remote access to part of an MR. See rdma_mw.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rdma_mw.h"
+
+int rdma_mw_supported(struct ibv_context *context) {
+    struct ibv_device_attr dev_attr;
+
+    if (ibv_query_device(context, &dev_attr)) {
+        fprintf(stderr, "Failed to query memory window support\n");
+        return 0;
+    }
+    return !!(dev_attr.device_cap_flags &
+              (IBV_DEVICE_MEM_WINDOW_TYPE_2A | IBV_DEVICE_MEM_WINDOW_TYPE_2B));
+}
+
+int rdma_mw_bind(struct ibv_qp *qp, struct ibv_mw *mw, struct ibv_mr *mr, void *addr, size_t length,
+                 unsigned access, uint64_t wr_id, uint32_t *rkey) {
+    struct ibv_send_wr wr, *bad_wr;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = wr_id;
+    wr.opcode = IBV_WR_BIND_MW;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.bind_mw.mw = mw;
+    wr.bind_mw.rkey = ibv_inc_rkey(mw->rkey);
+    wr.bind_mw.bind_info.mr = mr;
+    wr.bind_mw.bind_info.addr = (uintptr_t)addr;
+    wr.bind_mw.bind_info.length = length;
+    wr.bind_mw.bind_info.mw_access_flags = access;
+    if (ibv_post_send(qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post memory window bind\n");
+        return -1;
+    }
+    // Posted binds leave mw->rkey to the caller; keep it current so the
+    // next bind steps on from this key
+    *rkey = wr.bind_mw.rkey;
+    mw->rkey = wr.bind_mw.rkey;
+    return 0;
+}
+
+int rdma_mw_invalidate(struct ibv_qp *qp, uint32_t rkey, uint64_t wr_id) {
+    struct ibv_send_wr wr, *bad_wr;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = wr_id;
+    wr.opcode = IBV_WR_LOCAL_INV;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.invalidate_rkey = rkey;
+    if (ibv_post_send(qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post memory window invalidate\n");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * Memory windows: revocable remote access to part of an MR (librdmademo)
+ *
+ * Handing a peer an MR's rkey exposes the whole MR for as long as it is
+ * registered, and registering a buffer per request to narrow that costs a
+ * trip into the kernel to pin pages, and another to unpin them. A type 2
+ * memory window is a second rkey over any sub-range of an MR registered
+ * with IBV_ACCESS_MW_BIND, with its own access rights, that works only for
+ * the QP it was bound on:
+ *
+ *   bind        IBV_WR_BIND_MW on that QP's send queue attaches the window
+ *               to [addr, addr + length) under a fresh rkey (the key's low
+ *               8 bits step on every bind, so a stale key never matches)
+ *   invalidate  IBV_WR_LOCAL_INV, or the peer's SEND_WITH_INV, detaches it;
+ *               the rkey is dead from then on and the window can be bound
+ *               again
+ *
+ * Both are work requests the HCA executes in order with the QP's other
+ * sends, without a system call, and the MR's pages stay pinned throughout.
+ * The MR itself needs no remote access: the window grants it. Remote
+ * writes through a window need IBV_ACCESS_LOCAL_WRITE on the MR.
+ *
+ * rdma_mw_bind() and rdma_mw_invalidate() post signaled; the rkey is only
+ * usable (or only dead) once the completion arrives. A send posted after
+ * the bind on the same QP goes out after it, so the key can be granted
+ * without waiting.
+ */
+
+#ifndef RDMA_MW_H
+#define RDMA_MW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+// Whether context's device binds type 2 windows
+int rdma_mw_supported(struct ibv_context *context);
+
+// Bind mw over [addr, addr + length) of mr with access (IBV_ACCESS_REMOTE_*)
+// for qp's peer; the window's new rkey in *rkey
+int rdma_mw_bind(struct ibv_qp *qp, struct ibv_mw *mw, struct ibv_mr *mr, void *addr, size_t length,
+                 unsigned access, uint64_t wr_id, uint32_t *rkey);
+
+// Revoke the window bound under rkey
+int rdma_mw_invalidate(struct ibv_qp *qp, uint32_t rkey, uint64_t wr_id);
+
+#endif
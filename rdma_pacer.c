@@ -0,0 +1,119 @@
+/*
+ * Sender-side rate pacing and congestion control. See rdma_pacer.h.
+ */
+
+#include <string.h>
+
+#include "rdma_pacer.h"
+
+#define DEFAULT_BURST (64 * 1024)
+
+void rdma_pacer_init(struct rdma_pacer *p, const struct rdma_pacer_attr *attr, uint64_t now_ns) {
+    memset(p, 0, sizeof(*p));
+    p->attr = *attr;
+    if (p->attr.min_rate <= 0) {
+        p->attr.min_rate = p->attr.max_rate / 1000;
+    }
+    if (p->attr.burst <= 0) {
+        p->attr.burst = DEFAULT_BURST;
+    }
+    if (p->attr.increase_rate <= 0) {
+        p->attr.increase_rate = p->attr.max_rate / 64;
+    }
+    p->rate = p->target_rate = p->attr.max_rate;
+    p->tokens = p->attr.burst;
+    p->refilled_at = now_ns;
+    p->period_start = now_ns;
+}
+
+static void refill(struct rdma_pacer *p, uint64_t now_ns) {
+    if (now_ns <= p->refilled_at) {
+        return;
+    }
+    p->tokens += p->rate * (now_ns - p->refilled_at) / 1e9;
+    if (p->tokens > p->attr.burst) {
+        p->tokens = p->attr.burst;
+    }
+    p->refilled_at = now_ns;
+}
+
+static double clamp_rate(const struct rdma_pacer *p, double rate) {
+    if (rate < p->attr.min_rate) {
+        return p->attr.min_rate;
+    }
+    if (rate > p->attr.max_rate) {
+        return p->attr.max_rate;
+    }
+    return rate;
+}
+
+// DCQCN's rate update, once per period. A period without completions
+// counts as uncongested, so a flow cut down to a trickle still recovers
+static void update_rate(struct rdma_pacer *p) {
+    double fraction = p->samples ? (double)p->congested / p->samples : 0;
+
+    p->alpha += PACER_ALPHA_GAIN * (fraction - p->alpha);
+    if (p->congested) {
+        p->target_rate = p->rate;
+        p->rate = clamp_rate(p, p->rate * (1 - p->alpha / 2));
+        p->clean_periods = 0;
+        p->cuts++;
+        return;
+    }
+
+    p->clean_periods++;
+    if (p->clean_periods > 2 * PACER_FAST_RECOVERY) {
+        p->target_rate += PACER_HYPER_FACTOR * p->attr.increase_rate;
+    } else if (p->clean_periods > PACER_FAST_RECOVERY) {
+        p->target_rate += p->attr.increase_rate;
+    }
+    p->target_rate = clamp_rate(p, p->target_rate);
+    p->rate = clamp_rate(p, (p->rate + p->target_rate) / 2);
+}
+
+// Called on every admit and completion, so updates keep their pace even
+// when completions are rare
+static void maybe_update(struct rdma_pacer *p, uint64_t now_ns) {
+    if (!p->attr.adaptive || now_ns - p->period_start < p->attr.update_ns) {
+        return;
+    }
+    // The new rate applies from now: settle the bucket at the old one first
+    refill(p, now_ns);
+    update_rate(p);
+    p->rate_sum += p->rate;
+    p->periods++;
+    p->samples = p->congested = 0;
+    p->period_start = now_ns;
+}
+
+uint64_t rdma_pacer_admit(struct rdma_pacer *p, uint32_t bytes, uint64_t now_ns) {
+    maybe_update(p, now_ns);
+    refill(p, now_ns);
+    if (p->tokens < 0) {
+        return (uint64_t)(-p->tokens * 1e9 / p->rate) + 1;
+    }
+    p->tokens -= bytes;
+    return 0;
+}
+
+void rdma_pacer_mark(struct rdma_pacer *p, int congested, uint64_t now_ns) {
+    if (!p->attr.adaptive) {
+        return;
+    }
+    p->samples++;
+    if (congested) {
+        p->congested++;
+    }
+    maybe_update(p, now_ns);
+}
+
+void rdma_pacer_complete(struct rdma_pacer *p, uint64_t latency_ns, uint64_t now_ns) {
+    if (p->base_latency_ns == 0 || latency_ns < p->base_latency_ns) {
+        p->base_latency_ns = latency_ns;
+    }
+    rdma_pacer_mark(p, latency_ns > p->base_latency_ns + p->attr.target_delay_ns, now_ns);
+}
+
+double rdma_pacer_mean_rate(const struct rdma_pacer *p) {
+    return p->periods ? p->rate_sum / p->periods : p->rate;
+}
@@ -0,0 +1,80 @@
+/*
+ * Sender-side rate pacing and congestion control (librdmademo)
+ *
+ * One rdma_pacer per QP. A token bucket holds the sender to its current
+ * rate: tokens (bytes) refill at that rate up to the burst size, a message
+ * may go once the bucket is not in debt, and sending it takes its full
+ * size, so messages larger than the burst still pace correctly.
+ *
+ * With adaptive set the rate follows congestion. NICs do DCQCN on ECN
+ * marks, but the marks (CNPs) never reach user space, so this uses the
+ * signal an application does have: completion latency. A completion that
+ * took more than target_delay_ns longer than the fastest one seen counts
+ * as congested, which is what a filling queue on the path looks like.
+ * Every update_ns the fraction of congested completions feeds DCQCN's rate
+ * update:
+ *
+ *   alpha   EWMA of the congested fraction (gain 1/16)
+ *   cut     any congestion: remember the rate as the target, then
+ *           rate *= 1 - alpha / 2
+ *   recover no congestion: rate moves halfway to the target; after
+ *           PACER_FAST_RECOVERY such periods the target itself grows by
+ *           increase_rate (additive increase), and after as many again by
+ *           PACER_HYPER_FACTOR times that
+ *
+ * The rate stays between min_rate and max_rate. Messages should be of
+ * about one size: the latency baseline is per flow, not per byte.
+ */
+
+#ifndef RDMA_PACER_H
+#define RDMA_PACER_H
+
+#include <stdint.h>
+
+#define PACER_FAST_RECOVERY 5       // uncongested periods before additive increase
+#define PACER_HYPER_FACTOR 4        // increase multiplier once recovery drags on
+#define PACER_ALPHA_GAIN (1.0 / 16)
+
+struct rdma_pacer_attr {
+    double max_rate;            // bytes/s; the starting rate, and the only one without adaptive
+    double min_rate;            // bytes/s, 0 for max_rate / 1000
+    double burst;               // bytes the bucket holds, 0 for 64 KB
+    int adaptive;               // adjust the rate from completion latency
+    uint64_t target_delay_ns;   // latency over the baseline that counts as congestion
+    uint64_t update_ns;         // rate update period
+    double increase_rate;       // bytes/s added to the target per increase, 0 for max_rate / 64
+};
+
+struct rdma_pacer {
+    struct rdma_pacer_attr attr;
+    double rate;                // current rate, bytes/s
+    double target_rate;         // where recovery heads
+    double tokens;              // bytes; negative while paying off a large message
+    uint64_t refilled_at;
+    double alpha;
+    uint64_t base_latency_ns;   // fastest completion seen
+    uint64_t period_start;
+    uint32_t samples, congested;    // in the current period
+    int clean_periods;          // uncongested periods since the last cut
+
+    // Totals
+    uint64_t cuts;
+    double rate_sum;            // for the mean rate: summed once per period
+    uint64_t periods;
+};
+
+void rdma_pacer_init(struct rdma_pacer *p, const struct rdma_pacer_attr *attr, uint64_t now_ns);
+
+// 0 when bytes may be sent now (and they are charged to the bucket),
+// else how many ns until they may
+uint64_t rdma_pacer_admit(struct rdma_pacer *p, uint32_t bytes, uint64_t now_ns);
+
+// A completion that took latency_ns from post; drives the adaptive rate
+void rdma_pacer_complete(struct rdma_pacer *p, uint64_t latency_ns, uint64_t now_ns);
+// An explicit congestion signal instead, e.g. a CNP (the NIC's DCQCN)
+void rdma_pacer_mark(struct rdma_pacer *p, int congested, uint64_t now_ns);
+
+// Mean rate over the updates so far, bytes/s
+double rdma_pacer_mean_rate(const struct rdma_pacer *p);
+
+#endif
@@ -0,0 +1,350 @@
+/*
+ * One QP shared by many threads through a submission queue. See
+ * rdma_qp_share.h.
+ *
+ * Submission ring: every cell carries a sequence number. A cell at
+ * position pos is free for the producer that claims pos when its sequence
+ * is pos, and holds a published descriptor when it is pos + 1; the poster
+ * hands it back for pos + QP_SHARE_RING_SIZE. Producers claim positions
+ * with a CAS on enqueue_pos; the poster alone moves dequeue_pos.
+ *
+ * Completion rings are single-producer (the poster) single-consumer (the
+ * producer): the poster publishes with a release store of completed, the
+ * producer keeps its own consumed count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "rdma_qp_share.h"
+
+#define RING_MASK (QP_SHARE_RING_SIZE - 1)
+#define PRODUCER_MASK (QP_SHARE_PRODUCER_DEPTH - 1)
+#define POLL_BATCH 32
+#define IDLE_SPINS 1024         // empty rounds before yielding the core
+
+struct ring_cell {
+    uint64_t seq;
+    int producer;
+    struct qp_share_wr wr;
+};
+
+struct qp_share_producer {
+    uint64_t submitted __attribute__((aligned(64)));    // the producer's own
+    uint64_t consumed;
+    uint64_t completed __attribute__((aligned(64)));    // written by the poster
+    struct qp_share_completion ring[QP_SHARE_PRODUCER_DEPTH];
+} __attribute__((aligned(64)));
+
+// Who a posted WR belongs to, by posting sequence number
+struct route {
+    int producer;
+    uint64_t cookie;
+};
+
+struct qp_share {
+    struct ibv_qp *qp;
+    struct ibv_cq *cq;
+    int sq_depth;
+    int nproducers;
+    int running;
+    int started;
+    pthread_t poster;
+
+    uint64_t enqueue_pos __attribute__((aligned(64)));
+    uint64_t full;
+    uint64_t dequeue_pos __attribute__((aligned(64)));
+
+    // The poster's
+    uint64_t seq;               // next WR's number
+    uint64_t retired;           // WRs before this are handed back
+    int failed;
+    struct route *routes;       // sq_depth of them
+    struct qp_share_stats stats;
+
+    struct ring_cell ring[QP_SHARE_RING_SIZE];
+    struct qp_share_producer producers[];
+};
+
+_Static_assert((QP_SHARE_RING_SIZE & RING_MASK) == 0, "ring size must be a power of two");
+_Static_assert((QP_SHARE_PRODUCER_DEPTH & PRODUCER_MASK) == 0,
+               "producer depth must be a power of two");
+
+static int ring_push(struct qp_share *s, int producer, const struct qp_share_wr *wr) {
+    uint64_t pos = __atomic_load_n(&s->enqueue_pos, __ATOMIC_RELAXED);
+    struct ring_cell *cell;
+
+    for (;;) {
+        cell = &s->ring[pos & RING_MASK];
+        int64_t dif = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&s->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return -1;      // the poster hasn't freed this cell yet: full
+        } else {
+            pos = __atomic_load_n(&s->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->producer = producer;
+    cell->wr = *wr;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int ring_pop(struct qp_share *s, int *producer, struct qp_share_wr *wr) {
+    struct ring_cell *cell = &s->ring[s->dequeue_pos & RING_MASK];
+
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != s->dequeue_pos + 1) {
+        return -1;
+    }
+    *producer = cell->producer;
+    *wr = cell->wr;
+    __atomic_store_n(&cell->seq, s->dequeue_pos + QP_SHARE_RING_SIZE, __ATOMIC_RELEASE);
+    s->dequeue_pos++;
+    return 0;
+}
+
+static int ring_empty(struct qp_share *s) {
+    const struct ring_cell *cell = &s->ring[s->dequeue_pos & RING_MASK];
+
+    return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != s->dequeue_pos + 1;
+}
+
+// Hand WR number n back to its producer
+static void deliver(struct qp_share *s, uint64_t n, enum ibv_wc_status status) {
+    const struct route *r = &s->routes[n % s->sq_depth];
+    struct qp_share_producer *p = &s->producers[r->producer];
+    uint64_t c = __atomic_load_n(&p->completed, __ATOMIC_RELAXED);
+
+    p->ring[c & PRODUCER_MASK].cookie = r->cookie;
+    p->ring[c & PRODUCER_MASK].status = status;
+    __atomic_store_n(&p->completed, c + 1, __ATOMIC_RELEASE);
+}
+
+// Route what the CQ has; how many WRs that retired
+static int reap(struct qp_share *s) {
+    struct ibv_wc wc[POLL_BATCH];
+    uint64_t before = s->retired;
+    int n = ibv_poll_cq(s->cq, POLL_BATCH, wc);
+
+    if (n < 0) {
+        fprintf(stderr, "Failed to poll shared QP's CQ\n");
+        n = 0;
+        s->failed = 1;
+    }
+    for (int i = 0; i < n; i++) {
+        uint64_t id = wc[i].wr_id;
+
+        if (id < s->retired) {
+            continue;       // already flushed below
+        }
+        // In order: the silent WRs before a signaled one are done too
+        while (s->retired < id) {
+            deliver(s, s->retired++, IBV_WC_SUCCESS);
+        }
+        deliver(s, s->retired++, wc[i].status);
+        if (wc[i].status != IBV_WC_SUCCESS && !s->failed) {
+            fprintf(stderr, "Shared QP work completion error: %s\n",
+                    ibv_wc_status_str(wc[i].status));
+            s->failed = 1;
+        }
+    }
+    // A QP in error may not report its unsignaled WRs: flush them here
+    if (n == 0 && s->failed) {
+        while (s->retired < s->seq) {
+            deliver(s, s->retired++, IBV_WC_WR_FLUSH_ERR);
+        }
+    }
+    return (int)(s->retired - before);
+}
+
+// Move up to QP_SHARE_BATCH submissions into one chain; how many
+static int post_batch(struct qp_share *s) {
+    struct ibv_send_wr wr[QP_SHARE_BATCH], *bad_wr;
+    struct ibv_sge sge[QP_SHARE_BATCH];
+    uint64_t room = s->sq_depth - (s->seq - s->retired);
+    int n = 0;
+
+    while (n < QP_SHARE_BATCH && (uint64_t)n < room) {
+        struct qp_share_wr d;
+        int producer;
+        uint64_t id = s->seq + n;
+
+        if (ring_pop(s, &producer, &d)) {
+            break;
+        }
+        s->routes[id % s->sq_depth].producer = producer;
+        s->routes[id % s->sq_depth].cookie = d.cookie;
+
+        sge[n].addr = d.local_addr;
+        sge[n].length = d.length;
+        sge[n].lkey = d.lkey;
+        memset(&wr[n], 0, sizeof(wr[n]));
+        wr[n].wr_id = id;
+        wr[n].sg_list = &sge[n];
+        wr[n].num_sge = 1;
+        wr[n].opcode = d.opcode;
+        wr[n].send_flags = d.send_flags & ~IBV_SEND_SIGNALED;
+        wr[n].imm_data = d.imm_data;
+        wr[n].wr.rdma.remote_addr = d.remote_addr;
+        wr[n].wr.rdma.rkey = d.rkey;
+        if ((id + 1) % QP_SHARE_SIGNAL_EVERY == 0) {
+            wr[n].send_flags |= IBV_SEND_SIGNALED;
+        }
+        if (n > 0) {
+            wr[n - 1].next = &wr[n];
+        }
+        n++;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (!(wr[n - 1].send_flags & IBV_SEND_SIGNALED)) {
+        wr[n - 1].send_flags |= IBV_SEND_SIGNALED;
+    }
+    s->seq += n;
+    if (s->failed) {
+        return n;           // reap() flushes them
+    }
+
+    if (ibv_post_send(s->qp, wr, &bad_wr)) {
+        struct ibv_qp_attr attr = {.qp_state = IBV_QPS_ERR};
+
+        fprintf(stderr, "Failed to post %d WRs on the shared QP\n", n);
+        // Error the QP so what did go out is flushed too
+        ibv_modify_qp(s->qp, &attr, IBV_QP_STATE);
+        s->failed = 1;
+        return n;
+    }
+    s->stats.posted += n;
+    s->stats.chains++;
+    for (int i = 0; i < n; i++) {
+        s->stats.signaled += !!(wr[i].send_flags & IBV_SEND_SIGNALED);
+    }
+    return n;
+}
+
+static void *poster_main(void *arg) {
+    struct qp_share *s = arg;
+    int idle = 0;
+
+    for (;;) {
+        int did = reap(s);
+
+        did += post_batch(s);
+        if (did) {
+            idle = 0;
+            continue;
+        }
+        if (!__atomic_load_n(&s->running, __ATOMIC_ACQUIRE) && ring_empty(s) &&
+            s->retired == s->seq) {
+            break;
+        }
+        if (++idle == IDLE_SPINS) {
+            sched_yield();
+            idle = 0;
+        }
+    }
+    return NULL;
+}
+
+struct qp_share *qp_share_create(struct ibv_qp *qp, struct ibv_cq *cq, int sq_depth,
+                                 int nproducers) {
+    struct qp_share *s;
+    size_t size;
+
+    if (nproducers < 1 || nproducers > QP_SHARE_MAX_PRODUCERS) {
+        fprintf(stderr, "Shared QP takes 1 to %d producers\n", QP_SHARE_MAX_PRODUCERS);
+        return NULL;
+    }
+    if (sq_depth < 1) {
+        fprintf(stderr, "Shared QP needs a send queue\n");
+        return NULL;
+    }
+    size = sizeof(*s) + nproducers * sizeof(s->producers[0]);
+    s = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (!s) {
+        fprintf(stderr, "Failed to allocate shared QP\n");
+        return NULL;
+    }
+    memset(s, 0, size);
+    s->routes = calloc(sq_depth, sizeof(*s->routes));
+    if (!s->routes) {
+        fprintf(stderr, "Failed to allocate shared QP routes\n");
+        free(s);
+        return NULL;
+    }
+    s->qp = qp;
+    s->cq = cq;
+    s->sq_depth = sq_depth;
+    s->nproducers = nproducers;
+    for (uint64_t i = 0; i < QP_SHARE_RING_SIZE; i++) {
+        s->ring[i].seq = i;
+    }
+    return s;
+}
+
+int qp_share_start(struct qp_share *s) {
+    s->running = 1;
+    if (pthread_create(&s->poster, NULL, poster_main, s)) {
+        fprintf(stderr, "Failed to start shared QP poster\n");
+        s->running = 0;
+        return -1;
+    }
+    s->started = 1;
+    return 0;
+}
+
+void qp_share_stop(struct qp_share *s) {
+    __atomic_store_n(&s->running, 0, __ATOMIC_RELEASE);
+    if (s->started) {
+        pthread_join(s->poster, NULL);
+        s->started = 0;
+    }
+}
+
+void qp_share_destroy(struct qp_share *s) {
+    if (!s) {
+        return;
+    }
+    qp_share_stop(s);
+    free(s->routes);
+    free(s);
+}
+
+int qp_share_submit(struct qp_share *s, int producer, const struct qp_share_wr *wr) {
+    struct qp_share_producer *p = &s->producers[producer];
+
+    if (p->submitted - p->consumed >= QP_SHARE_PRODUCER_DEPTH) {
+        return 1;
+    }
+    if (ring_push(s, producer, wr)) {
+        __atomic_fetch_add(&s->full, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    p->submitted++;
+    return 0;
+}
+
+int qp_share_poll(struct qp_share *s, int producer, struct qp_share_completion *c, int max) {
+    struct qp_share_producer *p = &s->producers[producer];
+    uint64_t completed = __atomic_load_n(&p->completed, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while (p->consumed < completed && n < max) {
+        c[n++] = p->ring[p->consumed++ & PRODUCER_MASK];
+    }
+    return n;
+}
+
+void qp_share_get_stats(const struct qp_share *s, struct qp_share_stats *stats) {
+    *stats = s->stats;
+    stats->full = __atomic_load_n(&s->full, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,90 @@
+/*
+ * One QP shared by many threads through a submission queue (librdmademo)
+ *
+ * A QP per thread multiplies connection state (QPs, CQs, the NIC's QP
+ * context cache) by the thread count; one QP behind a mutex serializes
+ * every ibv_post_send() and lets threads fight over the CQ. Here producer
+ * threads hand work requests to a single poster thread instead:
+ *
+ *   submit   a producer copies a qp_share_wr into a bounded MPSC ring: one
+ *            CAS to claim a slot, one release store to publish it. No
+ *            producer ever waits for another or for the poster, short of
+ *            the ring being full
+ *   post     the poster drains up to QP_SHARE_BATCH descriptors at a time
+ *            into one WR chain and one ibv_post_send() (one doorbell),
+ *            signaling only every QP_SHARE_SIGNAL_EVERY-th WR and the last
+ *            of each chain
+ *   route    RC completes in posting order, so a signaled completion
+ *            retires every WR posted before it; the poster looks each up
+ *            by wr_id (its posting sequence number) and hands the
+ *            producer's cookie and status to that producer's completion
+ *            ring, which only that producer reads
+ *
+ * A producer may have at most QP_SHARE_PRODUCER_DEPTH requests in flight,
+ * so its completion ring never overflows. The poster is also the only
+ * thread that touches the QP and CQ.
+ *
+ * The ring is Vyukov's bounded queue: a producer preempted between
+ * claiming and publishing a slot holds up the poster at that slot (not
+ * other producers) until it runs again.
+ *
+ * After a failed completion the QP is in error: everything outstanding or
+ * submitted later completes with IBV_WC_WR_FLUSH_ERR.
+ */
+
+#ifndef RDMA_QP_SHARE_H
+#define RDMA_QP_SHARE_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+#define QP_SHARE_MAX_PRODUCERS 64
+#define QP_SHARE_RING_SIZE 1024         // submission ring slots, power of two
+#define QP_SHARE_PRODUCER_DEPTH 64      // per producer in flight, power of two
+#define QP_SHARE_BATCH 32               // WRs per ibv_post_send() chain
+#define QP_SHARE_SIGNAL_EVERY 16
+
+struct qp_share_wr {
+    enum ibv_wr_opcode opcode;  // RDMA WRITE/READ or SEND, with or without immediate
+    uint32_t length;
+    uint64_t local_addr;
+    uint32_t lkey;
+    uint32_t rkey;
+    uint64_t remote_addr;
+    uint32_t imm_data;
+    unsigned send_flags;        // e.g. IBV_SEND_INLINE; signaling is the poster's
+    uint64_t cookie;            // handed back with the completion
+};
+
+struct qp_share_completion {
+    uint64_t cookie;
+    enum ibv_wc_status status;
+};
+
+struct qp_share_stats {
+    uint64_t posted;            // WRs
+    uint64_t chains;            // ibv_post_send() calls
+    uint64_t signaled;
+    uint64_t full;              // submissions refused with the ring full
+};
+
+struct qp_share;
+
+// qp's send queue holds sq_depth WRs and so does cq, where its sends
+// complete; nothing else may post to qp or poll cq
+struct qp_share *qp_share_create(struct ibv_qp *qp, struct ibv_cq *cq, int sq_depth,
+                                 int nproducers);
+int qp_share_start(struct qp_share *s);
+// Posts what is queued, waits for its completions and joins the poster
+void qp_share_stop(struct qp_share *s);
+void qp_share_destroy(struct qp_share *s);
+
+// From producer's thread only. 0 when queued, 1 when the ring or the
+// producer's window is full (poll and retry)
+int qp_share_submit(struct qp_share *s, int producer, const struct qp_share_wr *wr);
+// Up to max of producer's completions; how many
+int qp_share_poll(struct qp_share *s, int producer, struct qp_share_completion *c, int max);
+
+void qp_share_get_stats(const struct qp_share *s, struct qp_share_stats *stats);
+
+#endif
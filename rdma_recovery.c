@@ -0,0 +1,482 @@
+/*
+ * QP error recovery: outstanding WR tracking, in-place reset or reconnect,
+ * replay, and fault injection. See rdma_recovery.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_recovery.h"
+#include "rdma_connection.h"
+
+#define DRAIN_BATCH 16
+#define BACKOFF_MIN_NS 1000000ULL
+#define BACKOFF_MAX_NS 100000000ULL
+#define MAX_GID_NDEVS 16
+
+const char *const rdma_recovery_mode_names[RECOVERY_MODE_COUNT] = {"reset", "reconnect", "auto"};
+
+// What a reset needs to bring the QP back as it was connected
+#define RESET_QUERY_MASK (IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS | IBV_QP_AV | \
+                          IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |                 \
+                          IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER | IBV_QP_SQ_PSN |   \
+                          IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |              \
+                          IBV_QP_MAX_QP_RD_ATOMIC)
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = {ns / 1000000000, ns % 1000000000};
+
+    nanosleep(&ts, NULL);
+}
+
+static int query_qp(struct rdma_recovery *r) {
+    struct ibv_qp_init_attr init;
+
+    if (ibv_query_qp(r->ctx->qp, &r->qp_attr, RESET_QUERY_MASK, &init)) {
+        fprintf(stderr, "Failed to query QP: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_recovery_init(struct rdma_recovery *r, struct rdma_context *ctx, uint32_t depth,
+                       const struct rdma_recovery_attr *attr) {
+    memset(r, 0, sizeof(*r));
+    if (attr->mode != RECOVERY_RESET && !attr->server_ip) {
+        fprintf(stderr, "Reconnecting needs the server's address\n");
+        return -1;
+    }
+    r->ctx = ctx;
+    r->attr = *attr;
+    r->depth = depth;
+    r->ring = calloc(depth, sizeof(*r->ring));
+    if (!r->ring) {
+        fprintf(stderr, "Failed to allocate %u outstanding WRs\n", depth);
+        return -1;
+    }
+    if (query_qp(r)) {
+        free(r->ring);
+        r->ring = NULL;
+        return -1;
+    }
+    r->start_ns = rdma_now_ns();
+    return 0;
+}
+
+void rdma_recovery_destroy(struct rdma_recovery *r) {
+    // The link comes back up before the thread exits
+    if (r->link_thread_started) {
+        pthread_join(r->link_thread, NULL);
+        r->link_thread_started = 0;
+    }
+    free(r->ring);
+    r->ring = NULL;
+}
+
+uint32_t rdma_recovery_outstanding(const struct rdma_recovery *r) {
+    return r->head - r->tail;
+}
+
+// e as a WR on ctx's current connection
+static void build_wr(const struct rdma_recovery *r, const struct rdma_recovery_wr *e,
+                     struct ibv_sge *sge, struct ibv_send_wr *wr) {
+    const struct rdma_context *ctx = r->ctx;
+
+    sge->addr = (uintptr_t)ctx->buffer + e->local_offset;
+    sge->length = e->length;
+    sge->lkey = ctx->mr->lkey;
+
+    memset(wr, 0, sizeof(*wr));
+    wr->wr_id = e->wr_id;
+    wr->sg_list = e->length ? sge : NULL;
+    wr->num_sge = e->length ? 1 : 0;
+    wr->opcode = e->opcode;
+    wr->send_flags = e->send_flags;
+    wr->imm_data = e->imm_data;
+    wr->wr.rdma.remote_addr = ctx->remote_addr + e->remote_offset;
+    wr->wr.rdma.rkey = ctx->remote_rkey;
+}
+
+int rdma_recovery_post(struct rdma_recovery *r, const struct ibv_send_wr *wr) {
+    struct rdma_context *ctx = r->ctx;
+    struct rdma_recovery_wr e = {
+        .wr_id = wr->wr_id,
+        .opcode = wr->opcode,
+        .send_flags = wr->send_flags,
+        .imm_data = wr->imm_data,
+    };
+    struct ibv_send_wr copy, *bad_wr;
+    struct ibv_sge sge;
+
+    if (r->head - r->tail == r->depth) {
+        fprintf(stderr, "%u WRs already outstanding\n", r->depth);
+        return -1;
+    }
+    switch (wr->opcode) {
+    case IBV_WR_RDMA_WRITE:
+    case IBV_WR_RDMA_WRITE_WITH_IMM:
+    case IBV_WR_RDMA_READ:
+        if (wr->wr.rdma.rkey != ctx->remote_rkey || wr->wr.rdma.remote_addr < ctx->remote_addr) {
+            fprintf(stderr, "Recoverable WRs must target the peer's advertised buffer\n");
+            return -1;
+        }
+        e.remote_offset = wr->wr.rdma.remote_addr - ctx->remote_addr;
+        break;
+    case IBV_WR_SEND:
+    case IBV_WR_SEND_WITH_IMM:
+        break;
+    default:
+        fprintf(stderr, "Opcode %d cannot be replayed\n", wr->opcode);
+        return -1;
+    }
+    if (wr->num_sge > 1 ||
+        (wr->num_sge == 1 && (wr->sg_list->lkey != ctx->mr->lkey ||
+                              wr->sg_list->addr < (uintptr_t)ctx->buffer ||
+                              wr->sg_list->addr + wr->sg_list->length >
+                              (uintptr_t)ctx->buffer + ctx->buffer_size))) {
+        fprintf(stderr, "Recoverable WRs must have at most one SGE, in the context's buffer\n");
+        return -1;
+    }
+    if (wr->num_sge == 1) {
+        e.local_offset = wr->sg_list->addr - (uintptr_t)ctx->buffer;
+        e.length = wr->sg_list->length;
+    }
+
+    build_wr(r, &e, &sge, &copy);
+    if (ibv_post_send(ctx->qp, &copy, &bad_wr)) {
+        fprintf(stderr, "Failed to post send\n");
+        return -1;
+    }
+    r->ring[r->head++ % r->depth] = e;
+    return 0;
+}
+
+int rdma_recovery_complete(struct rdma_recovery *r, const struct ibv_wc *wc) {
+    uint64_t s;
+    int n;
+
+    if (wc->status != IBV_WC_SUCCESS) {
+        if (!r->failed_ns) {
+            r->failed_ns = rdma_now_ns();
+            r->failed_status = wc->status;
+        }
+        return -1;
+    }
+    if (wc->opcode & IBV_WC_RECV) {
+        return 0;
+    }
+    for (s = r->tail; s < r->head && r->ring[s % r->depth].wr_id != wc->wr_id; s++) {
+        ;
+    }
+    if (s == r->head) {
+        return 0;
+    }
+    n = s + 1 - r->tail;
+    r->tail = s + 1;
+    r->attempts = 0;
+    return n;
+}
+
+static int modify_state(struct ibv_qp *qp, struct ibv_qp_attr *a, int mask, const char *state) {
+    if (ibv_modify_qp(qp, a, mask)) {
+        fprintf(stderr, "Failed to move QP to %s: %s\n", state, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Successes still in the CQ acknowledge their WRs; everything else is
+// flushed WRs that get replayed
+static void drain(struct rdma_recovery *r, volatile int *running) {
+    struct ibv_wc wc[DRAIN_BATCH];
+    uint64_t quiet_since = rdma_now_ns(), t = quiet_since;
+
+    while (t - quiet_since < RECOVERY_DRAIN_NS && *running) {
+        int n = ibv_poll_cq(r->ctx->cq, DRAIN_BATCH, wc);
+
+        if (n < 0) {
+            break;
+        }
+        t = rdma_now_ns();
+        if (n > 0) {
+            quiet_since = t;
+        }
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status == IBV_WC_SUCCESS) {
+                rdma_recovery_complete(r, &wc[i]);
+            }
+        }
+    }
+}
+
+// ERR -> RESET -> INIT -> RTR -> RTS with the connected attributes, resuming
+// at the PSNs the QP had reached
+static int reset_qp(struct rdma_recovery *r) {
+    struct ibv_qp *qp = r->ctx->qp;
+    struct ibv_qp_attr a = r->qp_attr, cur;
+    struct ibv_qp_init_attr init;
+
+    if (!ibv_query_qp(qp, &cur, IBV_QP_SQ_PSN | IBV_QP_RQ_PSN, &init)) {
+        a.sq_psn = cur.sq_psn;
+        a.rq_psn = cur.rq_psn;
+    }
+
+    a.qp_state = IBV_QPS_RESET;
+    if (modify_state(qp, &a, IBV_QP_STATE, "RESET")) {
+        return -1;
+    }
+    a.qp_state = IBV_QPS_INIT;
+    if (modify_state(qp, &a, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS,
+                     "INIT")) {
+        return -1;
+    }
+    a.qp_state = IBV_QPS_RTR;
+    if (modify_state(qp, &a, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+                     IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER, "RTR")) {
+        return -1;
+    }
+    a.qp_state = IBV_QPS_RTS;
+    if (modify_state(qp, &a, IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+                     IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC, "RTS")) {
+        return -1;
+    }
+    r->stats.resets++;
+    return 0;
+}
+
+// A new connection on the same buffer, retried with backoff while the
+// server is unreachable
+static int reconnect_qp(struct rdma_recovery *r, volatile int *running) {
+    struct rdma_context *ctx = r->ctx;
+    struct rdma_resource_attr attr = r->attr.conn;
+    char *buffer = ctx->buffer;
+    int owns = ctx->owns_buffer, mapped = ctx->buffer_mapped;
+    uint64_t deadline = rdma_now_ns() + RECOVERY_GIVE_UP_NS, backoff = BACKOFF_MIN_NS;
+
+    attr.buffer = buffer;
+    attr.buffer_size = ctx->buffer_size;
+    attr.quiet = 1;
+    ctx->owns_buffer = 0;
+    close_rdma_connection(ctx);
+
+    while (connect_to_server(ctx, r->attr.server_ip, r->attr.port, &attr)) {
+        close_rdma_connection(ctx);
+        if (!*running || rdma_now_ns() + backoff > deadline) {
+            fprintf(stderr, "Gave up reconnecting to %s:%d\n", r->attr.server_ip, r->attr.port);
+            // Still the caller's to free
+            ctx->buffer = buffer;
+            ctx->buffer_size = attr.buffer_size;
+            ctx->owns_buffer = owns;
+            ctx->buffer_mapped = mapped;
+            return -1;
+        }
+        sleep_ns(backoff);
+        backoff = backoff * 2 < BACKOFF_MAX_NS ? backoff * 2 : BACKOFF_MAX_NS;
+    }
+    ctx->owns_buffer = owns;
+    ctx->buffer_mapped = mapped;
+    r->stats.reconnects++;
+    return query_qp(r);
+}
+
+static int replay(struct rdma_recovery *r) {
+    for (uint64_t s = r->tail; s < r->head; s++) {
+        struct ibv_send_wr wr, *bad_wr;
+        struct ibv_sge sge;
+
+        build_wr(r, &r->ring[s % r->depth], &sge, &wr);
+        if (ibv_post_send(r->ctx->qp, &wr, &bad_wr)) {
+            fprintf(stderr, "Failed to replay WR %lu\n", wr.wr_id);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int rdma_recovery_recover(struct rdma_recovery *r, volatile int *running) {
+    struct ibv_qp_attr err = { .qp_state = IBV_QPS_ERR };
+    struct rdma_recovery_event ev = {0};
+    uint64_t t0 = r->failed_ns ? r->failed_ns : rdma_now_ns();
+    int reconnect, ret;
+
+    if (++r->attempts > RECOVERY_MAX_ATTEMPTS) {
+        fprintf(stderr, "Giving up after %d recoveries with no completion between\n",
+                RECOVERY_MAX_ATTEMPTS);
+        return -1;
+    }
+
+    // Flush whatever the NIC has not, and collect what did complete
+    ibv_modify_qp(r->ctx->qp, &err, IBV_QP_STATE);
+    drain(r, running);
+
+    // A reset that was followed by another failure did not take
+    reconnect = r->attr.mode == RECOVERY_RECONNECT ||
+                (r->attr.mode == RECOVERY_AUTO && r->attempts > 1 && r->last_reset);
+    ret = reconnect ? reconnect_qp(r, running) : reset_qp(r);
+    if (ret && !reconnect && r->attr.mode == RECOVERY_AUTO) {
+        reconnect = 1;
+        ret = reconnect_qp(r, running);
+    }
+    if (ret || replay(r)) {
+        return -1;
+    }
+
+    ev.at_ns = t0 - r->start_ns;
+    ev.ns = rdma_now_ns() - t0;
+    ev.status = r->failed_status;
+    ev.reconnected = reconnect;
+    ev.replayed = r->head - r->tail;
+    if (r->stats.nevents < RECOVERY_EVENTS) {
+        r->stats.events[r->stats.nevents++] = ev;
+    }
+    r->stats.recoveries++;
+    r->stats.replayed += ev.replayed;
+    r->stats.total_ns += ev.ns;
+    r->stats.max_ns = ev.ns > r->stats.max_ns ? ev.ns : r->stats.max_ns;
+    r->last_reset = !reconnect;
+    r->failed_ns = 0;
+    return 0;
+}
+
+int rdma_fault_parse(const char *spec, struct rdma_fault_attr *fault) {
+    double every, down = 0;
+
+    memset(fault, 0, sizeof(*fault));
+    if (sscanf(spec, "qp:%lf", &every) == 1 && every > 0) {
+        fault->kind = RDMA_FAULT_QP;
+    } else if (sscanf(spec, "link:%lf:%lf", &every, &down) == 2 && every > 0 && down > 0) {
+        fault->kind = RDMA_FAULT_LINK;
+    } else {
+        fprintf(stderr, "Fault is qp:MS or link:MS:DOWN_MS, not %s\n", spec);
+        return -1;
+    }
+    fault->every_ns = every * 1e6;
+    fault->down_ns = down * 1e6;
+    return 0;
+}
+
+// The network interface behind ctx's device port (RoCE GIDs carry it)
+static int find_netdev(struct rdma_recovery *r) {
+    struct rdma_context *ctx = r->ctx;
+    unsigned port = ctx->cm_id && ctx->cm_id->port_num ? ctx->cm_id->port_num :
+                    ctx->port_num ? ctx->port_num : 1;
+
+    for (int i = 0; i < MAX_GID_NDEVS; i++) {
+        char path[256];
+        FILE *f;
+
+        snprintf(path, sizeof(path), "/sys/class/infiniband/%s/ports/%u/gid_attrs/ndevs/%d",
+                 ibv_get_device_name(ctx->context->device), port, i);
+        f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        if (fscanf(f, "%15s", r->netdev) == 1) {
+            fclose(f);
+            return 0;
+        }
+        fclose(f);
+    }
+    fprintf(stderr, "No network interface found for %s port %u\n",
+            ibv_get_device_name(ctx->context->device), port);
+    return -1;
+}
+
+static int set_link(const char *ifname, int up) {
+    struct ifreq ifr;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0), ret = -1;
+
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (!ioctl(fd, SIOCGIFFLAGS, &ifr)) {
+        if (up) {
+            ifr.ifr_flags |= IFF_UP;
+        } else {
+            ifr.ifr_flags &= ~IFF_UP;
+        }
+        ret = ioctl(fd, SIOCSIFFLAGS, &ifr);
+    }
+    if (ret) {
+        fprintf(stderr, "Failed to take %s %s: %s\n", ifname, up ? "up" : "down", strerror(errno));
+    }
+    close(fd);
+    return ret;
+}
+
+static void *link_flap(void *arg) {
+    struct rdma_recovery *r = arg;
+
+    if (!set_link(r->netdev, 0)) {
+        sleep_ns(r->fault.down_ns);
+        set_link(r->netdev, 1);
+    }
+    __atomic_store_n(&r->link_down, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int rdma_recovery_set_fault(struct rdma_recovery *r, const struct rdma_fault_attr *fault) {
+    r->fault = *fault;
+    r->next_fault_ns = rdma_now_ns() + fault->every_ns;
+    if (fault->kind == RDMA_FAULT_LINK && find_netdev(r)) {
+        r->fault.kind = RDMA_FAULT_NONE;
+        return -1;
+    }
+    return 0;
+}
+
+void rdma_recovery_inject(struct rdma_recovery *r, uint64_t now) {
+    if (r->fault.kind == RDMA_FAULT_NONE || now < r->next_fault_ns) {
+        return;
+    }
+    r->next_fault_ns += r->fault.every_ns;
+    if (r->next_fault_ns <= now) {
+        r->next_fault_ns = now + r->fault.every_ns;
+    }
+
+    if (r->fault.kind == RDMA_FAULT_QP) {
+        struct ibv_qp_attr err = { .qp_state = IBV_QPS_ERR };
+
+        if (!ibv_modify_qp(r->ctx->qp, &err, IBV_QP_STATE)) {
+            r->stats.faults++;
+        }
+        return;
+    }
+    // One flap at a time
+    if (__atomic_load_n(&r->link_down, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (r->link_thread_started) {
+        pthread_join(r->link_thread, NULL);
+        r->link_thread_started = 0;
+    }
+    __atomic_store_n(&r->link_down, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&r->link_thread, NULL, link_flap, r)) {
+        fprintf(stderr, "Failed to start link fault thread\n");
+        __atomic_store_n(&r->link_down, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    r->link_thread_started = 1;
+    r->stats.faults++;
+}
+
+void rdma_recovery_report(const struct rdma_recovery *r) {
+    const struct rdma_recovery_stats *s = &r->stats;
+
+    printf("Recoveries: %lu (%lu resets, %lu reconnects) after %lu injected faults, "
+           "%lu WRs replayed\n", s->recoveries, s->resets, s->reconnects, s->faults, s->replayed);
+    if (s->recoveries) {
+        printf("Recovery time: mean %.3f ms, max %.3f ms\n",
+               s->total_ns / (double)s->recoveries / 1e6, s->max_ns / 1e6);
+    }
+}
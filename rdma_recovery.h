@@ -0,0 +1,163 @@
+/*
+ * QP error recovery with replay of unacknowledged work requests (librdmademo)
+ *
+ * A completion with an error status puts the QP in the error state: every
+ * WR still outstanding is flushed, and without help the transfer is lost.
+ * Here sends are posted through rdma_recovery_post(), which keeps a copy of
+ * each until a completion acknowledges it (RC completes in order, so a
+ * signaled completion acknowledges every unsignaled WR before it too).
+ * When rdma_recovery_complete() sees an error, rdma_recovery_recover():
+ *
+ *   1. moves the QP to error (if the NIC has not) and drains the CQ; a
+ *      success still in there acknowledges its WRs, flushes are dropped
+ *   2. brings the QP back, by mode:
+ *        reset      ERR -> RESET -> INIT -> RTR -> RTS in place, with the
+ *                   attributes it was connected with and the PSNs it had
+ *                   reached: no round trip and the same QP number, but
+ *                   the peer only takes it if it saw everything sent
+ *                   before the failure (it NAKs otherwise)
+ *        reconnect  a new connection to the same server through rdma_cm,
+ *                   on the same buffer: slower, retried with backoff until
+ *                   RECOVERY_GIVE_UP_NS (a link that is down), and the
+ *                   peer starts over with it
+ *        auto       reset, and reconnect when a reset did not take (the
+ *                   next completion failed again)
+ *   3. reposts every unacknowledged WR in order, rebased onto the new
+ *      connection's lkey, remote address and rkey
+ *
+ * Replay is at least once: a WR the peer executed but whose ACK was lost
+ * runs again. That is harmless for RDMA WRITE and READ, not for SENDs or
+ * atomics. Receives posted on the QP are lost with a reset or reconnect
+ * and are the caller's to repost. Every WR must keep to ctx's buffer and
+ * the peer's advertised one, and wr_ids must be unique among those
+ * outstanding.
+ *
+ * Faults can be injected to exercise all this: forcing the QP into error
+ * every so often, or taking the device's network interface down for a
+ * while (soft RoCE (rxe) devices; needs CAP_NET_ADMIN), which fails
+ * outstanding WRs once their retries run out.
+ */
+
+#ifndef RDMA_RECOVERY_H
+#define RDMA_RECOVERY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <infiniband/verbs.h>
+
+#include "rdma_common.h"
+
+#define RECOVERY_MAX_ATTEMPTS 3             // recoveries in a row with no completion between
+#define RECOVERY_GIVE_UP_NS 30000000000ULL  // how long reconnecting keeps trying
+#define RECOVERY_DRAIN_NS 2000000           // CQ quiet this long after the error: drained
+#define RECOVERY_EVENTS 64                  // recoveries kept for reporting
+
+enum rdma_recovery_mode {
+    RECOVERY_RESET,
+    RECOVERY_RECONNECT,
+    RECOVERY_AUTO,
+    RECOVERY_MODE_COUNT,
+};
+
+extern const char *const rdma_recovery_mode_names[RECOVERY_MODE_COUNT];
+
+enum rdma_fault_kind {
+    RDMA_FAULT_NONE,
+    RDMA_FAULT_QP,          // force the QP into error
+    RDMA_FAULT_LINK,        // take the network interface down for down_ns
+};
+
+struct rdma_fault_attr {
+    enum rdma_fault_kind kind;
+    uint64_t every_ns;      // first after every_ns, then every every_ns
+    uint64_t down_ns;
+};
+
+struct rdma_recovery_attr {
+    enum rdma_recovery_mode mode;
+    const char *server_ip;  // reconnect: where ctx is connected, and how
+    int port;
+    struct rdma_resource_attr conn;
+};
+
+struct rdma_recovery_event {
+    uint64_t at_ns;         // the failure, from rdma_recovery_init()
+    uint64_t ns;            // failure seen to WRs replayed
+    enum ibv_wc_status status;
+    int reconnected;
+    uint32_t replayed;
+};
+
+struct rdma_recovery_stats {
+    uint64_t recoveries;
+    uint64_t resets;
+    uint64_t reconnects;
+    uint64_t replayed;      // WRs
+    uint64_t faults;        // injected
+    uint64_t total_ns, max_ns;
+    int nevents;
+    struct rdma_recovery_event events[RECOVERY_EVENTS];
+};
+
+// A send as rdma_recovery_post() took it, relative to ctx's buffers
+struct rdma_recovery_wr {
+    uint64_t wr_id;
+    enum ibv_wr_opcode opcode;
+    unsigned send_flags;
+    uint32_t imm_data;
+    uint32_t length;
+    uint64_t local_offset;      // into ctx->buffer
+    uint64_t remote_offset;     // from ctx->remote_addr
+};
+
+struct rdma_recovery {
+    struct rdma_context *ctx;
+    struct rdma_recovery_attr attr;
+    struct ibv_qp_attr qp_attr;     // as connected, for resets
+    struct rdma_recovery_wr *ring;
+    uint32_t depth;
+    uint64_t head, tail;            // posted, acknowledged
+    uint64_t start_ns;
+    uint64_t failed_ns;             // when the pending failure was seen, 0 if none
+    enum ibv_wc_status failed_status;
+    int attempts;                   // recoveries since the last successful completion
+    int last_reset;                 // the last recovery was a reset
+
+    struct rdma_fault_attr fault;
+    uint64_t next_fault_ns;
+    char netdev[IF_NAMESIZE];
+    pthread_t link_thread;
+    int link_thread_started;
+    int link_down;
+
+    struct rdma_recovery_stats stats;
+};
+
+// ctx is connected; its sends are posted through r from now on, at most
+// depth (its send queue depth) outstanding
+int rdma_recovery_init(struct rdma_recovery *r, struct rdma_context *ctx, uint32_t depth,
+                       const struct rdma_recovery_attr *attr);
+void rdma_recovery_destroy(struct rdma_recovery *r);
+
+// One send, of at most one SGE
+int rdma_recovery_post(struct rdma_recovery *r, const struct ibv_send_wr *wr);
+// For each completion polled off ctx->cq: how many WRs it acknowledged (it
+// and the unsignaled ones before it), or -1 when it failed and
+// rdma_recovery_recover() is due
+int rdma_recovery_complete(struct rdma_recovery *r, const struct ibv_wc *wc);
+// Bring the QP back and replay; 0 on success, -1 when it gave up (or
+// *running dropped). ctx's QP, CQ, MR and remote buffer may all change
+int rdma_recovery_recover(struct rdma_recovery *r, volatile int *running);
+uint32_t rdma_recovery_outstanding(const struct rdma_recovery *r);
+
+// "qp:MS" forces a QP error every MS ms, "link:MS:DOWN_MS" takes the link
+// down for DOWN_MS ms every MS ms
+int rdma_fault_parse(const char *spec, struct rdma_fault_attr *fault);
+int rdma_recovery_set_fault(struct rdma_recovery *r, const struct rdma_fault_attr *fault);
+// Called on the data path between posts; injects whatever fault is due
+void rdma_recovery_inject(struct rdma_recovery *r, uint64_t now_ns);
+
+void rdma_recovery_report(const struct rdma_recovery *r);
+
+#endif
@@ -0,0 +1,913 @@
+/*
+ * Workload replay from RoCEv2 captures. See rdma_replay.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "rdma_replay.h"
+#include "rdma_common.h"
+#include "rdma_connection.h"
+#include "rdma_trace.h"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_MAX_SNAPLEN 262144
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+#define BTH_LEN 12
+#define RETH_LEN 16
+#define ICRC_LEN 4
+#define MAX_SAMPLES (1 << 16)       // lag and latency samples kept per QP
+#define CALIBRATION_NS 10000000
+
+const char *const rdma_replay_op_names[REPLAY_OPS] = {
+    "send", "send_imm", "write", "write_imm", "read", "atomic",
+};
+
+// RC/UC opcodes, the low five bits of the BTH opcode
+enum {
+    OP_SEND_FIRST = 0x00,
+    OP_SEND_MIDDLE = 0x01,
+    OP_SEND_LAST = 0x02,
+    OP_SEND_LAST_IMM = 0x03,
+    OP_SEND_ONLY = 0x04,
+    OP_SEND_ONLY_IMM = 0x05,
+    OP_WRITE_FIRST = 0x06,
+    OP_WRITE_ONLY = 0x0a,
+    OP_WRITE_ONLY_IMM = 0x0b,
+    OP_READ_REQUEST = 0x0c,
+    OP_CMP_SWAP = 0x13,
+    OP_FETCH_ADD = 0x14,
+    OP_SEND_LAST_INV = 0x16,
+    OP_SEND_ONLY_INV = 0x17,
+};
+
+#define TRANSPORT_RC 0
+#define TRANSPORT_UC 1
+#define TRANSPORT_UD 3
+
+// Per QP while compiling
+struct compile_qp {
+    uint64_t last_ns;
+    int sending;                // a multi-packet send is open
+    uint64_t send_ns;
+    uint64_t send_bytes;
+};
+
+struct compile_state {
+    struct rdma_replay_schedule *s;
+    struct compile_qp qps[REPLAY_MAX_QPS];
+    uint64_t first_ns, last_ns;
+    uint64_t packets;           // RoCEv2 ones
+    uint64_t dropped_qps;       // messages of QPs past REPLAY_MAX_QPS
+};
+
+static int bucket_of(uint64_t v) {
+    return v ? 63 - __builtin_clzll(v) : 0;
+}
+
+static void hist_add(struct rdma_replay_hist *h, uint64_t v) {
+    int b = bucket_of(v);
+
+    h->count[b]++;
+    h->mean[b] += (v - h->mean[b]) / h->count[b];
+}
+
+static uint64_t hist_total(const struct rdma_replay_hist *h) {
+    uint64_t total = 0;
+
+    for (int b = 0; b < REPLAY_BUCKETS; b++) {
+        total += h->count[b];
+    }
+    return total;
+}
+
+static uint32_t get_be16(const uint8_t *p) {
+    return (uint32_t)p[0] << 8 | p[1];
+}
+
+static uint32_t get_be24(const uint8_t *p) {
+    return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int find_qp(struct compile_state *c, const char *peer, uint32_t qpn) {
+    struct rdma_replay_schedule *s = c->s;
+
+    for (int i = 0; i < s->nqps; i++) {
+        if (s->qps[i].qpn == qpn && !strcmp(s->qps[i].peer, peer)) {
+            return i;
+        }
+    }
+    if (s->nqps == REPLAY_MAX_QPS) {
+        return -1;
+    }
+    snprintf(s->qps[s->nqps].peer, sizeof(s->qps[0].peer), "%s", peer);
+    s->qps[s->nqps].qpn = qpn;
+    return s->nqps++;
+}
+
+static void emit(struct compile_state *c, int i, uint64_t t_ns, enum rdma_replay_op op,
+                 uint64_t bytes) {
+    struct rdma_replay_qp *q = &c->s->qps[i];
+    struct compile_qp *cq = &c->qps[i];
+
+    if (q->messages) {
+        hist_add(&q->gap, t_ns > cq->last_ns ? t_ns - cq->last_ns : 0);
+    } else {
+        q->start_ns = t_ns - c->first_ns;
+    }
+    cq->last_ns = t_ns;
+    q->messages++;
+    q->ops[op]++;
+    hist_add(&q->size[op], bytes);
+    if (t_ns > c->last_ns) {
+        c->last_ns = t_ns;
+    }
+}
+
+// One RoCEv2 packet: bth points at its base transport header, udp_len is
+// the UDP length field, avail the bytes captured from bth on
+static void compile_packet(struct compile_state *c, const char *peer, uint64_t t_ns,
+                           const uint8_t *bth, size_t avail, uint32_t udp_len) {
+    uint8_t opcode, op, pad;
+    uint32_t qpn;
+    int64_t payload;
+    int ext = 0, i;
+
+    if (avail < BTH_LEN || udp_len < 8 + BTH_LEN + ICRC_LEN) {
+        return;
+    }
+    opcode = bth[0];
+    op = opcode & 0x1f;
+    pad = (bth[1] >> 4) & 3;
+    qpn = get_be24(bth + 5);
+
+    // Requests only: responses and ACKs belong to the peer's QP
+    if (opcode >> 5 == TRANSPORT_UD) {
+        if (op != OP_SEND_ONLY && op != OP_SEND_ONLY_IMM) {
+            return;
+        }
+        ext = 8 + (op == OP_SEND_ONLY_IMM ? 4 : 0);     // DETH, ImmDt
+    } else if (opcode >> 5 == TRANSPORT_RC || opcode >> 5 == TRANSPORT_UC) {
+        switch (op) {
+        case OP_SEND_FIRST:
+        case OP_SEND_MIDDLE:
+        case OP_SEND_LAST:
+        case OP_SEND_ONLY:
+            break;
+        case OP_SEND_LAST_IMM:
+        case OP_SEND_ONLY_IMM:
+        case OP_SEND_LAST_INV:
+        case OP_SEND_ONLY_INV:
+            ext = 4;
+            break;
+        case OP_WRITE_FIRST:
+        case OP_WRITE_ONLY:
+        case OP_WRITE_ONLY_IMM:
+        case OP_READ_REQUEST:
+            ext = RETH_LEN;
+            break;
+        case OP_CMP_SWAP:
+        case OP_FETCH_ADD:
+            ext = 28;
+            break;
+        default:
+            return;
+        }
+    } else {
+        return;
+    }
+
+    c->packets++;
+    if (c->packets == 1) {
+        c->first_ns = t_ns;
+    }
+    i = find_qp(c, peer, qpn);
+    if (i < 0) {
+        c->dropped_qps++;
+        return;
+    }
+    payload = (int64_t)udp_len - 8 - BTH_LEN - ext - ICRC_LEN - pad;
+    if (payload < 0) {
+        payload = 0;
+    }
+
+    if (opcode >> 5 == TRANSPORT_UD) {
+        emit(c, i, t_ns, op == OP_SEND_ONLY_IMM ? REPLAY_SEND_IMM : REPLAY_SEND, payload);
+        return;
+    }
+    switch (op) {
+    case OP_SEND_FIRST:
+        // A FIRST with one still open: its LAST was not captured
+        if (c->qps[i].sending) {
+            emit(c, i, c->qps[i].send_ns, REPLAY_SEND, c->qps[i].send_bytes);
+        }
+        c->qps[i].sending = 1;
+        c->qps[i].send_ns = t_ns;
+        c->qps[i].send_bytes = payload;
+        break;
+    case OP_SEND_MIDDLE:
+        c->qps[i].send_bytes += payload;
+        break;
+    case OP_SEND_LAST:
+    case OP_SEND_LAST_IMM:
+    case OP_SEND_LAST_INV:
+        if (c->qps[i].sending) {
+            emit(c, i, c->qps[i].send_ns, op == OP_SEND_LAST_IMM ? REPLAY_SEND_IMM : REPLAY_SEND,
+                 c->qps[i].send_bytes + payload);
+            c->qps[i].sending = 0;
+        }
+        break;
+    case OP_SEND_ONLY:
+    case OP_SEND_ONLY_INV:
+        emit(c, i, t_ns, REPLAY_SEND, payload);
+        break;
+    case OP_SEND_ONLY_IMM:
+        emit(c, i, t_ns, REPLAY_SEND_IMM, payload);
+        break;
+    case OP_WRITE_FIRST:
+    case OP_WRITE_ONLY:
+    case OP_WRITE_ONLY_IMM:
+    case OP_READ_REQUEST:
+        if (avail < BTH_LEN + RETH_LEN) {
+            return;
+        }
+        emit(c, i, t_ns,
+             op == OP_READ_REQUEST ? REPLAY_READ : op == OP_WRITE_ONLY_IMM ? REPLAY_WRITE_IMM
+                                                                           : REPLAY_WRITE,
+             get_be32(bth + BTH_LEN + 12));
+        break;
+    default:
+        emit(c, i, t_ns, REPLAY_ATOMIC, 8);
+        break;
+    }
+}
+
+// Find the UDP datagram in a link-layer frame; RoCEv2 ones go on to
+// compile_packet()
+static void compile_frame(struct compile_state *c, uint32_t link, uint64_t t_ns,
+                          const uint8_t *p, size_t len) {
+    uint32_t ethertype;
+    const uint8_t *udp;
+    char peer[INET6_ADDRSTRLEN];
+    size_t off;
+
+    switch (link) {
+    case LINKTYPE_ETHERNET:
+        if (len < 14) {
+            return;
+        }
+        ethertype = get_be16(p + 12);
+        off = 14;
+        while ((ethertype == 0x8100 || ethertype == 0x88a8) && len >= off + 4) {
+            ethertype = get_be16(p + off + 2);
+            off += 4;
+        }
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (len < 16) {
+            return;
+        }
+        ethertype = get_be16(p + 14);
+        off = 16;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        if (len < 20) {
+            return;
+        }
+        ethertype = get_be16(p);
+        off = 20;
+        break;
+    default:
+        if (len < 1) {
+            return;
+        }
+        ethertype = p[0] >> 4 == 6 ? 0x86dd : 0x0800;
+        off = 0;
+        break;
+    }
+    p += off;
+    len -= off;
+
+    if (ethertype == 0x0800) {
+        size_t ihl;
+
+        if (len < 20 || p[9] != 17) {
+            return;
+        }
+        ihl = (p[0] & 0xf) * 4;
+        if (len < ihl + 8) {
+            return;
+        }
+        inet_ntop(AF_INET, p + 16, peer, sizeof(peer));
+        udp = p + ihl;
+        len -= ihl;
+    } else if (ethertype == 0x86dd) {
+        if (len < 48 || p[6] != 17) {
+            return;
+        }
+        inet_ntop(AF_INET6, p + 24, peer, sizeof(peer));
+        udp = p + 40;
+        len -= 40;
+    } else {
+        return;
+    }
+    if (get_be16(udp + 2) != ROCEV2_UDP_PORT) {
+        return;
+    }
+    compile_packet(c, peer, t_ns, udp + 8, len - 8, get_be16(udp + 4));
+}
+
+int rdma_replay_compile(const char *pcap_path, struct rdma_replay_schedule *s) {
+    FILE *f = fopen(pcap_path, "rb");
+    struct compile_state *c = calloc(1, sizeof(*c));
+    uint8_t *frame = malloc(PCAP_MAX_SNAPLEN);
+    uint32_t hdr[6], rec[4];
+    int swap = 0, nsec = 0;
+    int ret = -1;
+
+    memset(s, 0, sizeof(*s));
+    if (!c || !frame) {
+        fprintf(stderr, "Failed to allocate capture buffers\n");
+        goto out;
+    }
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", pcap_path, strerror(errno));
+        goto out;
+    }
+    if (fread(hdr, sizeof(hdr), 1, f) != 1) {
+        fprintf(stderr, "%s: not a pcap file\n", pcap_path);
+        goto out;
+    }
+    if (hdr[0] == __builtin_bswap32(PCAP_MAGIC_US) || hdr[0] == __builtin_bswap32(PCAP_MAGIC_NS)) {
+        swap = 1;
+        for (int i = 0; i < 6; i++) {
+            hdr[i] = __builtin_bswap32(hdr[i]);
+        }
+    }
+    if (hdr[0] != PCAP_MAGIC_US && hdr[0] != PCAP_MAGIC_NS) {
+        fprintf(stderr, "%s: not a pcap file (pcapng is not read; convert with editcap -F pcap)\n",
+                pcap_path);
+        goto out;
+    }
+    nsec = hdr[0] == PCAP_MAGIC_NS;
+    if (hdr[5] != LINKTYPE_ETHERNET && hdr[5] != LINKTYPE_RAW && hdr[5] != LINKTYPE_LINUX_SLL &&
+        hdr[5] != LINKTYPE_LINUX_SLL2) {
+        fprintf(stderr, "%s: link type %u is not Ethernet, raw IP or Linux cooked\n", pcap_path,
+                hdr[5]);
+        goto out;
+    }
+
+    c->s = s;
+    while (fread(rec, sizeof(rec), 1, f) == 1) {
+        uint64_t t_ns;
+
+        if (swap) {
+            for (int i = 0; i < 4; i++) {
+                rec[i] = __builtin_bswap32(rec[i]);
+            }
+        }
+        if (rec[2] > PCAP_MAX_SNAPLEN || fread(frame, 1, rec[2], f) != rec[2]) {
+            fprintf(stderr, "%s: truncated record, stopping there\n", pcap_path);
+            break;
+        }
+        t_ns = rec[0] * 1000000000ULL + (nsec ? rec[1] : rec[1] * 1000ULL);
+        compile_frame(c, hdr[5], t_ns, frame, rec[2]);
+    }
+    // Sends whose LAST the capture ended before
+    for (int i = 0; i < s->nqps; i++) {
+        if (c->qps[i].sending) {
+            emit(c, i, c->qps[i].send_ns, REPLAY_SEND, c->qps[i].send_bytes);
+        }
+    }
+    if (s->nqps == 0) {
+        fprintf(stderr, "%s: no RoCEv2 requests (UDP port %d)\n", pcap_path, ROCEV2_UDP_PORT);
+        goto out;
+    }
+    if (c->dropped_qps) {
+        fprintf(stderr, "%s: more than %d QPs, %lu messages of the rest left out\n", pcap_path,
+                REPLAY_MAX_QPS, c->dropped_qps);
+    }
+    s->seconds = (c->last_ns - c->first_ns) / 1e9;
+    ret = 0;
+
+out:
+    if (f) {
+        fclose(f);
+    }
+    free(frame);
+    free(c);
+    return ret;
+}
+
+static void save_hist(FILE *f, const char *kind, int qp, const char *op,
+                      const struct rdma_replay_hist *h) {
+    for (int b = 0; b < REPLAY_BUCKETS; b++) {
+        if (h->count[b]) {
+            fprintf(f, "%s %d %s%s%d %lu %.1f\n", kind, qp, op, *op ? " " : "", b, h->count[b],
+                    h->mean[b]);
+        }
+    }
+}
+
+int rdma_replay_save(const char *path, const struct rdma_replay_schedule *s, const char *source) {
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "# RDMA workload schedule from %s, replayed by rdma_client -W\n", source);
+    fprintf(f, "# qp INDEX PEER QPN START_NS MESSAGES\n");
+    fprintf(f, "# op INDEX OP COUNT\n");
+    fprintf(f, "# size INDEX OP LOG2_BUCKET COUNT MEAN_BYTES\n");
+    fprintf(f, "# gap INDEX LOG2_BUCKET COUNT MEAN_NS\n");
+    fprintf(f, "seconds %.9f\n", s->seconds);
+    for (int i = 0; i < s->nqps; i++) {
+        const struct rdma_replay_qp *q = &s->qps[i];
+
+        fprintf(f, "qp %d %s 0x%06x %lu %lu\n", i, q->peer, q->qpn, q->start_ns, q->messages);
+        for (int op = 0; op < REPLAY_OPS; op++) {
+            if (q->ops[op]) {
+                fprintf(f, "op %d %s %lu\n", i, rdma_replay_op_names[op], q->ops[op]);
+                save_hist(f, "size", i, rdma_replay_op_names[op], &q->size[op]);
+            }
+        }
+        save_hist(f, "gap", i, "", &q->gap);
+    }
+    if (fclose(f)) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int find_op(const char *name) {
+    for (int op = 0; op < REPLAY_OPS; op++) {
+        if (!strcmp(name, rdma_replay_op_names[op])) {
+            return op;
+        }
+    }
+    return -1;
+}
+
+int rdma_replay_load(const char *path, struct rdma_replay_schedule *s) {
+    FILE *f = fopen(path, "r");
+    char line[256];
+    int lineno = 0;
+    int ret = 0;
+
+    memset(s, 0, sizeof(*s));
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        char kind[16], name[INET6_ADDRSTRLEN], peer[INET6_ADDRSTRLEN];
+        unsigned long a, b;
+        double mean;
+        int i, bucket, op = 0, ok;
+
+        lineno++;
+        if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        if (sscanf(line, "%15s", kind) != 1) {
+            ok = 0;
+        } else if (!strcmp(kind, "seconds")) {
+            ok = sscanf(line, "%*s %lf", &s->seconds) == 1;
+        } else if (!strcmp(kind, "qp")) {
+            unsigned qpn;
+
+            ok = sscanf(line, "%*s %d %45s %x %lu %lu", &i, peer, &qpn, &a, &b) == 5 &&
+                 i == s->nqps && i < REPLAY_MAX_QPS;
+            if (ok) {
+                snprintf(s->qps[i].peer, sizeof(s->qps[i].peer), "%s", peer);
+                s->qps[i].qpn = qpn;
+                s->qps[i].start_ns = a;
+                s->qps[i].messages = b;
+                s->nqps++;
+            }
+        } else if (!strcmp(kind, "op")) {
+            ok = sscanf(line, "%*s %d %45s %lu", &i, name, &a) == 3 && i >= 0 && i < s->nqps &&
+                 (op = find_op(name)) >= 0;
+            if (ok) {
+                s->qps[i].ops[op] = a;
+            }
+        } else if (!strcmp(kind, "size")) {
+            ok = sscanf(line, "%*s %d %45s %d %lu %lf", &i, name, &bucket, &a, &mean) == 5 &&
+                 i >= 0 && i < s->nqps && (op = find_op(name)) >= 0 && bucket >= 0 &&
+                 bucket < REPLAY_BUCKETS;
+            if (ok) {
+                s->qps[i].size[op].count[bucket] = a;
+                s->qps[i].size[op].mean[bucket] = mean;
+            }
+        } else if (!strcmp(kind, "gap")) {
+            ok = sscanf(line, "%*s %d %d %lu %lf", &i, &bucket, &a, &mean) == 4 && i >= 0 &&
+                 i < s->nqps && bucket >= 0 && bucket < REPLAY_BUCKETS;
+            if (ok) {
+                s->qps[i].gap.count[bucket] = a;
+                s->qps[i].gap.mean[bucket] = mean;
+            }
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%d: not a schedule line\n", path, lineno);
+            ret = -1;
+        }
+    }
+    fclose(f);
+    if (ret == 0 && s->nqps == 0) {
+        fprintf(stderr, "%s: no QPs\n", path);
+        ret = -1;
+    }
+    for (int i = 0; ret == 0 && i < s->nqps; i++) {
+        for (int op = 0; op < REPLAY_OPS; op++) {
+            if (s->qps[i].ops[op] && !hist_total(&s->qps[i].size[op])) {
+                fprintf(stderr, "%s: qp %d has %s messages but no sizes\n", path, i,
+                        rdma_replay_op_names[op]);
+                ret = -1;
+            }
+        }
+    }
+    return ret;
+}
+
+int rdma_replay_read(const char *path, struct rdma_replay_schedule *s) {
+    FILE *f = fopen(path, "rb");
+    uint32_t magic = 0;
+    int pcap;
+
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    pcap = fread(&magic, sizeof(magic), 1, f) == 1 &&
+           (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS ||
+            magic == __builtin_bswap32(PCAP_MAGIC_US) ||
+            magic == __builtin_bswap32(PCAP_MAGIC_NS) || magic == 0x0a0d0d0a);
+    fclose(f);
+    return pcap ? rdma_replay_compile(path, s) : rdma_replay_load(path, s);
+}
+
+static double hist_mean(const struct rdma_replay_hist *h) {
+    double sum = 0;
+    uint64_t n = 0;
+
+    for (int b = 0; b < REPLAY_BUCKETS; b++) {
+        sum += h->count[b] * h->mean[b];
+        n += h->count[b];
+    }
+    return n ? sum / n : 0;
+}
+
+void rdma_replay_print(const struct rdma_replay_schedule *s) {
+    uint64_t total = 0;
+
+    for (int i = 0; i < s->nqps; i++) {
+        total += s->qps[i].messages;
+    }
+    printf("%d QPs, %lu messages over %.3f s\n", s->nqps, total, s->seconds);
+    printf("%3s %-24s %9s %10s %10s  %s\n", "qp", "destination", "messages", "msg/s",
+           "mean gap", "mix (mean bytes)");
+    for (int i = 0; i < s->nqps; i++) {
+        const struct rdma_replay_qp *q = &s->qps[i];
+        char dest[64];
+
+        snprintf(dest, sizeof(dest), "%s/0x%06x", q->peer, q->qpn);
+        printf("%3d %-24s %9lu %10.0f %8.1fus ", i, dest, q->messages,
+               s->seconds > 0 ? q->messages / s->seconds : 0, hist_mean(&q->gap) / 1e3);
+        for (int op = 0; op < REPLAY_OPS; op++) {
+            if (q->ops[op]) {
+                printf(" %s %.0f%% (%.0f)", rdma_replay_op_names[op],
+                       100.0 * q->ops[op] / q->messages, hist_mean(&q->size[op]));
+            }
+        }
+        printf("\n");
+    }
+}
+
+// Replay
+
+struct replay_flow {
+    const struct rdma_replay_qp *q;
+    struct rdma_context *ctx;
+    uint64_t rng;
+    uint64_t gap_total;
+    uint64_t ops_total;
+    uint64_t size_total[REPLAY_OPS];
+    double next_ns;             // when the next message is due, after start
+    enum rdma_replay_op next_op;
+    uint32_t next_bytes;
+    int blocked;                // the due message waits for the window
+    uint64_t head, tail;
+    uint64_t posted_at[REPLAY_WINDOW];
+    uint64_t messages, bytes, cut, full;
+    uint64_t *lag, *lat;
+    long lag_n, lat_n;
+};
+
+static uint64_t rand_next(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// A value drawn from h, whose counts add up to total
+static double draw(const struct rdma_replay_hist *h, uint64_t total, uint64_t *rng) {
+    uint64_t r;
+
+    if (total == 0) {
+        return 0;
+    }
+    r = rand_next(rng) % total;
+    for (int b = 0; b < REPLAY_BUCKETS; b++) {
+        if (r < h->count[b]) {
+            return h->mean[b];
+        }
+        r -= h->count[b];
+    }
+    return 0;
+}
+
+// Pick the next message's opcode and size, due gap_ns after the last
+static void draw_next(struct replay_flow *fl, double gap_ns) {
+    const struct rdma_replay_qp *q = fl->q;
+    uint64_t r = rand_next(&fl->rng) % fl->ops_total;
+    double bytes;
+    int op = 0;
+
+    while (op < REPLAY_OPS - 1 && r >= q->ops[op]) {
+        r -= q->ops[op++];
+    }
+    fl->next_op = op;
+    bytes = draw(&q->size[op], fl->size_total[op], &fl->rng);
+    fl->next_bytes = bytes < 1 ? 1 : bytes > REPLAY_MAX_MSG ? REPLAY_MAX_MSG : bytes;
+    fl->cut += bytes > REPLAY_MAX_MSG;
+    fl->next_ns += gap_ns;
+}
+
+static int post_message(struct replay_flow *fl, uint64_t tsc) {
+    struct rdma_context *ctx = fl->ctx;
+    int read = fl->next_op == REPLAY_READ || fl->next_op == REPLAY_ATOMIC;
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+
+    sge.addr = (uintptr_t)ctx->buffer;
+    sge.length = fl->next_op == REPLAY_ATOMIC ? 8 : fl->next_bytes;
+    sge.lkey = ctx->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = fl->head;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = read ? IBV_WR_RDMA_READ : IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = ctx->remote_addr;
+    wr.wr.rdma.rkey = ctx->remote_rkey;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post replayed %s\n", rdma_replay_op_names[fl->next_op]);
+        return -1;
+    }
+    fl->posted_at[fl->head % REPLAY_WINDOW] = tsc;
+    fl->head++;
+    fl->messages++;
+    fl->bytes += sge.length;
+    return 0;
+}
+
+static int reap(struct replay_flow *fl, double ns_per_tick) {
+    struct ibv_wc wc[16];
+    uint64_t tsc;
+    int n = ibv_poll_cq(fl->ctx->cq, 16, wc);
+
+    if (n < 0) {
+        fprintf(stderr, "Failed to poll CQ\n");
+        return -1;
+    }
+    tsc = rdma_trace_now();
+    for (int i = 0; i < n; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+            return -1;
+        }
+        if (fl->lat_n < MAX_SAMPLES) {
+            fl->lat[fl->lat_n++] = (tsc - fl->posted_at[fl->tail % REPLAY_WINDOW]) * ns_per_tick;
+        }
+        fl->tail++;
+    }
+    return n;
+}
+
+// Nanoseconds per tick of rdma_trace_now()
+static double calibrate(void) {
+    struct timespec delay = {0, CALIBRATION_NS}, t0, t1;
+    uint64_t tsc0, tsc1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    tsc0 = rdma_trace_now();
+    nanosleep(&delay, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    tsc1 = rdma_trace_now();
+    return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / (double)(tsc1 - tsc0);
+}
+
+static double pct_us(uint64_t *v, long n, int pct) {
+    return n ? v[n * pct / 100] / 1e3 : 0;
+}
+
+static void report(const struct rdma_replay_schedule *s, struct replay_flow *flows, double seconds,
+                   double speed) {
+    uint64_t messages = 0, bytes = 0, cut = 0, full = 0;
+    double target = 0;
+
+    printf("%3s %10s %10s %8s %9s %9s %9s %9s %7s\n", "qp", "target/s", "msg/s", "Gbit/s",
+           "lag p50", "lag p99", "lat p50", "lat p99", "blocked");
+    for (int i = 0; i < s->nqps; i++) {
+        struct replay_flow *fl = &flows[i];
+        double want = s->seconds > 0 ? fl->q->messages / s->seconds * speed : 0;
+
+        qsort(fl->lag, fl->lag_n, sizeof(*fl->lag), rdma_cmp_u64);
+        qsort(fl->lat, fl->lat_n, sizeof(*fl->lat), rdma_cmp_u64);
+        printf("%3d %10.0f %10.0f %8.3f %7.1fus %7.1fus %7.1fus %7.1fus %7lu\n", i, want,
+               fl->messages / seconds, fl->bytes * 8 / seconds / 1e9, pct_us(fl->lag, fl->lag_n, 50),
+               pct_us(fl->lag, fl->lag_n, 99), pct_us(fl->lat, fl->lat_n, 50),
+               pct_us(fl->lat, fl->lat_n, 99), fl->full);
+        messages += fl->messages;
+        bytes += fl->bytes;
+        cut += fl->cut;
+        full += fl->full;
+        target += want;
+    }
+    printf("all %10.0f %10.0f %8.3f over %.2f s, %lu messages", target, messages / seconds,
+           bytes * 8 / seconds / 1e9, seconds, messages);
+    if (full) {
+        printf(", %lu held back by a full window", full);
+    }
+    if (cut) {
+        printf(", %lu cut to %d bytes", cut, REPLAY_MAX_MSG);
+    }
+    printf("\n");
+}
+
+static int connect_flows(struct rdma_context *ctxs, int n, const char *server_ip, int port) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = REPLAY_MAX_MSG,
+        .cq_depth = REPLAY_WINDOW,
+        .qp_depth = REPLAY_WINDOW,
+        .fill_pattern = 1,
+        .quiet = 1,
+    };
+
+    if (connect_to_servers(ctxs, n, server_ip, port, &attr, NULL)) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (ctxs[i].remote_length < REPLAY_MAX_MSG) {
+            fprintf(stderr, "Server buffer holds %lu bytes, replay needs %d (rdma_server -A)\n",
+                    ctxs[i].remote_length, REPLAY_MAX_MSG);
+            for (int j = 0; j < n; j++) {
+                close_rdma_connection(&ctxs[j]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int rdma_replay_run(const char *server_ip, int port, const struct rdma_replay_schedule *s,
+                    const struct rdma_replay_opts *o, volatile int *running) {
+    double speed = o->speed > 0 ? o->speed : 1;
+    double end_ns = (o->seconds > 0 ? o->seconds : s->seconds / speed) * 1e9;
+    struct rdma_context *ctxs = calloc(s->nqps, sizeof(*ctxs));
+    struct replay_flow *flows = calloc(s->nqps, sizeof(*flows));
+    double ns_per_tick;
+    uint64_t start;
+    double now = 0;
+    int connected = 0;
+    int ret = -1;
+
+    if (!ctxs || !flows) {
+        fprintf(stderr, "Failed to allocate %d replay QPs\n", s->nqps);
+        goto out;
+    }
+    for (int i = 0; i < s->nqps; i++) {
+        flows[i].lag = malloc(MAX_SAMPLES * sizeof(*flows[i].lag));
+        flows[i].lat = malloc(MAX_SAMPLES * sizeof(*flows[i].lat));
+        if (!flows[i].lag || !flows[i].lat) {
+            fprintf(stderr, "Failed to allocate latency samples\n");
+            goto out;
+        }
+    }
+    if (end_ns <= 0) {
+        fprintf(stderr, "The schedule spans no time; give the replay a length\n");
+        goto out;
+    }
+    if (connect_flows(ctxs, s->nqps, server_ip, port)) {
+        goto out;
+    }
+    connected = 1;
+
+    for (int i = 0; i < s->nqps; i++) {
+        struct replay_flow *fl = &flows[i];
+
+        fl->q = &s->qps[i];
+        fl->ctx = &ctxs[i];
+        fl->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        fl->gap_total = hist_total(&fl->q->gap);
+        for (int op = 0; op < REPLAY_OPS; op++) {
+            fl->size_total[op] = hist_total(&fl->q->size[op]);
+            fl->ops_total += fl->q->ops[op];
+        }
+        if (fl->ops_total == 0) {
+            fl->next_ns = end_ns;
+            continue;
+        }
+        draw_next(fl, fl->q->start_ns / speed);
+    }
+
+    printf("Replaying %d QPs against %s:%d for %.2f s at %.2fx\n", s->nqps, server_ip, port,
+           end_ns / 1e9, speed);
+    ns_per_tick = calibrate();
+    start = rdma_trace_now();
+    ret = 0;
+    while (*running && ret == 0) {
+        double next = end_ns;
+        int inflight = 0;
+
+        now = (rdma_trace_now() - start) * ns_per_tick;
+        for (int i = 0; i < s->nqps && ret == 0; i++) {
+            struct replay_flow *fl = &flows[i];
+
+            while (fl->next_ns <= now && fl->next_ns < end_ns) {
+                if (fl->head - fl->tail == REPLAY_WINDOW) {
+                    fl->full += !fl->blocked;
+                    fl->blocked = 1;
+                    break;
+                }
+                if (post_message(fl, rdma_trace_now())) {
+                    ret = -1;
+                    break;
+                }
+                if (fl->lag_n < MAX_SAMPLES) {
+                    fl->lag[fl->lag_n++] = now - fl->next_ns;
+                }
+                fl->blocked = 0;
+                if (fl->gap_total == 0) {
+                    fl->next_ns = end_ns;   // one message in the capture, and it went
+                    break;
+                }
+                draw_next(fl, draw(&fl->q->gap, fl->gap_total, &fl->rng) / speed);
+            }
+            if (fl->head != fl->tail && reap(fl, ns_per_tick) < 0) {
+                ret = -1;
+            }
+            inflight += fl->head != fl->tail;
+            if (fl->next_ns < next) {
+                next = fl->next_ns;
+            }
+        }
+        if (next >= end_ns && !inflight) {
+            break;
+        }
+        if (!inflight && next - now > REPLAY_SPIN_NS) {
+            uint64_t wait = next - now - REPLAY_SPIN_NS;
+            struct timespec ts = {wait / 1000000000, wait % 1000000000};
+
+            nanosleep(&ts, NULL);
+        }
+    }
+    if (ret == 0) {
+        report(s, flows, (now > 0 ? now : 1) / 1e9, speed);
+    }
+
+out:
+    if (connected) {
+        for (int i = 0; i < s->nqps; i++) {
+            close_rdma_connection(&ctxs[i]);
+        }
+    }
+    if (flows) {
+        for (int i = 0; i < s->nqps; i++) {
+            free(flows[i].lag);
+            free(flows[i].lat);
+        }
+    }
+    free(flows);
+    free(ctxs);
+    return ret;
+}
@@ -0,0 +1,100 @@
+/*
+ * Workload replay from RoCEv2 captures (librdmademo)
+ *
+ * rdma_replay_compile() reads a pcap (Ethernet, raw IP or Linux cooked
+ * capture; tcpdump -w as capture_rdma_traffic.sh takes it) and follows
+ * every requester QP in it (RoCEv2, UDP port 4791; a QP is a destination
+ * address and QPN) from the requests' base transport headers:
+ *
+ *   opcode mix     send, send with immediate, write, write with immediate,
+ *                  read, atomic: a message per FIRST/ONLY packet
+ *   message size   from the RETH of writes and reads; summed over the
+ *                  packets of a send
+ *   inter-arrival  between one message's first packet and the next's
+ *
+ * The result is a schedule: per QP, its first message's offset into the
+ * capture, a count per opcode, and log2-bucketed histograms (count and
+ * mean per bucket) of message size by opcode and of inter-arrival time.
+ * A few hundred bytes of text per QP however long the capture, it can be
+ * saved, read back, edited and replayed for longer than was captured.
+ *
+ * rdma_replay_run() opens a connection per QP and issues a message on one
+ * whenever the QP's next arrival is due, drawing arrival gaps, opcodes and
+ * sizes from the histograms (seeded per QP, so a run repeats exactly). One
+ * thread drives all QPs off the TSC: it spins for the next deadline, and
+ * sleeps only when none is within REPLAY_SPIN_NS and nothing is in
+ * flight. The report compares achieved against scheduled rates and gives
+ * the schedule lag (post time - deadline; grows when a QP's
+ * REPLAY_WINDOW messages in flight hold it back) and completion latency.
+ *
+ * The server is rdma_server -A: any number of connections, each with a
+ * REPLAY_MAX_MSG buffer and no receives posted. So sends are replayed as
+ * writes of the same size, atomics as 8-byte reads, and larger messages
+ * are cut to REPLAY_MAX_MSG (counted in the report).
+ */
+
+#ifndef RDMA_REPLAY_H
+#define RDMA_REPLAY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define REPLAY_MAX_QPS 64
+#define REPLAY_BUCKETS 64               // log2 buckets: [2^b, 2^(b+1)), 0 in bucket 0
+#define REPLAY_MAX_MSG (1024 * 1024)    // rdma_server -A's buffer per connection
+#define REPLAY_WINDOW 64                // messages in flight per QP
+#define REPLAY_SPIN_NS 50000            // deadlines closer than this are spun for
+#define ROCEV2_UDP_PORT 4791
+
+enum rdma_replay_op {
+    REPLAY_SEND,
+    REPLAY_SEND_IMM,
+    REPLAY_WRITE,
+    REPLAY_WRITE_IMM,
+    REPLAY_READ,
+    REPLAY_ATOMIC,
+    REPLAY_OPS,
+};
+
+extern const char *const rdma_replay_op_names[REPLAY_OPS];
+
+struct rdma_replay_hist {
+    uint64_t count[REPLAY_BUCKETS];
+    double mean[REPLAY_BUCKETS];
+};
+
+struct rdma_replay_qp {
+    char peer[INET6_ADDRSTRLEN];    // destination address in the capture
+    uint32_t qpn;                   // destination QP in the capture
+    uint64_t start_ns;              // first message, after the capture's first
+    uint64_t messages;
+    uint64_t ops[REPLAY_OPS];
+    struct rdma_replay_hist size[REPLAY_OPS];
+    struct rdma_replay_hist gap;    // ns
+};
+
+struct rdma_replay_schedule {
+    double seconds;                 // first to last message in the capture
+    int nqps;
+    struct rdma_replay_qp qps[REPLAY_MAX_QPS];
+};
+
+struct rdma_replay_opts {
+    double speed;                   // 2 replays twice as fast, 0 for 1
+    double seconds;                 // how long, 0 for the capture's span / speed
+};
+
+int rdma_replay_compile(const char *pcap_path, struct rdma_replay_schedule *s);
+int rdma_replay_save(const char *path, const struct rdma_replay_schedule *s, const char *source);
+int rdma_replay_load(const char *path, struct rdma_replay_schedule *s);
+// A capture is compiled, anything else loaded as a saved schedule
+int rdma_replay_read(const char *path, struct rdma_replay_schedule *s);
+void rdma_replay_print(const struct rdma_replay_schedule *s);
+
+// Replay s against the rdma_server -A at server_ip, port until done or
+// *running drops, and report
+int rdma_replay_run(const char *server_ip, int port, const struct rdma_replay_schedule *s,
+                    const struct rdma_replay_opts *o, volatile int *running);
+
+#endif
@@ -0,0 +1,446 @@
+/*
+ * Request/response RPC over an established RC connection. See rdma_rpc.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "rdma_rpc.h"
+#include "rdma_trace.h"
+
+#define RESP_BASE (RPC_SLOTS * RPC_SLOT_SIZE)
+
+// Flag-mode calls in flight are tracked in one 64-bit mask
+_Static_assert(RPC_SLOTS <= 64, "RPC_SLOTS must fit a uint64_t mask");
+
+struct rpc_method {
+    rpc_handler fn;
+    void *arg;
+};
+
+struct rpc_server {
+    struct rdma_context *ctx;
+    struct rpc_method methods[RPC_MAX_METHODS];
+    int send_outstanding;       // send WRs not yet retired by a completion
+};
+
+struct rpc_call {
+    uint64_t cookie;
+    uint8_t seq;
+    uint8_t mode;
+};
+
+struct rpc_client {
+    struct rdma_context *ctx;
+    struct rpc_call calls[RPC_SLOTS];
+    int free_slots[RPC_SLOTS];
+    int nfree;
+    int pending[RPC_SLOTS];     // started, not yet posted
+    int npending;
+    uint64_t flag_waiting;      // flag-mode slots awaiting their trailer
+    int send_outstanding;
+    uint64_t poll_start;
+    uint32_t empty_polls;
+};
+
+static char *req_slot(struct rdma_context *ctx, int slot) {
+    return ctx->buffer + (size_t)slot * RPC_SLOT_SIZE;
+}
+
+static char *resp_slot_end(struct rdma_context *ctx, int slot) {
+    return ctx->buffer + RESP_BASE + (size_t)(slot + 1) * RPC_SLOT_SIZE;
+}
+
+static int check_context(const struct rdma_context *ctx) {
+    if (!ctx->qp || !ctx->connected) {
+        fprintf(stderr, "RPC needs a connected queue pair\n");
+        return -1;
+    }
+    if (ctx->buffer_size < RPC_REGION_SIZE || ctx->remote_length < RPC_REGION_SIZE) {
+        fprintf(stderr, "RPC needs %d byte buffers on both sides\n", RPC_REGION_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+// Zero-length receives: a WRITE WITH IMM only needs one to carry its
+// immediate. Posted as a single chain
+static int post_recvs(struct ibv_qp *qp, const int *slots, int n) {
+    struct ibv_recv_wr wr[RPC_SLOTS], *bad_wr;
+
+    if (n == 0) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        memset(&wr[i], 0, sizeof(wr[i]));
+        wr[i].wr_id = slots[i];
+        wr[i].next = i + 1 < n ? &wr[i + 1] : NULL;
+    }
+    return ibv_post_recv(qp, wr, &bad_wr);
+}
+
+static int post_all_recvs(struct ibv_qp *qp) {
+    int slots[RPC_SLOTS];
+
+    for (int i = 0; i < RPC_SLOTS; i++) {
+        slots[i] = i;
+    }
+    return post_recvs(qp, slots, RPC_SLOTS);
+}
+
+// Link n prepared WRs and post them with one doorbell; only the last is
+// signaled and its wr_id is the number of WRs its completion retires
+static int post_chain(struct ibv_qp *qp, struct ibv_send_wr *wr, int n) {
+    struct ibv_send_wr *bad_wr;
+
+    for (int i = 0; i < n; i++) {
+        wr[i].next = i + 1 < n ? &wr[i + 1] : NULL;
+        wr[i].send_flags = 0;
+        rdma_trace_post(i + 1 < n ? 0 : (uint64_t)n, wr[i].opcode, wr[i].sg_list->length);
+    }
+    wr[n - 1].wr_id = n;
+    wr[n - 1].send_flags = IBV_SEND_SIGNALED;
+    return ibv_post_send(qp, wr, &bad_wr);
+}
+
+static int poll_batch(struct ibv_cq *cq, int max, struct ibv_wc *wc, uint64_t *poll_start,
+                      uint32_t *empty_polls, uint64_t *polled_at) {
+    int n = ibv_poll_cq(cq, max < RPC_BATCH ? max : RPC_BATCH, wc);
+
+    if (n == 0) {
+        (*empty_polls)++;
+        return 0;
+    }
+    *polled_at = rdma_trace_poll_end(*poll_start, n, *empty_polls);
+    *poll_start = rdma_trace_poll_begin();
+    *empty_polls = 0;
+    if (n < 0) {
+        fprintf(stderr, "Failed to poll CQ\n");
+    }
+    return n;
+}
+
+struct rpc_server *rpc_server_create(struct rdma_context *ctx) {
+    struct rpc_server *srv;
+
+    if (check_context(ctx)) {
+        return NULL;
+    }
+    srv = calloc(1, sizeof(*srv));
+    if (!srv) {
+        fprintf(stderr, "Failed to allocate RPC server\n");
+        return NULL;
+    }
+    srv->ctx = ctx;
+    if (post_all_recvs(ctx->qp)) {
+        fprintf(stderr, "Failed to post receives\n");
+        free(srv);
+        return NULL;
+    }
+    return srv;
+}
+
+int rpc_server_register(struct rpc_server *srv, uint16_t method, rpc_handler fn, void *arg) {
+    if (method == RPC_METHOD_BYE || method >= RPC_MAX_METHODS) {
+        fprintf(stderr, "Invalid RPC method id %u\n", method);
+        return -1;
+    }
+    srv->methods[method].fn = fn;
+    srv->methods[method].arg = arg;
+    return 0;
+}
+
+// Run the handler for the request in slot and build its response, payload
+// then trailer, at the end of the local response slot
+static void handle_request(struct rpc_server *srv, int slot, struct ibv_send_wr *wr,
+                           struct ibv_sge *sge) {
+    struct rdma_context *ctx = srv->ctx;
+    const struct rpc_req_header *hdr = (const struct rpc_req_header *)req_slot(ctx, slot);
+    char *end = resp_slot_end(ctx, slot);
+    struct rpc_resp_trailer *trailer = (struct rpc_resp_trailer *)(end - sizeof(*trailer));
+    char *resp = ctx->buffer + RESP_BASE + (size_t)slot * RPC_SLOT_SIZE;
+    uint16_t status = RPC_OK;
+    int len = 0;
+
+    if (hdr->len > RPC_MAX_REQUEST) {
+        status = RPC_ERR_HANDLER;
+    } else if (hdr->method != RPC_METHOD_BYE) {
+        // Out-of-range ids land on RPC_METHOD_BYE's entry, which never has a handler
+        const struct rpc_method *m = &srv->methods[hdr->method < RPC_MAX_METHODS ? hdr->method : 0];
+        if (!m->fn) {
+            status = RPC_ERR_NO_METHOD;
+        } else {
+            // Handlers fill the slot from its start; the payload is moved up
+            // against the trailer so the response is one contiguous write
+            len = m->fn(m->arg, hdr + 1, hdr->len, resp, RPC_MAX_RESPONSE);
+            if (len < 0 || len > (int)RPC_MAX_RESPONSE) {
+                status = RPC_ERR_HANDLER;
+                len = 0;
+            } else if (len > 0) {
+                memmove((char *)trailer - len, resp, len);
+            }
+        }
+    }
+    trailer->len = len;
+    trailer->status = status;
+    trailer->pad = 0;
+    trailer->seq = hdr->seq;
+
+    memset(sge, 0, sizeof(*sge));
+    sge->addr = (uintptr_t)((char *)trailer - len);
+    sge->length = len + sizeof(*trailer);
+    sge->lkey = ctx->mr->lkey;
+
+    memset(wr, 0, sizeof(*wr));
+    wr->sg_list = sge;
+    wr->num_sge = 1;
+    wr->wr.rdma.remote_addr = ctx->remote_addr + (end - ctx->buffer) - sge->length;
+    wr->wr.rdma.rkey = ctx->remote_rkey;
+    if (hdr->resp_mode == RPC_RESP_IMM) {
+        wr->opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+        wr->imm_data = htonl(slot);
+    } else {
+        wr->opcode = IBV_WR_RDMA_WRITE;
+    }
+}
+
+int rpc_server_run(struct rpc_server *srv, volatile int *running) {
+    struct rdma_context *ctx = srv->ctx;
+    struct ibv_wc wc[RPC_BATCH];
+    // Responses wait here when the send queue is full, at most one per slot
+    struct ibv_send_wr wr[RPC_SLOTS];
+    struct ibv_sge sge[RPC_SLOTS];
+    int recv_slots[RPC_BATCH];
+    int npending = 0;
+    int bye = 0;
+    uint64_t poll_start = rdma_trace_poll_begin(), polled_at = 0;
+    uint32_t empty_polls = 0;
+    long served = 0;
+    int n;
+
+    while (*running && !(bye && npending == 0 && srv->send_outstanding == 0)) {
+        int nrecv = 0;
+
+        n = poll_batch(ctx->cq, RPC_BATCH, wc, &poll_start, &empty_polls, &polled_at);
+        if (n < 0) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+                return -1;
+            }
+            if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                int slot = ntohl(wc[i].imm_data);
+                if (slot < 0 || slot >= RPC_SLOTS || npending == RPC_SLOTS) {
+                    fprintf(stderr, "RPC request for invalid slot %d\n", slot);
+                    return -1;
+                }
+                handle_request(srv, slot, &wr[npending], &sge[npending]);
+                bye |= ((const struct rpc_req_header *)req_slot(ctx, slot))->method == RPC_METHOD_BYE;
+                npending++;
+                recv_slots[nrecv++] = slot;
+                served++;
+            } else {
+                rdma_trace_completion(&wc[i], polled_at);
+                srv->send_outstanding -= wc[i].wr_id;
+            }
+        }
+
+        // Receives go back before the responses, so a slot can take its
+        // next request as soon as the client sees the response
+        if (post_recvs(ctx->qp, recv_slots, nrecv)) {
+            fprintf(stderr, "Failed to post receives\n");
+            return -1;
+        }
+        if (npending && srv->send_outstanding + npending <= RPC_QP_DEPTH) {
+            if (post_chain(ctx->qp, wr, npending)) {
+                fprintf(stderr, "Failed to post RPC responses\n");
+                return -1;
+            }
+            srv->send_outstanding += npending;
+            npending = 0;
+        }
+    }
+    printf("RPC server handled %ld calls\n", served);
+    return 0;
+}
+
+void rpc_server_destroy(struct rpc_server *srv) {
+    free(srv);
+}
+
+struct rpc_client *rpc_client_create(struct rdma_context *ctx) {
+    struct rpc_client *cli;
+
+    if (check_context(ctx)) {
+        return NULL;
+    }
+    cli = calloc(1, sizeof(*cli));
+    if (!cli) {
+        fprintf(stderr, "Failed to allocate RPC client\n");
+        return NULL;
+    }
+    cli->ctx = ctx;
+    for (int i = 0; i < RPC_SLOTS; i++) {
+        cli->free_slots[i] = RPC_SLOTS - 1 - i;
+    }
+    cli->nfree = RPC_SLOTS;
+    cli->poll_start = rdma_trace_poll_begin();
+    // No stale trailer may match a call's sequence number
+    memset(ctx->buffer + RESP_BASE, 0, RPC_SLOTS * RPC_SLOT_SIZE);
+    if (post_all_recvs(ctx->qp)) {
+        fprintf(stderr, "Failed to post receives\n");
+        free(cli);
+        return NULL;
+    }
+    return cli;
+}
+
+int rpc_call_start(struct rpc_client *cli, uint16_t method, enum rpc_resp_mode mode,
+                   const void *req, uint32_t len, uint64_t cookie) {
+    struct rpc_req_header *hdr;
+    struct rpc_call *call;
+    int slot;
+
+    if (cli->nfree == 0 || len > RPC_MAX_REQUEST) {
+        return -1;
+    }
+    slot = cli->free_slots[--cli->nfree];
+    call = &cli->calls[slot];
+    call->cookie = cookie;
+    call->mode = mode;
+    // 1..255: zero is what a never-used trailer holds
+    call->seq = call->seq == 255 ? 1 : call->seq + 1;
+
+    hdr = (struct rpc_req_header *)req_slot(cli->ctx, slot);
+    hdr->len = len;
+    hdr->method = method;
+    hdr->resp_mode = mode;
+    hdr->seq = call->seq;
+    if (len) {
+        memcpy(hdr + 1, req, len);
+    }
+    cli->pending[cli->npending++] = slot;
+    return slot;
+}
+
+int rpc_client_flush(struct rpc_client *cli) {
+    struct rdma_context *ctx = cli->ctx;
+    struct ibv_send_wr wr[RPC_SLOTS];
+    struct ibv_sge sge[RPC_SLOTS];
+    int n = cli->npending;
+
+    // With the send queue full the requests stay pending; the caller's
+    // next rpc_client_poll() retires sends and the next flush posts them
+    if (n == 0 || cli->send_outstanding + n > RPC_QP_DEPTH) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        int slot = cli->pending[i];
+        const struct rpc_req_header *hdr = (const struct rpc_req_header *)req_slot(ctx, slot);
+
+        memset(&sge[i], 0, sizeof(sge[i]));
+        sge[i].addr = (uintptr_t)hdr;
+        sge[i].length = sizeof(*hdr) + hdr->len;
+        sge[i].lkey = ctx->mr->lkey;
+
+        memset(&wr[i], 0, sizeof(wr[i]));
+        wr[i].sg_list = &sge[i];
+        wr[i].num_sge = 1;
+        wr[i].opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+        wr[i].imm_data = htonl(slot);
+        wr[i].wr.rdma.remote_addr = ctx->remote_addr + (uint64_t)slot * RPC_SLOT_SIZE;
+        wr[i].wr.rdma.rkey = ctx->remote_rkey;
+
+        if (cli->calls[slot].mode == RPC_RESP_FLAG) {
+            cli->flag_waiting |= 1ULL << slot;
+        }
+    }
+    if (post_chain(ctx->qp, wr, n)) {
+        fprintf(stderr, "Failed to post RPC requests\n");
+        return -1;
+    }
+    cli->send_outstanding += n;
+    cli->npending = 0;
+    return 0;
+}
+
+// Fill out from the trailer of slot's response and free the slot
+static void complete_call(struct rpc_client *cli, int slot, struct rpc_completion *out) {
+    char *end = resp_slot_end(cli->ctx, slot);
+    const struct rpc_resp_trailer *trailer = (const struct rpc_resp_trailer *)(end - sizeof(*trailer));
+
+    out->cookie = cli->calls[slot].cookie;
+    out->status = trailer->status;
+    out->resp_len = trailer->len <= RPC_MAX_RESPONSE ? trailer->len : 0;
+    out->resp = (const char *)trailer - out->resp_len;
+    cli->free_slots[cli->nfree++] = slot;
+}
+
+int rpc_client_poll(struct rpc_client *cli, struct rpc_completion *out, int max) {
+    struct rdma_context *ctx = cli->ctx;
+    struct ibv_wc wc[RPC_BATCH];
+    int recv_slots[RPC_BATCH];
+    uint64_t polled_at = 0;
+    int nrecv = 0;
+    int done = 0;
+    int n;
+
+    n = poll_batch(ctx->cq, max, wc, &cli->poll_start, &cli->empty_polls, &polled_at);
+    if (n < 0) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+            return -1;
+        }
+        if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+            int slot = ntohl(wc[i].imm_data);
+            if (slot < 0 || slot >= RPC_SLOTS) {
+                fprintf(stderr, "RPC response for invalid slot %d\n", slot);
+                return -1;
+            }
+            complete_call(cli, slot, &out[done++]);
+            recv_slots[nrecv++] = slot;
+        } else if (wc[i].opcode == IBV_WC_RDMA_WRITE) {
+            rdma_trace_completion(&wc[i], polled_at);
+            rpc_client_retire(cli, &wc[i]);
+        } else {
+            fprintf(stderr, "Unexpected completion opcode %d\n", wc[i].opcode);
+            return -1;
+        }
+    }
+    if (post_recvs(ctx->qp, recv_slots, nrecv)) {
+        fprintf(stderr, "Failed to post receives\n");
+        return -1;
+    }
+
+    // Flag mode: the sequence number is the last byte the response write
+    // places, so once it matches the rest of the response is there too
+    for (uint64_t waiting = cli->flag_waiting; waiting && done < max; waiting &= waiting - 1) {
+        int slot = __builtin_ctzll(waiting);
+        const uint8_t *seq = (const uint8_t *)resp_slot_end(ctx, slot) - 1;
+
+        if (__atomic_load_n(seq, __ATOMIC_ACQUIRE) == cli->calls[slot].seq) {
+            cli->flag_waiting &= ~(1ULL << slot);
+            complete_call(cli, slot, &out[done++]);
+        }
+    }
+    return done;
+}
+
+void rpc_client_retire(struct rpc_client *cli, const struct ibv_wc *wc) {
+    cli->send_outstanding -= wc->wr_id;
+}
+
+int rpc_client_outstanding(const struct rpc_client *cli) {
+    return RPC_SLOTS - cli->nfree;
+}
+
+void rpc_client_destroy(struct rpc_client *cli) {
+    free(cli);
+}
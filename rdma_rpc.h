@@ -0,0 +1,121 @@
+/*
+ * Request/response RPC over an established RC connection (librdmademo)
+ *
+ * Both peers carve the buffer they exchanged at connect time into
+ * RPC_SLOTS request slots followed by RPC_SLOTS response slots, each
+ * RPC_SLOT_SIZE bytes, at the same offsets on both sides. A call owns one
+ * slot index end to end:
+ *
+ *   client: builds the request in its local request slot, then RDMA WRITE
+ *           WITH IMM (imm = slot) into the same slot on the server
+ *   server: the immediate names the slot; it dispatches on the method id
+ *           through its handler table and builds the response at the end
+ *           of its local response slot, then RDMA WRITEs it into the same
+ *           place on the client
+ *
+ * Responses come back in one of two ways, chosen per call:
+ *
+ *   RPC_RESP_IMM   WRITE WITH IMM; the client reaps a receive completion
+ *   RPC_RESP_FLAG  plain WRITE; the response ends with a trailer whose
+ *                  last byte is the call's sequence number, and the client
+ *                  spins on that byte. No receive WR or CQE on the client,
+ *                  which is the lowest-latency path. This relies on the
+ *                  HCA placing a WRITE's bytes in address order, as
+ *                  InfiniBand and RoCE HCAs do in practice.
+ *
+ * Both sides batch: the client posts every request started since its last
+ * flush as one WR chain (one doorbell), and the server answers each CQ
+ * poll's worth of requests with one chain, reposting receives the same way.
+ */
+
+#ifndef RDMA_RPC_H
+#define RDMA_RPC_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+#include "rdma_common.h"
+
+#define RPC_SLOTS 64
+#define RPC_SLOT_SIZE 4096
+#define RPC_REGION_SIZE (2 * RPC_SLOTS * RPC_SLOT_SIZE)
+#define RPC_QP_DEPTH (2 * RPC_SLOTS)    // requests plus responses in flight
+#define RPC_CQ_DEPTH (2 * RPC_QP_DEPTH)
+#define RPC_MAX_METHODS 256
+#define RPC_BATCH 16
+
+// Method 0 is reserved: it ends rpc_server_run() after replying
+#define RPC_METHOD_BYE 0
+// Served by rdma_server -R and benchmarked by rdma_client -R
+#define RPC_METHOD_ECHO 1       // response = request
+#define RPC_METHOD_COMPUTE 2    // response = FNV-1a hash and byte sum of the request
+
+enum rpc_resp_mode {
+    RPC_RESP_IMM,
+    RPC_RESP_FLAG,
+};
+
+enum rpc_status {
+    RPC_OK = 0,
+    RPC_ERR_NO_METHOD = 1,      // nothing registered under the method id
+    RPC_ERR_HANDLER = 2,        // handler failed or response too large
+    RPC_ERR_TRANSPORT = 3,      // a WR failed; the connection is unusable
+};
+
+struct rpc_req_header {
+    uint32_t len;               // payload bytes following the header
+    uint16_t method;
+    uint8_t resp_mode;          // enum rpc_resp_mode
+    uint8_t seq;
+};
+
+// Ends the response slot, payload immediately before it; seq is the very
+// last byte written
+struct rpc_resp_trailer {
+    uint32_t len;
+    uint16_t status;            // enum rpc_status
+    uint8_t pad;
+    uint8_t seq;
+};
+
+#define RPC_MAX_REQUEST (RPC_SLOT_SIZE - sizeof(struct rpc_req_header))
+#define RPC_MAX_RESPONSE (RPC_SLOT_SIZE - sizeof(struct rpc_resp_trailer))
+
+// Returns the response length written to resp (at most resp_max), or -1
+typedef int (*rpc_handler)(void *arg, const void *req, uint32_t req_len, void *resp,
+                           uint32_t resp_max);
+
+struct rpc_server;
+struct rpc_client;
+
+struct rpc_completion {
+    uint64_t cookie;            // as passed to rpc_call_start()
+    int status;                 // enum rpc_status
+    const void *resp;           // valid until the next rpc_call_start()
+    uint32_t resp_len;
+};
+
+// ctx must be connected, with RPC_QP_DEPTH/RPC_CQ_DEPTH queues and at least
+// RPC_REGION_SIZE of buffer
+struct rpc_server *rpc_server_create(struct rdma_context *ctx);
+int rpc_server_register(struct rpc_server *srv, uint16_t method, rpc_handler fn, void *arg);
+// Serve until the client says RPC_METHOD_BYE or *running clears
+int rpc_server_run(struct rpc_server *srv, volatile int *running);
+void rpc_server_destroy(struct rpc_server *srv);
+
+struct rpc_client *rpc_client_create(struct rdma_context *ctx);
+// Copy a request into a free slot; it goes out at the next flush. Returns
+// the slot, or -1 when all RPC_SLOTS calls are outstanding
+int rpc_call_start(struct rpc_client *cli, uint16_t method, enum rpc_resp_mode mode,
+                   const void *req, uint32_t len, uint64_t cookie);
+// Post every started request as one chain
+int rpc_client_flush(struct rpc_client *cli);
+// Reap up to max finished calls without blocking; -1 on a transport error
+int rpc_client_poll(struct rpc_client *cli, struct rpc_completion *out, int max);
+// Account for an RPC send completion (IBV_WC_RDMA_WRITE) reaped by another
+// user of the connection's CQ
+void rpc_client_retire(struct rpc_client *cli, const struct ibv_wc *wc);
+int rpc_client_outstanding(const struct rpc_client *cli);
+void rpc_client_destroy(struct rpc_client *cli);
+
+#endif
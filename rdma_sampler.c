@@ -0,0 +1,500 @@
+/*
+ * RDMA RoCEv2 Throughput Sampler
+ * Native, low-overhead replacement for the psutil/ss polling loop in
+ * throughput_monitor.py.
+ *
+ * Every counter file is opened once at startup and re-read with pread() at
+ * offset 0 on each tick (sysfs regenerates the value on every read at offset
+ * 0), so a sample costs a handful of syscalls and no process spawns:
+ *   - /sys/class/net/<iface>/statistics/{tx,rx}_{bytes,packets}
+ *   - /sys/class/infiniband/<dev>/ports/<port>/counters/<name>
+ *   - /sys/class/infiniband/<dev>/ports/<port>/hw_counters/<name>
+ *
+ * Only the per-port traffic counters are read on every tick; the remaining
+ * RDMA counters (errors, retries, CNPs, ...) are refreshed at 10 Hz so that
+ * sampling at up to 10 kHz stays cheap.
+ *
+ * Output uses the demo_throughput.json layout and is streamed to disk as
+ * samples are taken, so throughput_monitor.py --analyze keeps working. An
+ * output file ending in .rsl gets the compact binary sample log instead
+ * (see sample_log.h).
+ *
+ * Compile with: gcc -O2 -o rdma_sampler rdma_sampler.c sample_log.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/resource.h>
+
+#include "sample_log.h"
+
+#define SYSFS_NET "/sys/class/net"
+#define SYSFS_IB "/sys/class/infiniband"
+#define MAX_COLUMNS SAMPLE_LOG_MAX_COLUMNS
+#define COLUMN_NAME_LEN 96
+#define MAX_RATE_HZ 10000
+#define DEFAULT_RATE_HZ 10
+#define COLD_INTERVAL_NS 100000000LL   // cold counters refreshed at 10 Hz
+#define PRINT_INTERVAL_NS 100000000LL  // console refresh at 10 Hz
+#define FLUSH_INTERVAL_NS 1000000000LL // binary log tail block flushed at 1 Hz
+
+// Per-port traffic counters, read on every tick. port_*_data is in units of
+// 4 octets per the IBTA PortCounters definition; rxe only exposes packet
+// counts through hw_counters.
+static const struct {
+    const char *column;
+    const char *files[2];
+    int scale;
+} port_traffic[] = {
+    { "tx_bytes", { "counters/port_xmit_data", NULL }, 4 },
+    { "rx_bytes", { "counters/port_rcv_data", NULL }, 4 },
+    { "tx_packets", { "counters/port_xmit_packets", "hw_counters/sent_pkts" }, 1 },
+    { "rx_packets", { "counters/port_rcv_packets", "hw_counters/rcvd_pkts" }, 1 },
+};
+
+#define PORT_TRAFFIC_COLUMNS (sizeof(port_traffic) / sizeof(port_traffic[0]))
+
+struct column {
+    int fd;
+    int scale;
+    int hot;
+};
+
+struct sampler {
+    char interface[IF_NAMESIZE];
+    struct column columns[MAX_COLUMNS];
+    char names[MAX_COLUMNS][COLUMN_NAME_LEN];
+    const char *name_ptrs[MAX_COLUMNS];
+    uint64_t values[MAX_COLUMNS];
+    uint64_t prev_values[MAX_COLUMNS];
+    uint32_t num_columns;
+    int num_ports;
+
+    double duration;
+    int rate_hz;
+    int quiet;
+    const char *output;
+    FILE *out;
+    struct sample_log_writer *log;
+    uint64_t num_samples;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void signal_handler(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static int64_t timespec_ns(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int64_t wall_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return timespec_ns(&ts);
+}
+
+static double cpu_seconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int read_counter(int fd, uint64_t *value) {
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    *value = strtoull(buf, NULL, 10);
+    return 0;
+}
+
+static void read_column(struct sampler *s, uint32_t c) {
+    uint64_t v;
+
+    if (read_counter(s->columns[c].fd, &v) == 0) {
+        s->values[c] = v * s->columns[c].scale;
+    }
+}
+
+// Pick the interface the same way throughput_monitor.py does: use the
+// requested one if present, otherwise the first eth*/en* device.
+static int resolve_interface(struct sampler *s, const char *requested) {
+    char path[256];
+    struct dirent *de;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), SYSFS_NET "/%s", requested);
+    if (access(path, F_OK) == 0) {
+        snprintf(s->interface, sizeof(s->interface), "%s", requested);
+        return 0;
+    }
+
+    dir = opendir(SYSFS_NET);
+    if (!dir) {
+        fprintf(stderr, "Failed to open %s: %s\n", SYSFS_NET, strerror(errno));
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if ((strncmp(de->d_name, "eth", 3) == 0 || strncmp(de->d_name, "en", 2) == 0) &&
+            snprintf(s->interface, sizeof(s->interface), "%s", de->d_name) < (int)sizeof(s->interface)) {
+            closedir(dir);
+            return 0;
+        }
+    }
+    closedir(dir);
+
+    fprintf(stderr, "Interface %s not found\n", requested);
+    return -1;
+}
+
+// Open path and append it as a column. Returns the column index, or -1 if
+// the file is missing or unreadable (some hw_counters are write-only).
+static int add_column(struct sampler *s, const char *path, const char *prefix,
+                      const char *name, int scale, int hot) {
+    uint32_t c = s->num_columns;
+    uint64_t v;
+    int fd;
+
+    if (c >= MAX_COLUMNS) {
+        return -1;
+    }
+    if (snprintf(s->names[c], COLUMN_NAME_LEN, "%s%s%s", prefix, *prefix ? ":" : "", name) >=
+        COLUMN_NAME_LEN) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (read_counter(fd, &v)) {
+        close(fd);
+        return -1;
+    }
+
+    s->columns[c].fd = fd;
+    s->columns[c].scale = scale;
+    s->columns[c].hot = hot;
+    s->values[c] = v * scale;
+    s->name_ptrs[c] = s->names[c];
+    s->num_columns++;
+    return (int)c;
+}
+
+static int open_net_counters(struct sampler *s) {
+    char path[256];
+
+    for (int i = 0; i < SAMPLE_LOG_NET_COLUMNS; i++) {
+        snprintf(path, sizeof(path), SYSFS_NET "/%s/statistics/%s",
+                 s->interface, sample_log_net_columns[i]);
+        if (add_column(s, path, "", sample_log_net_columns[i], 1, 1) != i) {
+            fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int is_traffic_file(const char *file) {
+    for (size_t i = 0; i < PORT_TRAFFIC_COLUMNS; i++) {
+        for (int alt = 0; alt < 2 && port_traffic[i].files[alt]; alt++) {
+            if (strcmp(port_traffic[i].files[alt], file) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void open_cold_counters(struct sampler *s, const char *port_path,
+                               const char *port_name, const char *sub) {
+    char dir_path[512], path[800], file[COLUMN_NAME_LEN];
+    struct dirent *de;
+    DIR *dir;
+
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", port_path, sub);
+    dir = opendir(dir_path);
+    if (!dir) {
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' || strcmp(de->d_name, "lifespan") == 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir_path, de->d_name) >= (int)sizeof(path) ||
+            snprintf(file, sizeof(file), "%s/%s", sub, de->d_name) >= (int)sizeof(file) ||
+            is_traffic_file(file)) {
+            continue;
+        }
+        add_column(s, path, port_name, file, 1, 0);
+    }
+    closedir(dir);
+}
+
+// Discover every RDMA device/port and pre-open its counter files. Missing
+// RDMA devices are not an error; the sampler then reports netdev stats only.
+// The columns of one port are added contiguously, as sample_log.h requires.
+static void open_rdma_counters(struct sampler *s) {
+    char ports_path[512], port_path[800], port_name[COLUMN_NAME_LEN / 2];
+    struct dirent *dev, *port;
+    DIR *devs, *ports;
+
+    devs = opendir(SYSFS_IB);
+    if (!devs) {
+        return;
+    }
+    while ((dev = readdir(devs)) != NULL) {
+        if (dev->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(ports_path, sizeof(ports_path), SYSFS_IB "/%s/ports", dev->d_name);
+        ports = opendir(ports_path);
+        if (!ports) {
+            continue;
+        }
+        while ((port = readdir(ports)) != NULL) {
+            if (port->d_name[0] == '.' ||
+                snprintf(port_name, sizeof(port_name), "%s/%s", dev->d_name, port->d_name) >=
+                    (int)sizeof(port_name)) {
+                continue;
+            }
+            snprintf(port_path, sizeof(port_path), "%s/%s", ports_path, port->d_name);
+
+            for (size_t i = 0; i < PORT_TRAFFIC_COLUMNS; i++) {
+                for (int alt = 0; alt < 2 && port_traffic[i].files[alt]; alt++) {
+                    char path[900];
+                    snprintf(path, sizeof(path), "%s/%s", port_path, port_traffic[i].files[alt]);
+                    if (add_column(s, path, port_name, port_traffic[i].column,
+                                   port_traffic[i].scale, 1) >= 0) {
+                        break;
+                    }
+                }
+            }
+            open_cold_counters(s, port_path, port_name, "counters");
+            open_cold_counters(s, port_path, port_name, "hw_counters");
+            s->num_ports++;
+        }
+        closedir(ports);
+    }
+    closedir(devs);
+}
+
+static int sample_loop(struct sampler *s) {
+    struct throughput_summary summary;
+    struct timespec next, now_ts;
+    int64_t period_ns = 1000000000LL / s->rate_hz;
+    int64_t start_ns, prev_ns, last_cold_ns, last_print_ns = 0, last_flush_ns;
+    int64_t start_time_ns, end_time_ns;
+    double cpu_start;
+
+    memset(&summary, 0, sizeof(summary));
+    memcpy(s->prev_values, s->values, s->num_columns * sizeof(uint64_t));
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    start_ns = prev_ns = last_cold_ns = last_flush_ns = timespec_ns(&next);
+    start_time_ns = wall_time_ns();
+    cpu_start = cpu_seconds();
+
+    if (s->log) {
+        if (sample_log_create(s->log, s->output, s->interface, start_time_ns, s->duration,
+                              s->rate_hz, s->num_columns, s->name_ptrs)) {
+            return -1;
+        }
+        // The baseline reading is stored as the first sample so that rates
+        // can be derived for every later one
+        sample_log_append(s->log, start_time_ns, s->values);
+    } else {
+        throughput_json_begin(s->out, s->interface, s->duration, start_time_ns / 1e9, s->rate_hz);
+    }
+
+    while (running) {
+        int64_t now_ns, elapsed_ns, ts_ns;
+        int cold;
+
+        // Absolute deadlines keep the rate exact regardless of sample cost
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now_ts);
+        now_ns = timespec_ns(&now_ts);
+        elapsed_ns = now_ns - start_ns;
+        if (elapsed_ns >= (int64_t)(s->duration * 1e9)) {
+            break;
+        }
+
+        cold = now_ns - last_cold_ns >= COLD_INTERVAL_NS;
+        for (uint32_t c = 0; c < s->num_columns; c++) {
+            if (cold || s->columns[c].hot) {
+                read_column(s, c);
+            }
+        }
+        if (cold) {
+            last_cold_ns = now_ns;
+        }
+
+        ts_ns = start_time_ns + elapsed_ns;
+        if (s->log) {
+            if (sample_log_append(s->log, ts_ns, s->values)) {
+                fprintf(stderr, "Failed to append sample\n");
+                return -1;
+            }
+            if (now_ns - last_flush_ns >= FLUSH_INTERVAL_NS) {
+                sample_log_flush(s->log);
+                last_flush_ns = now_ns;
+            }
+        } else {
+            throughput_json_sample(s->out, s->num_samples, ts_ns / 1e9, elapsed_ns / 1e9,
+                                   (now_ns - prev_ns) / 1e9, s->num_columns, s->name_ptrs,
+                                   s->values, s->prev_values, cold, &summary);
+        }
+        s->num_samples++;
+
+        if (!s->quiet && now_ns - last_print_ns >= PRINT_INTERVAL_NS) {
+            double dt = (now_ns - prev_ns) / 1e9;
+            double tx = (s->values[SAMPLE_LOG_TX_BYTES] - s->prev_values[SAMPLE_LOG_TX_BYTES]) * 8.0 / (dt * 1e6);
+            double rx = (s->values[SAMPLE_LOG_RX_BYTES] - s->prev_values[SAMPLE_LOG_RX_BYTES]) * 8.0 / (dt * 1e6);
+            printf("\r[%6.1fs] TX: %6.2f Mbps | RX: %6.2f Mbps | Total: %6.2f Mbps",
+                   elapsed_ns / 1e9, tx, rx, tx + rx);
+            fflush(stdout);
+            last_print_ns = now_ns;
+        }
+
+        memcpy(s->prev_values, s->values, s->num_columns * sizeof(uint64_t));
+        prev_ns = now_ns;
+    }
+
+    end_time_ns = wall_time_ns();
+    if (s->log) {
+        if (sample_log_close(s->log)) {
+            return -1;
+        }
+    } else {
+        throughput_json_end(s->out, s->num_samples, end_time_ns / 1e9, &summary);
+    }
+
+    double cpu = cpu_seconds() - cpu_start;
+    double wall = (end_time_ns - start_time_ns) / 1e9;
+
+    printf("\nSampling completed after %.1f seconds\n", wall);
+    printf("Samples: %lu (%.0f Hz), RDMA ports: %d, columns: %u\n",
+           s->num_samples, wall > 0 ? s->num_samples / wall : 0.0,
+           s->num_ports, s->num_columns);
+    printf("Sampler CPU: %.3f s (%.2f%% of one core)\n", cpu, wall > 0 ? 100.0 * cpu / wall : 0.0);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  -i, --interface IFACE  Network interface to monitor (default: eth0)\n");
+    printf("  -d, --duration SEC     Sampling duration in seconds (default: 60)\n");
+    printf("  -r, --rate HZ          Sample rate, 1-%d Hz (default: %d)\n", MAX_RATE_HZ, DEFAULT_RATE_HZ);
+    printf("  -o, --output FILE      Output file (default: throughput_data.json);\n");
+    printf("                         a .rsl extension selects the binary sample log\n");
+    printf("  -q, --quiet            Do not print live rates\n");
+}
+
+static int has_suffix(const char *s, const char *suffix) {
+    size_t len = strlen(s), slen = strlen(suffix);
+    return len >= slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    static struct sampler s;
+    static struct sample_log_writer log;
+    static const struct option long_opts[] = {
+        { "interface", required_argument, NULL, 'i' },
+        { "duration", required_argument, NULL, 'd' },
+        { "rate", required_argument, NULL, 'r' },
+        { "output", required_argument, NULL, 'o' },
+        { "quiet", no_argument, NULL, 'q' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *interface = "eth0";
+    struct sigaction sa;
+    int opt, ret;
+
+    s.duration = 60;
+    s.rate_hz = DEFAULT_RATE_HZ;
+    s.output = "throughput_data.json";
+
+    while ((opt = getopt_long(argc, argv, "i:d:r:o:qh", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'i': interface = optarg; break;
+        case 'd': s.duration = atof(optarg); break;
+        case 'r': s.rate_hz = atoi(optarg); break;
+        case 'o': s.output = optarg; break;
+        case 'q': s.quiet = 1; break;
+        case 'h': usage(argv[0]); return 0;
+        default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (s.rate_hz < 1 || s.rate_hz > MAX_RATE_HZ) {
+        fprintf(stderr, "Sample rate must be between 1 and %d Hz\n", MAX_RATE_HZ);
+        return 1;
+    }
+
+    // No SA_RESTART so clock_nanosleep wakes up on Ctrl+C
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (resolve_interface(&s, interface) || open_net_counters(&s)) {
+        return 1;
+    }
+    open_rdma_counters(&s);
+
+    if (has_suffix(s.output, ".rsl")) {
+        s.log = &log;
+    } else {
+        s.out = fopen(s.output, "w");
+        if (!s.out) {
+            fprintf(stderr, "Failed to open %s: %s\n", s.output, strerror(errno));
+            return 1;
+        }
+    }
+
+    if (!s.quiet) {
+        printf("Starting throughput sampling on interface %s\n", s.interface);
+        printf("Duration: %g seconds, rate: %d Hz, RDMA ports: %d\n",
+               s.duration, s.rate_hz, s.num_ports);
+        printf("Press Ctrl+C to stop early\n");
+    }
+
+    ret = sample_loop(&s);
+
+    if (s.out) {
+        fclose(s.out);
+    }
+    for (uint32_t c = 0; c < s.num_columns; c++) {
+        close(s.columns[c].fd);
+    }
+
+    if (ret == 0) {
+        printf("Results saved to: %s\n", s.output);
+    }
+    return ret ? 1 : 0;
+}
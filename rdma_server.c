@@ -8,29 +8,27 @@
 #include <arpa/inet.h>
 #include <infiniband/verbs.h>
 #include <rdma/rdma_cma.h>
-#include <rdma/rdma_verbs.h>
 #include <time.h>
 #include <signal.h>
+#include <getopt.h>
+
+#include "rdma_common.h"
+#include "rdma_connection.h"
+#include "rdma_metrics.h"
+#include "rdma_trace.h"
+#include "rdma_file.h"
+#include "rdma_rpc.h"
+#include "rdma_kv.h"
+#include "rdma_stripe.h"
+#include "rdma_tune.h"
+#include "rdma_farmem.h"
 
 #define BUFFER_SIZE (1024 * 1024)  // 1MB buffer
-#define MAX_CONNECTIONS 10
 #define PORT 18515
+#define QP_DEPTH 16                // room for the file transfer pipeline
+#define CQ_DEPTH (2 * QP_DEPTH)
 
-struct rdma_context {
-    struct ibv_context *context;
-    struct ibv_pd *pd;
-    struct ibv_cq *cq;
-    struct ibv_qp *qp;
-    struct ibv_mr *mr;
-    char *buffer;
-    struct rdma_cm_id *cm_id;
-    struct ibv_comp_channel *comp_channel;
-    int connected;
-    uint64_t bytes_transferred;
-    struct timespec start_time, end_time;
-};
-
-static struct rdma_context *g_ctx = NULL;
+static struct rdma_conn_metrics *conn_metrics = NULL;
 static volatile int running = 1;
 
 void signal_handler(int sig) {
@@ -38,219 +36,36 @@ void signal_handler(int sig) {
     running = 0;
 }
 
-int setup_rdma_resources(struct rdma_context *ctx) {
-    struct ibv_device **dev_list;
-    int num_devices;
-    struct ibv_device *device;
-    struct ibv_qp_init_attr qp_init_attr;
-    struct ibv_port_attr port_attr;
-    
-    // Get device list
-    dev_list = ibv_get_device_list(&num_devices);
-    if (!dev_list) {
-        fprintf(stderr, "Failed to get IB device list\n");
-        return -1;
-    }
-    
-    if (num_devices == 0) {
-        fprintf(stderr, "No IB devices found\n");
-        return -1;
-    }
-    
-    // Use first available device
-    device = dev_list[0];
-    printf("Using device: %s\n", ibv_get_device_name(device));
-    
-    // Open device context
-    ctx->context = ibv_open_device(device);
-    if (!ctx->context) {
-        fprintf(stderr, "Failed to open device context\n");
-        return -1;
-    }
-    
-    // Allocate protection domain
-    ctx->pd = ibv_alloc_pd(ctx->context);
-    if (!ctx->pd) {
-        fprintf(stderr, "Failed to allocate protection domain\n");
-        return -1;
-    }
-    
-    // Query port attributes
-    if (ibv_query_port(ctx->context, 1, &port_attr)) {
-        fprintf(stderr, "Failed to query port attributes\n");
-        return -1;
-    }
-    
-    printf("Port state: %s\n", ibv_port_state_str(port_attr.state));
-    if (port_attr.state != IBV_PORT_ACTIVE) {
-        fprintf(stderr, "Port is not active\n");
+// Accept one client, on local's device when given, and label its metrics
+// with the peer address. RPC mode needs room for a request and a response
+// per slot, KV mode for the table too
+int setup_rdma_connection(struct rdma_context *ctx, int rpc, int kv, const struct sockaddr *local) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = kv ? KV_BUFFER_SIZE : BUFFER_SIZE,
+        .cq_depth = rpc ? RPC_CQ_DEPTH : CQ_DEPTH,
+        .qp_depth = rpc ? RPC_QP_DEPTH : QP_DEPTH,
+        .src_addr = local,
+    };
+    char peer[INET6_ADDRSTRLEN + 8] = "unknown";
+    struct sockaddr *peer_addr;
+    
+    if (accept_rdma_connection(ctx, PORT, &attr)) {
         return -1;
     }
     
-    // Create completion queue
-    ctx->cq = ibv_create_cq(ctx->context, 10, NULL, NULL, 0);
-    if (!ctx->cq) {
-        fprintf(stderr, "Failed to create completion queue\n");
-        return -1;
+    peer_addr = rdma_get_peer_addr(ctx->cm_id);
+    if (peer_addr && peer_addr->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)peer_addr;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+        snprintf(peer, sizeof(peer), "%s:%d", ip, ntohs(sin->sin_port));
     }
-    
-    // Allocate and register memory
-    ctx->buffer = malloc(BUFFER_SIZE);
-    if (!ctx->buffer) {
-        fprintf(stderr, "Failed to allocate buffer\n");
+    conn_metrics = rdma_metrics_conn_register(peer, attr.cq_depth);
+    if (!conn_metrics) {
+        fprintf(stderr, "Failed to register connection metrics\n");
         return -1;
     }
-    
-    memset(ctx->buffer, 0, BUFFER_SIZE);
-    
-    ctx->mr = ibv_reg_mr(ctx->pd, ctx->buffer, BUFFER_SIZE, 
-                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | 
-                        IBV_ACCESS_REMOTE_READ);
-    if (!ctx->mr) {
-        fprintf(stderr, "Failed to register memory region\n");
-        return -1;
-    }
-    
-    // Create queue pair
-    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-    qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.send_cq = ctx->cq;
-    qp_init_attr.recv_cq = ctx->cq;
-    qp_init_attr.cap.max_send_wr = 10;
-    qp_init_attr.cap.max_recv_wr = 10;
-    qp_init_attr.cap.max_send_sge = 1;
-    qp_init_attr.cap.max_recv_sge = 1;
-    
-    ctx->qp = ibv_create_qp(ctx->pd, &qp_init_attr);
-    if (!ctx->qp) {
-        fprintf(stderr, "Failed to create queue pair\n");
-        return -1;
-    }
-    
-    ibv_free_device_list(dev_list);
-    return 0;
-}
-
-int setup_rdma_connection(struct rdma_context *ctx) {
-    struct rdma_cm_id *cm_id;
-    struct rdma_addrinfo hints, *res;
-    struct ibv_qp_attr qp_attr;
-    int flags;
-    int ret;
-    
-    // Initialize RDMA CM
-    ret = rdma_create_id(NULL, &cm_id, NULL, RDMA_PS_TCP);
-    if (ret) {
-        fprintf(stderr, "Failed to create RDMA CM ID\n");
-        return -1;
-    }
-    
-    // Set up address info
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_flags = RAI_PASSIVE;
-    hints.ai_port_space = RDMA_PS_TCP;
-    
-    char port_str[16];
-    snprintf(port_str, sizeof(port_str), "%d", PORT);
-    
-    ret = rdma_getaddrinfo(NULL, port_str, &hints, &res);
-    if (ret) {
-        fprintf(stderr, "Failed to get address info\n");
-        return -1;
-    }
-    
-    // Bind to address
-    ret = rdma_bind_addr(cm_id, res->ai_src_addr);
-    if (ret) {
-        fprintf(stderr, "Failed to bind address\n");
-        return -1;
-    }
-    
-    // Listen for connections
-    ret = rdma_listen(cm_id, MAX_CONNECTIONS);
-    if (ret) {
-        fprintf(stderr, "Failed to listen for connections\n");
-        return -1;
-    }
-    
-    printf("RDMA server listening on port %d\n", PORT);
-    
-    // Accept connection
-    struct rdma_cm_id *new_cm_id;
-    ret = rdma_get_cm_event(cm_id->channel, &new_cm_id, &ctx->cm_id);
-    if (ret) {
-        fprintf(stderr, "Failed to get CM event\n");
-        return -1;
-    }
-    
-    if (ctx->cm_id->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
-        fprintf(stderr, "Unexpected CM event: %d\n", ctx->cm_id->event);
-        return -1;
-    }
-    
-    // Accept the connection
-    ret = rdma_accept(ctx->cm_id, NULL);
-    if (ret) {
-        fprintf(stderr, "Failed to accept connection\n");
-        return -1;
-    }
-    
-    // Wait for connection established
-    ret = rdma_get_cm_event(cm_id->channel, &new_cm_id, &ctx->cm_id);
-    if (ret) {
-        fprintf(stderr, "Failed to get CM event\n");
-        return -1;
-    }
-    
-    if (ctx->cm_id->event != RDMA_CM_EVENT_ESTABLISHED) {
-        fprintf(stderr, "Connection not established: %d\n", ctx->cm_id->event);
-        return -1;
-    }
-    
-    // Transition QP to RTR
-    memset(&qp_attr, 0, sizeof(qp_attr));
-    qp_attr.qp_state = IBV_QPS_RTR;
-    qp_attr.path_mtu = IBV_MTU_1024;
-    qp_attr.dest_qp_num = ctx->qp->qp_num;
-    qp_attr.rq_psn = 0;
-    qp_attr.max_dest_rd_atomic = 1;
-    qp_attr.min_rnr_timer = 12;
-    qp_attr.ah_attr.is_global = 0;
-    qp_attr.ah_attr.dlid = ctx->cm_id->route.addr.addr.ibaddr.dlid;
-    qp_attr.ah_attr.sl = 0;
-    qp_attr.ah_attr.src_path_bits = 0;
-    qp_attr.ah_attr.port_num = 1;
-    
-    flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
-            IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
-    
-    ret = ibv_modify_qp(ctx->qp, &qp_attr, flags);
-    if (ret) {
-        fprintf(stderr, "Failed to modify QP to RTR\n");
-        return -1;
-    }
-    
-    // Transition QP to RTS
-    qp_attr.qp_state = IBV_QPS_RTS;
-    qp_attr.timeout = 14;
-    qp_attr.retry_cnt = 7;
-    qp_attr.rnr_retry = 7;
-    qp_attr.sq_psn = 0;
-    qp_attr.max_rd_atomic = 1;
-    
-    flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
-            IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
-    
-    ret = ibv_modify_qp(ctx->qp, &qp_attr, flags);
-    if (ret) {
-        fprintf(stderr, "Failed to modify QP to RTS\n");
-        return -1;
-    }
-    
-    ctx->connected = 1;
-    printf("RDMA connection established\n");
-    
-    rdma_freeaddrinfo(res);
+    rdma_metrics_mr_registered(ctx->buffer_size);
     return 0;
 }
 
@@ -258,9 +73,14 @@ void perform_rdma_operations(struct rdma_context *ctx) {
     struct ibv_sge sge;
     struct ibv_send_wr send_wr, *bad_wr;
     struct ibv_wc wc;
+    struct timespec post_time, done_time;
+    uint64_t poll_start, polled_at;
+    uint32_t empty_polls;
     int ret;
     int iterations = 1000;
     int i;
+    // Write our buffer into the peer's, as much of it as fits
+    uint32_t length = ctx->buffer_size < ctx->remote_length ? ctx->buffer_size : ctx->remote_length;
     
     printf("Starting RDMA operations...\n");
     clock_gettime(CLOCK_MONOTONIC, &ctx->start_time);
@@ -269,40 +89,56 @@ void perform_rdma_operations(struct rdma_context *ctx) {
         // Prepare send work request
         memset(&sge, 0, sizeof(sge));
         sge.addr = (uintptr_t)ctx->buffer;
-        sge.length = BUFFER_SIZE;
+        sge.length = length;
         sge.lkey = ctx->mr->lkey;
         
         memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.wr_id = i;
         send_wr.sg_list = &sge;
         send_wr.num_sge = 1;
         send_wr.opcode = IBV_WR_RDMA_WRITE;
         send_wr.send_flags = IBV_SEND_SIGNALED;
-        send_wr.wr.rdma.remote_addr = (uintptr_t)ctx->buffer;
-        send_wr.wr.rdma.rkey = ctx->mr->rkey;
+        send_wr.wr.rdma.remote_addr = ctx->remote_addr;
+        send_wr.wr.rdma.rkey = ctx->remote_rkey;
         
         // Post send
+        clock_gettime(CLOCK_MONOTONIC, &post_time);
+        rdma_trace_post(send_wr.wr_id, send_wr.opcode, length);
         ret = ibv_post_send(ctx->qp, &send_wr, &bad_wr);
         if (ret) {
             fprintf(stderr, "Failed to post send: %d\n", ret);
             break;
         }
+        rdma_metrics_wr_posted(conn_metrics, send_wr.opcode);
         
         // Wait for completion
-        do {
-            ret = ibv_poll_cq(ctx->cq, 1, &wc);
-        } while (ret == 0 && running);
+        poll_start = rdma_trace_poll_begin();
+        empty_polls = 0;
+        while ((ret = ibv_poll_cq(ctx->cq, 1, &wc)) == 0 && running) {
+            empty_polls++;
+        }
+        polled_at = rdma_trace_poll_end(poll_start, ret, empty_polls);
         
         if (ret < 0) {
             fprintf(stderr, "Failed to poll CQ\n");
             break;
         }
+        if (ret == 0) {
+            break;  // interrupted while waiting
+        }
+        rdma_trace_completion(&wc, polled_at);
+        
+        clock_gettime(CLOCK_MONOTONIC, &done_time);
+        rdma_metrics_completion(conn_metrics, wc.status, length,
+                                (done_time.tv_sec - post_time.tv_sec) * 1000000000ULL +
+                                done_time.tv_nsec - post_time.tv_nsec);
         
         if (wc.status != IBV_WC_SUCCESS) {
             fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc.status));
             break;
         }
         
-        ctx->bytes_transferred += BUFFER_SIZE;
+        ctx->bytes_transferred += length;
         
         if (i % 100 == 0) {
             printf("Completed %d operations, %lu bytes transferred\n", 
@@ -311,76 +147,238 @@ void perform_rdma_operations(struct rdma_context *ctx) {
     }
     
     clock_gettime(CLOCK_MONOTONIC, &ctx->end_time);
-    
-    // Calculate throughput
-    double elapsed = (ctx->end_time.tv_sec - ctx->start_time.tv_sec) + 
-                     (ctx->end_time.tv_nsec - ctx->start_time.tv_nsec) / 1e9;
-    double throughput_mbps = (ctx->bytes_transferred * 8.0) / (elapsed * 1e6);
-    
-    printf("\n=== RDMA Performance Results ===\n");
-    printf("Operations completed: %d\n", i);
-    printf("Total bytes transferred: %lu\n", ctx->bytes_transferred);
-    printf("Elapsed time: %.3f seconds\n", elapsed);
-    printf("Throughput: %.2f Mbps\n", throughput_mbps);
-    printf("Throughput: %.2f MB/s\n", ctx->bytes_transferred / (elapsed * 1e6));
+    report_rdma_results(ctx, i);
 }
 
-void cleanup_rdma_resources(struct rdma_context *ctx) {
-    if (ctx->qp) {
-        ibv_destroy_qp(ctx->qp);
+static int rpc_echo(void *arg, const void *req, uint32_t req_len, void *resp, uint32_t resp_max) {
+    (void)arg;
+    if (req_len > resp_max) {
+        return -1;
     }
-    if (ctx->mr) {
-        ibv_dereg_mr(ctx->mr);
+    memcpy(resp, req, req_len);
+    return req_len;
+}
+
+static int rpc_compute(void *arg, const void *req, uint32_t req_len, void *resp, uint32_t resp_max) {
+    const uint8_t *p = req;
+    uint64_t out[2] = {0xcbf29ce484222325ULL, 0};
+
+    (void)arg;
+    if (resp_max < sizeof(out)) {
+        return -1;
     }
-    if (ctx->cq) {
-        ibv_destroy_cq(ctx->cq);
+    for (uint32_t i = 0; i < req_len; i++) {
+        out[0] = (out[0] ^ p[i]) * 0x100000001b3ULL;
+        out[1] += p[i];
     }
-    if (ctx->pd) {
-        ibv_dealloc_pd(ctx->pd);
+    memcpy(resp, out, sizeof(out));
+    return sizeof(out);
+}
+
+// Serve the demo RPC methods, and the KV store's PUTs, until the client
+// says goodbye. KV GETs are RDMA READs of the table and never show up here
+int serve_rpc(struct rdma_context *ctx, int kv) {
+    struct rpc_server *srv = rpc_server_create(ctx);
+    struct kv_table *table = NULL;
+    int ret;
+
+    if (!srv) {
+        return -1;
     }
-    if (ctx->context) {
-        ibv_close_device(ctx->context);
+    rpc_server_register(srv, RPC_METHOD_ECHO, rpc_echo, NULL);
+    rpc_server_register(srv, RPC_METHOD_COMPUTE, rpc_compute, NULL);
+    if (kv) {
+        table = kv_table_create(ctx, srv);
+        if (!table) {
+            rpc_server_destroy(srv);
+            return -1;
+        }
     }
-    if (ctx->buffer) {
-        free(ctx->buffer);
+    printf("Serving RPCs...\n");
+    ret = rpc_server_run(srv, &running);
+    kv_table_destroy(table);
+    rpc_server_destroy(srv);
+    return ret;
+}
+
+// Receive one striped transfer over lanes connections and check that every
+// chunk landed in place
+int serve_stripe(int lanes) {
+    struct rdma_stripe stripe;
+    struct rdma_stripe_stats stats;
+    int ret;
+
+    ret = rdma_stripe_accept(&stripe, lanes, PORT);
+    if (ret == 0) {
+        ret = rdma_stripe_wait(&stripe, &running, &stats);
     }
-    if (ctx->cm_id) {
-        rdma_destroy_id(ctx->cm_id);
+    if (ret == 0) {
+        ret = rdma_stripe_verify(&stripe);
+        if (ret == 0) {
+            printf("Stripe region verified\n");
+        }
+        rdma_stripe_report(&stripe, &stats);
     }
+    rdma_stripe_close(&stripe);
+    return ret;
+}
+
+void cleanup_server(struct rdma_context *ctx) {
+    if (conn_metrics) {
+        rdma_metrics_mr_deregistered(ctx->buffer_size);
+        rdma_metrics_conn_unregister(conn_metrics);
+        conn_metrics = NULL;
+    }
+    close_rdma_connection(ctx);
 }
 
 int main(int argc, char *argv[]) {
     struct rdma_context ctx = {0};
+    int metrics_port = METRICS_DEFAULT_PORT;
+    const char *trace_path = NULL;
+    const char *file_path = NULL;
+    struct file_xfer_stats file_stats;
+    struct rdma_device_sel device;
+    struct sockaddr_storage local;
+    int use_device = 0;
+    int stripe_lanes = 0;
+    int tune = 0;
+    size_t donate_mb = 0;
+    int rpc = 0;
+    int kv = 0;
+    int opt;
     int ret;
     
+    while ((opt = getopt(argc, argv, "m:t:F:RKd:S:AM:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            metrics_port = atoi(optarg);
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'F':
+            file_path = optarg;
+            break;
+        case 'R':
+            rpc = 1;
+            break;
+        case 'K':
+            rpc = kv = 1;
+            break;
+        case 'd':
+            if (rdma_parse_device_sel(optarg, &device)) {
+                return 1;
+            }
+            use_device = 1;
+            break;
+        case 'S':
+            stripe_lanes = atoi(optarg);
+            break;
+        case 'A':
+            tune = 1;
+            break;
+        case 'M':
+            donate_mb = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            printf("Usage: %s [-m metrics_port] [-t trace.json] [-d dev[:port[:gid]]]\n"
+                   "       [-F output_file | -R | -K | -S lanes | -A | -M MB]\n", argv[0]);
+            printf("  -m PORT  Serve Prometheus metrics on 127.0.0.1:PORT (default %d, 0 disables)\n",
+                   METRICS_DEFAULT_PORT);
+            printf("  -t FILE  Trace work requests to FILE (Chrome trace / Perfetto JSON)\n");
+            printf("  -F FILE  Receive a file from the client into FILE, decompressing the chunks\n");
+            printf("           it compressed (rdma_client -z)\n");
+            printf("  -R       Serve the echo and compute RPCs (rdma_client -R)\n");
+            printf("  -K       Serve the RPCs and a key-value store (rdma_client -K)\n");
+            printf("  -d DEV   Accept on device DEV, port and GID index optional (the address\n");
+            printf("           in the GID, first IPv4 one by default)\n");
+            printf("  -S N     Receive one transfer striped over N connections (rdma_client -S)\n");
+            printf("  -A       Serve auto-tuning trials (rdma_client -A/-P) until interrupted\n");
+            printf("  -M MB    Lend MB of memory to each far-memory client (farmem_bench) until\n");
+            printf("           interrupted\n");
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    
     // Set up signal handlers
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
     printf("RDMA RoCEv2 Server Starting...\n");
     
-    // Set up RDMA resources
-    ret = setup_rdma_resources(&ctx);
-    if (ret) {
-        fprintf(stderr, "Failed to set up RDMA resources\n");
-        cleanup_rdma_resources(&ctx);
+    // Metrics exporter is optional; the server runs without it
+    if (rdma_metrics_start(metrics_port)) {
+        fprintf(stderr, "Continuing without metrics endpoint\n");
+    }
+    if (trace_path && rdma_trace_start(trace_path)) {
+        fprintf(stderr, "Failed to start tracing\n");
+        rdma_metrics_stop();
         return 1;
     }
+    rdma_trace_thread_name("server data path");
+    
+    if (use_device && rdma_device_sel_addr(&device, &local)) {
+        rdma_trace_stop();
+        rdma_metrics_stop();
+        return 1;
+    }
+    
+    // A striped transfer brings its own connections, one per device
+    if (stripe_lanes) {
+        ret = serve_stripe(stripe_lanes);
+        rdma_trace_stop();
+        rdma_metrics_stop();
+        printf("RDMA server shutdown complete\n");
+        return ret ? 1 : 0;
+    }
+    
+    // Tuning trials come and go on connections of their own
+    if (tune) {
+        ret = rdma_tune_serve(use_device ? (struct sockaddr *)&local : NULL, PORT, &running);
+        rdma_trace_stop();
+        rdma_metrics_stop();
+        printf("RDMA server shutdown complete\n");
+        return ret ? 1 : 0;
+    }
+    
+    // So do far-memory clients, each with a loan of its own
+    if (donate_mb) {
+        ret = farmem_serve(use_device ? (struct sockaddr *)&local : NULL, PORT, donate_mb << 20,
+                           &running);
+        rdma_trace_stop();
+        rdma_metrics_stop();
+        printf("RDMA server shutdown complete\n");
+        return ret ? 1 : 0;
+    }
     
-    // Set up RDMA connection
-    ret = setup_rdma_connection(&ctx);
+    // Accept a client; RDMA resources are set up on the device it arrives on
+    ret = setup_rdma_connection(&ctx, rpc, kv, use_device ? (struct sockaddr *)&local : NULL);
     if (ret) {
         fprintf(stderr, "Failed to set up RDMA connection\n");
-        cleanup_rdma_resources(&ctx);
+        cleanup_server(&ctx);
+        rdma_trace_stop();
+        rdma_metrics_stop();
         return 1;
     }
     
-    // Perform RDMA operations
-    perform_rdma_operations(&ctx);
+    // Perform RDMA operations, receive a file or serve RPCs
+    if (file_path) {
+        ret = file_receive(ctx.pd, ctx.qp, ctx.cq, file_path, &running, &file_stats);
+        if (ret == 0) {
+            file_xfer_report("Received", &file_stats);
+        }
+    } else if (rpc) {
+        ret = serve_rpc(&ctx, kv);
+    } else {
+        perform_rdma_operations(&ctx);
+    }
     
     // Cleanup
-    cleanup_rdma_resources(&ctx);
+    cleanup_server(&ctx);
+    rdma_trace_stop();
+    rdma_metrics_stop();
     
     printf("RDMA server shutdown complete\n");
-    return 0;
+    return ret ? 1 : 0;
 }
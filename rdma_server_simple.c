@@ -10,21 +10,11 @@
 #include <time.h>
 #include <signal.h>
 
+#include "rdma_common.h"
+
 #define BUFFER_SIZE (1024 * 1024)  // 1MB buffer
 #define PORT 18515
 
-struct rdma_context {
-    struct ibv_context *context;
-    struct ibv_pd *pd;
-    struct ibv_cq *cq;
-    struct ibv_qp *qp;
-    struct ibv_mr *mr;
-    char *buffer;
-    int connected;
-    uint64_t bytes_transferred;
-    struct timespec start_time, end_time;
-};
-
 static volatile int running = 1;
 
 void signal_handler(int sig) {
@@ -32,99 +22,6 @@ void signal_handler(int sig) {
     running = 0;
 }
 
-int setup_rdma_resources(struct rdma_context *ctx) {
-    struct ibv_device **dev_list;
-    int num_devices;
-    struct ibv_device *device;
-    struct ibv_qp_init_attr qp_init_attr;
-    struct ibv_port_attr port_attr;
-    
-    // Get device list
-    dev_list = ibv_get_device_list(&num_devices);
-    if (!dev_list) {
-        fprintf(stderr, "Failed to get IB device list\n");
-        return -1;
-    }
-    
-    if (num_devices == 0) {
-        fprintf(stderr, "No IB devices found\n");
-        return -1;
-    }
-    
-    // Use first available device
-    device = dev_list[0];
-    printf("Using device: %s\n", ibv_get_device_name(device));
-    
-    // Open device context
-    ctx->context = ibv_open_device(device);
-    if (!ctx->context) {
-        fprintf(stderr, "Failed to open device context\n");
-        return -1;
-    }
-    
-    // Allocate protection domain
-    ctx->pd = ibv_alloc_pd(ctx->context);
-    if (!ctx->pd) {
-        fprintf(stderr, "Failed to allocate protection domain\n");
-        return -1;
-    }
-    
-    // Query port attributes
-    if (ibv_query_port(ctx->context, 1, &port_attr)) {
-        fprintf(stderr, "Failed to query port attributes\n");
-        return -1;
-    }
-    
-    printf("Port state: %s\n", ibv_port_state_str(port_attr.state));
-    if (port_attr.state != IBV_PORT_ACTIVE) {
-        fprintf(stderr, "Port is not active\n");
-        return -1;
-    }
-    
-    // Create completion queue
-    ctx->cq = ibv_create_cq(ctx->context, 10, NULL, NULL, 0);
-    if (!ctx->cq) {
-        fprintf(stderr, "Failed to create completion queue\n");
-        return -1;
-    }
-    
-    // Allocate and register memory
-    ctx->buffer = malloc(BUFFER_SIZE);
-    if (!ctx->buffer) {
-        fprintf(stderr, "Failed to allocate buffer\n");
-        return -1;
-    }
-    
-    memset(ctx->buffer, 0, BUFFER_SIZE);
-    
-    ctx->mr = ibv_reg_mr(ctx->pd, ctx->buffer, BUFFER_SIZE, 
-                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | 
-                        IBV_ACCESS_REMOTE_READ);
-    if (!ctx->mr) {
-        fprintf(stderr, "Failed to register memory region\n");
-        return -1;
-    }
-    
-    // Create queue pair
-    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-    qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.send_cq = ctx->cq;
-    qp_init_attr.recv_cq = ctx->cq;
-    qp_init_attr.cap.max_send_wr = 10;
-    qp_init_attr.cap.max_recv_wr = 10;
-    qp_init_attr.cap.max_send_sge = 1;
-    qp_init_attr.cap.max_recv_sge = 1;
-    
-    ctx->qp = ibv_create_qp(ctx->pd, &qp_init_attr);
-    if (!ctx->qp) {
-        fprintf(stderr, "Failed to create queue pair\n");
-        return -1;
-    }
-    
-    ibv_free_device_list(dev_list);
-    return 0;
-}
-
 void perform_rdma_operations(struct rdma_context *ctx) {
     struct ibv_sge sge;
     struct ibv_send_wr send_wr, *bad_wr;
@@ -182,43 +79,16 @@ void perform_rdma_operations(struct rdma_context *ctx) {
     }
     
     clock_gettime(CLOCK_MONOTONIC, &ctx->end_time);
-    
-    // Calculate throughput
-    double elapsed = (ctx->end_time.tv_sec - ctx->start_time.tv_sec) + 
-                     (ctx->end_time.tv_nsec - ctx->start_time.tv_nsec) / 1e9;
-    double throughput_mbps = (ctx->bytes_transferred * 8.0) / (elapsed * 1e6);
-    
-    printf("\n=== RDMA Performance Results ===\n");
-    printf("Operations completed: %d\n", i);
-    printf("Total bytes transferred: %lu\n", ctx->bytes_transferred);
-    printf("Elapsed time: %.3f seconds\n", elapsed);
-    printf("Throughput: %.2f Mbps\n", throughput_mbps);
-    printf("Throughput: %.2f MB/s\n", ctx->bytes_transferred / (elapsed * 1e6));
-}
-
-void cleanup_rdma_resources(struct rdma_context *ctx) {
-    if (ctx->qp) {
-        ibv_destroy_qp(ctx->qp);
-    }
-    if (ctx->mr) {
-        ibv_dereg_mr(ctx->mr);
-    }
-    if (ctx->cq) {
-        ibv_destroy_cq(ctx->cq);
-    }
-    if (ctx->pd) {
-        ibv_dealloc_pd(ctx->pd);
-    }
-    if (ctx->context) {
-        ibv_close_device(ctx->context);
-    }
-    if (ctx->buffer) {
-        free(ctx->buffer);
-    }
+    report_rdma_results(ctx, i);
 }
 
 int main(int argc, char *argv[]) {
     struct rdma_context ctx = {0};
+    struct rdma_resource_attr attr = {
+        .buffer_size = BUFFER_SIZE,
+        .cq_depth = 10,
+        .qp_depth = 10,
+    };
     int ret;
     
     // Set up signal handlers
@@ -229,7 +99,10 @@ int main(int argc, char *argv[]) {
     printf("Note: This is a simplified demo version\n");
     
     // Set up RDMA resources
-    ret = setup_rdma_resources(&ctx);
+    ret = setup_rdma_resources(&ctx, &attr);
+    if (ret == 0) {
+        ret = create_rdma_qp(&ctx, &attr);
+    }
     if (ret) {
         fprintf(stderr, "Failed to set up RDMA resources\n");
         cleanup_rdma_resources(&ctx);
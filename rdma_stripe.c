@@ -0,0 +1,358 @@
+/*
+ * One transfer striped across several RDMA devices. See rdma_stripe.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_stripe.h"
+#include "rdma_connection.h"
+
+// 251 is prime, so a chunk written at the wrong offset never matches
+static uint8_t pattern_byte(size_t i) {
+    return i % 251;
+}
+
+static int stripe_alloc(struct rdma_stripe *s, size_t size) {
+    s->buffer = malloc(size);
+    if (!s->buffer) {
+        fprintf(stderr, "Failed to allocate %zu byte stripe region\n", size);
+        return -1;
+    }
+    s->size = size;
+    return 0;
+}
+
+static void stripe_attr(const struct rdma_stripe *s, struct rdma_resource_attr *attr) {
+    memset(attr, 0, sizeof(*attr));
+    attr->buffer = s->buffer;
+    attr->buffer_size = s->size;
+    attr->cq_depth = STRIPE_CQ_DEPTH;
+    attr->qp_depth = STRIPE_QP_DEPTH;
+}
+
+static void name_lane(struct rdma_stripe *s, int lane) {
+    snprintf(s->devices[lane], sizeof(s->devices[lane]), "%s",
+             ibv_get_device_name(s->lanes[lane].context->device));
+}
+
+int rdma_stripe_connect(struct rdma_stripe *s, const struct rdma_device_sel *sels, int n,
+                        const char *const *servers, int nservers, int port) {
+    struct rdma_resource_attr attr;
+    struct sockaddr_storage src;
+
+    memset(s, 0, sizeof(*s));
+    if (n < 1 || n > STRIPE_MAX_LANES || nservers < 1) {
+        fprintf(stderr, "Striping takes 1 to %d devices\n", STRIPE_MAX_LANES);
+        return -1;
+    }
+    if (stripe_alloc(s, STRIPE_REGION_SIZE)) {
+        return -1;
+    }
+    for (size_t i = 0; i < s->size; i++) {
+        s->buffer[i] = pattern_byte(i);
+    }
+
+    stripe_attr(s, &attr);
+    attr.src_addr = (struct sockaddr *)&src;
+    for (int i = 0; i < n; i++) {
+        if (rdma_device_sel_addr(&sels[i], &src)) {
+            return -1;
+        }
+        s->nlanes++;
+        if (connect_to_server(&s->lanes[i], servers[i % nservers], port, &attr)) {
+            return -1;
+        }
+        if (s->lanes[i].remote_length < s->size) {
+            fprintf(stderr, "Server region of %lu bytes is smaller than %zu\n",
+                    s->lanes[i].remote_length, s->size);
+            return -1;
+        }
+        name_lane(s, i);
+        if (strcmp(s->devices[i], sels[i].name)) {
+            fprintf(stderr, "Lane %d asked for %s but was routed over %s\n", i, sels[i].name,
+                    s->devices[i]);
+        }
+    }
+    return 0;
+}
+
+// Zero-length receive for a lane's final WRITE_WITH_IMM
+static int post_done_recv(struct rdma_context *ctx) {
+    struct ibv_recv_wr wr, *bad_wr;
+
+    memset(&wr, 0, sizeof(wr));
+    if (ibv_post_recv(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post receive\n");
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_stripe_accept(struct rdma_stripe *s, int nlanes, int port) {
+    struct rdma_resource_attr attr;
+    struct rdma_cm_event *event;
+    int established = 0;
+
+    memset(s, 0, sizeof(*s));
+    if (nlanes < 1 || nlanes > STRIPE_MAX_LANES) {
+        fprintf(stderr, "Striping takes 1 to %d lanes\n", STRIPE_MAX_LANES);
+        return -1;
+    }
+    if (stripe_alloc(s, STRIPE_REGION_SIZE)) {
+        return -1;
+    }
+    memset(s->buffer, 0, s->size);
+    stripe_attr(s, &attr);
+
+    if (listen_rdma_connections(&s->listener, NULL, port)) {
+        return -1;
+    }
+    // Requests and the establishment of earlier lanes arrive interleaved
+    while (established < nlanes) {
+        enum rdma_cm_event_type type;
+        struct rdma_context *ctx;
+        int lane;
+        int ret = 0;
+
+        if (rdma_get_cm_event(s->listener.cm_channel, &event)) {
+            fprintf(stderr, "Failed to get CM event\n");
+            return -1;
+        }
+        type = event->event;
+        if (type == RDMA_CM_EVENT_CONNECT_REQUEST) {
+            if (s->nlanes == nlanes) {
+                rdma_reject(event->id, NULL, 0);
+            } else {
+                ctx = &s->lanes[s->nlanes++];
+                ret = accept_connect_request(ctx, event, &attr, NULL);
+                if (ret == 0) {
+                    ret = post_done_recv(ctx);
+                }
+            }
+            rdma_ack_cm_event(event);
+        } else if (type == RDMA_CM_EVENT_ESTABLISHED) {
+            ctx = event->id->context;
+            rdma_ack_cm_event(event);
+            ctx->connected = 1;
+            lane = ctx - s->lanes;
+            name_lane(s, lane);
+            printf("Lane %d established on %s\n", lane, s->devices[lane]);
+            established++;
+        } else {
+            fprintf(stderr, "Unexpected CM event: %s (status %d)\n",
+                    rdma_event_str(type), event->status);
+            rdma_ack_cm_event(event);
+            ret = -1;
+        }
+        if (ret) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int post_chunk(struct rdma_stripe *s, struct rdma_context *ctx, uint64_t chunk) {
+    size_t off = chunk * STRIPE_CHUNK_SIZE;
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+
+    sge.addr = (uintptr_t)(s->buffer + off);
+    sge.length = STRIPE_CHUNK_SIZE;
+    sge.lkey = ctx->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = chunk;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = ctx->remote_addr + off;
+    wr.wr.rdma.rkey = ctx->remote_rkey;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post chunk %lu\n", chunk);
+        return -1;
+    }
+    return 0;
+}
+
+static int post_done(struct rdma_context *ctx, uint32_t chunks) {
+    struct ibv_send_wr wr, *bad_wr;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.imm_data = htonl(chunks);
+    wr.wr.rdma.remote_addr = ctx->remote_addr;
+    wr.wr.rdma.rkey = ctx->remote_rkey;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post end of stripe\n");
+        return -1;
+    }
+    return 0;
+}
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int rdma_stripe_write(struct rdma_stripe *s, int passes, volatile int *running,
+                      struct rdma_stripe_stats *stats) {
+    uint64_t per_pass = s->size / STRIPE_CHUNK_SIZE;
+    uint64_t total = per_pass * passes;
+    uint64_t next = 0, done = 0;
+    int inflight[STRIPE_MAX_LANES] = {0};
+    struct ibv_wc wc[STRIPE_LANE_DEPTH];
+    struct timespec start;
+
+    memset(stats, 0, sizeof(*stats));
+    printf("Striping %lu chunks of %d KB over %d lanes\n", total, STRIPE_CHUNK_SIZE / 1024,
+           s->nlanes);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (done < total) {
+        if (!*running) {
+            return -1;
+        }
+        for (int l = 0; l < s->nlanes; l++) {
+            struct rdma_context *ctx = &s->lanes[l];
+            int n = ibv_poll_cq(ctx->cq, STRIPE_LANE_DEPTH, wc);
+
+            if (n < 0) {
+                fprintf(stderr, "Failed to poll CQ of lane %d\n", l);
+                return -1;
+            }
+            for (int i = 0; i < n; i++) {
+                if (wc[i].status != IBV_WC_SUCCESS) {
+                    fprintf(stderr, "Lane %d (%s): work completion error: %s\n", l,
+                            s->devices[l], ibv_wc_status_str(wc[i].status));
+                    return -1;
+                }
+                stats->chunks[l]++;
+                stats->bytes[l] += STRIPE_CHUNK_SIZE;
+            }
+            inflight[l] -= n;
+            done += n;
+
+            // A lane is refilled as fast as it drains: that is the balancing
+            while (inflight[l] < STRIPE_LANE_DEPTH && next < total) {
+                if (post_chunk(s, ctx, next % per_pass)) {
+                    return -1;
+                }
+                inflight[l]++;
+                next++;
+            }
+        }
+    }
+    stats->seconds = elapsed_since(&start);
+
+    for (int l = 0; l < s->nlanes; l++) {
+        if (post_done(&s->lanes[l], stats->chunks[l])) {
+            return -1;
+        }
+    }
+    for (int l = 0; l < s->nlanes; l++) {
+        int n;
+
+        while ((n = ibv_poll_cq(s->lanes[l].cq, 1, wc)) == 0 && *running) {
+        }
+        if (n <= 0 || wc[0].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Lane %d (%s) failed to report its chunks\n", l, s->devices[l]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int rdma_stripe_wait(struct rdma_stripe *s, volatile int *running, struct rdma_stripe_stats *stats) {
+    int reported = 0;
+    int done[STRIPE_MAX_LANES] = {0};
+    struct ibv_wc wc;
+
+    memset(stats, 0, sizeof(*stats));
+    while (reported < s->nlanes) {
+        if (!*running) {
+            return -1;
+        }
+        for (int l = 0; l < s->nlanes; l++) {
+            int n = done[l] ? 0 : ibv_poll_cq(s->lanes[l].cq, 1, &wc);
+
+            if (n < 0) {
+                fprintf(stderr, "Failed to poll CQ of lane %d\n", l);
+                return -1;
+            }
+            if (n == 0) {
+                continue;
+            }
+            if (wc.status != IBV_WC_SUCCESS || wc.opcode != IBV_WC_RECV_RDMA_WITH_IMM) {
+                fprintf(stderr, "Lane %d (%s): unexpected completion, status %s\n", l,
+                        s->devices[l], ibv_wc_status_str(wc.status));
+                return -1;
+            }
+            stats->chunks[l] = ntohl(wc.imm_data);
+            stats->bytes[l] = stats->chunks[l] * STRIPE_CHUNK_SIZE;
+            done[l] = 1;
+            reported++;
+        }
+    }
+    return 0;
+}
+
+int rdma_stripe_verify(const struct rdma_stripe *s) {
+    for (size_t i = 0; i < s->size; i++) {
+        if ((uint8_t)s->buffer[i] != pattern_byte(i)) {
+            fprintf(stderr, "Stripe region differs at byte %zu (chunk %zu)\n", i,
+                    i / STRIPE_CHUNK_SIZE);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void rdma_stripe_report(const struct rdma_stripe *s, const struct rdma_stripe_stats *stats) {
+    uint64_t total = 0;
+
+    for (int l = 0; l < s->nlanes; l++) {
+        total += stats->bytes[l];
+    }
+    printf("\n=== Striped Transfer Results ===\n");
+    printf("%-5s %-16s %10s %10s %7s", "lane", "device", "chunks", "MB", "share");
+    if (stats->seconds > 0) {
+        printf(" %10s", "MB/s");
+    }
+    printf("\n");
+    for (int l = 0; l < s->nlanes; l++) {
+        printf("%-5d %-16s %10lu %10.1f %6.1f%%", l, s->devices[l], stats->chunks[l],
+               stats->bytes[l] / 1e6, total ? 100.0 * stats->bytes[l] / total : 0.0);
+        if (stats->seconds > 0) {
+            printf(" %10.1f", stats->bytes[l] / (stats->seconds * 1e6));
+        }
+        printf("\n");
+    }
+    printf("%-5s %-16s %10s %10.1f %6.1f%%", "all", "", "", total / 1e6, 100.0);
+    if (stats->seconds > 0) {
+        printf(" %10.1f", total / (stats->seconds * 1e6));
+    }
+    printf("\n");
+    if (stats->seconds > 0) {
+        printf("Elapsed time: %.3f seconds, aggregate %.2f Gbps\n", stats->seconds,
+               total * 8.0 / (stats->seconds * 1e9));
+    }
+}
+
+void rdma_stripe_close(struct rdma_stripe *s) {
+    for (int l = 0; l < s->nlanes; l++) {
+        close_rdma_connection(&s->lanes[l]);
+    }
+    s->nlanes = 0;
+    close_rdma_connection(&s->listener);
+    free(s->buffer);
+    s->buffer = NULL;
+}
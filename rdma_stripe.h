@@ -0,0 +1,67 @@
+/*
+ * One transfer striped across several RDMA devices (librdmademo)
+ *
+ * The client opens one connection (lane) per selected device, each bound
+ * to the address of that device's GID so rdma_cm keeps it there, and each
+ * to one of the server's addresses in turn so the server side spreads over
+ * its devices too. Both sides register one region on every lane's device;
+ * the client cuts the transfer into chunks and writes chunk k at offset k
+ * of the server's region through whichever lane takes it, so the data lands
+ * in place and nothing is reassembled.
+ *
+ * Every lane has its own QP and CQ and keeps STRIPE_LANE_DEPTH chunks in
+ * flight. Lanes are topped up as their completions come back, so a faster
+ * device simply takes more of the chunks. When done each lane sends its
+ * chunk count as a zero-length WRITE_WITH_IMM, which on RC arrives after
+ * its data; the server waits for one from every lane.
+ */
+
+#ifndef RDMA_STRIPE_H
+#define RDMA_STRIPE_H
+
+#include <stdint.h>
+
+#include "rdma_common.h"
+
+#define STRIPE_MAX_LANES 8
+#define STRIPE_REGION_SIZE (16 * 1024 * 1024)
+#define STRIPE_CHUNK_SIZE (64 * 1024)
+#define STRIPE_LANE_DEPTH 16
+#define STRIPE_QP_DEPTH (STRIPE_LANE_DEPTH + 1)     // the chunks and the final imm
+#define STRIPE_CQ_DEPTH (2 * STRIPE_QP_DEPTH)
+#define STRIPE_PASSES 64                            // times the client writes the region
+
+struct rdma_stripe {
+    int nlanes;
+    struct rdma_context lanes[STRIPE_MAX_LANES];
+    char devices[STRIPE_MAX_LANES][IBV_SYSFS_NAME_MAX];    // where each lane landed
+    struct rdma_context listener;   // server only
+    char *buffer;                   // the region, registered on every lane's device
+    size_t size;
+};
+
+struct rdma_stripe_stats {
+    uint64_t chunks[STRIPE_MAX_LANES];
+    uint64_t bytes[STRIPE_MAX_LANES];
+    double seconds;                 // 0 when not timed (server)
+};
+
+// Client: a lane per entry of sels, lane i to servers[i % nservers]
+int rdma_stripe_connect(struct rdma_stripe *s, const struct rdma_device_sel *sels, int n,
+                        const char *const *servers, int nservers, int port);
+// Server: accept nlanes connections on port, on whichever devices they reach
+int rdma_stripe_accept(struct rdma_stripe *s, int nlanes, int port);
+
+// Client: write the region passes times over the lanes, then tell the server
+int rdma_stripe_write(struct rdma_stripe *s, int passes, volatile int *running,
+                      struct rdma_stripe_stats *stats);
+// Server: wait until every lane reports its chunk count
+int rdma_stripe_wait(struct rdma_stripe *s, volatile int *running, struct rdma_stripe_stats *stats);
+// Server: whether every byte of the region is where the client put it
+int rdma_stripe_verify(const struct rdma_stripe *s);
+
+// Aggregate and per-device throughput (or chunk share, untimed)
+void rdma_stripe_report(const struct rdma_stripe *s, const struct rdma_stripe_stats *stats);
+void rdma_stripe_close(struct rdma_stripe *s);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ * Per-work-request tracing: ring registry, TSC calibration and the drain
+ * thread that writes Chrome trace event JSON. See rdma_trace.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "rdma_trace.h"
+
+#define CALIBRATION_NS 20000000        // 20 ms
+
+int rdma_trace_enabled = 0;
+__thread struct rdma_trace_ring *rdma_trace_ring = NULL;
+static __thread int attach_failed = 0;
+
+static struct {
+    pthread_mutex_t lock;
+    struct rdma_trace_ring *rings[TRACE_MAX_THREADS];
+    int num_rings;
+
+    FILE *out;
+    const char *path;
+    int pid;
+    uint64_t start_tsc;
+    double ns_per_tick;
+    uint64_t events_written;
+
+    pthread_t thread;
+    volatile int running;
+} tracer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Ticks of rdma_trace_now() per nanosecond, measured against CLOCK_MONOTONIC
+static double calibrate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec delay = {0, CALIBRATION_NS};
+    uint64_t ns0 = monotonic_ns(), tsc0 = rdma_trace_now();
+    nanosleep(&delay, NULL);
+    uint64_t ns1 = monotonic_ns(), tsc1 = rdma_trace_now();
+    return (double)(ns1 - ns0) / (double)(tsc1 - tsc0);
+#else
+    return 1.0;
+#endif
+}
+
+struct rdma_trace_ring *rdma_trace_ring_attach(void) {
+    struct rdma_trace_ring *ring;
+
+    if (attach_failed) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&tracer.lock);
+    if (tracer.num_rings >= TRACE_MAX_THREADS ||
+        !(ring = aligned_alloc(64, sizeof(*ring)))) {
+        pthread_mutex_unlock(&tracer.lock);
+        fprintf(stderr, "Trace: no ring available for this thread, its events are not recorded\n");
+        attach_failed = 1;
+        return NULL;
+    }
+    // Touch the whole ring now so the data path never takes a page fault on it
+    memset(ring, 0, sizeof(*ring));
+    ring->tid = (int)syscall(SYS_gettid);
+    if (pthread_getname_np(pthread_self(), ring->thread_name, sizeof(ring->thread_name))) {
+        snprintf(ring->thread_name, sizeof(ring->thread_name), "thread %d", ring->tid);
+    }
+    tracer.rings[tracer.num_rings] = ring;
+    __atomic_store_n(&tracer.num_rings, tracer.num_rings + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tracer.lock);
+
+    rdma_trace_ring = ring;
+    return ring;
+}
+
+void rdma_trace_thread_name(const char *name) {
+    struct rdma_trace_ring *ring;
+
+    if (!rdma_trace_enabled) {
+        return;
+    }
+    ring = rdma_trace_ring ? rdma_trace_ring : rdma_trace_ring_attach();
+    if (ring) {
+        // Only read by rdma_trace_stop(), after the data path has finished
+        snprintf(ring->thread_name, sizeof(ring->thread_name), "%s", name);
+    }
+}
+
+// Drain output is formatted by hand into a local buffer: at full message
+// rate the drain thread formats millions of events per second, and printf
+// would make it the bottleneck (or, on a shared core, the data path's).
+struct out_buf {
+    char data[1 << 16];
+    size_t len;
+};
+
+static struct out_buf obuf;
+
+static void put_str(struct out_buf *b, const char *s) {
+    while (*s) {
+        b->data[b->len++] = *s++;
+    }
+}
+
+static void put_u64(struct out_buf *b, uint64_t v) {
+    char tmp[20];
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n) {
+        b->data[b->len++] = tmp[--n];
+    }
+}
+
+static void put_hex(struct out_buf *b, uint64_t v) {
+    char tmp[16];
+    int n = 0;
+
+    do {
+        tmp[n++] = "0123456789abcdef"[v & 15];
+        v >>= 4;
+    } while (v);
+    put_str(b, "0x");
+    while (n) {
+        b->data[b->len++] = tmp[--n];
+    }
+}
+
+// Nanoseconds as microseconds with three decimals, the trace format's unit
+static void put_us(struct out_buf *b, uint64_t ns) {
+    put_u64(b, ns / 1000);
+    b->data[b->len++] = '.';
+    b->data[b->len++] = '0' + ns / 100 % 10;
+    b->data[b->len++] = '0' + ns / 10 % 10;
+    b->data[b->len++] = '0' + ns % 10;
+}
+
+static void flush_out(struct out_buf *b) {
+    fwrite(b->data, 1, b->len, tracer.out);
+    b->len = 0;
+}
+
+static uint64_t tsc_to_ns(uint64_t tsc) {
+    return tsc > tracer.start_tsc ? (uint64_t)((tsc - tracer.start_tsc) * tracer.ns_per_tick) : 0;
+}
+
+static void put_common(struct out_buf *b, const struct rdma_trace_ring *ring, const char *head,
+                       uint64_t tsc) {
+    put_str(b, tracer.events_written++ ? ",\n" : "\n");
+    put_str(b, head);
+    put_str(b, ",\"pid\":");
+    put_u64(b, tracer.pid);
+    put_str(b, ",\"tid\":");
+    put_u64(b, ring->tid);
+    put_str(b, ",\"ts\":");
+    put_us(b, tsc_to_ns(tsc));
+}
+
+static void write_event(const struct rdma_trace_ring *ring, const struct rdma_trace_event *ev) {
+    struct out_buf *b = &obuf;
+
+    if (b->len > sizeof(b->data) - 512) {
+        flush_out(b);
+    }
+    switch (ev->type) {
+    case TRACE_POST:
+        put_common(b, ring, "{\"ph\":\"b\",\"cat\":\"wr\",\"name\":\"wr\"", ev->tsc);
+        put_str(b, ",\"id\":\"");
+        put_hex(b, ev->wr_id);
+        put_str(b, "\",\"args\":{\"opcode\":");
+        put_u64(b, ev->code);
+        put_str(b, ",\"bytes\":");
+        put_u64(b, ev->arg);
+        put_str(b, "}}");
+        break;
+    case TRACE_COMPLETION:
+        put_common(b, ring, "{\"ph\":\"e\",\"cat\":\"wr\",\"name\":\"wr\"", ev->tsc);
+        put_str(b, ",\"id\":\"");
+        put_hex(b, ev->wr_id);
+        put_str(b, "\",\"args\":{\"status\":\"");
+        put_str(b, ibv_wc_status_str((enum ibv_wc_status)ev->code));
+        put_str(b, "\"}}");
+        break;
+    case TRACE_POLL:
+        put_common(b, ring, "{\"ph\":\"X\",\"cat\":\"cq\",\"name\":\"poll_cq\"", ev->tsc);
+        put_str(b, ",\"dur\":");
+        put_us(b, tsc_to_ns(ev->tsc_end) - tsc_to_ns(ev->tsc));
+        put_str(b, ",\"args\":{\"completions\":");
+        put_u64(b, ev->code);
+        put_str(b, ",\"empty_polls\":");
+        put_u64(b, ev->arg);
+        put_str(b, "}}");
+        break;
+    }
+}
+
+// Move everything currently published in each ring to the output file
+static void drain(void) {
+    int num_rings = __atomic_load_n(&tracer.num_rings, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < num_rings; i++) {
+        struct rdma_trace_ring *ring = tracer.rings[i];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        for (; tail != head; tail++) {
+            write_event(ring, &ring->events[tail & (TRACE_RING_EVENTS - 1)]);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    flush_out(&obuf);
+}
+
+static void *drain_thread(void *arg) {
+    struct timespec interval = {0, TRACE_DRAIN_INTERVAL_US * 1000};
+
+    (void)arg;
+    while (tracer.running) {
+        nanosleep(&interval, NULL);
+        drain();
+    }
+    return NULL;
+}
+
+// Must be called before the data-path threads start posting
+int rdma_trace_start(const char *path) {
+    tracer.out = fopen(path, "w");
+    if (!tracer.out) {
+        perror(path);
+        return -1;
+    }
+    // Events are small and frequent; let stdio batch them into large writes
+    setvbuf(tracer.out, NULL, _IOFBF, 1 << 20);
+
+    tracer.path = path;
+    tracer.pid = getpid();
+    tracer.ns_per_tick = calibrate();
+    tracer.start_tsc = rdma_trace_now();
+    tracer.events_written = 0;
+    fprintf(tracer.out, "{\"traceEvents\":[");
+
+    tracer.running = 1;
+    if (pthread_create(&tracer.thread, NULL, drain_thread, NULL)) {
+        fprintf(stderr, "Failed to start trace drain thread\n");
+        tracer.running = 0;
+        fclose(tracer.out);
+        tracer.out = NULL;
+        return -1;
+    }
+
+    rdma_trace_enabled = 1;
+    printf("Tracing work requests to %s (%.3f ns per tick)\n", path, tracer.ns_per_tick);
+    return 0;
+}
+
+// Must be called once the data-path threads have stopped posting
+void rdma_trace_stop(void) {
+    uint64_t dropped = 0;
+
+    if (!tracer.out) {
+        return;
+    }
+    rdma_trace_enabled = 0;
+    tracer.running = 0;
+    pthread_join(tracer.thread, NULL);
+
+    // Final drain, then name every thread that produced events
+    drain();
+    for (int i = 0; i < tracer.num_rings; i++) {
+        struct rdma_trace_ring *ring = tracer.rings[i];
+        fprintf(tracer.out, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+                            "\"args\":{\"name\":\"%s\"}}",
+                tracer.events_written++ ? ",\n" : "\n", tracer.pid, ring->tid, ring->thread_name);
+        dropped += ring->dropped;
+        free(ring);
+        tracer.rings[i] = NULL;
+    }
+    fprintf(tracer.out, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":%lu}}\n", dropped);
+    fclose(tracer.out);
+    tracer.out = NULL;
+
+    printf("Trace: %lu events from %d thread(s) written to %s", tracer.events_written,
+           tracer.num_rings, tracer.path);
+    if (dropped) {
+        printf(" (%lu dropped, ring full)", dropped);
+    }
+    printf("\n");
+
+    tracer.num_rings = 0;
+    rdma_trace_ring = NULL;
+}
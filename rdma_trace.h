@@ -0,0 +1,137 @@
+/*
+ * Per-work-request tracing for the RDMA data path
+ *
+ * Post, completion and CQ poll-batch events are stamped with the TSC and
+ * appended to a per-thread single-producer ring; a background thread drains
+ * the rings and writes Chrome trace event JSON, which loads directly into
+ * chrome://tracing and https://ui.perfetto.dev.
+ *
+ * Tracing is off unless rdma_trace_start() is called. While off, every hook
+ * costs one load and one not-taken branch. While on, a hook is at most one
+ * TSC read and a 32-byte store; events are dropped (and counted) rather than
+ * ever blocking the data path when a ring is full.
+ */
+
+#ifndef RDMA_TRACE_H
+#define RDMA_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <infiniband/verbs.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define TRACE_RING_EVENTS (1 << 16)    // per thread, must be a power of two
+#define TRACE_MAX_THREADS 64
+#define TRACE_DRAIN_INTERVAL_US 1000
+
+enum rdma_trace_type {
+    TRACE_POST = 1,
+    TRACE_COMPLETION,
+    TRACE_POLL,
+};
+
+struct rdma_trace_event {
+    uint64_t tsc;
+    uint64_t tsc_end;        // TRACE_POLL: end of the poll batch
+    uint64_t wr_id;
+    uint32_t arg;            // bytes, or empty polls for TRACE_POLL
+    uint16_t type;
+    uint16_t code;           // opcode, wc status, or completions polled
+};
+
+struct rdma_trace_ring {
+    // Producer side, written only by the owning thread
+    uint64_t head;
+    uint64_t cached_tail;
+    uint64_t dropped;
+    char pad0[40];
+    // Consumer side, written only by the drain thread
+    uint64_t tail;
+    char pad1[56];
+    int tid;
+    char thread_name[32];
+    struct rdma_trace_event events[TRACE_RING_EVENTS];
+} __attribute__((aligned(64)));
+
+extern int rdma_trace_enabled;
+extern __thread struct rdma_trace_ring *rdma_trace_ring;
+
+struct rdma_trace_ring *rdma_trace_ring_attach(void);
+
+static inline uint64_t rdma_trace_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void rdma_trace_record(uint16_t type, uint16_t code, uint64_t wr_id, uint32_t arg,
+                                     uint64_t tsc, uint64_t tsc_end) {
+    struct rdma_trace_ring *ring = rdma_trace_ring;
+    struct rdma_trace_event *ev;
+
+    if (!ring && !(ring = rdma_trace_ring_attach())) {
+        return;
+    }
+    // Only re-read the consumer's tail when the cached copy says we're full
+    if (ring->head - ring->cached_tail >= TRACE_RING_EVENTS) {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (ring->head - ring->cached_tail >= TRACE_RING_EVENTS) {
+            ring->dropped++;
+            return;
+        }
+    }
+    ev = &ring->events[ring->head & (TRACE_RING_EVENTS - 1)];
+    ev->tsc = tsc;
+    ev->tsc_end = tsc_end;
+    ev->wr_id = wr_id;
+    ev->arg = arg;
+    ev->type = type;
+    ev->code = code;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Data path hooks: a single predictable branch when tracing is off
+
+static inline void rdma_trace_post(uint64_t wr_id, enum ibv_wr_opcode opcode, uint32_t bytes) {
+    if (__builtin_expect(rdma_trace_enabled, 0)) {
+        uint64_t now = rdma_trace_now();
+        rdma_trace_record(TRACE_POST, opcode, wr_id, bytes, now, now);
+    }
+}
+
+// Poll batches are bracketed by the caller: start = rdma_trace_poll_begin(),
+// then rdma_trace_poll_end() returns the batch end time, which also stamps
+// the completions it returned (that is when the application observed them)
+static inline uint64_t rdma_trace_poll_begin(void) {
+    return __builtin_expect(rdma_trace_enabled, 0) ? rdma_trace_now() : 0;
+}
+
+static inline uint64_t rdma_trace_poll_end(uint64_t start, int completions, uint32_t empty_polls) {
+    if (__builtin_expect(rdma_trace_enabled, 0)) {
+        uint64_t now = rdma_trace_now();
+        rdma_trace_record(TRACE_POLL, completions > 0 ? completions : 0, 0, empty_polls, start, now);
+        return now;
+    }
+    return 0;
+}
+
+static inline void rdma_trace_completion(const struct ibv_wc *wc, uint64_t polled_at) {
+    if (__builtin_expect(rdma_trace_enabled, 0)) {
+        rdma_trace_record(TRACE_COMPLETION, wc->status, wc->wr_id, wc->byte_len, polled_at, polled_at);
+    }
+}
+
+// Name the calling thread in the trace (optional)
+void rdma_trace_thread_name(const char *name);
+
+// Start tracing to a Chrome trace JSON file; stop drains and closes it
+int rdma_trace_start(const char *path);
+void rdma_trace_stop(void);
+
+#endif
@@ -0,0 +1,630 @@
+/*
+ * Automatic tuning of the client's write path. See rdma_tune.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_tune.h"
+#include "rdma_common.h"
+#include "rdma_connection.h"
+
+#define POLL_BATCH 16
+#define DRAIN_NS 1000000000ULL      // for the writes still in flight after a trial
+
+const char *const rdma_tune_knob_names[TUNE_KNOBS] = {
+    [TUNE_WINDOW] = "window",
+    [TUNE_MSG_SIZE] = "msg_size",
+    [TUNE_SIGNAL_EVERY] = "signal_every",
+    [TUNE_INLINE] = "inline",
+    [TUNE_QPS] = "qps",
+    [TUNE_THREADS] = "threads",
+};
+
+static const struct rdma_tune_space default_space = {
+    .values = {
+        [TUNE_WINDOW] = {1, 2, 4, 8, 16, 32, 64},
+        [TUNE_MSG_SIZE] = {64, 256, 1024, 4096, 16384, 65536, 262144, 1048576},
+        [TUNE_SIGNAL_EVERY] = {1, 2, 4, 8, 16, 32, 64},
+        [TUNE_INLINE] = {0, 64, 128, 256},
+        [TUNE_QPS] = {1, 2, 4, 8, 16, 32},
+        [TUNE_THREADS] = {1, 2, 4, 8},
+    },
+    .count = {
+        [TUNE_WINDOW] = 7,
+        [TUNE_MSG_SIZE] = 8,
+        [TUNE_SIGNAL_EVERY] = 7,
+        [TUNE_INLINE] = 4,
+        [TUNE_QPS] = 6,
+        [TUNE_THREADS] = 4,
+    },
+};
+
+// What each knob may be set to at all
+static const uint32_t knob_min[TUNE_KNOBS] = {1, 1, 1, 0, 1, 1};
+static const uint32_t knob_max[TUNE_KNOBS] = {
+    TUNE_MAX_WINDOW, TUNE_MAX_MSG, TUNE_MAX_WINDOW, TUNE_MAX_MSG, TUNE_MAX_QPS, TUNE_MAX_QPS,
+};
+
+void rdma_tune_default_space(struct rdma_tune_space *s) {
+    *s = default_space;
+}
+
+static int find_knob(const char *name, size_t len) {
+    for (int k = 0; k < TUNE_KNOBS; k++) {
+        if (strlen(rdma_tune_knob_names[k]) == len && !strncmp(rdma_tune_knob_names[k], name, len)) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+int rdma_tune_restrict(struct rdma_tune_space *s, const char *spec) {
+    const char *eq = strchr(spec, '=');
+    const char *p;
+    uint32_t values[TUNE_MAX_VALUES];
+    int n = 0;
+    int k;
+
+    k = eq ? find_knob(spec, eq - spec) : -1;
+    if (k < 0) {
+        fprintf(stderr, "Expected knob=v1,v2,... with a knob of window, msg_size, signal_every,\n"
+                        "inline, qps or threads: %s\n", spec);
+        return -1;
+    }
+    for (p = eq + 1; *p; p++) {
+        char *end;
+        unsigned long v = strtoul(p, &end, 10);
+        int i;
+
+        if (end == p || (*end && *end != ',') || v < knob_min[k] || v > knob_max[k]) {
+            fprintf(stderr, "%s takes values from %u to %u: %s\n", rdma_tune_knob_names[k],
+                    knob_min[k], knob_max[k], eq + 1);
+            return -1;
+        }
+        if (n == TUNE_MAX_VALUES) {
+            fprintf(stderr, "At most %d values per knob\n", TUNE_MAX_VALUES);
+            return -1;
+        }
+        // Insert in order, once
+        for (i = n; i > 0 && values[i - 1] > v; i--) {
+            values[i] = values[i - 1];
+        }
+        if (i > 0 && values[i - 1] == v) {
+            memmove(&values[i], &values[i + 1], (n - i) * sizeof(*values));
+        } else {
+            values[i] = v;
+            n++;
+        }
+        p = end;
+        if (!*p) {
+            break;
+        }
+    }
+    if (n == 0) {
+        fprintf(stderr, "No values for %s\n", rdma_tune_knob_names[k]);
+        return -1;
+    }
+    memcpy(s->values[k], values, n * sizeof(*values));
+    s->count[k] = n;
+    return 0;
+}
+
+// Fold settings that can't take effect onto the ones that do the same: at
+// most a window of writes per signal, a thread per QP, and no inline
+// threshold below the message size
+static void normalize(struct rdma_tune_config *cfg) {
+    if (cfg->v[TUNE_SIGNAL_EVERY] > cfg->v[TUNE_WINDOW]) {
+        cfg->v[TUNE_SIGNAL_EVERY] = cfg->v[TUNE_WINDOW];
+    }
+    if (cfg->v[TUNE_THREADS] > cfg->v[TUNE_QPS]) {
+        cfg->v[TUNE_THREADS] = cfg->v[TUNE_QPS];
+    }
+    if (cfg->v[TUNE_INLINE] < cfg->v[TUNE_MSG_SIZE]) {
+        cfg->v[TUNE_INLINE] = 0;
+    }
+}
+
+static void format_config(const struct rdma_tune_config *cfg, char *buf, size_t len) {
+    size_t used = 0;
+
+    buf[0] = '\0';
+    for (int k = 0; k < TUNE_KNOBS && used < len; k++) {
+        used += snprintf(buf + used, len - used, "%s%s %u", k ? ", " : "",
+                         rdma_tune_knob_names[k], cfg->v[k]);
+    }
+}
+
+void rdma_tune_print(const struct rdma_tune_config *cfg) {
+    char buf[256];
+
+    format_config(cfg, buf, sizeof(buf));
+    printf("%s\n", buf);
+}
+
+// One QP's window: writes are posted at head, and a signaled completion
+// retires every write up to it
+struct tune_qp {
+    struct rdma_context *ctx;
+    uint64_t head;
+    uint64_t tail;
+};
+
+struct tune_worker {
+    struct tune_qp *qps;
+    int nqps;
+    const struct rdma_tune_config *cfg;
+    double seconds;
+    volatile int *running;
+    const volatile int *go;
+    pthread_t thread;
+    uint64_t writes;        // retired after the warmup
+    double scored;
+    int failed;
+};
+
+static int post_write(struct tune_qp *q, const struct rdma_tune_config *cfg) {
+    struct rdma_context *ctx = q->ctx;
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+
+    sge.addr = (uintptr_t)ctx->buffer;
+    sge.length = cfg->v[TUNE_MSG_SIZE];
+    sge.lkey = ctx->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = q->head;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    if ((q->head + 1) % cfg->v[TUNE_SIGNAL_EVERY] == 0) {
+        wr.send_flags |= IBV_SEND_SIGNALED;
+    }
+    if (cfg->v[TUNE_INLINE] && sge.length <= cfg->v[TUNE_INLINE]) {
+        wr.send_flags |= IBV_SEND_INLINE;
+    }
+    wr.wr.rdma.remote_addr = ctx->remote_addr;
+    wr.wr.rdma.rkey = ctx->remote_rkey;
+    if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+        fprintf(stderr, "Failed to post write\n");
+        return -1;
+    }
+    q->head++;
+    return 0;
+}
+
+// Retire what q's CQ has; how many writes that was, or -1
+static int reap(struct tune_qp *q) {
+    struct ibv_wc wc[POLL_BATCH];
+    uint64_t tail = q->tail;
+    int n = ibv_poll_cq(q->ctx->cq, POLL_BATCH, wc);
+
+    if (n < 0) {
+        fprintf(stderr, "Failed to poll CQ\n");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+            return -1;
+        }
+        q->tail = wc[i].wr_id + 1;
+    }
+    return q->tail - tail;
+}
+
+// A signal per signal_every writes, and signal_every <= window, so a full
+// window always holds a signaled write and never stalls
+static void *worker_main(void *arg) {
+    struct tune_worker *w = arg;
+    uint64_t window = w->cfg->v[TUNE_WINDOW];
+    uint64_t signal_every = w->cfg->v[TUNE_SIGNAL_EVERY];
+    uint64_t start, warm, end, t, deadline;
+    int done;
+
+    while (!__atomic_load_n(w->go, __ATOMIC_ACQUIRE)) {
+        ;
+    }
+    start = rdma_now_ns();
+    warm = start + w->seconds * TUNE_WARMUP * 1e9;
+    end = start + w->seconds * 1e9;
+
+    for (t = start; t < end && *w->running; t = rdma_now_ns()) {
+        for (int i = 0; i < w->nqps; i++) {
+            struct tune_qp *q = &w->qps[i];
+            int n;
+
+            while (q->head - q->tail < window) {
+                if (post_write(q, w->cfg)) {
+                    w->failed = 1;
+                    return NULL;
+                }
+            }
+            n = reap(q);
+            if (n < 0) {
+                w->failed = 1;
+                return NULL;
+            }
+            if (t >= warm) {
+                w->writes += n;
+            }
+        }
+    }
+    w->scored = t > warm ? (t - warm) / 1e9 : 0;
+
+    // Let the signaled writes still in flight land before the QPs go
+    deadline = rdma_now_ns() + DRAIN_NS;
+    do {
+        done = 1;
+        for (int i = 0; i < w->nqps; i++) {
+            struct tune_qp *q = &w->qps[i];
+
+            if (q->tail < q->head - q->head % signal_every) {
+                done = 0;
+                if (reap(q) < 0) {
+                    w->failed = 1;
+                    return NULL;
+                }
+            }
+        }
+    } while (!done && rdma_now_ns() < deadline);
+    if (!done) {
+        fprintf(stderr, "Writes still in flight after the trial\n");
+        w->failed = 1;
+    }
+    return NULL;
+}
+
+static int connect_qps(struct rdma_context *ctxs, int n, const char *server_ip, int port,
+                       const struct rdma_tune_config *cfg) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = cfg->v[TUNE_MSG_SIZE],
+        .cq_depth = cfg->v[TUNE_WINDOW],
+        .qp_depth = cfg->v[TUNE_WINDOW],
+        .max_inline = cfg->v[TUNE_INLINE],
+        .quiet = 1,
+    };
+
+    if (connect_to_servers(ctxs, n, server_ip, port, &attr, NULL)) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (ctxs[i].remote_length < cfg->v[TUNE_MSG_SIZE]) {
+            fprintf(stderr, "Server buffer holds %lu bytes, writes are %u (rdma_server -A?)\n",
+                    ctxs[i].remote_length, cfg->v[TUNE_MSG_SIZE]);
+            for (int j = 0; j < n; j++) {
+                close_rdma_connection(&ctxs[j]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int rdma_tune_trial(const char *server_ip, int port, const struct rdma_tune_config *cfg,
+                    double seconds, volatile int *running, struct rdma_tune_result *r) {
+    int nqps = cfg->v[TUNE_QPS];
+    int nthreads = cfg->v[TUNE_THREADS];
+    struct rdma_context *ctxs = calloc(nqps, sizeof(*ctxs));
+    struct tune_qp *qps = calloc(nqps, sizeof(*qps));
+    struct tune_worker *workers = calloc(nthreads, sizeof(*workers));
+    volatile int go = 0;
+    int started = 0;
+    int ret = -1;
+
+    memset(r, 0, sizeof(*r));
+    r->failed = 1;
+    if (!ctxs || !qps || !workers) {
+        fprintf(stderr, "Failed to allocate a trial of %d QPs\n", nqps);
+        goto out;
+    }
+    if (connect_qps(ctxs, nqps, server_ip, port, cfg)) {
+        goto out;
+    }
+
+    for (int i = 0; i < nqps; i++) {
+        qps[i].ctx = &ctxs[i];
+    }
+    for (int i = 0; i < nthreads; i++) {
+        struct tune_worker *w = &workers[i];
+        int first = i * nqps / nthreads;
+
+        w->qps = &qps[first];
+        w->nqps = (i + 1) * nqps / nthreads - first;
+        w->cfg = cfg;
+        w->seconds = seconds;
+        w->running = running;
+        w->go = &go;
+        if (pthread_create(&w->thread, NULL, worker_main, w)) {
+            fprintf(stderr, "Failed to start trial thread %d\n", i);
+            break;
+        }
+        started++;
+    }
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    ret = started == nthreads ? 0 : -1;
+    for (int i = 0; i < started; i++) {
+        struct tune_worker *w = &workers[i];
+        double rate;
+
+        pthread_join(w->thread, NULL);
+        if (w->failed) {
+            ret = -1;
+        }
+        rate = w->scored > 0 ? w->writes / w->scored : 0;
+        r->mops += rate / 1e6;
+        r->gbps += rate * cfg->v[TUNE_MSG_SIZE] * 8 / 1e9;
+        if (w->scored > r->seconds) {
+            r->seconds = w->scored;
+        }
+    }
+    r->failed = ret != 0;
+    for (int i = 0; i < nqps; i++) {
+        close_rdma_connection(&ctxs[i]);
+    }
+
+out:
+    free(workers);
+    free(qps);
+    free(ctxs);
+    return ret;
+}
+
+struct tune_candidate {
+    struct rdma_tune_config cfg;
+    struct rdma_tune_result r;
+    double score;
+};
+
+static double score(const struct rdma_tune_result *r, enum rdma_tune_goal goal) {
+    if (r->failed) {
+        return -1;
+    }
+    return goal == TUNE_GOAL_OPS ? r->mops : r->gbps;
+}
+
+static int cmp_candidate(const void *a, const void *b) {
+    double x = ((const struct tune_candidate *)a)->score;
+    double y = ((const struct tune_candidate *)b)->score;
+    return x > y ? -1 : x < y;
+}
+
+static uint64_t rand_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static int seen(const struct tune_candidate *c, int n, const struct rdma_tune_config *cfg) {
+    for (int i = 0; i < n; i++) {
+        if (!memcmp(&c[i].cfg, cfg, sizeof(*cfg))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// cfg with knob k one value up (dir 1) or down (-1) in space; 0 when that
+// is a different configuration
+static int step(const struct rdma_tune_space *space, const struct rdma_tune_config *cfg,
+                int k, int dir, struct rdma_tune_config *next) {
+    int i = -1;
+
+    // The largest of space's values at most cfg's; normalizing may have
+    // left cfg between two of them, or below all
+    while (i + 1 < space->count[k] && space->values[k][i + 1] <= cfg->v[k]) {
+        i++;
+    }
+    if (dir > 0) {
+        i++;
+    } else if (i >= 0 && space->values[k][i] == cfg->v[k]) {
+        i--;
+    }
+    if (i < 0 || i >= space->count[k]) {
+        return -1;
+    }
+    *next = *cfg;
+    next->v[k] = space->values[k][i];
+    normalize(next);
+    return memcmp(next, cfg, sizeof(*cfg)) ? 0 : -1;
+}
+
+static void run_candidate(const char *server_ip, int port, struct tune_candidate *c,
+                          double seconds, enum rdma_tune_goal goal, volatile int *running) {
+    rdma_tune_trial(server_ip, port, &c->cfg, seconds, running, &c->r);
+    c->score = *running ? score(&c->r, goal) : -1;
+}
+
+int rdma_tune_search(const char *server_ip, int port, const struct rdma_tune_space *space,
+                     enum rdma_tune_goal goal, volatile int *running,
+                     struct rdma_tune_config *best, struct rdma_tune_result *best_r) {
+    // The rounds' candidates, then every configuration the climb tries
+    int max = TUNE_INITIAL + 1 + TUNE_CLIMB_ROUNDS * TUNE_KNOBS * 2;
+    struct tune_candidate *c = calloc(max, sizeof(*c));
+    struct tune_candidate top;
+    const char *unit = goal == TUNE_GOAL_OPS ? "Mwrites/s" : "Gbit/s";
+    uint64_t seed = rdma_now_ns();
+    double seconds = TUNE_FIRST_SECONDS;
+    char desc[256];
+    int n = 0, tried;
+
+    if (!c) {
+        fprintf(stderr, "Failed to allocate tuning candidates\n");
+        return -1;
+    }
+
+    // The untuned configuration first, then distinct random ones
+    for (int k = 0; k < TUNE_KNOBS; k++) {
+        c[0].cfg.v[k] = space->values[k][0];
+    }
+    c[0].cfg.v[TUNE_MSG_SIZE] = space->values[TUNE_MSG_SIZE][space->count[TUNE_MSG_SIZE] - 1];
+    normalize(&c[0].cfg);
+    n = 1;
+    for (int attempt = 0; attempt < 20 * TUNE_INITIAL && n < TUNE_INITIAL + 1; attempt++) {
+        struct rdma_tune_config cfg;
+
+        for (int k = 0; k < TUNE_KNOBS; k++) {
+            cfg.v[k] = space->values[k][rand_next(&seed) % space->count[k]];
+        }
+        normalize(&cfg);
+        if (!seen(c, n, &cfg)) {
+            c[n++].cfg = cfg;
+        }
+    }
+
+    // Successive halving; the last survivor is measured once more at full length
+    for (int round = 1; *running; round++) {
+        printf("Round %d: %d configuration%s, %.1f s each\n", round, n, n == 1 ? "" : "s", seconds);
+        for (int i = 0; i < n && *running; i++) {
+            run_candidate(server_ip, port, &c[i], seconds, goal, running);
+        }
+        qsort(c, n, sizeof(*c), cmp_candidate);
+        format_config(&c[0].cfg, desc, sizeof(desc));
+        printf("  best %.2f %s: %s\n", c[0].score, unit, desc);
+        if (n == 1) {
+            break;
+        }
+        n = (n + TUNE_ETA - 1) / TUNE_ETA;
+        seconds = seconds * TUNE_ETA < TUNE_MAX_SECONDS ? seconds * TUNE_ETA : TUNE_MAX_SECONDS;
+    }
+    if (c[0].score < 0) {
+        fprintf(stderr, "No configuration could be measured\n");
+        free(c);
+        return -1;
+    }
+
+    // Hill climb from the winner, a knob at a time
+    top = c[0];
+    tried = 1;
+    for (int round = 0; round < TUNE_CLIMB_ROUNDS && *running; round++) {
+        int improved = 0;
+
+        printf("Climb %d from %.2f %s\n", round + 1, top.score, unit);
+        for (int k = 0; k < TUNE_KNOBS && *running; k++) {
+            for (int dir = -1; dir <= 1 && *running; dir += 2) {
+                struct tune_candidate *next = &c[tried];
+
+                if (step(space, &top.cfg, k, dir, &next->cfg) || seen(c, tried, &next->cfg)) {
+                    continue;
+                }
+                tried++;
+                run_candidate(server_ip, port, next, TUNE_MAX_SECONDS, goal, running);
+                printf("  %s %u -> %u: %.2f %s\n", rdma_tune_knob_names[k], top.cfg.v[k],
+                       next->cfg.v[k], next->score, unit);
+                if (next->score > top.score * (1 + TUNE_MIN_GAIN)) {
+                    top = *next;
+                    improved = 1;
+                }
+            }
+        }
+        if (!improved) {
+            break;
+        }
+    }
+
+    *best = top.cfg;
+    *best_r = top.r;
+    free(c);
+    return 0;
+}
+
+int rdma_tune_profile_save(const char *path, const struct rdma_tune_config *cfg,
+                           const struct rdma_tune_result *r, enum rdma_tune_goal goal) {
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "# rdma_client auto-tune profile; run it with rdma_client -P %s\n", path);
+    fprintf(f, "# tuned for %s: %.2f Gbit/s, %.3f Mwrites/s over %.1f s\n",
+            goal == TUNE_GOAL_OPS ? "writes/s" : "bandwidth", r->gbps, r->mops, r->seconds);
+    for (int k = 0; k < TUNE_KNOBS; k++) {
+        fprintf(f, "%s=%u\n", rdma_tune_knob_names[k], cfg->v[k]);
+    }
+    if (fclose(f)) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int rdma_tune_profile_load(const char *path, struct rdma_tune_config *cfg) {
+    FILE *f = fopen(path, "r");
+    char line[256];
+    int lineno = 0;
+    int found = 0;
+    int ret = 0;
+
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        char *p = line + strspn(line, " \t");
+        char *eq, *end;
+        unsigned long v;
+        int k;
+
+        lineno++;
+        p[strcspn(p, "\r\n")] = '\0';
+        if (*p == '#' || *p == '\0') {
+            continue;
+        }
+        eq = strchr(p, '=');
+        k = eq ? find_knob(p, eq - p) : -1;
+        if (k < 0) {
+            fprintf(stderr, "%s:%d: expected knob=value\n", path, lineno);
+            ret = -1;
+            break;
+        }
+        v = strtoul(eq + 1, &end, 10);
+        if (end == eq + 1 || *end || v < knob_min[k] || v > knob_max[k]) {
+            fprintf(stderr, "%s:%d: %s takes a value from %u to %u\n", path, lineno,
+                    rdma_tune_knob_names[k], knob_min[k], knob_max[k]);
+            ret = -1;
+            break;
+        }
+        cfg->v[k] = v;
+        found |= 1 << k;
+    }
+    fclose(f);
+    if (ret == 0 && found != (1 << TUNE_KNOBS) - 1) {
+        for (int k = 0; k < TUNE_KNOBS; k++) {
+            if (!(found & (1 << k))) {
+                fprintf(stderr, "%s: no %s\n", path, rdma_tune_knob_names[k]);
+            }
+        }
+        ret = -1;
+    }
+    if (ret == 0) {
+        normalize(cfg);
+    }
+    return ret;
+}
+
+int rdma_tune_serve(const struct sockaddr *local, int port, volatile int *running) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = TUNE_MAX_MSG,
+        .cq_depth = 2,
+        .qp_depth = 1,
+        .quiet = 1,
+        .src_addr = local,
+    };
+    int64_t served;
+
+    printf("Serving tuning trials on port %d\n", port);
+    served = serve_connections(local, port, &attr, 0, running);
+    if (served < 0) {
+        return -1;
+    }
+    printf("Served %ld trial connections\n", served);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Automatic tuning of the client's write path (librdmademo)
+ *
+ * The knobs that decide how fast RDMA WRITEs go are spread over the demos
+ * and hard-coded in them. This searches them instead, with short trials
+ * against a server (rdma_tune_serve(), rdma_server -A):
+ *
+ *   window        writes in flight per QP
+ *   msg_size      bytes per write
+ *   signal_every  one signaled write per this many; the rest complete
+ *                 silently and are retired by the next signaled one
+ *   inline        writes up to this size are posted IBV_SEND_INLINE
+ *   qps           connections, each with its own CQ
+ *   threads       posting threads, the QPs split among them
+ *
+ * A trial connects the QPs, lets every thread keep its QPs' windows full
+ * for the trial's length and scores the completions after a warmup, by
+ * bytes or by writes per second.
+ *
+ * The search is successive halving: TUNE_INITIAL configurations drawn at
+ * random (plus the untuned one: a single write at a time, as rdma_client
+ * does) get a TUNE_FIRST_SECONDS trial each, the best third go on with
+ * trials three times as long, and so on until one is left. Most
+ * configurations are thus dropped after a glance, and only promising ones
+ * get the long runs that make a measurement trustworthy. The winner then
+ * climbs: each knob one value up or down, in TUNE_MAX_SECONDS trials, for
+ * as long as that gains more than TUNE_MIN_GAIN. A full search takes one
+ * to two minutes.
+ *
+ * The result is a profile, one knob=value per line, that rdma_client -P
+ * runs again.
+ */
+
+#ifndef RDMA_TUNE_H
+#define RDMA_TUNE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define TUNE_MAX_VALUES 8
+#define TUNE_MAX_MSG (1024 * 1024)     // the server's buffer per connection
+#define TUNE_MAX_WINDOW 64
+#define TUNE_MAX_QPS 64
+#define TUNE_INITIAL 81                 // configurations in the first round
+#define TUNE_ETA 3                      // a third survive each round, on trials 3x as long
+#define TUNE_FIRST_SECONDS 0.1
+#define TUNE_MAX_SECONDS 3.0            // longest trial
+#define TUNE_WARMUP 0.2                 // of each trial, left out of its score
+#define TUNE_MIN_GAIN 0.02              // a climbing step must beat the best by this much
+#define TUNE_CLIMB_ROUNDS 2
+
+enum rdma_tune_knob {
+    TUNE_WINDOW,
+    TUNE_MSG_SIZE,
+    TUNE_SIGNAL_EVERY,
+    TUNE_INLINE,
+    TUNE_QPS,
+    TUNE_THREADS,
+    TUNE_KNOBS,
+};
+
+extern const char *const rdma_tune_knob_names[TUNE_KNOBS];
+
+enum rdma_tune_goal {
+    TUNE_GOAL_BANDWIDTH,
+    TUNE_GOAL_OPS,
+};
+
+struct rdma_tune_config {
+    uint32_t v[TUNE_KNOBS];
+};
+
+// The values each knob may take, ascending
+struct rdma_tune_space {
+    uint32_t values[TUNE_KNOBS][TUNE_MAX_VALUES];
+    int count[TUNE_KNOBS];
+};
+
+struct rdma_tune_result {
+    double gbps;
+    double mops;
+    double seconds;         // scored, after the warmup
+    int failed;             // couldn't connect or a write failed
+};
+
+// Every knob over its default range
+void rdma_tune_default_space(struct rdma_tune_space *s);
+// Narrow a knob to the values in "knob=v1,v2,..."
+int rdma_tune_restrict(struct rdma_tune_space *s, const char *spec);
+
+// One trial of cfg against server_ip for seconds, stopped early when
+// *running drops
+int rdma_tune_trial(const char *server_ip, int port, const struct rdma_tune_config *cfg,
+                    double seconds, volatile int *running, struct rdma_tune_result *r);
+
+// Search space for the best configuration by goal; on interrupt the best
+// so far. best_r is its last trial
+int rdma_tune_search(const char *server_ip, int port, const struct rdma_tune_space *space,
+                     enum rdma_tune_goal goal, volatile int *running,
+                     struct rdma_tune_config *best, struct rdma_tune_result *best_r);
+
+int rdma_tune_profile_save(const char *path, const struct rdma_tune_config *cfg,
+                           const struct rdma_tune_result *r, enum rdma_tune_goal goal);
+int rdma_tune_profile_load(const char *path, struct rdma_tune_config *cfg);
+void rdma_tune_print(const struct rdma_tune_config *cfg);
+
+// Server: accept trial connections on port of local (NULL for any), each
+// with a TUNE_MAX_MSG buffer to write into, until *running drops
+int rdma_tune_serve(const struct sockaddr *local, int port, volatile int *running);
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * C++ verbs layer for librdmademo
+ *
+ * Owners: device, protection_domain, completion_queue, queue_pair and
+ * memory_region are std::unique_ptr with the matching ibv_* release
+ * function as a stateless deleter, so they are exactly one pointer wide
+ * and release in reverse order of declaration. The factories throw
+ * verbs_error; nothing on the data path throws.
+ *
+ * Posting: poster<Opcode, SignalEvery, InlineThreshold> keeps one
+ * pre-built work request and rewrites only the fields that change per post.
+ * The opcode, how often a WR is signaled and whether small payloads go
+ * inline are template parameters, so each combination compiles to the
+ * straight-line code a hand-written C loop for that case would be; see
+ * verbs_bench.cpp for the comparison.
+ */
+
+#ifndef RDMA_VERBS_HPP
+#define RDMA_VERBS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <infiniband/verbs.h>
+
+#include "rdma_common.h"
+
+namespace rdmademo {
+
+class verbs_error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+namespace detail {
+
+template <typename T, int (*Release)(T *)>
+struct releaser {
+    void operator()(T *p) const noexcept { Release(p); }
+};
+
+struct device_list_releaser {
+    void operator()(ibv_device **list) const noexcept { ibv_free_device_list(list); }
+};
+
+}  // namespace detail
+
+using device = std::unique_ptr<ibv_context, detail::releaser<ibv_context, ibv_close_device>>;
+using protection_domain = std::unique_ptr<ibv_pd, detail::releaser<ibv_pd, ibv_dealloc_pd>>;
+using completion_queue = std::unique_ptr<ibv_cq, detail::releaser<ibv_cq, ibv_destroy_cq>>;
+using queue_pair = std::unique_ptr<ibv_qp, detail::releaser<ibv_qp, ibv_destroy_qp>>;
+using memory_region = std::unique_ptr<ibv_mr, detail::releaser<ibv_mr, ibv_dereg_mr>>;
+
+// Open the named device, or the first one when name is null
+inline device open_device(const char *name = nullptr) {
+    int num_devices;
+    std::unique_ptr<ibv_device *, detail::device_list_releaser> list(ibv_get_device_list(&num_devices));
+
+    if (!list) {
+        throw verbs_error("Failed to get IB device list");
+    }
+    for (int i = 0; i < num_devices; i++) {
+        if (!name || std::strcmp(name, ibv_get_device_name(list.get()[i])) == 0) {
+            device dev(ibv_open_device(list.get()[i]));
+            if (!dev) {
+                throw verbs_error("Failed to open device context");
+            }
+            return dev;
+        }
+    }
+    throw verbs_error(name ? std::string("No IB device named ") + name : "No IB devices found");
+}
+
+inline protection_domain alloc_pd(ibv_context *context) {
+    protection_domain pd(ibv_alloc_pd(context));
+    if (!pd) {
+        throw verbs_error("Failed to allocate protection domain");
+    }
+    return pd;
+}
+
+inline completion_queue create_cq(ibv_context *context, int depth) {
+    completion_queue cq(ibv_create_cq(context, depth, nullptr, nullptr, 0));
+    if (!cq) {
+        throw verbs_error("Failed to create completion queue");
+    }
+    return cq;
+}
+
+// RC QP with ctx's CQ on both queues, as create_rdma_qp() builds it
+inline queue_pair create_qp(ibv_pd *pd, ibv_cq *cq, int depth, uint32_t max_inline = 0) {
+    ibv_qp_init_attr attr{};
+    attr.qp_type = IBV_QPT_RC;
+    attr.send_cq = cq;
+    attr.recv_cq = cq;
+    attr.cap.max_send_wr = depth;
+    attr.cap.max_recv_wr = depth;
+    attr.cap.max_send_sge = 1;
+    attr.cap.max_recv_sge = 1;
+    attr.cap.max_inline_data = max_inline;
+    queue_pair qp(ibv_create_qp(pd, &attr));
+    if (!qp) {
+        throw verbs_error("Failed to create queue pair");
+    }
+    return qp;
+}
+
+inline memory_region reg_mr(ibv_pd *pd, void *addr, size_t length,
+                            int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                                         IBV_ACCESS_REMOTE_READ) {
+    memory_region mr(ibv_reg_mr(pd, addr, length, access));
+    if (!mr) {
+        throw verbs_error("Failed to register memory region");
+    }
+    return mr;
+}
+
+template <ibv_wr_opcode Opcode, unsigned SignalEvery = 1, uint32_t InlineThreshold = 0>
+class poster {
+    static_assert(SignalEvery >= 1, "at least every SignalEvery-th WR must be signaled");
+    static_assert(Opcode == IBV_WR_RDMA_WRITE || Opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
+                  Opcode == IBV_WR_SEND || Opcode == IBV_WR_SEND_WITH_IMM ||
+                  Opcode == IBV_WR_RDMA_READ, "unsupported opcode");
+    static_assert(InlineThreshold == 0 || Opcode != IBV_WR_RDMA_READ, "reads cannot be inline");
+
+    static constexpr bool has_remote = Opcode == IBV_WR_RDMA_WRITE ||
+                                       Opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
+                                       Opcode == IBV_WR_RDMA_READ;
+
+public:
+    static constexpr unsigned signal_every = SignalEvery;
+
+    poster(ibv_qp *qp, uint32_t lkey, uint64_t remote_addr = 0, uint32_t rkey = 0)
+        : qp_(qp), remote_base_(remote_addr) {
+        sge_.lkey = lkey;
+        wr_.sg_list = &sge_;
+        wr_.num_sge = 1;
+        wr_.opcode = Opcode;
+        if constexpr (has_remote) {
+            wr_.wr.rdma.rkey = rkey;
+        }
+    }
+
+    // wr_ points at sge_
+    poster(const poster &) = delete;
+    poster &operator=(const poster &) = delete;
+
+    // One WR; `signal` forces a completion, e.g. for the last WR of a batch.
+    // Returns ibv_post_send()'s result
+    int post(uint64_t wr_id, const void *addr, uint32_t length, uint64_t remote_offset = 0,
+             bool signal = false, uint32_t imm_data = 0) {
+        ibv_send_wr *bad_wr;
+        unsigned flags = 0;
+
+        sge_.addr = reinterpret_cast<uintptr_t>(addr);
+        sge_.length = length;
+        wr_.wr_id = wr_id;
+        if constexpr (has_remote) {
+            wr_.wr.rdma.remote_addr = remote_base_ + remote_offset;
+        }
+        if constexpr (Opcode == IBV_WR_RDMA_WRITE_WITH_IMM || Opcode == IBV_WR_SEND_WITH_IMM) {
+            wr_.imm_data = imm_data;
+        } else {
+            (void)imm_data;
+        }
+
+        if constexpr (SignalEvery == 1) {
+            (void)signal;
+            flags = IBV_SEND_SIGNALED;
+        } else {
+            if (++unsignaled_ == SignalEvery || signal) {
+                flags = IBV_SEND_SIGNALED;
+                unsignaled_ = 0;
+            }
+        }
+        if constexpr (InlineThreshold > 0) {
+            if (length <= InlineThreshold) {
+                flags |= IBV_SEND_INLINE;
+            }
+        }
+        wr_.send_flags = flags;
+
+        return ibv_post_send(qp_, &wr_, &bad_wr);
+    }
+
+    // Unsignaled WRs posted since the last signaled one
+    unsigned pending_unsignaled() const { return unsignaled_; }
+
+private:
+    ibv_qp *qp_;
+    uint64_t remote_base_;
+    unsigned unsignaled_ = 0;
+    ibv_sge sge_{};
+    ibv_send_wr wr_{};
+};
+
+// Post `count` WRs of `length` bytes from addr, keeping at most `depth` in
+// flight, and reap their completions. Returns the number of WRs completed,
+// or -1 on a post, poll or completion error
+template <typename Poster>
+long run_posting_loop(Poster &p, ibv_cq *cq, long count, const void *addr, uint32_t length,
+                      unsigned depth, const volatile int *running = nullptr) {
+    constexpr unsigned batch = Poster::signal_every;
+    ibv_wc wc[16];
+    long posted = 0, completed = 0;
+    // With selective signaling, the WRs each outstanding signaled WR retires
+    // (a forced signal on the last WR may retire fewer than a full batch)
+    unsigned retires[64];
+    unsigned head = 0, tail = 0;
+
+    if (depth < batch || depth > 64 * batch) {
+        return -1;
+    }
+
+    while (completed < count && (!running || *running)) {
+        while (posted < count && posted - completed + batch <= depth) {
+            if constexpr (batch == 1) {
+                if (p.post(posted, addr, length)) {
+                    return -1;
+                }
+            } else {
+                unsigned before = p.pending_unsignaled();
+                if (p.post(posted, addr, length, 0, posted == count - 1)) {
+                    return -1;
+                }
+                if (p.pending_unsignaled() == 0) {
+                    retires[tail++ % 64] = before + 1;
+                }
+            }
+            posted++;
+        }
+
+        int n = ibv_poll_cq(cq, 16, wc);
+        if (n < 0) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                return -1;
+            }
+            if constexpr (batch == 1) {
+                completed++;
+            } else {
+                completed += retires[head++ % 64];
+            }
+        }
+    }
+    (void)retires;
+    (void)tail;
+    return completed;
+}
+
+// The C context's resources, owned: setup_rdma_resources() + create_rdma_qp()
+// with cleanup on scope exit
+class rdma_resources {
+public:
+    explicit rdma_resources(const rdma_resource_attr &attr) : ctx_{} {
+        if (setup_rdma_resources(&ctx_, &attr) || create_rdma_qp(&ctx_, &attr)) {
+            cleanup_rdma_resources(&ctx_);
+            throw verbs_error("Failed to set up RDMA resources");
+        }
+    }
+    ~rdma_resources() { cleanup_rdma_resources(&ctx_); }
+
+    rdma_resources(const rdma_resources &) = delete;
+    rdma_resources &operator=(const rdma_resources &) = delete;
+
+    rdma_context *get() { return &ctx_; }
+    rdma_context *operator->() { return &ctx_; }
+
+private:
+    rdma_context ctx_;
+};
+
+}  // namespace rdmademo
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ * QP error recovery benchmark: how long a streaming writer is set back by
+ * faults with each way of recovering (rdma_recovery.h)
+ *
+ * The client keeps -w WRITEs of -b bytes in flight into the buffer of an
+ * rdma_server -A connection for -t seconds, signaling one in -c, while the
+ * fault given with -f is injected (by default the QP forced into error
+ * every 500 ms). Every failure is recovered from and the unacknowledged
+ * WRITEs replayed, once per mode:
+ *
+ *   reset      the QP reset in place and brought back to RTS
+ *   reconnect  a new connection to the server
+ *   auto       reset, reconnecting when that does not take
+ *
+ * Acknowledged bytes are counted in 10 ms buckets. Per mode it reports the
+ * throughput overall and steady (the median bucket), the worst bucket and
+ * how far it dipped below steady, the time spent under 90% of steady, and
+ * the recoveries: how many, WRITEs replayed, mean and max recovery time
+ * (from the failed completion to the WRITEs reposted).
+ *
+ * link:MS:DOWN_MS faults take the device's interface down instead; they
+ * need a soft RoCE (rxe) device, and root. A reset cannot bring a link
+ * back: reset gives up when it stays down through RECOVERY_MAX_ATTEMPTS of
+ * them, where reconnect and auto wait it out (and count it as recovery
+ * time).
+ *
+ * Usage: recovery_bench [-t seconds] [-b bytes] [-w window] [-c signal_every]
+ *                       [-m mode,...] [-f fault] <server_ip>
+ * against rdma_server -A on <server_ip>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include "rdma_common.h"
+#include "rdma_connection.h"
+#include "rdma_recovery.h"
+
+#define PORT 18515                      // rdma_server -A
+#define QP_DEPTH 64
+#define CQ_DEPTH 128
+#define BUCKET_NS 10000000ULL
+#define MAX_SECONDS 60
+#define STEADY_SHARE 0.9                // buckets below this share of steady are the dip
+#define DEFAULT_SECONDS 5
+#define DEFAULT_BYTES 65536
+#define DEFAULT_WINDOW 16
+#define DEFAULT_SIGNAL 4
+#define DEFAULT_FAULT "qp:500"
+
+struct rb_opts {
+    double seconds;
+    uint32_t bytes;
+    int window;
+    int signal_every;
+    struct rdma_fault_attr fault;
+};
+
+struct rb_result {
+    double gbps;                // overall, GB/s
+    double steady_gbps;         // median bucket
+    double worst_gbps;
+    double below_ms;            // time under STEADY_SHARE of steady
+    struct rdma_recovery_stats stats;
+};
+
+static volatile int running = 1;
+
+static void signal_handler(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static int post_write(struct rdma_recovery *rec, const struct rb_opts *o, uint64_t seq,
+                      uint32_t slots) {
+    struct rdma_context *ctx = rec->ctx;
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)ctx->buffer + (seq % o->window) * o->bytes,
+        .length = o->bytes,
+        .lkey = ctx->mr->lkey,
+    };
+    struct ibv_send_wr wr = {
+        .wr_id = seq,
+        .sg_list = &sge,
+        .num_sge = 1,
+        .opcode = IBV_WR_RDMA_WRITE,
+        .send_flags = (seq + 1) % o->signal_every ? 0 : IBV_SEND_SIGNALED,
+    };
+
+    wr.wr.rdma.remote_addr = ctx->remote_addr + (seq % slots) * o->bytes;
+    wr.wr.rdma.rkey = ctx->remote_rkey;
+    return rdma_recovery_post(rec, &wr);
+}
+
+static int run_mode(const char *server_ip, const struct rb_opts *o, enum rdma_recovery_mode mode,
+                    struct rb_result *res) {
+    struct rdma_context ctx = {0};
+    struct rdma_resource_attr attr = {
+        .buffer_size = (size_t)o->bytes * o->window,
+        .cq_depth = CQ_DEPTH,
+        .qp_depth = QP_DEPTH,
+        .fill_pattern = 1,
+        .quiet = 1,
+    };
+    struct rdma_recovery_attr rattr = {
+        .mode = mode,
+        .server_ip = server_ip,
+        .port = PORT,
+        .conn = attr,
+    };
+    struct rdma_recovery rec;
+    struct ibv_wc wc[16];
+    uint64_t nbuckets = o->seconds * 1e9 / BUCKET_NS, *buckets, *sorted;
+    uint64_t seq = 0, acked = 0, start, end, t, b;
+    uint32_t slots;
+    int ret = -1;
+
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    sorted = calloc(nbuckets, sizeof(*sorted));
+    if (!buckets || !sorted) {
+        fprintf(stderr, "Failed to allocate %lu buckets\n", nbuckets);
+        goto out;
+    }
+    if (connect_to_server(&ctx, server_ip, PORT, &attr)) {
+        goto out;
+    }
+    if (ctx.remote_length < o->bytes) {
+        fprintf(stderr, "Server buffer is %lu bytes, writes are %u\n", ctx.remote_length, o->bytes);
+        goto out;
+    }
+    slots = ctx.remote_length / o->bytes;
+    if (rdma_recovery_init(&rec, &ctx, QP_DEPTH, &rattr)) {
+        goto out;
+    }
+    if (rdma_recovery_set_fault(&rec, &o->fault)) {
+        goto out_rec;
+    }
+
+    start = rdma_now_ns();
+    end = start + nbuckets * BUCKET_NS;
+    for (t = start; t < end && running; t = rdma_now_ns()) {
+        int n, failed = 0;
+
+        rdma_recovery_inject(&rec, t);
+        while (rdma_recovery_outstanding(&rec) < (uint32_t)o->window) {
+            if (post_write(&rec, o, seq, slots)) {
+                failed = 1;
+                break;
+            }
+            seq++;
+        }
+
+        n = ibv_poll_cq(ctx.cq, 16, wc);
+        if (n < 0) {
+            fprintf(stderr, "Failed to poll CQ\n");
+            goto out_rec;
+        }
+        for (int i = 0; i < n; i++) {
+            int acks = rdma_recovery_complete(&rec, &wc[i]);
+
+            if (acks < 0) {
+                failed = 1;
+                continue;
+            }
+            b = (rdma_now_ns() - start) / BUCKET_NS;
+            acked += (uint64_t)acks * o->bytes;
+            buckets[b < nbuckets ? b : nbuckets - 1] += (uint64_t)acks * o->bytes;
+        }
+        // A QP the fault left unable to take WRs recovers like a failed one
+        if (failed && rdma_recovery_recover(&rec, &running)) {
+            goto out_rec;
+        }
+    }
+    t = rdma_now_ns();
+
+    memcpy(sorted, buckets, nbuckets * sizeof(*sorted));
+    qsort(sorted, nbuckets, sizeof(*sorted), rdma_cmp_u64);
+    res->gbps = acked / (double)(t - start);
+    res->steady_gbps = sorted[nbuckets / 2] / (double)BUCKET_NS;
+    res->worst_gbps = sorted[0] / (double)BUCKET_NS;
+    res->below_ms = 0;
+    for (b = 0; b < nbuckets; b++) {
+        if (buckets[b] < STEADY_SHARE * sorted[nbuckets / 2]) {
+            res->below_ms += BUCKET_NS / 1e6;
+        }
+    }
+    res->stats = rec.stats;
+    ret = 0;
+
+out_rec:
+    rdma_recovery_destroy(&rec);
+out:
+    close_rdma_connection(&ctx);
+    free(buckets);
+    free(sorted);
+    return ret;
+}
+
+static void print_result(enum rdma_recovery_mode mode, const struct rb_result *r) {
+    const struct rdma_recovery_stats *s = &r->stats;
+
+    printf("%-10s %7.2f %7.2f %7.2f %6.1f%% %9.0f %6lu %7lu %8.3f %8.3f\n",
+           rdma_recovery_mode_names[mode], r->gbps, r->steady_gbps, r->worst_gbps,
+           r->steady_gbps > 0 ? 100 * (1 - r->worst_gbps / r->steady_gbps) : 0.0, r->below_ms,
+           s->recoveries, s->replayed, s->recoveries ? s->total_ns / (double)s->recoveries / 1e6 : 0.0,
+           s->max_ns / 1e6);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t seconds] [-b bytes] [-w window] [-c signal_every]\n"
+                    "       [-m mode,...] [-f fault] <server_ip>\n", prog);
+    fprintf(stderr, "  -t  Seconds per mode, at most %d (default %d)\n", MAX_SECONDS,
+            DEFAULT_SECONDS);
+    fprintf(stderr, "  -b  WRITE size, bytes (default %d)\n", DEFAULT_BYTES);
+    fprintf(stderr, "  -w  WRITEs in flight, at most %d (default %d)\n", QP_DEPTH, DEFAULT_WINDOW);
+    fprintf(stderr, "  -c  Signal one WRITE in this many, a divisor of the window (default %d)\n",
+            DEFAULT_SIGNAL);
+    fprintf(stderr, "  -m  Modes: reset, reconnect, auto (default all)\n");
+    fprintf(stderr, "  -f  Fault: qp:MS (QP error every MS ms) or link:MS:DOWN_MS (link down\n"
+                    "      DOWN_MS ms every MS ms; rxe, root) (default %s)\n", DEFAULT_FAULT);
+}
+
+int main(int argc, char *argv[]) {
+    struct rb_opts o = {
+        .seconds = DEFAULT_SECONDS,
+        .bytes = DEFAULT_BYTES,
+        .window = DEFAULT_WINDOW,
+        .signal_every = DEFAULT_SIGNAL,
+    };
+    unsigned modes = (1U << RECOVERY_MODE_COUNT) - 1;
+    const char *fault = DEFAULT_FAULT;
+    int ret = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:b:w:c:m:f:h")) != -1) {
+        switch (opt) {
+        case 't':
+            o.seconds = atof(optarg);
+            break;
+        case 'b':
+            o.bytes = atoi(optarg);
+            break;
+        case 'w':
+            o.window = atoi(optarg);
+            break;
+        case 'c':
+            o.signal_every = atoi(optarg);
+            break;
+        case 'm':
+            if (rdma_parse_names(optarg, rdma_recovery_mode_names, RECOVERY_MODE_COUNT, &modes)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'f':
+            fault = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (o.seconds * 1e9 < BUCKET_NS || o.seconds > MAX_SECONDS || !o.bytes || o.window < 1 ||
+        o.window > QP_DEPTH || o.signal_every < 1 || o.window % o.signal_every ||
+        optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (rdma_fault_parse(fault, &o.fault)) {
+        return 1;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    printf("%u-byte WRITEs, %d in flight, to %s:%d for %.1f s per mode, fault %s\n",
+           o.bytes, o.window, argv[optind], PORT, o.seconds, fault);
+    printf("%-10s %7s %7s %7s %7s %9s %6s %7s %8s %8s\n", "mode", "GB/s", "steady", "worst",
+           "dip", "<90% ms", "recov", "replay", "mean ms", "max ms");
+    for (int m = 0; m < RECOVERY_MODE_COUNT && running; m++) {
+        struct rb_result r;
+
+        if (!(modes & (1U << m))) {
+            continue;
+        }
+        if (run_mode(argv[optind], &o, m, &r)) {
+            fprintf(stderr, "%s: failed\n", rdma_recovery_mode_names[m]);
+            ret = 1;
+            continue;
+        }
+        print_result(m, &r);
+    }
+    return ret;
+}
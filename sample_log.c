@@ -0,0 +1,824 @@
+/*
+ * Compact binary time-series log for throughput samples
+ * See sample_log.h for the file format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "sample_log.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "sample_log stores integers in host order and assumes little-endian"
+#endif
+
+#define FILE_MAGIC "RDMASLOG"
+#define TRAILER_MAGIC "RSLINDEX"
+#define BLOCK_MAGIC 0x4b4c4253u    // "SBLK"
+#define FILE_VERSION 1
+#define FILE_HEADER_SIZE 80
+#define BLOCK_HEADER_SIZE 32
+#define TRAILER_SIZE 32
+#define MAX_VARINT_LEN 10
+#define OUTLIER_MBPS 1000.0        // same filter as throughput_monitor.py
+
+const char *sample_log_net_columns[SAMPLE_LOG_NET_COLUMNS] = {
+    "tx_bytes", "rx_bytes", "tx_packets", "rx_packets"
+};
+
+struct file_header {
+    char magic[8];
+    uint16_t version;
+    uint16_t header_blocks;
+    uint32_t block_size;
+    uint32_t num_columns;
+    uint32_t names_len;
+    int64_t start_time_ns;
+    double duration;
+    uint32_t sample_rate_hz;
+    uint32_t reserved;
+    char interface[SAMPLE_LOG_IFNAME_LEN];
+};
+
+struct block_header {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t payload_len;
+    int64_t first_ts;
+    int64_t last_ts;
+    uint32_t block_no;
+    uint32_t reserved;
+};
+
+struct trailer {
+    char magic[8];
+    uint64_t index_offset;
+    uint64_t num_blocks;
+    uint64_t num_samples;
+};
+
+_Static_assert(sizeof(struct file_header) == FILE_HEADER_SIZE, "file header layout");
+_Static_assert(sizeof(struct block_header) == BLOCK_HEADER_SIZE, "block header layout");
+_Static_assert(sizeof(struct trailer) == TRAILER_SIZE, "trailer layout");
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static inline int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    uint64_t result = 0;
+    int shift = 0;
+
+    while (*p < end && shift < 64) {
+        uint8_t b = *(*p)++;
+        result |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = result;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+static int write_full(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len, off_t offset) {
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------- writer */
+
+// Encode one sample against the writer's previous state. Returns the number
+// of bytes written to out.
+static uint32_t encode_sample(struct sample_log_writer *w, int64_t ts,
+                              const uint64_t *values, uint8_t *out) {
+    uint8_t *p = out;
+    int64_t delta = ts - w->prev_ts;
+    uint32_t i = 0;
+
+    p = put_varint(p, zigzag(delta - w->prev_delta));
+    while (i < w->num_columns) {
+        uint64_t d = values[i] - w->prev_values[i];
+        if (d == 0) {
+            uint32_t run = 1;
+            while (i + run < w->num_columns && values[i + run] == w->prev_values[i + run]) {
+                run++;
+            }
+            *p++ = 0;
+            p = put_varint(p, run - 1);
+            i += run;
+        } else {
+            p = put_varint(p, zigzag((int64_t)d));
+            i++;
+        }
+    }
+    return (uint32_t)(p - out);
+}
+
+static off_t block_offset(uint64_t data_offset, uint32_t block_size, uint64_t block_no) {
+    return (off_t)(data_offset + block_no * block_size);
+}
+
+static int write_tail_block(struct sample_log_writer *w) {
+    struct block_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = BLOCK_MAGIC;
+    hdr.count = (uint16_t)w->block_count;
+    hdr.payload_len = (uint16_t)(w->block_used - BLOCK_HEADER_SIZE);
+    hdr.first_ts = w->block_first_ts;
+    hdr.last_ts = w->prev_ts;
+    hdr.block_no = (uint32_t)w->num_blocks;
+    memcpy(w->block, &hdr, sizeof(hdr));
+    memset(w->block + w->block_used, 0, w->block_size - w->block_used);
+
+    return write_full(w->fd, w->block, w->block_size,
+                      block_offset(w->data_offset, w->block_size, w->num_blocks));
+}
+
+static int finalize_block(struct sample_log_writer *w) {
+    struct sample_log_index_entry *e;
+
+    if (w->block_count == 0) {
+        return 0;
+    }
+    if (write_tail_block(w)) {
+        return -1;
+    }
+    if (w->num_blocks == w->index_cap) {
+        uint64_t cap = w->index_cap ? w->index_cap * 2 : 64;
+        e = realloc(w->index, cap * sizeof(*e));
+        if (!e) {
+            return -1;
+        }
+        w->index = e;
+        w->index_cap = cap;
+    }
+    e = &w->index[w->num_blocks++];
+    e->first_ts = w->block_first_ts;
+    e->last_ts = w->prev_ts;
+    e->count = w->block_count;
+    e->reserved = 0;
+
+    w->block_used = BLOCK_HEADER_SIZE;
+    w->block_count = 0;
+    return 0;
+}
+
+int sample_log_create(struct sample_log_writer *w, const char *path,
+                      const char *interface, int64_t start_time_ns,
+                      double duration, uint32_t sample_rate_hz,
+                      uint32_t num_columns, const char *const *column_names) {
+    struct file_header hdr;
+    uint32_t names_len = 0, max_sample, header_blocks;
+    uint8_t *header;
+    char *p;
+
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+
+    if (num_columns == 0 || num_columns > SAMPLE_LOG_MAX_COLUMNS) {
+        fprintf(stderr, "sample_log: unsupported column count %u\n", num_columns);
+        return -1;
+    }
+    for (uint32_t i = 0; i < num_columns; i++) {
+        names_len += strlen(column_names[i]) + 1;
+    }
+
+    // A block must hold at least one sample with every column absolute
+    max_sample = MAX_VARINT_LEN + num_columns * MAX_VARINT_LEN;
+    w->block_size = SAMPLE_LOG_BLOCK_SIZE;
+    while (w->block_size - BLOCK_HEADER_SIZE < max_sample) {
+        w->block_size *= 2;
+    }
+    header_blocks = (FILE_HEADER_SIZE + names_len + w->block_size - 1) / w->block_size;
+    w->data_offset = (uint64_t)header_blocks * w->block_size;
+    w->num_columns = num_columns;
+
+    w->block = calloc(1, w->block_size);
+    w->scratch = malloc(max_sample);
+    w->prev_values = calloc(num_columns, sizeof(uint64_t));
+    header = calloc(header_blocks, w->block_size);
+    if (!w->block || !w->scratch || !w->prev_values || !header) {
+        fprintf(stderr, "sample_log: out of memory\n");
+        free(header);
+        sample_log_close(w);
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FILE_MAGIC, sizeof(hdr.magic));
+    hdr.version = FILE_VERSION;
+    hdr.header_blocks = (uint16_t)header_blocks;
+    hdr.block_size = w->block_size;
+    hdr.num_columns = num_columns;
+    hdr.names_len = names_len;
+    hdr.start_time_ns = start_time_ns;
+    hdr.duration = duration;
+    hdr.sample_rate_hz = sample_rate_hz;
+    snprintf(hdr.interface, sizeof(hdr.interface), "%s", interface);
+    memcpy(header, &hdr, sizeof(hdr));
+
+    p = (char *)header + FILE_HEADER_SIZE;
+    for (uint32_t i = 0; i < num_columns; i++) {
+        size_t len = strlen(column_names[i]) + 1;
+        memcpy(p, column_names[i], len);
+        p += len;
+    }
+
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        fprintf(stderr, "sample_log: failed to create %s: %s\n", path, strerror(errno));
+        free(header);
+        sample_log_close(w);
+        return -1;
+    }
+    if (write_full(w->fd, header, w->data_offset, 0)) {
+        fprintf(stderr, "sample_log: failed to write header: %s\n", strerror(errno));
+        free(header);
+        sample_log_close(w);
+        return -1;
+    }
+    free(header);
+
+    w->block_used = BLOCK_HEADER_SIZE;
+    return 0;
+}
+
+int sample_log_append(struct sample_log_writer *w, int64_t ts_ns, const uint64_t *values) {
+    uint32_t len;
+
+    if (w->block_count == 0) {
+        w->block_first_ts = ts_ns;
+        w->prev_ts = ts_ns;
+        w->prev_delta = 0;
+        memset(w->prev_values, 0, w->num_columns * sizeof(uint64_t));
+    }
+
+    len = encode_sample(w, ts_ns, values, w->scratch);
+    if (w->block_used + len > w->block_size || w->block_count == UINT16_MAX) {
+        if (finalize_block(w)) {
+            return -1;
+        }
+        return sample_log_append(w, ts_ns, values);
+    }
+
+    memcpy(w->block + w->block_used, w->scratch, len);
+    w->block_used += len;
+    w->block_count++;
+    w->prev_delta = ts_ns - w->prev_ts;
+    w->prev_ts = ts_ns;
+    memcpy(w->prev_values, values, w->num_columns * sizeof(uint64_t));
+    w->num_samples++;
+    return 0;
+}
+
+// Make every appended sample visible to readers by rewriting the partially
+// filled tail block in its slot. Finalized blocks are never rewritten.
+int sample_log_flush(struct sample_log_writer *w) {
+    if (w->block_count == 0) {
+        return 0;
+    }
+    return write_tail_block(w);
+}
+
+int sample_log_close(struct sample_log_writer *w) {
+    struct trailer tr;
+    int ret = 0;
+
+    if (w->fd >= 0) {
+        off_t index_offset;
+
+        ret = finalize_block(w);
+        index_offset = block_offset(w->data_offset, w->block_size, w->num_blocks);
+        memset(&tr, 0, sizeof(tr));
+        memcpy(tr.magic, TRAILER_MAGIC, sizeof(tr.magic));
+        tr.index_offset = index_offset;
+        tr.num_blocks = w->num_blocks;
+        tr.num_samples = w->num_samples;
+        if (!ret) {
+            ret = write_full(w->fd, w->index, w->num_blocks * sizeof(*w->index), index_offset);
+        }
+        if (!ret) {
+            ret = write_full(w->fd, &tr, sizeof(tr),
+                             index_offset + w->num_blocks * sizeof(*w->index));
+        }
+        if (ret) {
+            fprintf(stderr, "sample_log: failed to write index: %s\n", strerror(errno));
+        }
+        close(w->fd);
+        w->fd = -1;
+    }
+    free(w->block);
+    free(w->scratch);
+    free(w->prev_values);
+    free(w->index);
+    w->block = NULL;
+    w->scratch = NULL;
+    w->prev_values = NULL;
+    w->index = NULL;
+    return ret;
+}
+
+/* ---------------------------------------------------------------- reader */
+
+static int load_trailer_index(struct sample_log_reader *r, off_t file_size) {
+    struct trailer tr;
+    uint64_t expected;
+
+    if (file_size < (off_t)(r->data_offset + TRAILER_SIZE) ||
+        read_full(r->fd, &tr, sizeof(tr), file_size - TRAILER_SIZE) ||
+        memcmp(tr.magic, TRAILER_MAGIC, sizeof(tr.magic)) != 0) {
+        return -1;
+    }
+    expected = tr.index_offset + tr.num_blocks * sizeof(*r->index) + TRAILER_SIZE;
+    if (expected != (uint64_t)file_size ||
+        tr.index_offset != r->data_offset + tr.num_blocks * r->block_size) {
+        return -1;
+    }
+
+    r->index = calloc(tr.num_blocks ? tr.num_blocks : 1, sizeof(*r->index));
+    if (!r->index ||
+        read_full(r->fd, r->index, tr.num_blocks * sizeof(*r->index), tr.index_offset)) {
+        free(r->index);
+        r->index = NULL;
+        return -1;
+    }
+    r->num_blocks = tr.num_blocks;
+    r->num_samples = tr.num_samples;
+    return 0;
+}
+
+// Rebuild the index from block headers for logs that were never closed
+static int scan_block_index(struct sample_log_reader *r, off_t file_size) {
+    uint64_t max_blocks = 0;
+
+    if ((uint64_t)file_size > r->data_offset) {
+        max_blocks = ((uint64_t)file_size - r->data_offset) / r->block_size;
+    }
+    r->index = calloc(max_blocks ? max_blocks : 1, sizeof(*r->index));
+    if (!r->index) {
+        return -1;
+    }
+
+    r->num_blocks = 0;
+    r->num_samples = 0;
+    for (uint64_t b = 0; b < max_blocks; b++) {
+        struct block_header hdr;
+
+        if (read_full(r->fd, &hdr, sizeof(hdr), block_offset(r->data_offset, r->block_size, b)) ||
+            hdr.magic != BLOCK_MAGIC || hdr.count == 0 || hdr.block_no != (uint32_t)b) {
+            break;
+        }
+        r->index[b].first_ts = hdr.first_ts;
+        r->index[b].last_ts = hdr.last_ts;
+        r->index[b].count = hdr.count;
+        r->num_blocks++;
+        r->num_samples += hdr.count;
+    }
+    return 0;
+}
+
+int sample_log_open(struct sample_log_reader *r, const char *path) {
+    struct file_header hdr;
+    struct stat st;
+    char *p, *end;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->fd < 0) {
+        fprintf(stderr, "sample_log: failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (read_full(r->fd, &hdr, sizeof(hdr), 0) ||
+        memcmp(hdr.magic, FILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != FILE_VERSION || hdr.num_columns == 0 ||
+        hdr.num_columns > SAMPLE_LOG_MAX_COLUMNS || hdr.block_size < SAMPLE_LOG_BLOCK_SIZE ||
+        FILE_HEADER_SIZE + hdr.names_len > (uint64_t)hdr.header_blocks * hdr.block_size) {
+        fprintf(stderr, "sample_log: %s is not a sample log\n", path);
+        sample_log_close_reader(r);
+        return -1;
+    }
+
+    r->block_size = hdr.block_size;
+    r->data_offset = (uint64_t)hdr.header_blocks * hdr.block_size;
+    r->num_columns = hdr.num_columns;
+    r->start_time_ns = hdr.start_time_ns;
+    r->duration = hdr.duration;
+    r->sample_rate_hz = hdr.sample_rate_hz;
+    memcpy(r->interface, hdr.interface, sizeof(r->interface));
+    r->interface[sizeof(r->interface) - 1] = '\0';
+
+    r->names_buf = malloc(hdr.names_len + 1);
+    r->column_names = calloc(hdr.num_columns, sizeof(char *));
+    r->block = malloc(r->block_size);
+    r->prev_values = calloc(hdr.num_columns, sizeof(uint64_t));
+    if (!r->names_buf || !r->column_names || !r->block || !r->prev_values ||
+        read_full(r->fd, r->names_buf, hdr.names_len, FILE_HEADER_SIZE)) {
+        fprintf(stderr, "sample_log: failed to read column names\n");
+        sample_log_close_reader(r);
+        return -1;
+    }
+    r->names_buf[hdr.names_len] = '\0';
+
+    p = r->names_buf;
+    end = r->names_buf + hdr.names_len;
+    for (uint32_t i = 0; i < hdr.num_columns; i++) {
+        if (p >= end) {
+            fprintf(stderr, "sample_log: truncated column names\n");
+            sample_log_close_reader(r);
+            return -1;
+        }
+        r->column_names[i] = p;
+        p += strlen(p) + 1;
+    }
+
+    if (fstat(r->fd, &st) ||
+        (load_trailer_index(r, st.st_size) && scan_block_index(r, st.st_size))) {
+        fprintf(stderr, "sample_log: failed to load block index\n");
+        sample_log_close_reader(r);
+        return -1;
+    }
+
+    r->cur_block = 0;
+    r->block_left = 0;
+    r->block_pos = r->block_len = 0;
+    return 0;
+}
+
+static int load_block(struct sample_log_reader *r, uint64_t b) {
+    struct block_header hdr;
+
+    if (read_full(r->fd, r->block, r->block_size, block_offset(r->data_offset, r->block_size, b))) {
+        return -1;
+    }
+    memcpy(&hdr, r->block, sizeof(hdr));
+    if (hdr.magic != BLOCK_MAGIC || hdr.payload_len > r->block_size - BLOCK_HEADER_SIZE) {
+        return -1;
+    }
+
+    r->cur_block = b;
+    r->block_pos = BLOCK_HEADER_SIZE;
+    r->block_len = BLOCK_HEADER_SIZE + hdr.payload_len;
+    r->block_left = hdr.count;
+    r->prev_ts = hdr.first_ts;
+    r->prev_delta = 0;
+    memset(r->prev_values, 0, r->num_columns * sizeof(uint64_t));
+    return 0;
+}
+
+// Position the cursor on the block holding the first sample at or after
+// ts_ns, backed up by one block so callers that need the preceding sample
+// (rate computation) see it too. Callers skip samples before ts_ns.
+int sample_log_seek(struct sample_log_reader *r, int64_t ts_ns) {
+    uint64_t lo = 0, hi = r->num_blocks;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (r->index[mid].last_ts < ts_ns) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) {
+        lo--;
+    }
+
+    r->cur_block = lo;
+    r->block_left = 0;
+    r->block_pos = r->block_len = 0;
+    if (lo < r->num_blocks) {
+        return load_block(r, lo);
+    }
+    return 0;
+}
+
+// Returns 1 and fills ts_ns/values for the next sample, 0 at end of log, -1
+// on a corrupt block.
+int sample_log_next(struct sample_log_reader *r, int64_t *ts_ns, uint64_t *values) {
+    const uint8_t *p, *end;
+    uint64_t v;
+    uint32_t i = 0;
+
+    while (r->block_left == 0) {
+        uint64_t next = r->block_len ? r->cur_block + 1 : r->cur_block;
+        if (next >= r->num_blocks) {
+            return 0;
+        }
+        if (load_block(r, next)) {
+            return -1;
+        }
+    }
+
+    p = r->block + r->block_pos;
+    end = r->block + r->block_len;
+
+    if (get_varint(&p, end, &v)) {
+        return -1;
+    }
+    r->prev_delta += unzigzag(v);
+    r->prev_ts += r->prev_delta;
+
+    while (i < r->num_columns) {
+        if (get_varint(&p, end, &v)) {
+            return -1;
+        }
+        if (v == 0) {
+            uint64_t run;
+            if (get_varint(&p, end, &run) || run >= r->num_columns - i) {
+                return -1;
+            }
+            i += run + 1;
+        } else {
+            r->prev_values[i] += (uint64_t)unzigzag(v);
+            i++;
+        }
+    }
+
+    r->block_pos = (uint32_t)(p - r->block);
+    r->block_left--;
+    *ts_ns = r->prev_ts;
+    memcpy(values, r->prev_values, r->num_columns * sizeof(uint64_t));
+    return 1;
+}
+
+void sample_log_close_reader(struct sample_log_reader *r) {
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    r->fd = -1;
+    free(r->names_buf);
+    free(r->column_names);
+    free(r->index);
+    free(r->block);
+    free(r->prev_values);
+    r->names_buf = NULL;
+    r->column_names = NULL;
+    r->index = NULL;
+    r->block = NULL;
+    r->prev_values = NULL;
+}
+
+/* ------------------------------------------- demo_throughput.json layout */
+
+static void update_summary(struct throughput_summary *s, int k, double rate) {
+    if (rate >= OUTLIER_MBPS) {
+        return;
+    }
+    if (s->count[k] == 0 || rate > s->peak[k]) {
+        s->peak[k] = rate;
+    }
+    if (s->count[k] == 0 || rate < s->min[k]) {
+        s->min[k] = rate;
+    }
+    s->sum[k] += rate;
+    s->count[k]++;
+}
+
+static int is_traffic_counter(const char *name) {
+    return strcmp(name, "tx_bytes") == 0 || strcmp(name, "rx_bytes") == 0 ||
+           strcmp(name, "tx_packets") == 0 || strcmp(name, "rx_packets") == 0;
+}
+
+// Length of the "<dev>/<port>" prefix of a per-port column name, 0 if none
+static size_t port_prefix_len(const char *name) {
+    const char *colon = strchr(name, ':');
+    return colon ? (size_t)(colon - name) : 0;
+}
+
+static int find_port_column(uint32_t first, uint32_t last, const char *const *names,
+                            size_t prefix, const char *counter) {
+    for (uint32_t i = first; i < last; i++) {
+        if (strcmp(names[i] + prefix + 1, counter) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+void throughput_json_begin(FILE *out, const char *interface, double duration,
+                           double start_time, int sample_rate_hz) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"interface\": \"%s\",\n", interface);
+    fprintf(out, "  \"duration\": %.17g,\n", duration);
+    fprintf(out, "  \"start_time\": %.7f,\n", start_time);
+    fprintf(out, "  \"sample_rate_hz\": %d,\n", sample_rate_hz);
+    fprintf(out, "  \"data_points\": [");
+}
+
+void throughput_json_sample(FILE *out, uint64_t index, double timestamp, double elapsed,
+                            double dt, uint32_t num_columns, const char *const *column_names,
+                            const uint64_t *values, const uint64_t *prev_values,
+                            int include_counters, struct throughput_summary *summary) {
+    double send_rate = 0, recv_rate = 0;
+    int active = 0, ports = 0;
+    uint32_t first, last;
+
+    if (dt > 0) {
+        send_rate = ((values[SAMPLE_LOG_TX_BYTES] - prev_values[SAMPLE_LOG_TX_BYTES]) * 8.0) / (dt * 1e6);
+        recv_rate = ((values[SAMPLE_LOG_RX_BYTES] - prev_values[SAMPLE_LOG_RX_BYTES]) * 8.0) / (dt * 1e6);
+    }
+    update_summary(summary, 0, send_rate);
+    update_summary(summary, 1, recv_rate);
+    update_summary(summary, 2, send_rate + recv_rate);
+
+    fprintf(out, "%s\n    {\n", index ? "," : "");
+    fprintf(out, "      \"timestamp\": %.7f,\n", timestamp);
+    fprintf(out, "      \"elapsed_time\": %.9f,\n", elapsed);
+    fprintf(out, "      \"bytes_sent\": %lu,\n", values[SAMPLE_LOG_TX_BYTES]);
+    fprintf(out, "      \"bytes_recv\": %lu,\n", values[SAMPLE_LOG_RX_BYTES]);
+    fprintf(out, "      \"packets_sent\": %lu,\n", values[SAMPLE_LOG_TX_PACKETS]);
+    fprintf(out, "      \"packets_recv\": %lu,\n", values[SAMPLE_LOG_RX_PACKETS]);
+    fprintf(out, "      \"send_rate_mbps\": %.17g,\n", send_rate);
+    fprintf(out, "      \"recv_rate_mbps\": %.17g,\n", recv_rate);
+    fprintf(out, "      \"total_rate_mbps\": %.17g,\n", send_rate + recv_rate);
+
+    // port_stats lists the RDMA ports that moved traffic in this interval,
+    // each with its traffic counters, so an empty list means no RDMA traffic
+    fprintf(out, "      \"port_stats\": [");
+    for (first = SAMPLE_LOG_NET_COLUMNS; first < num_columns; first = last) {
+        size_t prefix = port_prefix_len(column_names[first]);
+        int cols[SAMPLE_LOG_NET_COLUMNS], moved = 0;
+
+        for (last = first + 1; last < num_columns && prefix &&
+             strncmp(column_names[last], column_names[first], prefix + 1) == 0; last++) {
+        }
+        if (!prefix) {
+            continue;
+        }
+        for (int k = 0; k < SAMPLE_LOG_NET_COLUMNS; k++) {
+            cols[k] = find_port_column(first, last, column_names, prefix, sample_log_net_columns[k]);
+            moved |= cols[k] >= 0 && values[cols[k]] != prev_values[cols[k]];
+        }
+        if (!moved) {
+            continue;
+        }
+        fprintf(out, "%s\"%.*s", active++ ? ", " : "", (int)prefix, column_names[first]);
+        for (int k = 0; k < SAMPLE_LOG_NET_COLUMNS; k++) {
+            fprintf(out, " %s=%lu", sample_log_net_columns[k], cols[k] >= 0 ? values[cols[k]] : 0);
+        }
+        fprintf(out, "\"");
+    }
+    fprintf(out, "],\n");
+
+    fprintf(out, "      \"rdma\": {");
+    for (first = SAMPLE_LOG_NET_COLUMNS; first < num_columns; first = last) {
+        static const char *traffic[] = { "tx_bytes", "rx_bytes", "tx_packets", "rx_packets" };
+        size_t prefix = port_prefix_len(column_names[first]);
+        int counters = 0;
+
+        for (last = first + 1; last < num_columns && prefix &&
+             strncmp(column_names[last], column_names[first], prefix + 1) == 0; last++) {
+        }
+        if (!prefix) {
+            continue;
+        }
+
+        fprintf(out, "%s\n        \"%.*s\": {", ports++ ? "," : "", (int)prefix, column_names[first]);
+        for (int k = 0; k < 4; k++) {
+            int c = find_port_column(first, last, column_names, prefix, traffic[k]);
+            fprintf(out, "%s\"%s\": %lu", k ? ", " : "", traffic[k], c >= 0 ? values[c] : 0);
+        }
+        if (include_counters) {
+            fprintf(out, ", \"counters\": {");
+            for (uint32_t c = first; c < last; c++) {
+                const char *name = column_names[c] + prefix + 1;
+                if (is_traffic_counter(name)) {
+                    continue;
+                }
+                fprintf(out, "%s\"%s\": %lu", counters++ ? ", " : "", name, values[c]);
+            }
+            fprintf(out, "}");
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "%s}\n    }", ports ? "\n      " : "");
+}
+
+void throughput_json_end(FILE *out, uint64_t num_samples, double end_time,
+                         const struct throughput_summary *summary) {
+    static const char *names[3] = { "send_rate", "recv_rate", "total_rate" };
+    int sections = 0;
+
+    fprintf(out, "%s],\n", num_samples ? "\n  " : "");
+    fprintf(out, "  \"end_time\": %.7f,\n", end_time);
+    fprintf(out, "  \"summary\": {");
+    for (int k = 0; k < 3; k++) {
+        if (!summary->count[k]) {
+            continue;
+        }
+        fprintf(out, "%s\n    \"%s\": {\n", sections++ ? "," : "", names[k]);
+        fprintf(out, "      \"avg\": %.17g,\n", summary->sum[k] / summary->count[k]);
+        fprintf(out, "      \"peak\": %.17g,\n", summary->peak[k]);
+        fprintf(out, "      \"min\": %.17g\n", summary->min[k]);
+        fprintf(out, "    }");
+    }
+    fprintf(out, "%s}\n}\n", sections ? "\n  " : "");
+}
+
+// Convert the samples between from_elapsed and to_elapsed (seconds since the
+// log's start time, to_elapsed < 0 for no upper bound) to the JSON layout.
+// Per-port "counters" are emitted whenever one of them changed.
+int sample_log_export_json(struct sample_log_reader *r, FILE *out,
+                           double from_elapsed, double to_elapsed) {
+    struct throughput_summary summary;
+    uint64_t *values, *prev, *tmp;
+    int64_t from_ns = r->start_time_ns + (int64_t)(from_elapsed * 1e9);
+    int64_t to_ns = to_elapsed < 0 ? INT64_MAX : r->start_time_ns + (int64_t)(to_elapsed * 1e9);
+    int64_t ts, prev_ts = 0, last_ts = r->start_time_ns;
+    uint64_t emitted = 0;
+    int have_prev = 0, ret;
+
+    values = calloc(r->num_columns, sizeof(uint64_t));
+    prev = calloc(r->num_columns, sizeof(uint64_t));
+    if (!values || !prev) {
+        free(values);
+        free(prev);
+        return -1;
+    }
+    memset(&summary, 0, sizeof(summary));
+
+    throughput_json_begin(out, r->interface, r->duration, r->start_time_ns / 1e9,
+                          (int)r->sample_rate_hz);
+    ret = sample_log_seek(r, from_ns);
+    while (ret == 0 && (ret = sample_log_next(r, &ts, values)) == 1) {
+        ret = 0;
+        if (ts > to_ns) {
+            break;
+        }
+        if (have_prev && ts >= from_ns) {
+            int counters_changed = emitted == 0;
+            for (uint32_t c = SAMPLE_LOG_NET_COLUMNS; c < r->num_columns && !counters_changed; c++) {
+                size_t prefix = port_prefix_len(r->column_names[c]);
+                counters_changed = values[c] != prev[c] && prefix &&
+                                   !is_traffic_counter(r->column_names[c] + prefix + 1);
+            }
+            throughput_json_sample(out, emitted++, ts / 1e9, (ts - r->start_time_ns) / 1e9,
+                                   (ts - prev_ts) / 1e9, r->num_columns,
+                                   (const char *const *)r->column_names, values, prev,
+                                   counters_changed, &summary);
+            last_ts = ts;
+        }
+        tmp = prev;
+        prev = values;
+        values = tmp;
+        prev_ts = ts;
+        have_prev = 1;
+    }
+    throughput_json_end(out, emitted, last_ts / 1e9, &summary);
+
+    free(values);
+    free(prev);
+    return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Compact binary time-series log for throughput samples
+ *
+ * A sample is a timestamp plus a fixed set of named uint64 counter columns
+ * (netdev bytes/packets, RDMA port counters). Samples are appended to
+ * fixed-size blocks; each block is independently decodable so a reader can
+ * jump straight to the block covering a time range.
+ *
+ * File layout (all integers little-endian):
+ *   header blocks  magic, block size, start time, requested duration and
+ *                  rate, interface, NUL-separated column names
+ *   data blocks    32-byte block header followed by varint payload; the
+ *                  tail block is rewritten in place on flush
+ *   index          one entry per data block (first/last timestamp, count)
+ *   trailer        magic, index offset, block and sample counts
+ *
+ * The index and trailer are written on close. A log that was never closed
+ * (crash, kill -9) is still readable; the reader rebuilds the index from the
+ * block headers.
+ *
+ * Payload encoding per sample:
+ *   timestamp  zigzag varint of the delta-of-delta in nanoseconds
+ *   columns    zigzag varint deltas against the previous sample; a run of
+ *              unchanged columns is a 0 token followed by (run length - 1)
+ * The first sample of a block is encoded against zero, so it carries
+ * absolute values.
+ */
+
+#ifndef SAMPLE_LOG_H
+#define SAMPLE_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SAMPLE_LOG_BLOCK_SIZE 4096    // grown to a power of two for wide schemas
+#define SAMPLE_LOG_MAX_COLUMNS 1024
+#define SAMPLE_LOG_IFNAME_LEN 32
+
+// Columns that every throughput log starts with, in this order
+enum sample_log_net_column {
+    SAMPLE_LOG_TX_BYTES,
+    SAMPLE_LOG_RX_BYTES,
+    SAMPLE_LOG_TX_PACKETS,
+    SAMPLE_LOG_RX_PACKETS,
+    SAMPLE_LOG_NET_COLUMNS
+};
+
+extern const char *sample_log_net_columns[SAMPLE_LOG_NET_COLUMNS];
+
+struct sample_log_index_entry {
+    int64_t first_ts;
+    int64_t last_ts;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct sample_log_writer {
+    int fd;
+    uint32_t block_size;
+    uint64_t data_offset;
+    uint32_t num_columns;
+    uint64_t num_blocks;       // finalized data blocks
+    uint64_t num_samples;
+    uint8_t *block;            // tail block being filled
+    uint32_t block_used;
+    uint32_t block_count;
+    int64_t block_first_ts;
+    int64_t prev_ts;
+    int64_t prev_delta;
+    uint64_t *prev_values;
+    uint8_t *scratch;
+    struct sample_log_index_entry *index;
+    uint64_t index_cap;
+};
+
+struct sample_log_reader {
+    int fd;
+    uint32_t block_size;
+    uint64_t data_offset;
+    uint32_t num_columns;
+    int64_t start_time_ns;
+    double duration;
+    uint32_t sample_rate_hz;
+    char interface[SAMPLE_LOG_IFNAME_LEN];
+    char **column_names;
+    char *names_buf;
+    uint64_t num_blocks;
+    uint64_t num_samples;
+    struct sample_log_index_entry *index;
+
+    // Decode cursor
+    uint64_t cur_block;
+    uint8_t *block;
+    uint32_t block_pos;
+    uint32_t block_len;
+    uint32_t block_left;
+    int64_t prev_ts;
+    int64_t prev_delta;
+    uint64_t *prev_values;
+};
+
+// Writer
+int sample_log_create(struct sample_log_writer *w, const char *path,
+                      const char *interface, int64_t start_time_ns,
+                      double duration, uint32_t sample_rate_hz,
+                      uint32_t num_columns, const char *const *column_names);
+int sample_log_append(struct sample_log_writer *w, int64_t ts_ns, const uint64_t *values);
+int sample_log_flush(struct sample_log_writer *w);
+int sample_log_close(struct sample_log_writer *w);
+
+// Reader
+int sample_log_open(struct sample_log_reader *r, const char *path);
+int sample_log_seek(struct sample_log_reader *r, int64_t ts_ns);
+int sample_log_next(struct sample_log_reader *r, int64_t *ts_ns, uint64_t *values);
+void sample_log_close_reader(struct sample_log_reader *r);
+
+/*
+ * demo_throughput.json layout
+ *
+ * Columns after the netdev ones are named "<dev>/<port>:<counter>" and the
+ * columns of one port must be contiguous. The per-port traffic counters use
+ * the names tx_bytes, rx_bytes, tx_packets and rx_packets; anything else is
+ * emitted under "counters" when include_counters is set.
+ */
+struct throughput_summary {
+    double sum[3];
+    double peak[3];
+    double min[3];
+    uint64_t count[3];
+};
+
+void throughput_json_begin(FILE *out, const char *interface, double duration,
+                           double start_time, int sample_rate_hz);
+void throughput_json_sample(FILE *out, uint64_t index, double timestamp, double elapsed,
+                            double dt, uint32_t num_columns, const char *const *column_names,
+                            const uint64_t *values, const uint64_t *prev_values,
+                            int include_counters, struct throughput_summary *summary);
+void throughput_json_end(FILE *out, uint64_t num_samples, double end_time,
+                         const struct throughput_summary *summary);
+
+int sample_log_export_json(struct sample_log_reader *r, FILE *out,
+                           double from_elapsed, double to_elapsed);
+
+#endif
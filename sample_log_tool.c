@@ -0,0 +1,232 @@
+/*
+ * Sample log utility
+ * Inspect and convert binary throughput logs written by rdma_sampler, and
+ * compare the binary format against the demo_throughput.json layout.
+ *
+ * Usage:
+ *   sample_log_tool info LOG
+ *   sample_log_tool to-json LOG OUT.json [FROM_SEC [TO_SEC]]
+ *   sample_log_tool bench [SAMPLES] [DIR]
+ *
+ * Compile with: gcc -O2 -o sample_log_tool sample_log_tool.c sample_log.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "sample_log.h"
+
+#define BENCH_SAMPLES 1000000
+#define BENCH_RATE_HZ 10000
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static int cmd_info(const char *path) {
+    struct sample_log_reader r;
+    long size;
+
+    if (sample_log_open(&r, path)) {
+        return 1;
+    }
+    size = file_size(path);
+
+    printf("Interface:    %s\n", r.interface);
+    printf("Start time:   %.6f\n", r.start_time_ns / 1e9);
+    printf("Duration:     %g seconds requested, %d Hz\n", r.duration, r.sample_rate_hz);
+    printf("Block size:   %u bytes\n", r.block_size);
+    printf("Blocks:       %lu\n", r.num_blocks);
+    printf("Samples:      %lu\n", r.num_samples);
+    if (r.num_blocks) {
+        printf("Time range:   %.6f - %.6f s\n",
+               (r.index[0].first_ts - r.start_time_ns) / 1e9,
+               (r.index[r.num_blocks - 1].last_ts - r.start_time_ns) / 1e9);
+    }
+    printf("File size:    %ld bytes\n", size);
+    if (r.num_samples) {
+        printf("Bytes/sample: %.2f\n", (double)size / r.num_samples);
+    }
+    printf("Columns (%u):\n", r.num_columns);
+    for (uint32_t i = 0; i < r.num_columns; i++) {
+        printf("  %s\n", r.column_names[i]);
+    }
+
+    sample_log_close_reader(&r);
+    return 0;
+}
+
+static int cmd_to_json(const char *path, const char *out_path, double from, double to) {
+    struct sample_log_reader r;
+    FILE *out;
+    int ret;
+
+    if (sample_log_open(&r, path)) {
+        return 1;
+    }
+    out = fopen(out_path, "w");
+    if (!out) {
+        perror(out_path);
+        sample_log_close_reader(&r);
+        return 1;
+    }
+
+    ret = sample_log_export_json(&r, out, from, to);
+    fclose(out);
+    sample_log_close_reader(&r);
+    if (ret) {
+        fprintf(stderr, "Failed to convert %s\n", path);
+        return 1;
+    }
+    printf("Converted %s -> %s\n", path, out_path);
+    return 0;
+}
+
+// Synthetic 10 kHz stream shaped like rdma_sampler output for one rxe port:
+// four netdev columns, four traffic columns and a few slow error counters.
+static void synth_sample(uint64_t i, int64_t start_ns, int64_t *ts, uint64_t *v) {
+    uint64_t bytes = 1200 + (i * 2654435761u) % 800;
+
+    *ts = start_ns + (int64_t)i * (1000000000 / BENCH_RATE_HZ) + (int64_t)((i * 40503u) % 20000);
+    v[0] += bytes;
+    v[1] += bytes / 3;
+    v[2] += 1;
+    v[3] += (i & 3) == 0;
+    v[4] += bytes;
+    v[5] += bytes / 3;
+    v[6] += 1;
+    v[7] += (i & 3) == 0;
+    v[8] += (i % 100000) == 0;
+    v[9] += (i % 250000) == 0;
+}
+
+static int cmd_bench(uint64_t samples, const char *dir) {
+    static const char *names[] = {
+        "tx_bytes", "rx_bytes", "tx_packets", "rx_packets",
+        "rxe0/1:tx_bytes", "rxe0/1:rx_bytes", "rxe0/1:tx_packets", "rxe0/1:rx_packets",
+        "rxe0/1:hw_counters/retry_exceeded_err", "rxe0/1:hw_counters/rcvd_seq_err",
+    };
+    const uint32_t ncols = sizeof(names) / sizeof(names[0]);
+    char bin_path[512], json_path[512];
+    struct sample_log_writer w;
+    struct sample_log_reader r;
+    struct throughput_summary summary;
+    uint64_t v[16] = {0}, prev[16] = {0}, decoded = 0;
+    int64_t start_ns = 1757837010000000000LL, ts, prev_ts;
+    double t0, bin_time, json_time, read_time, seek_time;
+    long bin_size, json_size;
+    FILE *out;
+
+    snprintf(bin_path, sizeof(bin_path), "%s/sample_log_bench.rsl", dir);
+    snprintf(json_path, sizeof(json_path), "%s/sample_log_bench.json", dir);
+
+    // Binary log
+    if (sample_log_create(&w, bin_path, "eth0", start_ns, samples / (double)BENCH_RATE_HZ,
+                          BENCH_RATE_HZ, ncols, names)) {
+        return 1;
+    }
+    t0 = now_sec();
+    for (uint64_t i = 0; i < samples; i++) {
+        synth_sample(i, start_ns, &ts, v);
+        sample_log_append(&w, ts, v);
+        if (i % BENCH_RATE_HZ == 0) {
+            sample_log_flush(&w);
+        }
+    }
+    sample_log_close(&w);
+    bin_time = now_sec() - t0;
+    bin_size = file_size(bin_path);
+
+    // Streaming JSON in the demo_throughput.json layout
+    out = fopen(json_path, "w");
+    if (!out) {
+        perror(json_path);
+        return 1;
+    }
+    memset(v, 0, sizeof(v));
+    memset(&summary, 0, sizeof(summary));
+    prev_ts = start_ns;
+    t0 = now_sec();
+    throughput_json_begin(out, "eth0", samples / (double)BENCH_RATE_HZ, start_ns / 1e9, BENCH_RATE_HZ);
+    for (uint64_t i = 0; i < samples; i++) {
+        synth_sample(i, start_ns, &ts, v);
+        throughput_json_sample(out, i, ts / 1e9, (ts - start_ns) / 1e9, (ts - prev_ts) / 1e9,
+                               ncols, names, v, prev, i % 1000 == 0, &summary);
+        memcpy(prev, v, sizeof(v));
+        prev_ts = ts;
+    }
+    throughput_json_end(out, samples, ts / 1e9, &summary);
+    fclose(out);
+    json_time = now_sec() - t0;
+    json_size = file_size(json_path);
+
+    // Full sequential decode and a 1-second window from the middle
+    if (sample_log_open(&r, bin_path)) {
+        return 1;
+    }
+    t0 = now_sec();
+    while (sample_log_next(&r, &ts, v) == 1) {
+        decoded++;
+    }
+    read_time = now_sec() - t0;
+
+    t0 = now_sec();
+    int64_t from = start_ns + (int64_t)(samples / 2) * (1000000000 / BENCH_RATE_HZ);
+    uint64_t window = 0;
+    sample_log_seek(&r, from);
+    while (sample_log_next(&r, &ts, v) == 1 && ts < from + 1000000000LL) {
+        window += ts >= from;
+    }
+    seek_time = now_sec() - t0;
+    sample_log_close_reader(&r);
+
+    printf("=== Sample Log Benchmark (%lu samples, %u columns, %d Hz) ===\n",
+           samples, ncols, BENCH_RATE_HZ);
+    printf("%-22s %14s %12s %14s\n", "Format", "Size (bytes)", "Bytes/sample", "Write ns/sample");
+    printf("%-22s %14ld %12.2f %14.1f\n", "binary sample log", bin_size,
+           (double)bin_size / samples, bin_time * 1e9 / samples);
+    printf("%-22s %14ld %12.2f %14.1f\n", "JSON (streamed)", json_size,
+           (double)json_size / samples, json_time * 1e9 / samples);
+    printf("Size ratio:            %.1fx smaller\n", (double)json_size / bin_size);
+    printf("Write cost ratio:      %.1fx cheaper\n", json_time / bin_time);
+    printf("Sequential decode:     %lu samples, %.1f ns/sample\n", decoded, read_time * 1e9 / decoded);
+    printf("Time-range read (1 s): %lu samples in %.3f ms\n", window, seek_time * 1e3);
+
+    unlink(bin_path);
+    unlink(json_path);
+    return decoded == samples ? 0 : 1;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s info LOG\n", prog);
+    printf("       %s to-json LOG OUT.json [FROM_SEC [TO_SEC]]\n", prog);
+    printf("       %s bench [SAMPLES] [DIR]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "info") == 0) {
+        return cmd_info(argv[2]);
+    }
+    if (argc >= 4 && strcmp(argv[1], "to-json") == 0) {
+        double from = argc > 4 ? atof(argv[4]) : 0;
+        double to = argc > 5 ? atof(argv[5]) : -1;
+        return cmd_to_json(argv[2], argv[3], from, to);
+    }
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        uint64_t samples = argc > 2 ? strtoull(argv[2], NULL, 10) : BENCH_SAMPLES;
+        return cmd_bench(samples ? samples : BENCH_SAMPLES, argc > 3 ? argv[3] : "/tmp");
+    }
+    usage(argv[0]);
+    return 1;
+}
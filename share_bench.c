@@ -0,0 +1,514 @@
+/*
+ * QP sharing benchmark: many threads writing over one connection
+ *
+ * For each producer count the client runs that many threads, each keeping
+ * -w RDMA WRITEs of -b bytes in flight into the server's buffer, three
+ * ways:
+ *
+ *   qp      a connection (QP and CQ) per thread, posted and polled by it
+ *           alone: no sharing, and the most connection state
+ *   mutex   one connection; threads take a mutex around ibv_post_send(),
+ *           and whoever gets it polls the CQ and credits each completion
+ *           to the thread whose wr_id it carries
+ *   mpsc    one connection behind a qp_share (rdma_qp_share.h): threads
+ *           submit to its lock-free ring, its poster thread posts chains
+ *           and routes completions back
+ *
+ * and reports aggregate writes per second and bandwidth, write latency
+ * (submit to the thread seeing the completion) percentiles, the QPs used
+ * and how many WRs went to the NIC per ibv_post_send().
+ *
+ * Usage: share_bench -s [-n conns]
+ *        share_bench [-p producers,...] [-w window] [-b bytes] [-t seconds]
+ *                    [-m mode,...] <server_ip>
+ * The server exits after conns connections: by default what one client
+ * with the default -p and all modes makes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <rdma/rdma_cma.h>
+
+#include "rdma_common.h"
+#include "rdma_connection.h"
+#include "rdma_qp_share.h"
+
+#define PORT 18521
+#define SERVER_BUFFER_SIZE (1024 * 1024)    // the largest write the client may do
+#define MAX_PRODUCERS 32
+#define MAX_WINDOW 32
+#define SHARED_DEPTH (MAX_PRODUCERS * MAX_WINDOW)
+#define POLL_BATCH 16
+#define MAX_SAMPLES (1 << 16)       // latency samples kept per producer
+#define MAX_COUNTS 8
+#define DEFAULT_PRODUCERS "1,2,4,8,16,32"
+#define DEFAULT_WINDOW 16
+#define DEFAULT_BYTES 64
+
+_Static_assert(MAX_WINDOW <= QP_SHARE_PRODUCER_DEPTH, "a window must fit a producer's depth");
+
+enum share_mode {
+    SHARE_QP,
+    SHARE_MUTEX,
+    SHARE_MPSC,
+    SHARE_MODE_COUNT,
+};
+
+static const char *const share_mode_names[SHARE_MODE_COUNT] = {"qp", "mutex", "mpsc"};
+
+struct share_opts {
+    int window;
+    uint32_t bytes;
+    double seconds;
+};
+
+// The one connection of mutex and mpsc
+struct shared {
+    struct rdma_context *ctx;
+    pthread_mutex_t lock;
+    struct qp_share *qs;
+    uint64_t completed[MAX_PRODUCERS];      // mutex: credited by whoever polled
+};
+
+struct producer {
+    int index;
+    enum share_mode mode;
+    struct rdma_context *ctx;               // its own, or the shared one
+    struct shared *sh;
+    const struct share_opts *opts;
+    const volatile int *go;
+    pthread_t thread;
+    uint64_t seen;                          // mutex: completions taken from completed
+    uint64_t *lat;
+    long samples;
+    uint64_t writes;
+    double seconds;
+    int failed;
+};
+
+static int run_server(int total) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = SERVER_BUFFER_SIZE,
+        .cq_depth = 2,
+        .qp_depth = 1,
+        .quiet = 1,
+    };
+    int64_t served;
+
+    printf("Waiting for %d connections on port %d\n", total, PORT);
+    served = serve_connections(NULL, PORT, &attr, total, NULL);
+    if (served < 0) {
+        return -1;
+    }
+    printf("Served %ld connections\n", served);
+    return served == total ? 0 : -1;
+}
+
+static void write_wr(struct producer *p, uint64_t wr_id, struct ibv_sge *sge,
+                     struct ibv_send_wr *wr) {
+    struct rdma_context *ctx = p->ctx;
+
+    sge->addr = (uintptr_t)ctx->buffer;
+    sge->length = p->opts->bytes;
+    sge->lkey = ctx->mr->lkey;
+
+    memset(wr, 0, sizeof(*wr));
+    wr->wr_id = wr_id;
+    wr->sg_list = sge;
+    wr->num_sge = 1;
+    wr->opcode = IBV_WR_RDMA_WRITE;
+    wr->send_flags = IBV_SEND_SIGNALED;
+    wr->wr.rdma.remote_addr = ctx->remote_addr;
+    wr->wr.rdma.rkey = ctx->remote_rkey;
+}
+
+// Hand one write to the QP; 0, 1 to retry later, -1 on failure
+static int submit(struct producer *p, uint64_t slot) {
+    struct ibv_sge sge;
+    struct ibv_send_wr wr, *bad_wr;
+    struct qp_share_wr d;
+    int ret;
+
+    switch (p->mode) {
+    case SHARE_QP:
+        write_wr(p, slot, &sge, &wr);
+        ret = ibv_post_send(p->ctx->qp, &wr, &bad_wr);
+        break;
+    case SHARE_MUTEX:
+        write_wr(p, (uint64_t)p->index << 32 | slot, &sge, &wr);
+        pthread_mutex_lock(&p->sh->lock);
+        ret = ibv_post_send(p->ctx->qp, &wr, &bad_wr);
+        pthread_mutex_unlock(&p->sh->lock);
+        break;
+    default:
+        memset(&d, 0, sizeof(d));
+        d.opcode = IBV_WR_RDMA_WRITE;
+        d.local_addr = (uintptr_t)p->ctx->buffer;
+        d.length = p->opts->bytes;
+        d.lkey = p->ctx->mr->lkey;
+        d.remote_addr = p->ctx->remote_addr;
+        d.rkey = p->ctx->remote_rkey;
+        d.cookie = slot;
+        return qp_share_submit(p->sh->qs, p->index, &d);
+    }
+    if (ret) {
+        fprintf(stderr, "Failed to post write\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int check_status(enum ibv_wc_status status) {
+    if (status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(status));
+        return -1;
+    }
+    return 0;
+}
+
+// How many of p's writes completed since the last call, or -1. Each
+// thread's writes go through a single QP, so they complete in order
+static int reap(struct producer *p) {
+    struct ibv_wc wc[POLL_BATCH];
+    struct qp_share_completion c[POLL_BATCH];
+    int n;
+
+    switch (p->mode) {
+    case SHARE_QP:
+        n = ibv_poll_cq(p->ctx->cq, POLL_BATCH, wc);
+        if (n < 0) {
+            fprintf(stderr, "Failed to poll CQ\n");
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (check_status(wc[i].status)) {
+                return -1;
+            }
+        }
+        return n;
+    case SHARE_MUTEX:
+        // Someone else polling is as good: they credit us
+        if (!pthread_mutex_trylock(&p->sh->lock)) {
+            n = ibv_poll_cq(p->ctx->cq, POLL_BATCH, wc);
+            for (int i = 0; i < n; i++) {
+                if (wc[i].status != IBV_WC_SUCCESS) {
+                    pthread_mutex_unlock(&p->sh->lock);
+                    return check_status(wc[i].status);
+                }
+                __atomic_fetch_add(&p->sh->completed[wc[i].wr_id >> 32], 1, __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&p->sh->lock);
+            if (n < 0) {
+                fprintf(stderr, "Failed to poll CQ\n");
+                return -1;
+            }
+        }
+        n = __atomic_load_n(&p->sh->completed[p->index], __ATOMIC_ACQUIRE) - p->seen;
+        p->seen += n;
+        return n;
+    default:
+        n = qp_share_poll(p->sh->qs, p->index, c, POLL_BATCH);
+        for (int i = 0; i < n; i++) {
+            if (check_status(c[i].status)) {
+                return -1;
+            }
+        }
+        return n;
+    }
+}
+
+// Writes are submitted at head and complete at tail
+static void *producer_main(void *arg) {
+    struct producer *p = arg;
+    const struct share_opts *o = p->opts;
+    uint64_t posted_at[MAX_WINDOW];
+    uint64_t head = 0, tail = 0;
+    uint64_t start, end, t;
+
+    while (!__atomic_load_n(p->go, __ATOMIC_ACQUIRE)) {
+        ;
+    }
+    start = rdma_now_ns();
+    end = start + o->seconds * 1e9;
+
+    for (t = start; t < end || tail < head; t = rdma_now_ns()) {
+        while (t < end && head - tail < (uint64_t)o->window) {
+            int ret;
+
+            posted_at[head % o->window] = t;
+            ret = submit(p, head % o->window);
+            if (ret < 0) {
+                p->failed = 1;
+                return NULL;
+            }
+            if (ret) {
+                break;
+            }
+            head++;
+        }
+
+        int n = reap(p);
+        if (n < 0) {
+            p->failed = 1;
+            return NULL;
+        }
+        if (n > 0) {
+            t = rdma_now_ns();
+        }
+        for (int i = 0; i < n; i++, tail++) {
+            if (p->samples < MAX_SAMPLES) {
+                p->lat[p->samples++] = t - posted_at[tail % o->window];
+            }
+        }
+    }
+    p->writes = tail;
+    p->seconds = (rdma_now_ns() - start) / 1e9;
+    return NULL;
+}
+
+static int connect_all(struct rdma_context *ctxs, int n, const char *server_ip,
+                       const struct rdma_resource_attr *attr, uint32_t bytes) {
+    if (connect_to_servers(ctxs, n, server_ip, PORT, attr, NULL)) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (ctxs[i].remote_length < bytes) {
+            fprintf(stderr, "Server buffer holds %lu bytes, writes are %u\n",
+                    ctxs[i].remote_length, bytes);
+            for (int j = 0; j < n; j++) {
+                close_rdma_connection(&ctxs[j]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void report(enum share_mode mode, struct producer *ps, int n, int qps, double wrs_per_post,
+                   const struct share_opts *o, uint64_t *all) {
+    double writes = 0;
+    long samples = 0;
+
+    for (int i = 0; i < n; i++) {
+        writes += ps[i].seconds > 0 ? ps[i].writes / ps[i].seconds : 0;
+        memcpy(all + samples, ps[i].lat, ps[i].samples * sizeof(*all));
+        samples += ps[i].samples;
+    }
+    if (samples == 0) {
+        printf("%-5s %9d no writes completed\n", share_mode_names[mode], n);
+        return;
+    }
+    qsort(all, samples, sizeof(*all), rdma_cmp_u64);
+    printf("%-5s %9d %8.3f %8.2f %8.1f %8.1f %8.1f %4d %9.1f\n", share_mode_names[mode], n,
+           writes / 1e6, writes * o->bytes * 8 / 1e9, all[samples / 2] / 1e3,
+           all[samples * 99 / 100] / 1e3, all[samples * 999 / 1000] / 1e3, qps, wrs_per_post);
+}
+
+static int run_case(const char *server_ip, const struct share_opts *o, enum share_mode mode,
+                    int n) {
+    struct rdma_resource_attr attr = {
+        .buffer_size = o->bytes,
+        .cq_depth = mode == SHARE_QP ? MAX_WINDOW : SHARED_DEPTH,
+        .qp_depth = mode == SHARE_QP ? MAX_WINDOW : SHARED_DEPTH,
+        .fill_pattern = 1,
+        .quiet = 1,
+    };
+    int qps = mode == SHARE_QP ? n : 1;
+    struct rdma_context *ctxs = calloc(qps, sizeof(*ctxs));
+    struct producer *ps = calloc(n, sizeof(*ps));
+    uint64_t *all = malloc((size_t)n * MAX_SAMPLES * sizeof(*all));
+    struct shared sh;
+    struct qp_share_stats stats;
+    double wrs_per_post = 1;
+    volatile int go = 0;
+    int started = 0;
+    int ret = -1;
+
+    memset(&sh, 0, sizeof(sh));
+    pthread_mutex_init(&sh.lock, NULL);
+    if (!ctxs || !ps || !all) {
+        fprintf(stderr, "Failed to allocate %d producers\n", n);
+        goto out;
+    }
+    for (int i = 0; i < n; i++) {
+        ps[i].lat = malloc(MAX_SAMPLES * sizeof(*ps[i].lat));
+        if (!ps[i].lat) {
+            fprintf(stderr, "Failed to allocate latency samples\n");
+            goto out;
+        }
+    }
+    if (connect_all(ctxs, qps, server_ip, &attr, o->bytes)) {
+        goto out;
+    }
+    sh.ctx = &ctxs[0];
+    if (mode == SHARE_MPSC) {
+        sh.qs = qp_share_create(sh.ctx->qp, sh.ctx->cq, SHARED_DEPTH, n);
+        if (!sh.qs || qp_share_start(sh.qs)) {
+            goto close;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct producer *p = &ps[i];
+
+        p->index = i;
+        p->mode = mode;
+        p->ctx = mode == SHARE_QP ? &ctxs[i] : sh.ctx;
+        p->sh = &sh;
+        p->opts = o;
+        p->go = &go;
+        if (pthread_create(&p->thread, NULL, producer_main, p)) {
+            fprintf(stderr, "Failed to start producer %d\n", i);
+            break;
+        }
+        started++;
+    }
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    ret = started == n ? 0 : -1;
+    for (int i = 0; i < started; i++) {
+        pthread_join(ps[i].thread, NULL);
+        if (ps[i].failed) {
+            ret = -1;
+        }
+    }
+    if (sh.qs) {
+        qp_share_stop(sh.qs);
+        qp_share_get_stats(sh.qs, &stats);
+        wrs_per_post = stats.chains ? stats.posted / (double)stats.chains : 0;
+    }
+    if (ret == 0) {
+        report(mode, ps, n, qps, wrs_per_post, o, all);
+    }
+
+close:
+    qp_share_destroy(sh.qs);
+    for (int i = 0; i < qps; i++) {
+        close_rdma_connection(&ctxs[i]);
+    }
+out:
+    if (ps) {
+        for (int i = 0; i < n; i++) {
+            free(ps[i].lat);
+        }
+    }
+    pthread_mutex_destroy(&sh.lock);
+    free(all);
+    free(ps);
+    free(ctxs);
+    return ret;
+}
+
+// Comma list of producer counts, each 1..MAX_PRODUCERS; how many, or -1
+static int parse_counts(char *list, int *counts) {
+    int n = 0;
+
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int v = atoi(tok);
+
+        if (n == MAX_COUNTS || v < 1 || v > MAX_PRODUCERS) {
+            return -1;
+        }
+        counts[n++] = v;
+    }
+    return n ? n : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -s [-n conns]\n", prog);
+    fprintf(stderr, "       %s [-p producers,...] [-w window] [-b bytes] [-t seconds]\n"
+                    "       [-m mode,...] <server_ip>\n", prog);
+    fprintf(stderr, "  -s  Run the server; it exits after conns connections (default: what one\n"
+                    "      client with the defaults makes)\n");
+    fprintf(stderr, "  -p  Producer thread counts, at most %d each (default %s)\n", MAX_PRODUCERS,
+            DEFAULT_PRODUCERS);
+    fprintf(stderr, "  -w  Writes in flight per producer, at most %d (default %d)\n", MAX_WINDOW,
+            DEFAULT_WINDOW);
+    fprintf(stderr, "  -b  Bytes per write, at most %d (default %d)\n", SERVER_BUFFER_SIZE,
+            DEFAULT_BYTES);
+    fprintf(stderr, "  -t  Seconds per mode and count (default 1)\n");
+    fprintf(stderr, "  -m  Modes: qp, mutex, mpsc (default all)\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct share_opts o = {
+        .window = DEFAULT_WINDOW,
+        .bytes = DEFAULT_BYTES,
+        .seconds = 1,
+    };
+    char default_counts[] = DEFAULT_PRODUCERS;
+    int counts[MAX_COUNTS];
+    int ncounts = parse_counts(default_counts, counts);
+    unsigned modes = (1U << SHARE_MODE_COUNT) - 1;
+    int server = 0;
+    int server_conns = 0;
+    int ret = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sn:p:w:b:t:m:h")) != -1) {
+        switch (opt) {
+        case 's':
+            server = 1;
+            break;
+        case 'n':
+            server_conns = atoi(optarg);
+            break;
+        case 'p':
+            ncounts = parse_counts(optarg, counts);
+            if (ncounts < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            o.window = atoi(optarg);
+            break;
+        case 'b':
+            o.bytes = atoi(optarg);
+            break;
+        case 't':
+            o.seconds = atof(optarg);
+            break;
+        case 'm':
+            if (rdma_parse_names(optarg, share_mode_names, SHARE_MODE_COUNT, &modes)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (o.window < 1 || o.window > MAX_WINDOW || o.bytes < 1 || o.bytes > SERVER_BUFFER_SIZE ||
+        o.seconds <= 0 || (!server && optind >= argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (server) {
+        // qp mode connects once per producer, the others once per count
+        if (!server_conns) {
+            for (int i = 0; i < ncounts; i++) {
+                server_conns += counts[i] + SHARE_MODE_COUNT - 1;
+            }
+        }
+        return run_server(server_conns) ? 1 : 0;
+    }
+
+    printf("Writes of %u bytes into %s, %d in flight per producer, %.1f s per case\n", o.bytes,
+           argv[optind], o.window, o.seconds);
+    printf("%-5s %9s %8s %8s %8s %8s %8s %4s %9s\n", "mode", "producers", "Mwr/s", "Gbit/s",
+           "p50 us", "p99 us", "p99.9 us", "QPs", "WRs/post");
+    for (int c = 0; c < ncounts; c++) {
+        for (int m = 0; m < SHARE_MODE_COUNT; m++) {
+            if (modes & (1U << m)) {
+                ret |= run_case(argv[optind], &o, m, counts[c]);
+            }
+        }
+    }
+    return ret ? 1 : 0;
+}
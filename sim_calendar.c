@@ -0,0 +1,209 @@
+/*
+ * Calendar queue event scheduler. See sim_calendar.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_calendar.h"
+
+#define MIN_BUCKETS 16
+#define INITIAL_WIDTH 1000          // 1 ns until there are events to measure
+#define WIDTH_SAMPLES 25            // events sampled to pick a new width
+#define EVENTS_PER_BLOCK 4096
+
+struct sim_event_block {
+    struct sim_event_block *next;
+    struct sim_event events[EVENTS_PER_BLOCK];
+};
+
+static int alloc_buckets(struct sim_calendar *cal, uint32_t nbuckets) {
+    cal->buckets = calloc(nbuckets, sizeof(*cal->buckets));
+    if (!cal->buckets) {
+        fprintf(stderr, "Failed to allocate %u calendar buckets\n", nbuckets);
+        return -1;
+    }
+    cal->nbuckets = nbuckets;
+    return 0;
+}
+
+// Point the dequeue cursor at the day holding time t
+static void seek(struct sim_calendar *cal, uint64_t t) {
+    uint64_t day = t / cal->width;
+
+    cal->cur = day & (cal->nbuckets - 1);
+    cal->bucket_top = (day + 1) * cal->width;
+}
+
+int sim_calendar_init(struct sim_calendar *cal) {
+    memset(cal, 0, sizeof(*cal));
+    cal->width = INITIAL_WIDTH;
+    if (alloc_buckets(cal, MIN_BUCKETS)) {
+        return -1;
+    }
+    seek(cal, 0);
+    return 0;
+}
+
+void sim_calendar_destroy(struct sim_calendar *cal) {
+    while (cal->blocks) {
+        struct sim_event_block *b = cal->blocks;
+
+        cal->blocks = b->next;
+        free(b);
+    }
+    free(cal->buckets);
+    memset(cal, 0, sizeof(*cal));
+}
+
+struct sim_event *sim_event_alloc(struct sim_calendar *cal) {
+    struct sim_event *ev;
+
+    if (!cal->free) {
+        struct sim_event_block *b = malloc(sizeof(*b));
+
+        if (!b) {
+            fprintf(stderr, "Failed to allocate simulator events\n");
+            return NULL;
+        }
+        b->next = cal->blocks;
+        cal->blocks = b;
+        for (int i = 0; i < EVENTS_PER_BLOCK; i++) {
+            b->events[i].next = cal->free;
+            cal->free = &b->events[i];
+        }
+    }
+    ev = cal->free;
+    cal->free = ev->next;
+    memset(ev, 0, sizeof(*ev));
+    return ev;
+}
+
+void sim_event_release(struct sim_calendar *cal, struct sim_event *ev) {
+    ev->next = cal->free;
+    cal->free = ev;
+}
+
+// Into its day's list, in (time, seq) order
+static void enqueue(struct sim_calendar *cal, struct sim_event *ev) {
+    struct sim_event **p = &cal->buckets[(ev->time / cal->width) & (cal->nbuckets - 1)];
+
+    while (*p && ((*p)->time < ev->time || ((*p)->time == ev->time && (*p)->seq < ev->seq))) {
+        p = &(*p)->next;
+    }
+    ev->next = *p;
+    *p = ev;
+    cal->size++;
+}
+
+static struct sim_event *dequeue(struct sim_calendar *cal) {
+    struct sim_event *ev;
+
+    if (cal->size == 0) {
+        return NULL;
+    }
+    // One year of days from the cursor...
+    for (uint32_t n = 0; n < cal->nbuckets; n++) {
+        ev = cal->buckets[cal->cur];
+        if (ev && ev->time < cal->bucket_top) {
+            goto found;
+        }
+        cal->cur = (cal->cur + 1) & (cal->nbuckets - 1);
+        cal->bucket_top += cal->width;
+    }
+    // ...and if nothing is due that soon, jump straight to the earliest
+    ev = NULL;
+    for (uint32_t i = 0; i < cal->nbuckets; i++) {
+        if (cal->buckets[i] && (!ev || cal->buckets[i]->time < ev->time)) {
+            ev = cal->buckets[i];
+        }
+    }
+    seek(cal, ev->time);
+
+found:
+    cal->buckets[cal->cur] = ev->next;
+    cal->size--;
+    cal->last_time = ev->time;
+    return ev;
+}
+
+// Brown's width estimate: three times the mean gap between the next few
+// events, leaving out gaps over twice the first mean
+static uint64_t estimate_width(struct sim_calendar *cal) {
+    struct sim_event *sample[WIDTH_SAMPLES];
+    uint64_t last_time = cal->last_time, bucket_top = cal->bucket_top;
+    uint32_t cur = cal->cur;
+    int n = 0;
+    double mean = 0, kept = 0;
+    int nkept = 0;
+
+    while (n < WIDTH_SAMPLES && (sample[n] = dequeue(cal))) {
+        n++;
+    }
+    if (n > 1) {
+        mean = (double)(sample[n - 1]->time - sample[0]->time) / (n - 1);
+        for (int i = 1; i < n; i++) {
+            uint64_t gap = sample[i]->time - sample[i - 1]->time;
+
+            if (gap <= 2 * mean) {
+                kept += gap;
+                nkept++;
+            }
+        }
+    }
+    // Put them back as they were; their seqs keep them ahead of any ties
+    for (int i = 0; i < n; i++) {
+        enqueue(cal, sample[i]);
+    }
+    cal->last_time = last_time;
+    cal->cur = cur;
+    cal->bucket_top = bucket_top;
+    if (nkept == 0 || kept == 0) {
+        return cal->width;
+    }
+    return (uint64_t)(3 * kept / nkept) + 1;
+}
+
+static void resize(struct sim_calendar *cal, uint32_t nbuckets) {
+    struct sim_event **old = cal->buckets;
+    uint32_t old_n = cal->nbuckets;
+    uint64_t width = estimate_width(cal);
+
+    if (alloc_buckets(cal, nbuckets)) {
+        // Keep going at the old size; only the speed suffers
+        cal->buckets = old;
+        cal->nbuckets = old_n;
+        return;
+    }
+    cal->width = width;
+    cal->size = 0;
+    for (uint32_t i = 0; i < old_n; i++) {
+        while (old[i]) {
+            struct sim_event *ev = old[i];
+
+            old[i] = ev->next;
+            enqueue(cal, ev);
+        }
+    }
+    free(old);
+    seek(cal, cal->last_time);
+    cal->resizes++;
+}
+
+void sim_calendar_insert(struct sim_calendar *cal, struct sim_event *ev) {
+    ev->seq = cal->next_seq++;
+    enqueue(cal, ev);
+    if (cal->size > 2 * (size_t)cal->nbuckets) {
+        resize(cal, 2 * cal->nbuckets);
+    }
+}
+
+struct sim_event *sim_calendar_pop(struct sim_calendar *cal) {
+    struct sim_event *ev = dequeue(cal);
+
+    if (ev && cal->nbuckets > MIN_BUCKETS && cal->size < cal->nbuckets / 2) {
+        resize(cal, cal->nbuckets / 2);
+    }
+    return ev;
+}
@@ -0,0 +1,62 @@
+/*
+ * Calendar queue event scheduler for the fabric simulator
+ *
+ * R. Brown, "Calendar Queues: A Fast O(1) Priority Queue Implementation
+ * for the Simulation Event Set Problem" (CACM 1988). Events hash by time
+ * into a ring of buckets ("days"), each a sorted list, so that a "year"
+ * of nbuckets * width covers the near future. Dequeue walks the days in
+ * order and takes the head of the current one if it falls within it; with
+ * a width near the mean event spacing that is a bucket or two per event.
+ * The ring doubles or halves as the event count passes twice or half the
+ * bucket count, re-estimating the width from the events due next.
+ *
+ * Times are in picoseconds and must never precede the last event taken.
+ * Events with equal times come out in insertion order: each is stamped
+ * with a sequence number on insert that breaks ties, so moving events
+ * between buckets on a resize cannot reorder them. Event structs come
+ * from a free list owned by the calendar; give each back with
+ * sim_event_release() once handled.
+ */
+
+#ifndef SIM_CALENDAR_H
+#define SIM_CALENDAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct sim_event {
+    uint64_t time;
+    uint64_t seq;           // insertion order, for ties on time
+    struct sim_event *next;
+    int type;
+    uint32_t index;         // caller's: host, QP, ...
+    uint64_t data;          // caller's: PSN, generation, ...
+    void *ptr;              // caller's: packet, ...
+};
+
+struct sim_calendar {
+    struct sim_event **buckets;
+    uint32_t nbuckets;      // power of two
+    uint64_t width;         // ps per bucket
+    uint32_t cur;           // bucket of the last event taken
+    uint64_t bucket_top;    // end of cur's day in the current year
+    uint64_t last_time;
+    uint64_t next_seq;
+    size_t size;
+    struct sim_event *free;
+    struct sim_event_block *blocks;
+    uint64_t resizes;
+};
+
+int sim_calendar_init(struct sim_calendar *cal);
+void sim_calendar_destroy(struct sim_calendar *cal);
+
+// A zeroed event from the free list, NULL when out of memory
+struct sim_event *sim_event_alloc(struct sim_calendar *cal);
+void sim_event_release(struct sim_calendar *cal, struct sim_event *ev);
+
+void sim_calendar_insert(struct sim_calendar *cal, struct sim_event *ev);
+// The earliest event, NULL when there are none
+struct sim_event *sim_calendar_pop(struct sim_calendar *cal);
+
+#endif
@@ -5,25 +5,66 @@ This script monitors network throughput and analyzes RDMA traffic patterns
 """
 
 import time
-import psutil
 import subprocess
 import json
 import argparse
 import signal
 import sys
+import os
+import shutil
+import tempfile
 from datetime import datetime
 import threading
 import queue
 
+try:
+    import psutil
+except ImportError:
+    psutil = None
+
+# Native sampler built by `make rdma_sampler`; preferred over psutil polling
+NATIVE_SAMPLER = 'rdma_sampler'
+# Converter for binary sample logs (*.rsl) written by the native sampler
+SAMPLE_LOG_TOOL = 'sample_log_tool'
+
+
+def find_native_tool(name):
+    """Locate a native helper next to this script or on PATH"""
+    local = os.path.join(os.path.dirname(os.path.abspath(__file__)), name)
+    if os.access(local, os.X_OK):
+        return local
+    return shutil.which(name)
+
+
+def load_results(path):
+    """Load monitor results, converting binary sample logs to the JSON layout"""
+    if not path.endswith('.rsl'):
+        with open(path, 'r') as f:
+            return json.load(f)
+    
+    tool = find_native_tool(SAMPLE_LOG_TOOL)
+    if not tool:
+        raise RuntimeError(f"{SAMPLE_LOG_TOOL} is required to read {path}")
+    tmp = tempfile.NamedTemporaryFile(suffix='.json', delete=False)
+    tmp.close()
+    try:
+        subprocess.run([tool, 'to-json', path, tmp.name], check=True, stdout=subprocess.DEVNULL)
+        with open(tmp.name, 'r') as f:
+            return json.load(f)
+    finally:
+        os.unlink(tmp.name)
+
 class ThroughputMonitor:
-    def __init__(self, interface='eth0', duration=60, output_file='throughput_data.json'):
+    def __init__(self, interface='eth0', duration=60, output_file='throughput_data.json', rate=10):
         self.interface = interface
         self.duration = duration
         self.output_file = output_file
+        self.rate = rate
         self.running = True
         self.data_points = []
         self.start_time = None
         self.end_time = None
+        self.sampler_proc = None
         
         # Set up signal handlers
         signal.signal(signal.SIGINT, self.signal_handler)
@@ -32,9 +73,34 @@ class ThroughputMonitor:
     def signal_handler(self, signum, frame):
         print(f"\nReceived signal {signum}, stopping monitor...")
         self.running = False
+        if self.sampler_proc and self.sampler_proc.poll() is None:
+            self.sampler_proc.send_signal(signum)
+    
+    def native_loop(self, sampler):
+        """Run the native sampler, which streams samples straight to the output file"""
+        cmd = [sampler, '-i', self.interface, '-d', str(self.duration),
+               '-r', str(self.rate), '-o', self.output_file]
+        self.sampler_proc = subprocess.Popen(cmd)
+        while True:
+            try:
+                ret = self.sampler_proc.wait()
+                break
+            except KeyboardInterrupt:
+                continue
+        if ret != 0:
+            raise RuntimeError(f"{sampler} exited with status {ret}")
+        
+        results = load_results(self.output_file)
+        self.interface = results.get('interface', self.interface)
+        self.start_time = results.get('start_time')
+        self.end_time = results.get('end_time')
+        self.data_points = results.get('data_points', [])
     
     def get_network_stats(self):
         """Get current network statistics for the interface"""
+        if psutil is None:
+            print("psutil is not installed and the native sampler was not found")
+            return None
         try:
             stats = psutil.net_io_counters(pernic=True)
             if self.interface in stats:
@@ -139,7 +205,7 @@ class ThroughputMonitor:
                 prev_stats = curr_stats
                 prev_time = current_time
             
-            time.sleep(0.1)  # 10 Hz sampling rate
+            time.sleep(1.0 / self.rate)  # 10 Hz sampling rate by default
         
         self.end_time = time.time()
         print(f"\nMonitoring completed after {self.end_time - self.start_time:.1f} seconds")
@@ -207,7 +273,17 @@ class ThroughputMonitor:
         
         print(f"\nRDMA Traffic:")
         print(f"  Port 18515 (RDMA CM) activity detected: {rdma_packets > 0}")
-        print(f"  Port 4791 (RoCEv2) activity detected: {any('4791' in str(dp['port_stats']) for dp in self.data_points)}")
+        print(f"  RDMA port activity detected: {any(dp['port_stats'] for dp in self.data_points)}")
+        
+        # Per-port RDMA counters are only present in native sampler output
+        first_rdma = self.data_points[0].get('rdma', {})
+        last_rdma = self.data_points[-1].get('rdma', {})
+        for port, last in last_rdma.items():
+            first = first_rdma.get(port, last)
+            print(f"  {port}: TX {(last['tx_bytes'] - first['tx_bytes']) / 1e6:.2f} MB "
+                  f"({last['tx_packets'] - first['tx_packets']} pkts), "
+                  f"RX {(last['rx_bytes'] - first['rx_bytes']) / 1e6:.2f} MB "
+                  f"({last['rx_packets'] - first['rx_packets']} pkts)")
     
     def save_results(self):
         """Save results to JSON file"""
@@ -263,16 +339,17 @@ def main():
     parser = argparse.ArgumentParser(description='RDMA RoCEv2 Throughput Monitor')
     parser.add_argument('-i', '--interface', default='eth0', help='Network interface to monitor')
     parser.add_argument('-d', '--duration', type=int, default=60, help='Monitoring duration in seconds')
-    parser.add_argument('-o', '--output', default='throughput_data.json', help='Output JSON file')
-    parser.add_argument('--analyze', help='Analyze existing JSON file')
+    parser.add_argument('-o', '--output', default='throughput_data.json', help='Output file (.rsl for the binary sample log)')
+    parser.add_argument('-r', '--rate', type=int, default=10, help='Sample rate in Hz (native sampler: up to 10000)')
+    parser.add_argument('--no-native', action='store_true', help='Use psutil polling instead of the native sampler')
+    parser.add_argument('--analyze', help='Analyze existing JSON or .rsl file')
     
     args = parser.parse_args()
     
     if args.analyze:
         # Analyze existing file
         try:
-            with open(args.analyze, 'r') as f:
-                data = json.load(f)
+            data = load_results(args.analyze)
             
             print("Analyzing existing data...")
             print(f"Interface: {data.get('interface', 'unknown')}")
@@ -293,9 +370,24 @@ def main():
         monitor = ThroughputMonitor(
             interface=args.interface,
             duration=args.duration,
-            output_file=args.output
+            output_file=args.output,
+            rate=args.rate
         )
         
+        sampler = None if args.no_native else find_native_tool(NATIVE_SAMPLER)
+        if sampler:
+            try:
+                monitor.native_loop(sampler)
+                monitor.analyze_results()
+            except Exception as e:
+                print(f"Error during monitoring: {e}")
+                return 1
+            return 0
+        
+        if args.output.endswith('.rsl'):
+            print("Binary sample logs (.rsl) require the native sampler; run `make rdma_sampler`")
+            return 1
+        
         try:
             monitor.monitor_loop()
             monitor.analyze_results()
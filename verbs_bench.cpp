@@ -0,0 +1,383 @@
+/*
+ * Posting loop overhead: the C loop against the templated poster
+ *
+ * Runs the loop from rdma_server.c/rdma_client.c (build the WR from scratch,
+ * post it, spin on the CQ) next to the same loop written with
+ * rdmademo::poster, and a runtime-parameterised C loop (opcode, signaling
+ * interval and inline threshold as arguments) next to the poster
+ * specialisation for the same settings. Finally, thousands of concurrent
+ * coroutines each awaiting their own writes (rdma_coro.hpp) run against the
+ * hand-pipelined loop at the same send queue depth.
+ *
+ * Everything runs against a null provider: a fake verbs context whose
+ * post_send copies each WR into a send queue the way a provider writes a
+ * WQE (payload included for inline sends) and completes signaled WRs
+ * immediately. With the wire taken out, time per WR is only the software
+ * cost of the posting path, which is the part the template layer must not
+ * add to. On a real device the wire time is added equally to every row.
+ * The coroutine comparison is also run with the provider pacing completions
+ * at the rate of a simulated link, to show both reach the same throughput
+ * once there is a wire to keep busy.
+ *
+ * Usage: verbs_bench [iterations]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "rdma_verbs.hpp"
+#include "rdma_coro.hpp"
+
+#define SQ_SLOTS 64
+#define INLINE_MAX 64
+#define RUNS 5
+#define SMALL_MSG 64
+#define PIPELINE_DEPTH 16
+#define SIGNAL_EVERY 8
+#define CORO_TASKS 4096
+#define LINK_GBPS 100
+#define LINK_MSG 4096
+
+namespace {
+
+struct null_wqe {
+    uint64_t wr_id;
+    uint64_t addr;
+    uint64_t remote_addr;
+    uint32_t length;
+    uint32_t lkey;
+    uint32_t rkey;
+    uint32_t opcode_flags;
+    char inline_data[INLINE_MAX];
+};
+
+struct null_device {
+    ibv_context context;
+    ibv_cq cq;
+    ibv_qp qp;
+    null_wqe sq[SQ_SLOTS];
+    unsigned sq_head;
+    uint64_t cqes[SQ_SLOTS];
+    double cqe_due[SQ_SLOTS];   // paced: when the WR leaves the wire
+    unsigned cq_head, cq_tail;
+    double ns_per_byte;         // 0: complete immediately
+    double wire_free;           // paced: when the link is next idle
+};
+
+null_device nulldev;
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int null_post_send(ibv_qp *, ibv_send_wr *wr, ibv_send_wr **bad_wr) {
+    for (; wr; wr = wr->next) {
+        null_wqe *wqe = &nulldev.sq[nulldev.sq_head++ % SQ_SLOTS];
+
+        if (wr->num_sge != 1 || nulldev.cq_tail - nulldev.cq_head >= SQ_SLOTS) {
+            *bad_wr = wr;
+            return ENOMEM;
+        }
+        wqe->wr_id = wr->wr_id;
+        wqe->addr = wr->sg_list[0].addr;
+        wqe->length = wr->sg_list[0].length;
+        wqe->lkey = wr->sg_list[0].lkey;
+        wqe->remote_addr = wr->wr.rdma.remote_addr;
+        wqe->rkey = wr->wr.rdma.rkey;
+        wqe->opcode_flags = wr->opcode << 16 | wr->send_flags;
+        if ((wr->send_flags & IBV_SEND_INLINE) && wqe->length <= INLINE_MAX) {
+            memcpy(wqe->inline_data, (const void *)wqe->addr, wqe->length);
+        }
+        if (nulldev.ns_per_byte) {
+            nulldev.wire_free = std::max(nulldev.wire_free, now_ns()) +
+                                wqe->length * nulldev.ns_per_byte;
+        }
+        if (wr->send_flags & IBV_SEND_SIGNALED) {
+            nulldev.cqe_due[nulldev.cq_tail % SQ_SLOTS] = nulldev.wire_free;
+            nulldev.cqes[nulldev.cq_tail++ % SQ_SLOTS] = wr->wr_id;
+        }
+    }
+    return 0;
+}
+
+int null_poll_cq(ibv_cq *, int num_entries, ibv_wc *wc) {
+    double now = nulldev.ns_per_byte ? now_ns() : 0;
+    int n = 0;
+
+    while (n < num_entries && nulldev.cq_head != nulldev.cq_tail &&
+           nulldev.cqe_due[nulldev.cq_head % SQ_SLOTS] <= now) {
+        memset(&wc[n], 0, sizeof(wc[n]));
+        wc[n].wr_id = nulldev.cqes[nulldev.cq_head++ % SQ_SLOTS];
+        wc[n].status = IBV_WC_SUCCESS;
+        wc[n].opcode = IBV_WC_RDMA_WRITE;
+        n++;
+    }
+    return n;
+}
+
+void null_device_init() {
+    nulldev.context.ops.post_send = null_post_send;
+    nulldev.context.ops.poll_cq = null_poll_cq;
+    nulldev.cq.context = &nulldev.context;
+    nulldev.qp.context = &nulldev.context;
+    nulldev.qp.send_cq = &nulldev.cq;
+}
+
+// rdma_client.c's perform_rdma_operations() loop, minus tracing and output
+__attribute__((noinline)) long c_loop(ibv_qp *qp, ibv_cq *cq, long iterations, char *buffer,
+                                      uint32_t length, uint32_t lkey, uint64_t remote_addr,
+                                      uint32_t rkey) {
+    struct ibv_sge sge;
+    struct ibv_send_wr send_wr, *bad_wr;
+    struct ibv_wc wc;
+    long i;
+    int ret;
+
+    for (i = 0; i < iterations; i++) {
+        memset(&sge, 0, sizeof(sge));
+        sge.addr = (uintptr_t)buffer;
+        sge.length = length;
+        sge.lkey = lkey;
+
+        memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.wr_id = i;
+        send_wr.sg_list = &sge;
+        send_wr.num_sge = 1;
+        send_wr.opcode = IBV_WR_RDMA_WRITE;
+        send_wr.send_flags = IBV_SEND_SIGNALED;
+        send_wr.wr.rdma.remote_addr = remote_addr;
+        send_wr.wr.rdma.rkey = rkey;
+
+        if (ibv_post_send(qp, &send_wr, &bad_wr)) {
+            return -1;
+        }
+        while ((ret = ibv_poll_cq(cq, 1, &wc)) == 0) {
+        }
+        if (ret < 0 || wc.status != IBV_WC_SUCCESS) {
+            return -1;
+        }
+    }
+    return i;
+}
+
+// The same loop with the poster
+template <typename Poster>
+__attribute__((noinline)) long poster_loop(Poster &p, ibv_cq *cq, long iterations, char *buffer,
+                                           uint32_t length) {
+    struct ibv_wc wc;
+    long i;
+    int ret;
+
+    for (i = 0; i < iterations; i++) {
+        if (p.post(i, buffer, length)) {
+            return -1;
+        }
+        while ((ret = ibv_poll_cq(cq, 1, &wc)) == 0) {
+        }
+        if (ret < 0 || wc.status != IBV_WC_SUCCESS) {
+            return -1;
+        }
+    }
+    return i;
+}
+
+// What flexibility costs in C: opcode, signaling interval and inline
+// threshold decided at run time, pipelined to `depth` like run_posting_loop()
+__attribute__((noinline)) long c_generic_loop(ibv_qp *qp, ibv_cq *cq, long count, char *buffer,
+                                              uint32_t length, uint32_t lkey, uint64_t remote_addr,
+                                              uint32_t rkey, enum ibv_wr_opcode opcode,
+                                              unsigned signal_every, uint32_t inline_threshold,
+                                              unsigned depth) {
+    struct ibv_sge sge;
+    struct ibv_send_wr send_wr, *bad_wr;
+    struct ibv_wc wc[16];
+    unsigned retires[64], head = 0, tail = 0, unsignaled = 0;
+    long posted = 0, completed = 0;
+
+    while (completed < count) {
+        while (posted < count && posted - completed + signal_every <= depth) {
+            memset(&sge, 0, sizeof(sge));
+            sge.addr = (uintptr_t)buffer;
+            sge.length = length;
+            sge.lkey = lkey;
+
+            memset(&send_wr, 0, sizeof(send_wr));
+            send_wr.wr_id = posted;
+            send_wr.sg_list = &sge;
+            send_wr.num_sge = 1;
+            send_wr.opcode = opcode;
+            if (opcode == IBV_WR_RDMA_WRITE || opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
+                opcode == IBV_WR_RDMA_READ) {
+                send_wr.wr.rdma.remote_addr = remote_addr;
+                send_wr.wr.rdma.rkey = rkey;
+            }
+            if (++unsignaled == signal_every || posted == count - 1) {
+                send_wr.send_flags = IBV_SEND_SIGNALED;
+                retires[tail++ % 64] = unsignaled;
+                unsignaled = 0;
+            }
+            if (inline_threshold && length <= inline_threshold && opcode != IBV_WR_RDMA_READ) {
+                send_wr.send_flags |= IBV_SEND_INLINE;
+            }
+            if (ibv_post_send(qp, &send_wr, &bad_wr)) {
+                return -1;
+            }
+            posted++;
+        }
+
+        int n = ibv_poll_cq(cq, 16, wc);
+        if (n < 0) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                return -1;
+            }
+            completed += retires[head++ % 64];
+        }
+    }
+    return completed;
+}
+
+template <typename Poster>
+__attribute__((noinline)) long pipelined_loop(Poster &p, ibv_cq *cq, long count, char *buffer,
+                                              uint32_t length, unsigned depth) {
+    return rdmademo::run_posting_loop(p, cq, count, buffer, length, depth);
+}
+
+rdmademo::task<void> write_task(rdmademo::async_qp &qp, long writes, char *buffer, uint32_t length,
+                               uint32_t lkey, uint64_t remote_addr, uint32_t rkey, long *done) {
+    for (long i = 0; i < writes; i++) {
+        rdmademo::op_result r = co_await qp.write(buffer, length, lkey, remote_addr, rkey);
+        if (!r.ok()) {
+            co_return;
+        }
+        (*done)++;
+    }
+}
+
+// `count` writes spread over `tasks` coroutines sharing one send queue
+__attribute__((noinline)) long coroutine_loop(ibv_qp *qp, ibv_cq *cq, long count, int tasks,
+                                              char *buffer, uint32_t length, uint32_t lkey,
+                                              uint64_t remote_addr, uint32_t rkey, unsigned depth) {
+    rdmademo::reactor reactor(cq);
+    rdmademo::async_qp aqp(qp, depth);
+    long done = 0;
+
+    for (int t = 0; t < tasks; t++) {
+        long writes = count / tasks + (t < count % tasks);
+        reactor.spawn(write_task(aqp, writes, buffer, length, lkey, remote_addr, rkey, &done));
+    }
+    if (reactor.run()) {
+        return -1;
+    }
+    return done;
+}
+
+// Median ns per WR over RUNS runs
+template <typename Fn>
+double measure(long iterations, Fn fn) {
+    double samples[RUNS];
+
+    for (int r = 0; r < RUNS; r++) {
+        double start = now_ns();
+        if (fn() != iterations) {
+            fprintf(stderr, "Posting loop failed\n");
+            exit(1);
+        }
+        samples[r] = (now_ns() - start) / iterations;
+    }
+    std::sort(samples, samples + RUNS);
+    return samples[RUNS / 2];
+}
+
+void report(const char *what, double ns, double baseline) {
+    printf("%-52s %8.2f ns/WR  %+6.1f%%\n", what, ns, (ns / baseline - 1) * 100);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+    static char buffer[1024 * 1024];
+    const uint32_t lkey = 0x1234, rkey = 0x5678;
+    const uint64_t remote_addr = 0x7f0000000000ULL;
+    ibv_qp *qp = &nulldev.qp;
+    ibv_cq *cq = &nulldev.cq;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+    null_device_init();
+    printf("Posting loop overhead, null provider, %ld WRs per run, median of %d runs\n\n",
+           iterations, RUNS);
+
+    // rdma_server.c/rdma_client.c: 1 MB RDMA WRITE, signaled, one in flight
+    rdmademo::poster<IBV_WR_RDMA_WRITE> write_poster(qp, lkey, remote_addr, rkey);
+    double c_ns = measure(iterations, [&] {
+        return c_loop(qp, cq, iterations, buffer, sizeof(buffer), lkey, remote_addr, rkey);
+    });
+    double p_ns = measure(iterations, [&] {
+        return poster_loop(write_poster, cq, iterations, buffer, sizeof(buffer));
+    });
+    printf("1 MB RDMA WRITE, every WR signaled, 1 in flight\n");
+    report("  C loop (rdma_client.c)", c_ns, c_ns);
+    report("  poster<IBV_WR_RDMA_WRITE>", p_ns, c_ns);
+
+    // Small messages, selective signaling, inline payload, pipelined
+    rdmademo::poster<IBV_WR_RDMA_WRITE, SIGNAL_EVERY, INLINE_MAX> small_poster(qp, lkey, remote_addr,
+                                                                                rkey);
+    double cg_ns = measure(iterations, [&] {
+        return c_generic_loop(qp, cq, iterations, buffer, SMALL_MSG, lkey, remote_addr, rkey,
+                              IBV_WR_RDMA_WRITE, SIGNAL_EVERY, INLINE_MAX, PIPELINE_DEPTH);
+    });
+    double ps_ns = measure(iterations, [&] {
+        return pipelined_loop(small_poster, cq, iterations, buffer, SMALL_MSG, PIPELINE_DEPTH);
+    });
+    printf("\n%d B RDMA WRITE, inline, 1 in %d signaled, %d in flight\n", SMALL_MSG, SIGNAL_EVERY,
+           PIPELINE_DEPTH);
+    report("  C loop, run-time opcode/signaling/inline", cg_ns, cg_ns);
+    report("  poster<IBV_WR_RDMA_WRITE, 8, 64>", ps_ns, cg_ns);
+
+    // Concurrent coroutines against the hand-written pipeline, same depth
+    double pl_ns = measure(iterations, [&] {
+        return pipelined_loop(write_poster, cq, iterations, buffer, sizeof(buffer), PIPELINE_DEPTH);
+    });
+    size_t slabs_warm = 0;
+    double co_ns = measure(iterations, [&] {
+        long done = coroutine_loop(qp, cq, iterations, CORO_TASKS, buffer, sizeof(buffer), lkey,
+                                   remote_addr, rkey, PIPELINE_DEPTH);
+        slabs_warm = slabs_warm ? slabs_warm : rdmademo::frame_pool::slabs();
+        return done;
+    });
+    printf("\n1 MB RDMA WRITE, every WR signaled, %d in flight\n", PIPELINE_DEPTH);
+    report("  run_posting_loop (hand-written pipeline)", pl_ns, pl_ns);
+    char label[64];
+    snprintf(label, sizeof(label), "  %d coroutines, co_await qp.write()", CORO_TASKS);
+    report(label, co_ns, pl_ns);
+    printf("  coroutine frame slabs: %zu after the first run, %zu after %d runs\n", slabs_warm,
+           rdmademo::frame_pool::slabs(), RUNS);
+
+    // The same, with completions paced by a simulated link
+    long link_iterations = std::max(iterations / 10, 1L);
+    nulldev.ns_per_byte = 8.0 / LINK_GBPS;
+    pl_ns = measure(link_iterations, [&] {
+        return pipelined_loop(write_poster, cq, link_iterations, buffer, LINK_MSG, PIPELINE_DEPTH);
+    });
+    co_ns = measure(link_iterations, [&] {
+        return coroutine_loop(qp, cq, link_iterations, CORO_TASKS, buffer, LINK_MSG, lkey,
+                              remote_addr, rkey, PIPELINE_DEPTH);
+    });
+    nulldev.ns_per_byte = 0;
+    printf("\n%d B RDMA WRITE over a simulated %d Gb/s link, %d in flight\n", LINK_MSG, LINK_GBPS,
+           PIPELINE_DEPTH);
+    printf("  %-50s %8.2f Gb/s\n", "run_posting_loop (hand-written pipeline)", LINK_MSG * 8 / pl_ns);
+    printf("  %-50s %8.2f Gb/s\n", label + 2, LINK_MSG * 8 / co_ns);
+    return 0;
+}